@@ -0,0 +1,425 @@
+/** @file
+ * Qin - Biquad filter kernels.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef DSP_BIQUAD_H_
+#define DSP_BIQUAD_H_
+
+#include <cmath>
+#include <cstring>
+
+#include "util/misc.h"
+#include "util/types.h"
+#include "util/assert.h"
+
+namespace dsp {
+
+/*
+ * The number of biquads evaluated in one SIMD register.
+ */
+#define BIQUAD_LANES (4)
+
+/*
+ * The highest order of a cascade, every section adds 2 orders.
+ */
+#define BIQUAD_MAX_ORDER (8)
+#define BIQUAD_MAX_SECTIONS (BIQUAD_MAX_ORDER / 2)
+
+typedef float biquad_v4sf __attribute__((vector_size(BIQUAD_LANES * sizeof(float))));
+
+/*
+ * Class of the filter response
+ */
+enum BiquadClass
+{
+  BIQUAD_LOWPASS = 0,
+  BIQUAD_HIGHPASS,
+  BIQUAD_BANDPASS,
+  BIQUAD_BANDNOTCH,
+  _MAX_BIQUAD_CLASS
+};
+
+/*
+ * Coefficients of a biquad section:
+ *   H(z) = (a0 + a1 z^-1 + a2 z^-2) / (1 + b1 z^-1 + b2 z^-2)
+ */
+struct BiquadCoeffs
+{
+  float a0, a1, a2;
+  float b1, b2;
+};
+
+int designBiquad(int cls, float rate, float freq, float q, BiquadCoeffs *c);
+int designButterworth(int cls, float rate, float freq, float q, int order, BiquadCoeffs *sections, int *nsections);
+
+/*
+ * The quantized designs, see lookupButterworth().
+ */
+#define BIQUAD_TABLE_OCTAVES (16)
+#define BIQUAD_TABLE_STEPS (48) /* per octave */
+
+int initBiquadTable();
+int lookupButterworth(int cls, float rate, float freq, float q, int order, BiquadCoeffs *sections, int *nsections);
+size_t biquadTail(const BiquadCoeffs *sections, int nsections, float floor);
+
+/***************************************************
+  *****          Biquad lanes object           *****
+  ***************************************************/
+
+/*
+ * A group of independent filters evaluated in the lanes of one SIMD
+ * register, in transposed direct form II. Each filter is a cascade of
+ * up to BIQUAD_MAX_SECTIONS biquads, all the lanes run the same number
+ * of sections (a lane may pad with the identity section).
+ */
+class BiquadLanes {
+public:
+  BiquadLanes()
+    : m_sections(1),
+      m_ramp(false)
+  {
+    BiquadCoeffs c = { 1, 0, 0, 0, 0 };
+    for (int n = 0; n < BIQUAD_LANES; n++)
+      m_laneSections[n] = 1;
+    for (int n = 0; n < BIQUAD_LANES; n++)
+      setCoeffs(n, &c, 1);
+    reset();
+  }
+
+  void reset()
+  {
+    for (int n = 0; n < BIQUAD_LANES; n++)
+      reset(n);
+  }
+
+  /*
+   * Clear the state of one lane, the others keep ringing.
+   */
+  void reset(int lane)
+  {
+    V_ASSERT(lane >= 0 && lane < BIQUAD_LANES);
+
+    for (int s = 0; s < BIQUAD_MAX_SECTIONS; s++)
+      {
+        m_sect[s].z1[lane] = 0;
+        m_sect[s].z2[lane] = 0;
+      }
+  }
+
+  void setCoeffs(int lane, const BiquadCoeffs &c)
+  {
+    setCoeffs(lane, &c, 1);
+  }
+
+  /*
+   * Set the cascade of a lane, the sections not used by this lane
+   * are set to the identity. If smooth, the coefficients glide to
+   * the new values across the next processed block.
+   */
+  void setCoeffs(int lane, const BiquadCoeffs *c, int nsections, bool smooth = false)
+  {
+    static const BiquadCoeffs identity = { 1, 0, 0, 0, 0 };
+
+    V_ASSERT(lane >= 0 && lane < BIQUAD_LANES);
+    V_ASSERT(nsections > 0 && nsections <= BIQUAD_MAX_SECTIONS);
+
+    for (int s = 0; s < BIQUAD_MAX_SECTIONS; s++)
+      {
+        const BiquadCoeffs &k = s < nsections ? c[s] : identity;
+        m_target[s].a0[lane] = k.a0;
+        m_target[s].a1[lane] = k.a1;
+        m_target[s].a2[lane] = k.a2;
+        m_target[s].b1[lane] = k.b1;
+        m_target[s].b2[lane] = k.b2;
+        if (!smooth)
+          {
+            m_sect[s].a0[lane] = k.a0;
+            m_sect[s].a1[lane] = k.a1;
+            m_sect[s].a2[lane] = k.a2;
+            m_sect[s].b1[lane] = k.b1;
+            m_sect[s].b2[lane] = k.b2;
+          }
+      }
+    m_laneSections[lane] = nsections;
+    m_ramp = m_ramp || smooth;
+
+    m_sections = 1;
+    for (int n = 0; n < BIQUAD_LANES; n++)
+      if (m_laneSections[n] > m_sections)
+        m_sections = m_laneSections[n];
+  }
+
+  inline void process(Sample_t *buff, size_t nframes, int stride, int lanes);
+  inline void process(Sample_t *const *buffs, size_t nframes, int stride, int lanes);
+
+private:
+  template <bool RAMP>
+    inline void run(Sample_t *const *buffs, size_t nframes, int stride, int lanes);
+
+  struct coeffs
+  {
+    biquad_v4sf a0, a1, a2;
+    biquad_v4sf b1, b2;
+  };
+
+  struct section : coeffs
+  {
+    biquad_v4sf z1, z2;
+  };
+
+  section       m_sect[BIQUAD_MAX_SECTIONS];
+  coeffs        m_target[BIQUAD_MAX_SECTIONS];
+  int           m_laneSections[BIQUAD_LANES];
+  int           m_sections;
+  bool          m_ramp;
+};
+
+/***************************************************
+  *****           Biquad bank object           *****
+  ***************************************************/
+
+/*
+ * A bank of independent filters, such as one per channel, per voice
+ * or per band. The filters are packed BIQUAD_LANES at a time, so the
+ * bank of N filters costs about N / BIQUAD_LANES single filters.
+ */
+class BiquadBank {
+public:
+  BiquadBank();
+  ~BiquadBank();
+
+  int init(int filters);
+  void uninit();
+  void reset();
+  void reset(int index);
+
+  int setFilter(int index, const BiquadCoeffs *sections, int nsections, bool smooth = false);
+
+  /** @return the number of filters in the bank. */
+  int filters() const { return m_filters; }
+
+  inline void process(Sample_t *const *buffs, size_t nframes, int stride);
+  inline void process(Sample_t *const *buffs, size_t nframes, int stride, Sample_t *idle);
+
+private:
+  BiquadLanes  *m_lanes;
+  int           m_filters;
+};
+
+/*
+ * Convert a filtered value back to the sample, with clip.
+ */
+static inline Sample_t
+biquadClip(float v)
+{
+  if (v >= 2147483520.0f)
+    return 2147483520;
+  if (v <= -2147483648.0f)
+    return (Sample_t)(-2147483647 - 1);
+  return (Sample_t)v;
+}
+
+/**
+ * Filter the interleaved samples in place, the lanes are the channels
+ * of a frame.
+ * @param buff        Pointer to the first sample of the lane 0.
+ * @param nframes     How many frames to process.
+ * @param stride      The number of samples of a frame.
+ * @param lanes       The number of lanes used, 1 ~ BIQUAD_LANES.
+ */
+inline void
+BiquadLanes::process(Sample_t *buff, size_t nframes, int stride, int lanes)
+{
+  Sample_t *buffs[BIQUAD_LANES];
+  for (int n = 0; n < lanes; n++)
+    buffs[n] = buff + n;
+
+  process(buffs, nframes, stride, lanes);
+}
+
+/**
+ * Filter the samples in place, each lane reads its own buffer. The
+ * sections are cascaded in float and the state stays in the registers
+ * for the whole block.
+ * @param buffs       Pointers to the first sample of each lane.
+ * @param nframes     How many frames to process.
+ * @param stride      The distance between two samples of a lane.
+ * @param lanes       The number of lanes used, 1 ~ BIQUAD_LANES.
+ */
+inline void
+BiquadLanes::process(Sample_t *const *buffs, size_t nframes, int stride, int lanes)
+{
+  V_ASSERT(lanes > 0 && lanes <= BIQUAD_LANES);
+
+  if (UNLIKELY(m_ramp) && nframes)
+    {
+      run<true>(buffs, nframes, stride, lanes);
+      m_ramp = false;
+    }
+  else
+    run<false>(buffs, nframes, stride, lanes);
+}
+
+/*
+ * The filter loop. When RAMP, the coefficients move linearly from the
+ * current values to the targets, reaching them on the last frame.
+ */
+template <bool RAMP>
+  inline void
+  BiquadLanes::run(Sample_t *const *buffs, size_t nframes, int stride, int lanes)
+{
+  section sect[BIQUAD_MAX_SECTIONS];
+  coeffs delta[BIQUAD_MAX_SECTIONS];
+  const int sections = m_sections;
+  Sample_t *in[BIQUAD_LANES];
+  biquad_v4sf x = { 0, 0, 0, 0 };
+  biquad_v4sf y;
+
+  for (int s = 0; s < sections; s++)
+    {
+      sect[s] = m_sect[s];
+      if (RAMP)
+        {
+          const float r = 1.0f / nframes;
+          const biquad_v4sf rv = { r, r, r, r };
+          delta[s].a0 = (m_target[s].a0 - sect[s].a0) * rv;
+          delta[s].a1 = (m_target[s].a1 - sect[s].a1) * rv;
+          delta[s].a2 = (m_target[s].a2 - sect[s].a2) * rv;
+          delta[s].b1 = (m_target[s].b1 - sect[s].b1) * rv;
+          delta[s].b2 = (m_target[s].b2 - sect[s].b2) * rv;
+        }
+    }
+  for (int n = 0; n < lanes; n++)
+    in[n] = buffs[n];
+
+  for (size_t i = 0; i < nframes; i++)
+    {
+      for (int n = 0; n < lanes; n++)
+        x[n] = (float)in[n][0];
+
+      for (int s = 0; s < sections; s++)
+        {
+          if (RAMP)
+            {
+              sect[s].a0 += delta[s].a0;
+              sect[s].a1 += delta[s].a1;
+              sect[s].a2 += delta[s].a2;
+              sect[s].b1 += delta[s].b1;
+              sect[s].b2 += delta[s].b2;
+            }
+          y  = sect[s].a0 * x + sect[s].z1;
+          sect[s].z1 = sect[s].a1 * x - sect[s].b1 * y + sect[s].z2;
+          sect[s].z2 = sect[s].a2 * x - sect[s].b2 * y;
+          x = y;
+        }
+
+      for (int n = 0; n < lanes; n++)
+        {
+          in[n][0] = biquadClip(x[n]);
+          in[n] += stride;
+        }
+    }
+
+  /*
+   * Land exactly on the targets, so that the rounding of the
+   * steps does not accumulate.
+   */
+  if (RAMP)
+    {
+      for (int s = 0; s < BIQUAD_MAX_SECTIONS; s++)
+        {
+          static_cast<coeffs &>(m_sect[s]) = m_target[s];
+        }
+    }
+
+  /*
+   * Flush the tiny state so that a silent input will not
+   * drive the FPU into the denormals.
+   */
+  for (int s = 0; s < sections; s++)
+    {
+      for (int n = 0; n < BIQUAD_LANES; n++)
+        {
+          if (std::fabs(sect[s].z1[n]) < 1e-3f) sect[s].z1[n] = 0;
+          if (std::fabs(sect[s].z2[n]) < 1e-3f) sect[s].z2[n] = 0;
+        }
+      m_sect[s].z1 = sect[s].z1;
+      m_sect[s].z2 = sect[s].z2;
+    }
+}
+
+/**
+ * Filter the samples in place.
+ * @param buffs       Pointers to the first sample of each filter,
+ *                    there are filters() of them.
+ * @param nframes     How many frames to process.
+ * @param stride      The distance between two samples of a filter.
+ */
+inline void
+BiquadBank::process(Sample_t *const *buffs, size_t nframes, int stride)
+{
+  for (int i = 0; i < m_filters; i += BIQUAD_LANES)
+    {
+      int lanes = m_filters - i;
+      if (lanes > BIQUAD_LANES)
+        lanes = BIQUAD_LANES;
+
+      m_lanes[i / BIQUAD_LANES].process(buffs + i, nframes, stride, lanes);
+    }
+}
+
+/**
+ * Filter the samples in place, where some of the filters are idle. The
+ * lanes with no busy filter are skipped, the idle filters sharing the
+ * lanes with a busy one are fed with the silence.
+ * @param buffs       Pointers to the first sample of each filter,
+ *                    0 = idle.
+ * @param nframes     How many frames to process.
+ * @param stride      The distance between two samples of a filter.
+ * @param idle        Scratch of nframes * stride samples.
+ */
+inline void
+BiquadBank::process(Sample_t *const *buffs, size_t nframes, int stride, Sample_t *idle)
+{
+  Sample_t *lanesBuffs[BIQUAD_LANES];
+
+  for (int i = 0; i < m_filters; i += BIQUAD_LANES)
+    {
+      int lanes = m_filters - i;
+      if (lanes > BIQUAD_LANES)
+        lanes = BIQUAD_LANES;
+
+      int busy = 0;
+      for (int n = 0; n < lanes; n++)
+        {
+          lanesBuffs[n] = buffs[i + n] ? buffs[i + n] : idle;
+          busy += buffs[i + n] != 0;
+        }
+      if (!busy)
+        continue;
+
+      if (busy < lanes)
+        std::memset(idle, 0, nframes * stride * sizeof(Sample_t));
+
+      m_lanes[i / BIQUAD_LANES].process(lanesBuffs, nframes, stride, lanes);
+    }
+}
+
+} // namespace dsp
+
+#endif //!defined(DSP_BIQUAD_H_)
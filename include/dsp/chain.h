@@ -0,0 +1,93 @@
+/** @file
+ * Qin - Compiled effector chains.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef DSP_CHAIN_H_
+#define DSP_CHAIN_H_
+
+#include "util/types.h"
+#include "util/list.h"
+
+namespace dsp {
+
+class IEffector;
+
+/*
+ * The most stages of a chain, and the most effectors fused in a stage.
+ */
+#define CHAIN_MAX_STAGES (16)
+#define CHAIN_MAX_FUSED (8)
+
+/*
+ * A stage of the chain, a plain function bound to its state.
+ */
+typedef int (*ChainKernel)(void *state, Sample_t *buff, size_t nframes, int channels);
+
+/***************************************************
+  *****            Effector chain              *****
+  ***************************************************/
+
+/*
+ * The effectors of a slot list flattened into an array of kernels.
+ * The runs of effectors which are point operations (see
+ * IEffector::pointOp()) are fused into one kernel, which makes one
+ * pass over the buffer for all of them. The others are called through
+ * IEffector::process(). A kernel given the silence for longer than the
+ * tail of its effectors is asleep, it is skipped until the sound comes
+ * back.
+ */
+class EffectChain {
+public:
+  EffectChain();
+
+  int compile(const V_LIST<IEffector> &slots, int channels);
+  int process(Sample_t *buff, size_t nframes, bool silent = false);
+
+  /** @return the number of kernels of the chain. */
+  int stages() const { return m_count; }
+
+private:
+  static int effectorKernel(void *state, Sample_t *buff, size_t nframes, int channels);
+  static int fusedKernel(void *state, Sample_t *buff, size_t nframes, int channels);
+
+private:
+  struct fusedGroup
+  {
+    IEffector  *effectors[CHAIN_MAX_FUSED];
+    int         count;
+  };
+
+  struct stage
+  {
+    ChainKernel kernel;
+    void       *state;
+    /** the frames of silence given since the last sound */
+    size_t      quiet;
+  };
+
+  size_t tail(int index) const;
+
+  stage         m_stages[CHAIN_MAX_STAGES];
+  fusedGroup    m_groups[CHAIN_MAX_STAGES];
+  int           m_count;
+  int           m_channels;
+};
+
+} // namespace dsp
+
+#endif //!defined(DSP_CHAIN_H_)
@@ -19,11 +19,51 @@
 #include "util/types.h"
 #include "util/list.h"
 #include "audiosys/audioformat.h"
+#include "dsp/biquad.h"
+#include "dsp/chain.h"
 
 #include "midi/note.h" // request: _MAX_POLYPHONY_NUM
 
+namespace wavetable {
+struct PipeChunk;
+}
+
 namespace dsp {
 
+class IEffectorBatch;
+
+/*
+ * The tail of an effector ends where its response falls below the
+ * floor, relative to the full scale. It is the LSB of 24 bits.
+ */
+#define EFFECT_TAIL_FLOOR (1.0f / (1 << 23))
+#define EFFECT_TAIL_INFINITE ((size_t)-1)
+
+/*
+ * Kind of a point operation, see IEffector::pointOp().
+ */
+enum PointOpKind
+{
+  POINT_OP_NONE = 0,    /* leave the frame as it is, e.g. bypassed */
+  POINT_OP_SILENCE,     /* zero the frame */
+  POINT_OP_ENVELOPE,    /* multiply the frame i by env[i] */
+  POINT_OP_GAIN,        /* the gain and line of the amplifier */
+  POINT_OP_SWAP         /* swap the 2 channels */
+};
+
+/*
+ * An effector which works on each frame on its own, with no memory
+ * across the frames other than a gain per frame.
+ */
+struct PointOp
+{
+  int           kind;
+  /** the gain of each frame, the buffer is given by the caller */
+  float        *env;
+  int32_t       gain;
+  int32_t       line;
+};
+
 /***************************************************
   *****         Interface of Effector          *****
   ***************************************************/
@@ -34,6 +74,7 @@ public:
     : m_rate(rate),
       m_channels(channels),
       m_bypass(false),
+      m_wetOnly(false),
       prev(0),
       next(0)
   {}
@@ -51,8 +92,69 @@ public:
     m_bypass = y;
   }
 
+  /*
+   * Leave the dry signal out of the output, so only what the effector
+   * adds to it is passed on. The aux buses run their effectors this way
+   * because the master carries the dry signal of the voices already.
+   * The effectors that replace the signal instead of adding to it have
+   * no dry signal and ignore it.
+   */
+  virtual void setWetOnly(bool y)
+  {
+    m_wetOnly = y;
+  }
+
   virtual void gate(bool gate)=0;
 
+  /**
+   * Describe the next nframes of this effector as a point operation,
+   * so that the chain compiler can fuse it with its neighbours. The
+   * state moves forward as if process() was called.
+   * @param op        Where to store the operation.
+   * @param nframes   How many frames, up to _EFFECT_BLOCK_FRAMES,
+   *                  0 just asks whether it is a point operation.
+   * @return VINF_SUCCEEDED if it is one, VERR_FAILED if not.
+   */
+  virtual int pointOp(PointOp *op, size_t nframes)
+  {
+    return VERR_FAILED;
+  }
+
+  /**
+   * Create the state of this effector for all the voices at once,
+   * see IEffectorBatch. The parameters are taken from this instance.
+   * @param voices    The number of voices.
+   * @return 0 if there is no batch form of this effector.
+   * @return !=0 Pointer to the new batch.
+   */
+  virtual IEffectorBatch *createBatch(int voices) const
+  {
+    return 0;
+  }
+
+  /**
+   * Get the tail of this effector, i.e. how long it keeps sounding
+   * after the input has turned silent. Once the silence has lasted
+   * that long, the chain skips the effector until the sound comes back.
+   * @return the number of frames, EFFECT_TAIL_INFINITE if it may
+   *         never settle.
+   */
+  virtual size_t tail()
+  {
+    return EFFECT_TAIL_INFINITE;
+  }
+
+  /**
+   * Get the gain this effector holds the voice at, which tells how
+   * audible the voice is when one has to be stolen. An envelope in its
+   * attack gives the level it is heading for.
+   * @return the gain, 0 ~ 1.
+   */
+  virtual float level()
+  {
+    return 1;
+  }
+
   virtual int getParameterCount()=0;
   virtual void getParameter(int index, float *valout)=0;
   virtual void getParameterName(int index, std::string &s)=0;
@@ -69,6 +171,7 @@ public:
   int           m_rate;
   int           m_channels;
   bool          m_bypass;
+  bool          m_wetOnly;
   IEffector    *prev;
   IEffector    *next;
 };
@@ -78,12 +181,119 @@ public:
  */
 #define _MAX_EFFECT_CHANNELS (16)
 
+/*
+ * The number of frames the block based effectors render at once,
+ * it sizes their scratch buffers on the stack.
+ */
+#define _EFFECT_BLOCK_FRAMES (256)
+
+/*
+ * The frames a voice cut off by a new note takes to fade out.
+ */
+#define _EFFECT_DECLICK_FRAMES (64)
+
+/*
+ * Set up the number of aux send/return buses
+ */
+#define _MAX_AUX_BUS (4)
+
+/*
+ * The number of voices a batch processes in one SIMD register.
+ */
+#define _EFFECT_BATCH_LANES (4)
 
 /***************************************************
-  *****             ADSR Class                 *****
+  *****      Interface of Effector batch       *****
   ***************************************************/
 
-#define ADSR_MAXVOLUME (256)
+/*
+ * One effector of the group chain for all the voices. The state of
+ * the voices is stored structure of arrays, so that a batch processes
+ * the same effector for all the active voices at once, with the lanes
+ * of the SIMD registers mapped to the voices. The parameters are
+ * shared by the voices.
+ */
+class IEffectorBatch {
+public:
+  IEffectorBatch(int voices, int channels)
+    : m_voices(voices),
+      m_channels(channels),
+      prev(0),
+      next(0)
+  {}
+  virtual ~IEffectorBatch() {};
+
+  virtual void gate(int voice, bool gate)=0;
+  virtual void bypass(int voice, bool y)=0;
+  virtual void reset(int voice)=0;
+
+  /**
+   * Get the gain a voice is held at, see IEffector::level().
+   * @param voice     Index of the voice.
+   * @return the gain, 0 ~ 1.
+   */
+  virtual float level(int voice)
+  {
+    return 1;
+  }
+
+  /**
+   * Set a parameter of all the voices, as IEffector::setParameter()
+   * of the effector the batch was made from. It is called from the
+   * control thread and takes effect at the next process().
+   * @param index     Index of the parameter.
+   * @param v         The value.
+   */
+  virtual void setParameter(int index, float v)=0;
+
+  /**
+   * Process the buffers of the voices. A voice which has been silent
+   * for longer than the tail is skipped.
+   * @param voices      Indexes of the voices, in any order.
+   * @param buffs       The buffer of each voice in voices.
+   * @param silent      Whether each buffer is all zero, it is updated
+   *                    to tell the same after this effector.
+   * @param count       The number of voices.
+   * @param nframes     How many frames are there in each buffer.
+   * @return status code.
+   */
+  virtual int process(const int *voices, Sample_t *const *buffs, bool *silent, int count, size_t nframes)=0;
+
+public:
+  int           m_voices;
+  int           m_channels;
+  IEffectorBatch *prev;
+  IEffectorBatch *next;
+};
+
+/*
+ * The batch of an effector which has no batch form, each voice runs
+ * its own instance.
+ */
+class InstanceBatch : public IEffectorBatch {
+public:
+  InstanceBatch(int voices, int channels);
+  ~InstanceBatch();
+
+  int init(const IEffector &src);
+
+  void gate(int voice, bool gate);
+  void bypass(int voice, bool y);
+  void reset(int voice);
+  void setParameter(int index, float v);
+  float level(int voice);
+  int process(const int *voices, Sample_t *const *buffs, bool *silent, int count, size_t nframes);
+
+private:
+  IEffector   **m_instances;
+  /* the frames of silence given to each voice */
+  size_t       *m_quiet;
+};
+
+
+/***************************************************
+  *****             ADSR Class                 *****
+  ***************************************************/
 
 class ADSRImpl : public IEffector {
 public:
@@ -97,6 +307,10 @@ public:
   int reset();
   int process(Sample_t *buff, size_t nsamples);
   void gate(bool gate);
+  size_t tail();
+  float level();
+  int pointOp(PointOp *op, size_t nframes);
+  IEffectorBatch *createBatch(int voices) const;
 
   int getParameterCount();
   void getParameter(int index, float *v);
@@ -110,43 +324,112 @@ public:
   const char *getauthor() const;
   const char *getcomment() const;
 
+  int setCurveTable(const float *table, int points);
+
+  friend class ADSRBatch;
+
 private:
+  void storeParameter(int index, float v);
   void updateParameters();
+  void enterStage(int state);
 
-  inline void
-  accum()
-  {
-    m_accum++;
-  }
-
-  inline int genenv();
+  size_t genenv(float *env, size_t nframes);
 
 private:
   float         m_kAttack;
   float         m_kDecay;
   float         m_kSustain;
   float         m_kRelease;
-
-  uint32_t      m_attackRate;
-  uint32_t      m_decayRate;
-  uint32_t      m_releaseRate;
-  uint32_t      m_sustainLevel;
-
-  uint32_t      m_accum;
-  int32_t       m_output;
+  float         m_kAttackCurve;
+  float         m_kDecayCurve;
+  float         m_kReleaseCurve;
 
   enum envState {
       env_idle = 0,
       env_attack,
       env_decay,
       env_sustain,
-      env_release
+      env_release,
+      _MAX_ENV_STATE
+  };
+
+  /*
+   * Segment of a stage
+   */
+  struct envStage
+  {
+    /** shape of the segment, see kCurve* */
+    int         curve;
+    /** level increment per frame of the linear shape */
+    float       step;
+    /** level = level * coef + base, for the exponential shape */
+    float       coef;
+    float       base;
+    /** the level the exponential shape approaches */
+    float       asym;
+    /** the level to reach */
+    float       target;
+    /** the stage that follows */
+    envState    next;
   };
 
+  envStage      m_stages[_MAX_ENV_STATE];
+
+  /** sustain level, 0 ~ 1 */
+  float         m_sustainLevel;
+
+  /** current output level, 0 ~ 1 */
+  float         m_level;
+  /** level at the start of the current stage */
+  float         m_stageStart;
+  /** position within the table shape, 0 ~ 1 */
+  float         m_phase;
+
+#define ADSR_CURVE_POINTS (64)
+
+  /** the custom shape, from 0 to 1 */
+  float         m_curveTable[ADSR_CURVE_POINTS + 1];
+
   envState      m_state;
 
 };
 
+/*
+ * The ADSR of all the voices. Each stage of the linear or exponential
+ * shape is level = level * coef + base, so the levels of the voices in
+ * different stages are still stepped together in the lanes.
+ */
+class ADSRBatch : public IEffectorBatch {
+public:
+  ADSRBatch(const ADSRImpl &src, int voices);
+  ~ADSRBatch();
+
+  int init();
+
+  void gate(int voice, bool gate);
+  void bypass(int voice, bool y);
+  void reset(int voice);
+  void setParameter(int index, float v);
+  float level(int voice);
+  int process(const int *voices, Sample_t *const *buffs, bool *silent, int count, size_t nframes);
+
+private:
+  size_t settle(int voice);
+  void run(const int *lanes, Sample_t *const *buffs, int count, size_t nframes);
+
+private:
+  /** holds the parameters, the stages are worked out by it */
+  ADSRImpl      m_proto;
+  /** the parameters changed, update in the next process() */
+  volatile bool m_dirty;
+  ADSRImpl::envStage m_stages[ADSRImpl::_MAX_ENV_STATE];
+
+  /* the state of each voice */
+  float        *m_level;
+  uint8_t      *m_state;
+  bool         *m_bypass;
+};
+
 /***************************************************
   *****            Amplifier Class             *****
   ***************************************************/
@@ -163,6 +446,8 @@ public:
   int reset();
   int process(Sample_t *buff, size_t nsamples);
   void gate(bool gate);
+  size_t tail();
+  int pointOp(PointOp *op, size_t nframes);
 
   int getParameterCount();
   void getParameter(int index, float *v);
@@ -204,6 +489,8 @@ public:
   int reset();
   int process(Sample_t *buff, size_t nsamples);
   void gate(bool gate);
+  size_t tail();
+  IEffectorBatch *createBatch(int voices) const;
 
   int getParameterCount();
   void getParameter(int index, float *v);
@@ -217,8 +504,10 @@ public:
   const char *getauthor() const;
   const char *getcomment() const;
 
+  friend class FilterBatch;
+
 private:
-  void updateParameters();
+  void updateParameters(bool smooth);
 
 private:
   bool          m_inited;
@@ -226,6 +515,9 @@ private:
   float         m_kQu;
   float         m_kGain;
   float         m_kClass;
+  float         m_kOrder;
+  /** the parameters changed, update in the next process() */
+  volatile bool m_dirty;
 
   // parameters of filter
 
@@ -238,7 +530,52 @@ private:
   /** gain */
   float g;
 
-  void *m_biquads[_MAX_EFFECT_CHANNELS];
+  /** one filter per channel, the channels of a frame share the lanes */
+  BiquadBank    m_bank;
+  /** the ringing of the cascade, see tail() */
+  size_t        m_tail;
+};
+
+/*
+ * The filter of all the voices, one bank holds the histories of every
+ * channel of every voice. The lanes of the voices which are not given
+ * are skipped, or run on the silence when they share the register
+ * with a busy one.
+ */
+class FilterBatch : public IEffectorBatch {
+public:
+  FilterBatch(const FilterImpl &src, int voices);
+  ~FilterBatch();
+
+  int init();
+
+  void gate(int voice, bool gate);
+  void bypass(int voice, bool y);
+  void reset(int voice);
+  void setParameter(int index, float v);
+  int process(const int *voices, Sample_t *const *buffs, bool *silent, int count, size_t nframes);
+
+private:
+  void updateParameters(bool smooth);
+
+private:
+  int           m_rate;
+  float         m_kFreq;
+  float         m_kQu;
+  float         m_kClass;
+  float         m_kOrder;
+  /** the parameters changed, update in the next process() */
+  volatile bool m_dirty;
+
+  BiquadBank    m_bank;
+  size_t        m_tail;
+  bool         *m_bypass;
+  /* the frames of silence given to each voice */
+  size_t       *m_quiet;
+  /* the buffer of each filter, 0 = idle */
+  Sample_t    **m_buffs;
+  /* whether each voice given to process() is asleep */
+  bool         *m_asleep;
 };
 
 
@@ -258,6 +595,8 @@ public:
   int reset();
   int process(Sample_t *buff, size_t nsamples);
   void gate(bool gate);
+  void setWetOnly(bool y);
+  size_t tail();
 
   int getParameterCount();
   void getParameter(int index, float *v);
@@ -273,26 +612,34 @@ public:
 
 private:
   void updateParameters();
+  void processBlock(Sample_t *buff, size_t nframes);
+  void processGlide(Sample_t *buff, size_t nframes);
+  int acquireRings();
+  void releaseRings();
 
 private:
   bool          m_inited;
+  volatile bool m_dirty;
   float         m_kSamples;
   float         m_kLevel;
   float         m_kFeedback;
+  float         m_kMaxSamples;
+  float         m_kDry;
 
   // parameters of delay
 
-  struct ringBuffer
-  {
-    int index;
-    Sample_t *buffer;
-  };
-
-  ringBuffer m_ringBuffs[_MAX_EFFECT_CHANNELS];
-
-  int32_t       m_delaySamples;
-  int32_t       m_delayLevel;
-  int32_t       m_feedback;
+  /** one ring of 2^m_ringOrder per channel, they share the write position */
+  float        *m_ringBuffs[_MAX_EFFECT_CHANNELS];
+  int           m_ringOrder;
+  uint32_t      m_ringMask;
+  uint32_t      m_index;
+
+  /** delay length in samples, with the fraction */
+  float         m_delay;
+  float         m_delayTarget;
+  float         m_delayLevel;
+  float         m_feedback;
+  float         m_dryLevel;
 };
 
 
@@ -312,6 +659,8 @@ public:
   int reset();
   int process(Sample_t *buff, size_t nsamples);
   void gate(bool gate);
+  size_t tail();
+  int pointOp(PointOp *op, size_t nframes);
 
   int getParameterCount();
   void getParameter(int index, float *v);
@@ -335,6 +684,12 @@ private:
 
 
 
+/*
+ * Renders a voice from its original data, see VoiceKernel in dsp/voice.h.
+ */
+typedef int (*VoiceRenderer)(IEffector *env, IEffector *amp, const wavetable::PipeChunk &chunk,
+                             Sample_t *buff, size_t nframes);
+
 enum EffectScope
 {
   EFFECT_SCOPE_GROUP = 0,
@@ -342,23 +697,113 @@ enum EffectScope
   _MAX_EFFECT_SCOPE
 };
 
+/*
+ * How the group effectors hold the voices, see Effectors::initVoices().
+ */
+enum VoiceLayout
+{
+  VOICE_LAYOUT_CHAIN = 0, /* a chain per voice, processed one voice at a time */
+  VOICE_LAYOUT_BATCH      /* a batch per effector, processed for all the voices at once */
+};
+
 /***************************************************
   *****         Effectors class                *****
   ***************************************************/
 
 class Effectors {
 public:
+  Effectors();
+  ~Effectors();
 
   int add(EffectScope scope, const IEffector &src);
+  int setGroupParameter(int slot, int index, float v);
   void groupGate(int nPoly, bool gate);
   void groupBypass(int nPoly, bool y);
 
-  int processGroup(int nPoly, Sample_t *buff, size_t nsamples, size_t channels);
-  int processInstrument(Sample_t *buff, size_t nsamples, size_t channels);
+  int initVoices(int voices, size_t nsamples, VoiceLayout layout);
+  /** @return the number of voices, see initVoices(). */
+  int voices() const { return m_voices; }
+  int initAux(size_t nsamples);
+  int addAux(int bus, const IEffector &src);
+  void auxSend(int bus, int volume);
+  void auxReturn(int bus, int volume);
+
+  int processGroup(int nPoly, Sample_t *buff, size_t nsamples, size_t channels, bool silent = false);
+  int processVoice(int nPoly, const wavetable::PipeChunk &chunk, Sample_t *buff, size_t nsamples, size_t channels);
+  int renderVoice(int nPoly, const wavetable::PipeChunk &chunk, size_t nsamples, size_t channels);
+  int mixVoices(Sample_t *buff, size_t nsamples, size_t channels);
+  bool voiceDecayed(int nPoly) const;
+  float voiceLevel(int nPoly);
+  void declickVoice(int nPoly);
+  int processAux(Sample_t *buff, size_t nsamples, size_t channels);
+  int processInstrument(Sample_t *buff, size_t nsamples, size_t channels, bool silent = false);
+
+private:
+  int allocVoices(int voices);
+  void freeVoices();
+  int sendAux(const Sample_t *buff, size_t nsamples);
+  void mixDeclicks(Sample_t *buff, size_t nsamples, size_t channels);
+  int addBatch(const IEffector &src);
+  void bindVoiceKernel(int nPoly, int channels);
 
 private:
-  V_LIST<IEffector> m_slotsGroup[_MAX_POLYPHONY_NUM];
+  /* the number of voices, all the arrays of the voices have this size */
+  int           m_voices;
+
+  V_LIST<IEffector> *m_slotsGroup;
   V_LIST<IEffector> m_slotsInstrument;
+
+  /* the slot lists compiled, see EffectChain */
+  EffectChain  *m_chainsGroup;
+  EffectChain   m_chainInstrument;
+
+  /* the fused kernel of a group chain, 0 = not a common chain */
+  VoiceRenderer *m_voiceRenderers;
+  IEffector   *(*m_voiceEffectors)[2];
+
+  /* the group effectors of VOICE_LAYOUT_BATCH */
+  VoiceLayout   m_layout;
+  V_LIST<IEffectorBatch> m_batchGroup;
+
+  /* the voices rendered since the last mixVoices(), each in its buffer */
+  Sample_t     *m_voiceBuffs;
+  size_t        m_voiceSamples;
+  int          *m_voicesPending;
+  bool         *m_voicesSilent;
+  int           m_voicesCount;
+  /* the buffers of the pending voices, the scratch of mixVoices() */
+  Sample_t    **m_voicesMixed;
+  /* whether the voice was silence after the group effectors in the last mix */
+  bool         *m_voicesDecayed;
+  /* the last frame of each voice in the last mix */
+  Sample_t    (*m_voicesLast)[_MAX_EFFECT_CHANNELS];
+
+  /*
+   * A voice cut off by a new note ramps from its last frame down to
+   * zero in the mix, instead of stopping dead.
+   */
+  Sample_t    (*m_declickFrom)[_MAX_EFFECT_CHANNELS];
+  size_t       *m_declickLeft;
+  int           m_declickCount;
+
+  /*
+   * The voices add a scaled copy of their output into the send
+   * buffer, one chain processes it and the result returns to the
+   * master, so a time based effector runs once instead of per voice.
+   */
+  struct auxBus
+  {
+    V_LIST<IEffector> slots;
+    EffectChain   chain;
+    Sample_t     *buffer;
+    /* whether a voice was sent since the last processAux() */
+    bool          sent;
+    int           send;   // 0 ~ MIXER_MAXVOLUME
+    int           ret;    // 0 ~ MIXER_MAXVOLUME
+  };
+
+  auxBus        m_aux[_MAX_AUX_BUS];
+  size_t        m_auxSamples;
 };
 
 } // namespace effect
@@ -0,0 +1,216 @@
+/** @file
+ * Qin - Fused voice kernels.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef DSP_VOICE_H_
+#define DSP_VOICE_H_
+
+#include <cstring>
+
+#include "dsp/effect.h"
+#include "wavetable/wavetable.h"
+#include "util/misc.h"
+#include "util/types.h"
+
+namespace dsp {
+
+/*
+ * Stands for an absent effector in a VoiceKernel.
+ */
+struct NullEffector
+{
+};
+
+/*
+ * Call the pointOp() of an effector of the known class, without
+ * going through the virtual table.
+ */
+template <class T>
+  inline void
+  voicePointOp(IEffector *e, PointOp *op, size_t nframes)
+{
+  static_cast<T *>(e)->T::pointOp(op, nframes);
+}
+
+template <>
+  inline void
+  voicePointOp<NullEffector>(IEffector *e, PointOp *op, size_t nframes)
+{
+  op->kind = POINT_OP_NONE;
+}
+
+/*
+ * Renders a voice whose group chain is ENV followed by AMP in one pass:
+ * the original data is decoded, scaled by its level, shaped by the
+ * envelope and amplified with each sample staying in a register. The
+ * effectors are given as point operations (see IEffector::pointOp()),
+ * so the result is the same as decoding and running the chain.
+ */
+template <class ENV, class AMP, int CHANNELS>
+  class VoiceKernel {
+  public:
+    static int render(IEffector *env, IEffector *amp, const wavetable::PipeChunk &chunk,
+                      Sample_t *buff, size_t nframes);
+
+  private:
+    template <int BYTES, bool ENVELOPE, bool GAIN>
+      static void run(const uint8_t *src, int level, const PointOp &env, const PointOp &amp,
+                      Sample_t *buff, size_t nframes);
+
+    template <int BYTES>
+      static void dispatch(const uint8_t *src, int level, const PointOp &env, const PointOp &amp,
+                           Sample_t *buff, size_t nframes);
+  };
+
+/*
+ * The loop of a block, the kinds of the operations are known at
+ * compile time so there is no branch on them inside.
+ */
+template <class ENV, class AMP, int CHANNELS>
+  template <int BYTES, bool ENVELOPE, bool GAIN>
+    inline void
+    VoiceKernel<ENV, AMP, CHANNELS>::run(const uint8_t *src, int level, const PointOp &env,
+                                         const PointOp &amp, Sample_t *buff, size_t nframes)
+{
+  const int64_t max_audioval = ((int64_t)1 << (sizeof(Sample_t) * 8 - 1)) - 1;
+  const int64_t min_audioval = -((int64_t)1 << (sizeof(Sample_t) * 8 - 1));
+  register int64_t sample;
+
+  for (size_t i = 0; i < nframes; i++)
+    {
+      for (int c = 0; c < CHANNELS; c++)
+        {
+          sample = wavetable::decodePcm<BYTES>(src);
+          if (BYTES != 4)
+            sample = sample * level / 128;
+          src += BYTES;
+
+          if (ENVELOPE)
+            sample = (Sample_t)((Sample_t)sample * env.env[i]);
+
+          if (GAIN)
+            {
+              sample += sample > 0 ? sample + amp.gain : sample - amp.gain;
+              if (sample > max_audioval) sample = max_audioval;
+              else if (sample < min_audioval) sample = min_audioval;
+              sample = sample * amp.line / 100;
+              if (sample > max_audioval) sample = max_audioval;
+              else if (sample < min_audioval) sample = min_audioval;
+            }
+
+          *buff++ = (Sample_t)sample;
+        }
+    }
+}
+
+template <class ENV, class AMP, int CHANNELS>
+  template <int BYTES>
+    inline void
+    VoiceKernel<ENV, AMP, CHANNELS>::dispatch(const uint8_t *src, int level, const PointOp &env,
+                                              const PointOp &amp, Sample_t *buff, size_t nframes)
+{
+  const bool gain = amp.kind == POINT_OP_GAIN;
+
+  if (env.kind == POINT_OP_ENVELOPE)
+    {
+      if (gain) run<BYTES, true, true>(src, level, env, amp, buff, nframes);
+      else      run<BYTES, true, false>(src, level, env, amp, buff, nframes);
+    }
+  else
+    {
+      if (gain) run<BYTES, false, true>(src, level, env, amp, buff, nframes);
+      else      run<BYTES, false, false>(src, level, env, amp, buff, nframes);
+    }
+}
+
+/**
+ * Render a voice.
+ * @param env         The envelope effector, of ENV.
+ * @param amp         The amplifier effector, of AMP (0 for NullEffector).
+ * @param chunk       The original data given by FetchPipeChannel(),
+ *                    the pcm must not be 0.
+ * @param buff        Where to store the samples.
+ * @param nframes     How many frames.
+ * @return VINF_SILENCE if the voice is all zero.
+ * @return status code.
+ */
+template <class ENV, class AMP, int CHANNELS>
+  int
+  VoiceKernel<ENV, AMP, CHANNELS>::render(IEffector *env, IEffector *amp, const wavetable::PipeChunk &chunk,
+                                          Sample_t *buff, size_t nframes)
+{
+  float gains[_EFFECT_BLOCK_FRAMES];
+  PointOp envOp, ampOp;
+  const uint8_t *src = chunk.pcm;
+  bool silent = true;
+
+  V_ASSERT(src);
+
+  while (nframes)
+    {
+      size_t n = nframes < _EFFECT_BLOCK_FRAMES ? nframes : _EFFECT_BLOCK_FRAMES;
+
+      envOp.env = gains;
+      voicePointOp<ENV>(env, &envOp, n);
+      voicePointOp<AMP>(amp, &ampOp, n);
+
+      if (envOp.kind == POINT_OP_SILENCE &&
+          (ampOp.kind != POINT_OP_GAIN || !ampOp.gain))
+        {
+          /*
+           * Nothing of the data gets through and the amplifier does
+           * not lift the silence, there is no need to decode.
+           */
+          std::memset(buff, 0, n * CHANNELS * sizeof(Sample_t));
+        }
+      else
+        {
+          if (envOp.kind == POINT_OP_SILENCE)
+            {
+              /*
+               * The amplifier still works on the silence.
+               */
+              for (size_t i = 0; i < n; i++)
+                gains[i] = 0;
+              envOp.kind = POINT_OP_ENVELOPE;
+            }
+
+          switch (chunk.sampleSize)
+          {
+            case 1: dispatch<1>(src, chunk.level, envOp, ampOp, buff, n); break;
+            case 2: dispatch<2>(src, chunk.level, envOp, ampOp, buff, n); break;
+            case 3: dispatch<3>(src, chunk.level, envOp, ampOp, buff, n); break;
+            case 4: dispatch<4>(src, chunk.level, envOp, ampOp, buff, n); break;
+
+            default:
+              V_ASSERT(0);
+              return VERR_FAILED;
+          }
+          silent = false;
+        }
+
+      src += n * CHANNELS * chunk.sampleSize;
+      buff += n * CHANNELS;
+      nframes -= n;
+    }
+  return silent ? VINF_SILENCE : VINF_SUCCEEDED;
+}
+
+} // namespace dsp
+
+#endif //!defined(DSP_VOICE_H_)
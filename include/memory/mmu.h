@@ -25,12 +25,84 @@ enum MemoryTag
   MEM_TAG_AUDIO_BUFFER,
   MEM_TAG_EFFECTOR_INSTANCE,
   MEM_TAG_EFFECTOR_BUFFER,
+  MEM_TAG_SAMPLE_CACHE,
   _MAX_MEM_TAG_NUM
 };
 
 #define MEM_RESERVED_SIZE (32 * 1024) /* bytes */
 
-#define MEM_ALIGNMENT    (4)
+/** @def MEM_ALIGNMENT
+ * Default alignment of the blocks returned by the tracked operator new.
+ * Override it at build time (16/32/64) to match the SIMD width of the
+ * target, it must be a power of two.
+ */
+#ifndef MEM_ALIGNMENT
+# define MEM_ALIGNMENT   (16)
+#endif
+
+/** @def MEM_CACHELINE_SIZE
+ * Size of the CPU cache line.
+ */
+#ifndef MEM_CACHELINE_SIZE
+# define MEM_CACHELINE_SIZE (64)
+#endif
+
+/** @def MEM_STAT_SHARDS
+ * The number of statistics shards. Each thread sticks to a shard so that
+ * the counters are not bounced between the cores.
+ */
+#define MEM_STAT_SHARDS  (16)
+
+/** @def MEM_PEAK_STEP
+ * The bytes a shard grows by before the peak is worked out again, the
+ * peak is accurate to it per shard.
+ */
+#ifndef MEM_PEAK_STEP
+# define MEM_PEAK_STEP (64 * 1024)
+#endif
+
+/** @def MEM_HUGEPAGE_SIZE
+ * Size of the huge page used by the large blocks.
+ */
+#ifndef MEM_HUGEPAGE_SIZE
+# define MEM_HUGEPAGE_SIZE (2 * 1024 * 1024)
+#endif
+
+/*
+ * Flags of AllocLargeMem()
+ */
+enum
+{
+  /** try the explicit huge pages (MAP_HUGETLB) first */
+  MEM_LARGE_HUGETLB = (1 << 0),
+  /** advise the transparent huge pages */
+  MEM_LARGE_THP = (1 << 1)
+};
+
+/*
+ * Alignment of the user blocks. MEM_ALIGN_DEFAULT selects the
+ * alignment preferred by the memory tag, see GetMemTagAlignment().
+ */
+enum MemoryAlign
+{
+  MEM_ALIGN_DEFAULT = 0,
+  MEM_ALIGN_16 = 16,
+  MEM_ALIGN_32 = 32,
+  MEM_ALIGN_64 = 64,
+  MEM_ALIGN_CACHELINE = MEM_CACHELINE_SIZE
+};
+
+/** @def MEM_ASSUME_ALIGNED
+ * Tell the compiler that a pointer is aligned, so that the vector
+ * kernels can use the aligned loads/stores.
+ * @param   p           The pointer.
+ * @param   alignment   The alignment. Power of two!
+ */
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+# define MEM_ASSUME_ALIGNED(p, alignment) __builtin_assume_aligned((p), (alignment))
+#else
+# define MEM_ASSUME_ALIGNED(p, alignment) ((void *)(p))
+#endif
 
 /** @def ALIGN_TYPE
  * alignment macro.
@@ -76,13 +148,60 @@ enum MemoryTag
  */
 #define ALIGN_PTR(p, alignment) ALIGN_PTR_CAST(p, alignment, void *)
 
+/*
+ * Statistics of a memory tag
+ */
+struct MemoryStats
+{
+  /** bytes currently allocated, including the track headers */
+  std::size_t   current;
+  /** high-water mark of current */
+  std::size_t   peak;
+  /** the number of allocations so far */
+  std::size_t   allocs;
+  /** bytes backed by the explicit huge pages (MAP_HUGETLB) */
+  std::size_t   huge;
+  /**
+   * bytes advised to the transparent huge pages, the kernel backs
+   * them with huge pages only if it can, see AnonHugePages in smaps
+   */
+  std::size_t   advised;
+};
+
+void *operator new(std::size_t count, MemoryTag tag) throw(std::bad_alloc);
+void *operator new(std::size_t count, MemoryTag tag, const std::nothrow_t&t) throw();
 void *operator new[](std::size_t count, MemoryTag tag) throw(std::bad_alloc);
 void *operator new[](std::size_t count, MemoryTag tag, const std::nothrow_t&t) throw();
 
+void *operator new(std::size_t count, MemoryTag tag, MemoryAlign align) throw(std::bad_alloc);
+void *operator new(std::size_t count, MemoryTag tag, MemoryAlign align, const std::nothrow_t&t) throw();
+void *operator new[](std::size_t count, MemoryTag tag, MemoryAlign align) throw(std::bad_alloc);
+void *operator new[](std::size_t count, MemoryTag tag, MemoryAlign align, const std::nothrow_t&t) throw();
+
+/*
+ * Matching deletes, only called by the compiler when a constructor
+ * throws. Use the plain delete/delete[] for the other cases, it handles
+ * the aligned blocks as well.
+ */
+void operator delete(void *pointer, MemoryTag tag) throw();
+void operator delete(void *pointer, MemoryTag tag, const std::nothrow_t&t) throw();
+void operator delete[](void *pointer, MemoryTag tag) throw();
+void operator delete[](void *pointer, MemoryTag tag, const std::nothrow_t&t) throw();
+void operator delete(void *pointer, MemoryTag tag, MemoryAlign align) throw();
+void operator delete(void *pointer, MemoryTag tag, MemoryAlign align, const std::nothrow_t&t) throw();
+void operator delete[](void *pointer, MemoryTag tag, MemoryAlign align) throw();
+void operator delete[](void *pointer, MemoryTag tag, MemoryAlign align, const std::nothrow_t&t) throw();
+
+std::size_t GetMemTagAlignment(MemoryTag tag);
+
+void *AllocLargeMem(std::size_t size, MemoryTag tag, int flags);
+void FreeLargeMem(void *pointer);
+
 int AllocReservedMem();
 void ReleaseReservedMem();
 
 std::size_t GetBytesMemAllocated();
 std::size_t GetBytesMemAllocated(MemoryTag tag);
+void GetMemoryStats(MemoryTag tag, MemoryStats *stats);
 
 #endif //!defined(MEMORY_MMU_H_)
@@ -55,9 +55,10 @@ typedef uint8_t Velocity; /* we have just used the range of 0~128 */
 Note stringToNote(const char *src);
 
 /*
- * The maximum number of polyphony.
+ * The polyphony is chosen at the initialization, up to the maximum.
  */
-#define _MAX_POLYPHONY_NUM (16)
+#define _MAX_POLYPHONY_NUM (256)
+#define _DEFAULT_POLYPHONY_NUM (16)
 
 } // namespace midi
 
@@ -28,6 +28,7 @@ namespace mixer {
 class Mixer {
 public:
   static int MixAudio (Sample_t *dst, const Sample_t *src, uint32_t nsamples, int volume);
+  static int MixAligned (Sample_t *dst, const Sample_t *src, uint32_t nsamples);
   static int Resample_S16LE (const Sample_t *src, uint8_t *dst, uint32_t nsamples, uint32_t *newlen, int format);
   static int Resample_S32LE (const Sample_t *src, uint8_t *dst, uint32_t nsamples);
 };
@@ -24,6 +24,8 @@
 
 /* gen{{ */
 
+/** The buffer is silence. */
+#define VINF_SILENCE (3)
 /** Operation was replaced. */
 #define VINF_REPLACED (2)
 /** Operation was succeeded. */
@@ -52,6 +54,8 @@
 #define VERR_QUEUE_FULL (-10)
 /** Queue is empty */
 #define VERR_QUEUE_EMPTY (-11)
+/** Not supported by the system */
+#define VERR_NOT_SUPPORTED (-12)
 
 /* }}gen */
 
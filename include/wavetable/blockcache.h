@@ -0,0 +1,109 @@
+/** @file
+ * Qin - Block cache of the sample files.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef WAVETABLE_BLOCKCACHE_H_
+#define WAVETABLE_BLOCKCACHE_H_
+
+#include <cstdio>
+
+#include "util/types.h"
+
+
+namespace wavetable
+{
+
+/*
+ * The bytes of a block, blocks start at the multiples of it in the file.
+ */
+#define BLOCK_CACHE_BLOCK_SIZE (64 * 1024)
+
+/*
+ * Counters of the cache, see BlockCache::getStats().
+ */
+struct BlockCacheStats
+{
+  /** reads served from the memory */
+  uint32_t      hits;
+  /** reads which loaded a block from the file */
+  uint32_t      misses;
+  /** blocks dropped for the others */
+  uint32_t      evictions;
+  /** bytes of the file data held */
+  size_t        resident;
+};
+
+/***************************************************
+  *****          Block cache                   *****
+  ***************************************************/
+
+/*
+ * A fixed number of blocks of the sample files shared by all the units,
+ * so a note played again reads its sample from the memory. The blocks
+ * are keyed by the file and the index of the block, and the one to drop
+ * is chosen by CLOCK: a block read since the hand last passed it gets
+ * another round. The cache belongs to the thread which renders the
+ * voices, it takes no lock.
+ */
+class BlockCache {
+public:
+  BlockCache();
+  ~BlockCache();
+
+  int init(size_t budget);
+  void uninit();
+  int read(int file, FILE *fp, uint64_t pos, size_t len, void *dst, const uint8_t **data);
+  void getStats(BlockCacheStats *stats) const;
+
+  /** @return whether there are blocks to cache in. */
+  bool enabled() const { return m_count > 0; }
+
+private:
+  struct block
+  {
+    uint64_t    key;
+    /** bytes of the block, short at the end of the file */
+    size_t      len;
+    /** the next block in the bucket, -1 = none */
+    int         next;
+    bool        valid;
+    bool        referenced;
+  };
+
+  int lookup(uint64_t key) const;
+  int load(uint64_t key, FILE *fp);
+  int victim();
+  void unlink(int index);
+  unsigned bucketOf(uint64_t key) const;
+
+private:
+  uint8_t      *m_store;
+  block        *m_blocks;
+  int           m_count;
+  int          *m_buckets;
+  unsigned      m_bucketMask;
+  int           m_hand;
+
+  BlockCacheStats m_stats;
+};
+
+size_t readFileAt(FILE *fp, uint64_t pos, void *dst, size_t len);
+
+} // namespace wavetable
+
+#endif //!defined(WAVETABLE_BLOCKCACHE_H_)
@@ -0,0 +1,50 @@
+/** @file
+ * Qin - Decoder of the coded samples.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef WAVETABLE_CODEC_H_
+#define WAVETABLE_CODEC_H_
+
+#include "util/types.h"
+
+#include "wavetable/wavebank.h"
+
+
+namespace wavetable
+{
+
+/** @def WAVE_ADPCM_BLOCK_BOUND
+ * The bytes of a block coded by WAVE_CODEC_ADPCM.
+ * @param   frames      The frames of the block.
+ * @param   channels    The channels.
+ */
+#define WAVE_ADPCM_BLOCK_BOUND(frames, channels) \
+    ((channels) * (4 + (frames) / 2))
+
+int decodeRiceBlock(const uint8_t *src, size_t len, int channels, int bytes,
+                    size_t frames, uint8_t *dst);
+int encodeRiceBlock(const uint8_t *src, int channels, int bytes, size_t frames,
+                    uint8_t *dst, size_t *len);
+int decodeAdpcmBlock(const uint8_t *src, size_t len, int channels,
+                     size_t frames, uint8_t *dst);
+int encodeAdpcmBlock(const uint8_t *src, int channels, size_t frames,
+                     uint8_t *dst, size_t *len);
+
+} // namespace wavetable
+
+#endif //!defined(WAVETABLE_CODEC_H_)
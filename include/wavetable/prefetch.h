@@ -0,0 +1,100 @@
+/** @file
+ * Qin - Predictive prefetch of the samples.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef WAVETABLE_PREFETCH_H_
+#define WAVETABLE_PREFETCH_H_
+
+#include "midi/note.h"  // request: midi::Note ; midi::Velocity
+#include "util/list.h"
+#include "util/types.h"
+
+
+namespace wavetable
+{
+
+class WaveSample;
+
+/*
+ * The number of samples advised lately which are remembered.
+ */
+#define PREFETCH_RING_SIZE (32)
+
+/*
+ * Counters of the prefetcher, see SamplePrefetcher::getStats().
+ */
+struct PrefetchStats
+{
+  /** samples advised to the system */
+  uint32_t      issued;
+  /** notes streaming a sample which was advised ahead */
+  uint32_t      hits;
+  /** notes streaming a sample which was not */
+  uint32_t      misses;
+  /** notes playing a sample from the memory, which needs no prefetch */
+  uint32_t      resident;
+};
+
+/***************************************************
+  *****          Sample prefetcher             *****
+  ***************************************************/
+
+/*
+ * Guesses the samples of the next notes from the note-ons, and asks the
+ * system to read the head of them ahead, so that the first read of the
+ * note does not wait for the seek. A run of notes on the adjacent
+ * strings (a glissando) is followed in its direction, otherwise both
+ * neighbours of the string are taken. The guesses keep the velocity
+ * layer of the last note, as a run is mostly played evenly.
+ */
+class SamplePrefetcher {
+public:
+  SamplePrefetcher();
+
+  void init(const V_LIST<WaveSample> *samples);
+  void noteOn(midi::Note note, const WaveSample *ws);
+  void getStats(PrefetchStats *stats) const;
+
+private:
+  struct key
+  {
+    midi::Note      note;
+    midi::Velocity  dynamics;
+  };
+
+  bool advised(midi::Note note, midi::Velocity dynamics) const;
+  const WaveSample *layer(int note, midi::Velocity dynamics) const;
+  void issue(const WaveSample *ws);
+
+private:
+  /** the samples, indexed by the note */
+  const V_LIST<WaveSample> *m_samples;
+
+  midi::Note    m_lastNote;
+
+  /** the samples advised lately, a ring */
+  key           m_ring[PREFETCH_RING_SIZE];
+  int           m_ringCount;
+  int           m_ringNext;
+
+  PrefetchStats m_stats;
+};
+
+} // namespace wavetable
+
+#endif //!defined(WAVETABLE_PREFETCH_H_)
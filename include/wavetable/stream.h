@@ -0,0 +1,171 @@
+/** @file
+ * Qin - Asynchronous streaming of the samples.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef WAVETABLE_STREAM_H_
+#define WAVETABLE_STREAM_H_
+
+#include "util/types.h"
+
+
+namespace wavetable
+{
+
+/*
+ * The segments of the ring of a stream, and the bytes of a segment.
+ * The segments are read at the multiples of STREAM_ALIGN in the file,
+ * into buffers aligned as well.
+ */
+#define STREAM_RING_SEGMENTS (4)
+#define STREAM_SEGMENT_SIZE (32 * 1024)
+#define STREAM_ALIGN (4096)
+
+/*
+ * Counters of the streams, see StreamEngine::getStats().
+ */
+struct StreamStats
+{
+  /** reads submitted */
+  uint32_t      submitted;
+  /** reads completed */
+  uint32_t      completed;
+  /** calls into the system to submit or wait */
+  uint32_t      syscalls;
+  /** fetches which had to wait for a read */
+  uint32_t      stalls;
+  /** the most reads in flight at a time */
+  uint32_t      peak;
+};
+
+/***************************************************
+  *****          Stream engine                 *****
+  ***************************************************/
+
+/*
+ * Streams the samples through io_uring. Each stream owns a ring of
+ * segments, which are refilled ahead of the voice as it consumes them.
+ * The reads are queued while the voices render and submitted by one
+ * call per block in poll(), the completions are reaped there as well,
+ * so hundreds of streams need neither a thread each nor a blocking read.
+ * Only open(), for the first segment, and a fetch which gets ahead of
+ * its reads wait for them.
+ */
+class StreamEngine {
+public:
+  StreamEngine();
+  ~StreamEngine();
+
+  int init(int streams);
+  void uninit();
+  int open(int stream, int fd, uint64_t start, uint64_t size);
+  int read(int stream, size_t len, void *dst, const uint8_t **data);
+  void close(int stream);
+  int poll();
+  void getStats(StreamStats *stats) const;
+
+  /** @return whether the engine is running. */
+  bool enabled() const { return m_ring >= 0; }
+
+private:
+  enum segmentState
+  {
+    SEGMENT_FREE = 0,
+    SEGMENT_INFLIGHT,
+    SEGMENT_READY,
+    SEGMENT_ERROR
+  };
+
+  struct segment
+  {
+    segmentState state;
+    /** the stream which the read in flight was for, see streamState::epoch */
+    uint32_t    epoch;
+    /** the offset of the data in the file */
+    uint64_t    pos;
+    /** bytes read so far, and bytes wanted */
+    size_t      filled;
+    size_t      want;
+  };
+
+  struct streamState
+  {
+    int         fd;
+    bool        open;
+    /** bumped by each open(), the reads of an older one are stale */
+    uint32_t    epoch;
+    /** the sample in the file, and the next byte to consume */
+    uint64_t    end;
+    uint64_t    cur;
+    /** the file offset of the next segment to read */
+    uint64_t    next;
+    /** the segments in the order of the file, a FIFO */
+    int         order[STREAM_RING_SEGMENTS];
+    int         head;
+    int         count;
+    /** the head is consumed, recycle it on the next read */
+    bool        drained;
+  };
+
+  segment *seg(int stream, int index) { return &m_segments[stream * STREAM_RING_SEGMENTS + index]; }
+  uint8_t *buffer(int stream, int index);
+
+  void refill(int stream);
+  void submit(int stream, int index);
+  void recycle(int stream);
+  int reap(bool wait);
+  void complete(uint64_t data, int32_t res);
+  int enter(unsigned submit, unsigned wait);
+  bool setupRing(unsigned entries);
+  bool probeReads(bool *fixed);
+
+private:
+  int           m_streams;
+  streamState  *m_state;
+  segment      *m_segments;
+  uint8_t      *m_store;
+  uint8_t      *m_storeBlock;
+  bool          m_fixed;
+
+  /* the io_uring, -1 = not set up */
+  int           m_ring;
+  void         *m_sqMap;
+  size_t        m_sqMapSize;
+  void         *m_cqMap;
+  size_t        m_cqMapSize;
+  void         *m_sqes;
+  size_t        m_sqesSize;
+
+  unsigned     *m_sqHead;
+  unsigned     *m_sqTail;
+  unsigned      m_sqMask;
+  unsigned     *m_sqArray;
+  unsigned     *m_cqHead;
+  unsigned     *m_cqTail;
+  unsigned      m_cqMask;
+  void         *m_cqes;
+
+  /** reads queued and not submitted yet */
+  unsigned      m_queued;
+  unsigned      m_inflight;
+
+  StreamStats   m_stats;
+};
+
+} // namespace wavetable
+
+#endif //!defined(WAVETABLE_STREAM_H_)
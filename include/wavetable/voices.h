@@ -0,0 +1,94 @@
+/** @file
+ * Qin - Allocator of the polyphony units.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef WAVETABLE_VOICES_H_
+#define WAVETABLE_VOICES_H_
+
+#include "midi/note.h"  // request: _MAX_POLYPHONY_NUM
+#include "util/types.h"
+
+
+namespace wavetable
+{
+
+/*
+ * Counters of the allocator, see VoiceAllocator::getStats().
+ */
+struct VoiceStats
+{
+  /** notes started */
+  uint32_t      notes;
+  /** notes which took the unit of a sounding one */
+  uint32_t      stolen;
+  /** the most units in use at a time */
+  uint32_t      peak;
+};
+
+/***************************************************
+  *****          Voice allocator               *****
+  ***************************************************/
+
+/*
+ * The free units are kept in a stack. The units in use are kept in a
+ * binary heap ordered by their loudness, the quietest on the top, and
+ * the older one first when they are as loud. So taking a free unit is
+ * O(1), and finding the one to steal and updating the loudness of a
+ * unit are O(log n).
+ */
+class VoiceAllocator {
+public:
+  VoiceAllocator();
+  ~VoiceAllocator();
+
+  int init(int voices);
+  int acquire(bool *stolen);
+  void start(int voice, float loudness);
+  void update(int voice, float loudness);
+  void release(int voice);
+  void getStats(VoiceStats *stats) const;
+
+private:
+  bool quieter(int a, int b) const;
+  void place(int pos, int voice);
+  void siftUp(int pos);
+  void siftDown(int pos);
+  void remove(int voice);
+  void freeUnits();
+
+private:
+  int           m_voices;
+
+  int          *m_free;
+  int           m_freeCount;
+
+  int          *m_heap;
+  int           m_heapCount;
+  /* the position of each unit in the heap, or VOICE_FREE / VOICE_TAKEN */
+  int          *m_pos;
+
+  float        *m_loudness;
+  uint32_t     *m_started;
+  uint32_t      m_clock;
+
+  VoiceStats    m_stats;
+};
+
+} // namespace wavetable
+
+#endif //!defined(WAVETABLE_VOICES_H_)
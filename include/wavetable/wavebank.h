@@ -23,8 +23,65 @@ typedef struct WaveBank_s
 {
   /** Magic number of this file. */
   char magic[4];
+  /** The samples start at the multiples of it, 0 = packed. */
+  int align;
+  /** The coding of the samples, WAVE_CODEC_*. */
+  int codec;
   /** Reserved fields. */
-  int reserved[8];
+  int reserved[6];
 } WaveBank_t;
 
+/**
+ * The alignment of the aligned banks, the page and the block of the
+ * disk, so that the samples can be read with O_DIRECT.
+ */
+#define WAVE_BANK_ALIGN (4096)
+
+/*
+ * Coding of the samples
+ */
+#define WAVE_CODEC_PCM (0)
+#define WAVE_CODEC_RICE (1)
+/* IMA ADPCM of 16 bits samples, only in the memory, see CompressSamples() */
+#define WAVE_CODEC_ADPCM (2)
+
+/*
+ * A sample coded by WAVE_CODEC_RICE is split into blocks of
+ * WAVE_CODEC_BLOCK_FRAMES frames, each of them decodes on its own.
+ * The sample starts with a WaveCodedSample_t, followed by the offsets
+ * of the blocks from the start of the sample (blocks + 1 of them, the
+ * last one is the end) and the blocks.
+ *
+ * In a block each channel starts at a byte, with a byte of
+ * (order << 5 | k). The first order samples follow as they are, of the
+ * bits of the sample, then the residuals of the fixed predictor of the
+ * order (0 ~ WAVE_CODEC_MAX_ORDER), zigzag mapped and Rice coded with
+ * the parameter k: q zeros, a one, then the low k bits. A q of
+ * WAVE_CODEC_ESCAPE or more is written as that many zeros, a one and
+ * the value in 32 bits. The bits are taken from the MSB of each byte.
+ * Up to 24 bits per sample are supported.
+ */
+#define WAVE_CODEC_BLOCK_FRAMES (4096)
+#define WAVE_CODEC_MAX_ORDER (4)
+#define WAVE_CODEC_ESCAPE (31)
+
+/**
+ * Header of a coded sample
+ */
+typedef struct WaveCodedSample_s
+{
+  /** Bytes of the sample in the bank, this header included. */
+  unsigned int stored;
+  /** The number of blocks. */
+  unsigned int blocks;
+} WaveCodedSample_t;
+
+/** @def WAVE_CODEC_BLOCK_BOUND
+ * The most bytes of a coded block.
+ * @param   frames      The frames of the block.
+ * @param   channels    The channels.
+ */
+#define WAVE_CODEC_BLOCK_BOUND(frames, channels) \
+    ((frames) * (channels) * 8 + (channels) * (1 + WAVE_CODEC_MAX_ORDER * 4))
+
 #endif //!defined(WAVETABLE_WAVEBANK_H_)
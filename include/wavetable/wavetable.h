@@ -24,6 +24,11 @@
 #include "util/list.h"
 #include "util/types.h"
 
+#include "wavetable/voices.h"
+#include "wavetable/prefetch.h"
+#include "wavetable/blockcache.h"
+#include "wavetable/stream.h"
+
 
 namespace wavetable
 {
@@ -46,12 +51,20 @@ public:
       m_note(midi::NOTE_INVALID),
       m_dynamics(0),
       m_size(0),
+      m_stored(0),
       m_offset(0),
       m_channels(1),
       m_bps(0),
       m_rate(0),
       m_align(0),
       m_file(0),
+      m_fileId(0),
+      m_directFd(-1),
+      m_blockIndex(0),
+      m_blocks(0),
+      m_cache(0),
+      m_cacheIndex(0),
+      m_cacheCodec(0),
       prev(0),
       next(0)
   {}
@@ -69,6 +82,8 @@ public:
 
   /** the number of bytes this wave */
   uint32_t m_size;
+  /** the number of bytes in the bank, less than m_size if coded */
+  uint32_t m_stored;
   /** the start position of the sample */
   uint32_t m_offset;
   /** the number of channels */
@@ -81,6 +96,21 @@ public:
   uint32_t m_align;
   /** pointer to the file struct */
   FILE    *m_file;
+  /** the index of the file, the same in all the units */
+  int      m_fileId;
+  /** the file opened with O_DIRECT, -1 = none, see InitStreams() */
+  int      m_directFd;
+  /** the offsets of the coded blocks, 0 = plain PCM. Shared by the units */
+  const uint32_t *m_blockIndex;
+  /** the number of the coded blocks */
+  uint32_t m_blocks;
+  /** pointer to the copy in sample cache, 0 = read from the file */
+  const uint8_t *m_cache;
+  /** the offsets of the blocks of the copy compressed by CompressSamples(),
+      0 = the copy is as stored */
+  const uint32_t *m_cacheIndex;
+  /** the coding of the compressed copy, WAVE_CODEC_* */
+  int      m_cacheCodec;
 
   /** pointer to the previous */
   WaveSample *prev;
@@ -94,8 +124,16 @@ public:
 struct SampleFile {
   /** Filename of this file */
   std::string name;
+  /** The path opened */
+  std::string path;
   /** Pointer to the file struct */
   FILE *fp;
+  /** The file opened with O_DIRECT, -1 = none */
+  int directFd;
+  /** The samples start at the multiples of it, 0 = packed */
+  uint32_t align;
+  /** The coding of the samples, WAVE_CODEC_* */
+  int codec;
   /** Pointer to the previous */
   struct SampleFile *prev;
   /** Pointer to the next */
@@ -109,9 +147,18 @@ class PolyUnit {
 public:
   PolyUnit()
     : busy(false),
+      released(false),
       dynamics(0),
       level(0),
       fp(0),
+      fileId(0),
+      offset(0),
+      channels(0),
+      blockIndex(0),
+      codec(0),
+      decoded(-1),
+      pcm(0),
+      cache(0),
       len(0),
       remain(0),
       size(0)
@@ -119,25 +166,78 @@ public:
 public:
   /** Whether the unit is busy */
   bool           busy;
+  /** Whether the note is released, by NoteOff */
+  bool           released;
   /** Current MIDI note */
   midi::Event    event;
   /** The dynamics of sample */
   midi::Velocity dynamics;
   /** Compression level */
   int            level;
-  /** Pointer to the current file */
+  /** Pointer to the current file, shared with the other units */
   FILE          *fp;
+  /** The index of the current file */
+  int            fileId;
+  /** The start position of the current sample in the file */
+  uint64_t       offset;
+  /** The channels of the sample */
+  int            channels;
+  /** The offsets of the coded blocks, 0 = plain PCM */
+  const uint32_t *blockIndex;
+  /** The coding of the blocks, WAVE_CODEC_* */
+  int            codec;
+  /** The coded block in pcm, -1 = none */
+  int            decoded;
+  /** The decoded data of a coded block */
+  uint8_t       *pcm;
+  /** Pointer to the cached sample data, 0 = read from fp */
+  const uint8_t *cache;
   /** The the number of bytes that has been read. */
   size_t         len;
   /** Bytes of data remained. */
   size_t         remain;
   /** The total size of current sample */
   size_t         size;
+};
 
-  /** Collection of loaded files. */
-  V_LIST<SampleFile> sampleFiles;
+/*
+ * Sizes of the sample cache, see WaveTable::GetSampleCacheStats().
+ */
+struct SampleCacheStats
+{
+  /** bytes held in the memory */
+  size_t         resident;
+  /** bytes of the PCM data of the samples held */
+  size_t         original;
+};
+
+/*
+ * The original data of a pipe, see WaveTable::FetchPipeChannel().
+ */
+struct PipeChunk
+{
+  /** the data in the format of the bank, 0 = silence */
+  const uint8_t *pcm;
+  /** bytes per sample, 1 ~ 4 */
+  int            sampleSize;
+  /** compression level, 0 ~ 128 */
+  int            level;
 };
 
+/*
+ * Convert a sample of BYTES into the unified sample, the original
+ * data is little endian and the result sits in the upper bits.
+ */
+template <int BYTES>
+  inline Sample_t
+  decodePcm(const uint8_t *src)
+{
+  uint32_t v = 0;
+  for (int i = 0; i < BYTES; i++)
+    v |= (uint32_t)src[i] << (8 * (4 - BYTES + i));
+  return (Sample_t)v;
+}
+
 /***************************************************
   *****          Wave Table object             *****
   ***************************************************/
@@ -145,10 +245,16 @@ class WaveTable {
 public:
   WaveTable();
 
-  int init();
+  int init(int polyphony);
   int uninit();
 
   int LoadTimbres(const char *path);
+  int CacheSamples(size_t budget, int flags);
+  int CompressSamples(size_t budget, int codec, int flags);
+  void ReleaseSampleCache();
+  int CacheBlocks(size_t budget);
+  int InitStreams(bool direct);
+  int PollStreams();
   int SendMIDIEvent(const midi::Event &event, int *poly);
   int GetSampleRate();
   int GetSampleFormat();
@@ -156,7 +262,18 @@ public:
   int GetChannels();
   int GetPipeChannelNum();
   bool PipeBusy(int index);
+  int GetActivePipes(const int **pipes);
+  bool PipeReleased(int index);
+  void ClosePipeChannel(int index);
+  void SetPipeLoudness(int index, float gain);
+  void GetVoiceStats(VoiceStats *stats);
+  void GetPrefetchStats(PrefetchStats *stats);
+  void GetBlockCacheStats(BlockCacheStats *stats);
+  void GetStreamStats(StreamStats *stats);
+  void GetSampleCacheStats(SampleCacheStats *stats);
   int ReadPipeChannel(int index, void *ori, Sample_t *buff, size_t nsamples);
+  int FetchPipeChannel(int index, void *ori, size_t nsamples, PipeChunk *chunk);
+  static int DecodePipeChunk(const PipeChunk &chunk, Sample_t *buff, size_t nsamples);
 
 private:
   int parseSynTable(FILE *fp);
@@ -165,11 +282,56 @@ private:
 
   SampleBank stringToBank(const char *src);
 
+  void openDirect();
+  void closeDirect();
+
+  int loadBlockIndex(FILE *fp, uint32_t offset, uint32_t size, uint32_t frameBytes,
+                     uint32_t **index, uint32_t *blocks, uint32_t *stored);
+  int readCoded(int index, void *ori, size_t len, const uint8_t **data);
+  int readBlock(WaveSample *ws, uint32_t block, uint8_t *dst);
+  int encodeSample(WaveSample *ws, int codec, uint8_t *pcm, uint8_t *work,
+                   uint8_t *dst, size_t limit, size_t *len);
+  int allocDecoders(size_t frameBytes);
+  int decodeBlock(int index, int block);
+
+  void activateUnit(int index);
+  void endUnit(int index);
+
 private:
-  V_LIST<WaveSample> m_waveSamples[_MAX_POLYPHONY_NUM][midi::_MAX_NOTE_NUM];
-  PolyUnit  m_units[_MAX_POLYPHONY_NUM];
+  /** The number of polyphonic units, see init() */
+  int       m_polyphony;
+  /** The samples of each note, shared by the units */
+  V_LIST<WaveSample> *m_waveSamples;
+  /** Collection of loaded files, shared by the units */
+  V_LIST<SampleFile> m_sampleFiles;
+  PolyUnit *m_units;
+  VoiceAllocator m_voices;
+  SamplePrefetcher m_prefetch;
+
+  /** The indexes of the busy units, packed, see GetActivePipes() */
+  int      *m_active;
+  int       m_activeCount;
+  /** The position of each unit in m_active, -1 = idle */
+  int      *m_activePos;
 
   size_t m_sampleSize;
+
+  /** The in-memory sample store, see CacheSamples() */
+  uint8_t *m_cache;
+  size_t m_cacheSize;
+  /** The PCM bytes of the samples in the store */
+  size_t m_cacheOriginal;
+
+  /** The blocks of the streamed samples, see CacheBlocks() */
+  BlockCache m_blocks;
+  /** The asynchronous reads of the streamed samples, see InitStreams() */
+  StreamEngine m_streams;
+
+  /** The largest frame of the coded samples, 0 = none coded */
+  size_t    m_codedFrameBytes;
+  /** Where a coded block is read to */
+  uint8_t  *m_codedScratch;
+  size_t    m_codedScratchSize;
 };
 
 } // namespace wavetable
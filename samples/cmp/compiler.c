@@ -112,8 +112,12 @@ usage(const char *argv0)
 {
   fprintf(stderr, "Sample compiler: Usage :\n");
   fprintf(stderr, "\t%s [input] [output] [table output] [bank] [dynamics] [note].\n", argv0);
-  fprintf(stderr, "\t%s -ct [table output]      - Create a empty table file.\n");
-  fprintf(stderr, "\t%s -cw [wave bank output]  - Create a empty wave bank file.\n");
+  fprintf(stderr, "\t%s -ct [table output]      - Create a empty table file.\n", argv0);
+  fprintf(stderr, "\t%s -cw [wave bank output]  - Create a empty wave bank file.\n", argv0);
+  fprintf(stderr, "\t%s -cwa [wave bank output] - Create a empty wave bank file, each\n"
+                  "\t\t\t\t\t\tsample padded to %d bytes for O_DIRECT.\n", argv0, WAVE_BANK_ALIGN);
+  fprintf(stderr, "\t%s -cwz [wave bank output] - Create a empty wave bank file, the\n"
+                  "\t\t\t\t\t\tsamples losslessly compressed (-cwaz aligned as well).\n", argv0);
   fflush(stderr);
   return 1;
 }
@@ -131,6 +135,221 @@ cmperr(const char *msg)
   return 1;
 }
 
+/**
+ * Pad the file with zeros to a multiple of the alignment.
+ * @return 0 if succeeded.
+ */
+static
+int
+padfile(FILE *f, int align)
+{
+  static const char zeros[WAVE_BANK_ALIGN];
+  long pos;
+
+  if (align <= 0)
+    return 0;
+
+  if (fseek(f, 0, SEEK_END) != 0 || (pos = ftell(f)) < 0)
+    return 1;
+
+  while (pos % align)
+    {
+      size_t n = align - pos % align;
+      if (n > sizeof(zeros))
+        n = sizeof(zeros);
+      if (fwrite(zeros, 1, n, f) != n)
+        return 1;
+      pos += n;
+    }
+  return 0;
+}
+
+/*
+ * Writes the bits from the MSB of each byte, into a zeroed buffer.
+ */
+typedef struct BITWRITER_s
+{
+  unsigned char *p;
+  size_t        pos;
+} BITWRITER_t;
+
+static
+void
+putbits(BITWRITER_t *bw, unsigned long v, int n)
+{
+  int i;
+  for (i = n - 1; i >= 0; i--)
+    {
+      if ((v >> i) & 1)
+          bw->p[bw->pos >> 3] |= 0x80 >> (bw->pos & 7);
+      bw->pos++;
+    }
+}
+
+/*
+ * The residual of the fixed predictor of the order at the frame.
+ */
+static
+long long
+residual(const long *s, size_t i, int order)
+{
+  switch (order)
+    {
+      case 0: return s[i];
+      case 1: return s[i] - s[i-1];
+      case 2: return s[i] - 2 * s[i-1] + s[i-2];
+      case 3: return s[i] - 3 * s[i-1] + 3 * s[i-2] - s[i-3];
+      default: return s[i] - 4 * s[i-1] + 6 * s[i-2] - 4 * s[i-3] + s[i-4];
+    }
+}
+
+static
+unsigned long
+zigzag(long long r)
+{
+  return (unsigned long)((r < 0) ? ((-r) << 1) - 1 : r << 1);
+}
+
+/*
+ * Bits of the Rice codes of the residuals with the parameter k.
+ */
+static
+unsigned long long
+ricecost(const long *s, size_t frames, int order, int k)
+{
+  unsigned long long bits = 0;
+  size_t i;
+  for (i = order; i < frames; i++)
+    {
+      unsigned long q = zigzag(residual(s, i, order)) >> k;
+      bits += q < WAVE_CODEC_ESCAPE ? q + 1 + k : WAVE_CODEC_ESCAPE + 1 + 32;
+    }
+  return bits;
+}
+
+/*
+ * Code a channel of a block, see wavetable/wavebank.h for the format.
+ */
+static
+void
+encodechannel(BITWRITER_t *bw, const long *s, size_t frames, int sbits)
+{
+  int order, k, best = 0, bestk = 0;
+  unsigned long long cost, bestcost = 0;
+  size_t i;
+
+  /*
+   * Try all the orders and the parameters, the block is small.
+   */
+  for (order = 0; order <= WAVE_CODEC_MAX_ORDER && (size_t)order <= frames; order++)
+    {
+      for (k = 0; k <= 30; k++)
+        {
+          cost = ricecost(s, frames, order, k) + order * sbits;
+          if ((order == 0 && k == 0) || cost < bestcost)
+            {
+              bestcost = cost;
+              best = order;
+              bestk = k;
+            }
+        }
+    }
+
+  bw->pos = (bw->pos + 7) & ~(size_t)7;
+  putbits(bw, (best << 5) | bestk, 8);
+
+  for (i = 0; i < (size_t)best; i++)
+    {
+      putbits(bw, (unsigned long)s[i] & ((1UL << sbits) - 1), sbits);
+    }
+
+  for (i = best; i < frames; i++)
+    {
+      unsigned long u = zigzag(residual(s, i, best));
+      unsigned long q = u >> bestk;
+      if (q < WAVE_CODEC_ESCAPE)
+        {
+          bw->pos += q;
+          putbits(bw, 1, 1);
+          putbits(bw, u & ((1UL << bestk) - 1), bestk);
+        }
+      else
+        {
+          bw->pos += WAVE_CODEC_ESCAPE;
+          putbits(bw, 1, 1);
+          putbits(bw, u, 32);
+        }
+    }
+}
+
+/**
+ * Compress a sample into blocks, see wavetable/wavebank.h for the format.
+ * @param pcm       The little endian PCM data.
+ * @param size      Bytes of the data.
+ * @param channels  The number of channels.
+ * @param bytes     Bytes per sample, 1 ~ 3.
+ * @param out       Where to store the coded sample, free() it.
+ * @param outlen    Where to store the bytes of the coded sample.
+ * @return 0 if succeeded.
+ */
+static
+int
+encodesample(const unsigned char *pcm, size_t size, int channels, int bytes,
+             unsigned char **out, size_t *outlen)
+{
+  size_t frames = size / (channels * bytes);
+  size_t blocks = (frames + WAVE_CODEC_BLOCK_FRAMES - 1) / WAVE_CODEC_BLOCK_FRAMES;
+  size_t hdrsize = sizeof(WaveCodedSample_t) + (blocks + 1) * sizeof(unsigned int);
+  size_t b, i;
+  int c, n;
+  long s[WAVE_CODEC_BLOCK_FRAMES];
+  unsigned int *offsets;
+  WaveCodedSample_t *hdr;
+  BITWRITER_t bw;
+
+  unsigned char *buf = (unsigned char *)calloc(1, hdrsize + blocks *
+      WAVE_CODEC_BLOCK_BOUND(WAVE_CODEC_BLOCK_FRAMES, channels));
+  if (!buf)
+      return 1;
+
+  hdr = (WaveCodedSample_t *)buf;
+  offsets = (unsigned int *)(buf + sizeof(WaveCodedSample_t));
+  bw.p = buf;
+  bw.pos = hdrsize * 8;
+
+  for (b = 0; b < blocks; b++)
+    {
+      size_t start = b * WAVE_CODEC_BLOCK_FRAMES;
+      size_t count = frames - start < WAVE_CODEC_BLOCK_FRAMES ? frames - start : WAVE_CODEC_BLOCK_FRAMES;
+
+      bw.pos = (bw.pos + 7) & ~(size_t)7;
+      offsets[b] = (unsigned int)(bw.pos / 8);
+
+      for (c = 0; c < channels; c++)
+        {
+          for (i = 0; i < count; i++)
+            {
+              const unsigned char *src = pcm + ((start + i) * channels + c) * bytes;
+              unsigned long v = 0;
+              for (n = 0; n < bytes; n++)
+                  v |= (unsigned long)src[n] << (8 * n);
+              /* sign extension */
+              s[i] = (long)(v ^ (1UL << (bytes * 8 - 1))) - (long)(1UL << (bytes * 8 - 1));
+            }
+          encodechannel(&bw, s, count, bytes * 8);
+        }
+    }
+
+  bw.pos = (bw.pos + 7) & ~(size_t)7;
+  offsets[blocks] = (unsigned int)(bw.pos / 8);
+  hdr->stored = offsets[blocks];
+  hdr->blocks = (unsigned int)blocks;
+
+  *out = buf;
+  *outlen = hdr->stored;
+  return 0;
+}
+
 /**
  * Main entry of compiler.
  */
@@ -140,6 +359,9 @@ main(int argc, char *argv[])
   FILE *inf;
   FILE *outf;
   FILE *tablef;
+  FILE *bankf;
+  WaveBank_t bankHdr;
+  unsigned char *pcm = NULL;
 
   char *srcname[MAX_PATH_LEN+1];
   const char *rawfile;
@@ -175,6 +397,8 @@ main(int argc, char *argv[])
     }
   else if (argc == 3 && strncmp(argv[1], "-cw", 3)==0)
     {
+      int aligned = strchr(argv[1] + 3, 'a') != NULL;
+      int coded = strchr(argv[1] + 3, 'z') != NULL;
       FILE *wf = fopen(argv[2], "wb");
       if (!wf)
           return cmperr("failed on creating the wave bank.");
@@ -185,10 +409,14 @@ main(int argc, char *argv[])
       waveHdr.magic[1] = 'W';
       waveHdr.magic[2] = 'S';
       waveHdr.magic[3] = 'F';
+      waveHdr.align = aligned ? WAVE_BANK_ALIGN : 0;
+      waveHdr.codec = coded ? WAVE_CODEC_RICE : WAVE_CODEC_PCM;
 
       len = fwrite(&waveHdr, sizeof(waveHdr), 1, wf);
       if (len<=0 || ferror(wf))
           return cmperr("failed on writing the wave bank.");
+      if (padfile(wf, waveHdr.align))
+          return cmperr("failed on writing the wave bank.");
       fclose(wf);
       /*
        * The procedure of compilation will end here.
@@ -235,6 +463,27 @@ main(int argc, char *argv[])
       return cmperr("failed on creating the table output.");
     }
 
+  /*
+   * An aligned bank starts each sample at a multiple of the alignment,
+   * the runtime works out the same offsets from the header.
+   */
+  memset(&bankHdr, 0, sizeof(bankHdr));
+  bankf = fopen(argv[2], "rb");
+  if (bankf)
+    {
+      if (fread(&bankHdr, sizeof(bankHdr), 1, bankf) != 1)
+          memset(&bankHdr, 0, sizeof(bankHdr));
+      fclose(bankf);
+    }
+  if (padfile(outf, bankHdr.align))
+    {
+      return cmperr("failed on writing the output file.");
+    }
+  if (bankHdr.codec != WAVE_CODEC_PCM && bankHdr.codec != WAVE_CODEC_RICE)
+    {
+      return cmperr("unknown coding of the wave bank.");
+    }
+
   /*
    * Read the RIFF header
    */
@@ -367,10 +616,25 @@ main(int argc, char *argv[])
     }
 
   /*
-   * Read the PCM data
+   * Read the PCM data. A coded bank compresses the sample as a whole,
+   * so keep the data in the memory.
    */
   required = bufData.dwDataSize;
   total = 0;
+  if (bankHdr.codec == WAVE_CODEC_RICE)
+    {
+      if (bufFmt.wavFormat.wBitsPerSample < 8 ||
+          bufFmt.wavFormat.wBitsPerSample > 24 ||
+          bufFmt.wavFormat.wBitsPerSample % 8)
+        {
+          return cmperr("the coded bank supports 8, 16 and 24 bits per sample.");
+        }
+      pcm = (unsigned char *)malloc(required ? required : 1);
+      if (!pcm)
+        {
+          return cmperr("out of memory.");
+        }
+    }
   for (;;)
     {
       len = fread(buff, 1, sizeof(buff), inf);
@@ -385,6 +649,12 @@ main(int argc, char *argv[])
               return cmperr("internal error.");
             }
 
+          if (pcm)
+            {
+              memcpy(pcm + total - len, buff, len);
+              continue;
+            }
+
           /*
            * Write the pcm data to the target
            */
@@ -408,6 +678,33 @@ main(int argc, char *argv[])
       return cmperr("the input file was damaged.");
     }
 
+  if (pcm)
+    {
+      unsigned char *coded;
+      size_t codedlen;
+
+      if (encodesample(pcm, required, bufFmt.wavFormat.wf.nChannels,
+                       bufFmt.wavFormat.wBitsPerSample / 8, &coded, &codedlen))
+        {
+          return cmperr("out of memory.");
+        }
+      wlen = fwrite(coded, 1, codedlen, outf);
+      if (wlen != codedlen || ferror(outf))
+        {
+          return cmperr("failed on writing the output file.");
+        }
+#if DEBUG
+      printf("\ncoded: %lu -> %lu bytes\n", (unsigned long)required, (unsigned long)codedlen);
+#endif
+      free(coded);
+      free(pcm);
+    }
+
+  if (padfile(outf, bankHdr.align))
+    {
+      return cmperr("failed on writing the output file.");
+    }
+
   /*
    * Append the wave table
    */
@@ -17,6 +17,9 @@
  *  Lesser General Public License for more details.
  */
 
+#include <cmath>
+#include <cstring>
+
 #include "dsp/effect.h"
 #include "util/misc.h"
 #include "util/error.h"
@@ -25,8 +28,6 @@
 #include "memory/mmu.h"
 
 
-#define ADSR_MAXVOLUME (256)
-
 namespace dsp
 {
 
@@ -35,9 +36,26 @@ enum {
   kDecay,
   kSustain,
   kRelease,
+  kAttackCurve,
+  kDecayCurve,
+  kReleaseCurve,
   kMaxCount
 };
 
+enum {
+  kCurveLinear = 0,
+  kCurveExponential,
+  kCurveTable,
+  kMaxCurve
+};
+
+/*
+ * How far beyond the target the exponential shape aims, the smaller
+ * the more curved. Attack is kept mild so that it still sounds sharp.
+ */
+#define EXP_RATIO_ATTACK    (0.3f)
+#define EXP_RATIO_DECAY     (0.0001f)
+
 ////////////////////////////////////////////////////////////////////////////////
 
 /**
@@ -47,12 +65,10 @@ enum {
  */
 ADSRImpl::ADSRImpl(int rate, int channels)
   : IEffector(rate, channels),
-    m_attackRate(0),
-    m_decayRate(0),
-    m_releaseRate(0),
     m_sustainLevel(0),
-    m_accum(0),
-    m_output(0),
+    m_level(0),
+    m_stageStart(0),
+    m_phase(0),
     m_state(env_idle)
 {
   /*
@@ -62,6 +78,24 @@ ADSRImpl::ADSRImpl(int rate, int channels)
   m_kDecay = 2000;
   m_kRelease = 30;
   m_kSustain = 88;
+  /*
+   * All linear as the counter envelope was, the other shapes are
+   * chosen by the curve parameters.
+   */
+  m_kAttackCurve = kCurveLinear;
+  m_kDecayCurve = kCurveLinear;
+  m_kReleaseCurve = kCurveLinear;
+
+  std::memset(m_stages, 0, sizeof(m_stages));
+
+  /*
+   * The default custom shape is a smooth step.
+   */
+  for (int i = 0; i <= ADSR_CURVE_POINTS; i++)
+    {
+      float x = (float)i / ADSR_CURVE_POINTS;
+      m_curveTable[i] = x * x * (3 - 2 * x);
+    }
 }
 
 ADSRImpl::~ADSRImpl()
@@ -98,6 +132,9 @@ ADSRImpl::getParameter(int index, float *v)
     case kDecay:    *v = m_kDecay;  break;
     case kSustain:  *v = m_kSustain; break;
     case kRelease:  *v = m_kRelease; break;
+    case kAttackCurve:  *v = m_kAttackCurve; break;
+    case kDecayCurve:   *v = m_kDecayCurve; break;
+    case kReleaseCurve: *v = m_kReleaseCurve; break;
   }
 }
 
@@ -111,6 +148,9 @@ ADSRImpl::getParameterName(int index, std::string &s)
     case kDecay:    s = "Decay time";  break;
     case kSustain:  s = "Sustain level"; break;
     case kRelease:  s = "Release time"; break;
+    case kAttackCurve:  s = "Attack curve"; break;
+    case kDecayCurve:   s = "Decay curve"; break;
+    case kReleaseCurve: s = "Release curve"; break;
   }
 }
 
@@ -124,6 +164,9 @@ ADSRImpl::getParameterLable(int index, std::string &s)
     case kDecay:    s = "ms";   break;
     case kSustain:  s = "%";    break;
     case kRelease:  s = "ms";   break;
+    case kAttackCurve:
+    case kDecayCurve:
+    case kReleaseCurve: s = ""; break;
   }
 }
 
@@ -138,6 +181,24 @@ ADSRImpl::getParameterDisplay(int index, std::string &s)
     case kDecay:    gcvt(m_kDecay, 8, buff);    break;
     case kSustain:  gcvt(m_kSustain, 8, buff);  break;
     case kRelease:  gcvt(m_kRelease, 8, buff);  break;
+    case kAttackCurve:
+    case kDecayCurve:
+    case kReleaseCurve:
+      {
+        float v = 0;
+        getParameter(index, &v);
+        switch ((int)v)
+        {
+          case kCurveLinear:
+            s = "Linear"; return;
+          case kCurveExponential:
+            s = "Exponential"; return;
+          case kCurveTable:
+            s = "Custom"; return;
+          default:
+            s = "unknown"; return;
+        }
+      }
   }
   s = buff;
 }
@@ -145,6 +206,16 @@ ADSRImpl::getParameterDisplay(int index, std::string &s)
 //------------------------------------------------------------------------
 void
 ADSRImpl::setParameter(int index, float v)
+{
+  storeParameter(index, v);
+  updateParameters();
+}
+
+/*
+ * Store the value of a parameter, the stages are not worked out.
+ */
+void
+ADSRImpl::storeParameter(int index, float v)
 {
   switch ( index )
   {
@@ -152,9 +223,40 @@ ADSRImpl::setParameter(int index, float v)
     case kDecay:    m_kDecay = v;  break;
     case kSustain:  m_kSustain = v; break;
     case kRelease:  m_kRelease = v; break;
+    case kAttackCurve:  m_kAttackCurve = v; break;
+    case kDecayCurve:   m_kDecayCurve = v; break;
+    case kReleaseCurve: m_kReleaseCurve = v; break;
   }
+}
 
-  updateParameters();
+/**
+ * Set up the custom shape used by the kCurveTable segments.
+ * @param table       The shape sampled evenly over the segment, it
+ *                    should rise from 0 to 1.
+ * @param points      The number of points in table, at least 2.
+ * @return status code.
+ */
+int
+ADSRImpl::setCurveTable(const float *table, int points)
+{
+  if (!table || points < 2)
+    {
+      return VERR_INVALID_PARAMETER;
+    }
+
+  /*
+   * Resample it to the fixed size so that the lookup is a plain index.
+   */
+  for (int i = 0; i <= ADSR_CURVE_POINTS; i++)
+    {
+      float pos = (float)i * (points - 1) / ADSR_CURVE_POINTS;
+      int n = (int)pos;
+      if (n >= points - 1)
+        n = points - 2;
+      float frac = pos - n;
+      m_curveTable[i] = table[n] + (table[n + 1] - table[n]) * frac;
+    }
+  return VINF_SUCCEEDED;
 }
 
 /**
@@ -194,9 +296,9 @@ ADSRImpl::init(int flags)
   if (!printed)
     {
       LOG(INFO) << "\n" <<
-          "Attack = " << m_attackRate << " s/s\n" <<
-          "Decay = " << m_decayRate << " s/s\n" <<
-          "Release = " << m_releaseRate << " s/s\n" <<
+          "Attack = " << m_stages[env_attack].step << " /frame\n" <<
+          "Decay = " << m_stages[env_decay].step << " /frame\n" <<
+          "Release = " << m_stages[env_release].step << " /frame\n" <<
           "Sustain = " << m_sustainLevel << "\n";
       printed = true;
     }
@@ -225,100 +327,212 @@ int
 ADSRImpl::reset()
 {
   m_state = env_idle;
-  m_accum = 0;
-  m_output = 0;
+  m_level = 0;
+  m_stageStart = 0;
+  m_phase = 0;
   return VINF_SUCCEEDED;
 }
 
+/*
+ * Work out the number of frames a stage takes to pass the full scale.
+ */
+static inline float
+stageFrames(float ms, int rate)
+{
+  float frames = ms * rate / 1000;
+  return frames > 1 ? frames : 1;
+}
+
+/*
+ * Convert the curve parameter to the shape index.
+ */
+static inline int
+curveShape(float v)
+{
+  int curve = (int)v;
+  return (curve >= 0 && curve < kMaxCurve) ? curve : kCurveLinear;
+}
+
 /**
  * Recalculate the parameters.
  */
 void
 ADSRImpl::updateParameters()
 {
-  m_attackRate  = m_kAttack * m_rate / 1000 / ADSR_MAXVOLUME;
-  m_decayRate   = m_kDecay * m_rate / 1000 / ADSR_MAXVOLUME;
-  m_releaseRate = m_kRelease * m_rate / 1000 / ADSR_MAXVOLUME;
-  m_sustainLevel = m_kSustain * ADSR_MAXVOLUME / 100;
+  m_sustainLevel = m_kSustain / 100;
+
+  if (m_sustainLevel > 1)
+    m_sustainLevel = 1;
+  else if (m_sustainLevel < 0)
+    m_sustainLevel = 0;
+
+  struct {
+      envState  state;
+      float     ms;
+      float     curve;
+      float     target;
+      float     ratio;
+      envState  next;
+  } stages[] = {
+      { env_attack,  m_kAttack,  m_kAttackCurve,  1,              EXP_RATIO_ATTACK, env_decay },
+      { env_decay,   m_kDecay,   m_kDecayCurve,   m_sustainLevel, EXP_RATIO_DECAY,  env_sustain },
+      { env_release, m_kRelease, m_kReleaseCurve, 0,              EXP_RATIO_DECAY,  env_idle }
+  };
+
+  for (size_t i = 0; i < GET_ELEMENTS(stages); i++)
+    {
+      envStage *st = &m_stages[stages[i].state];
+      float frames = stageFrames(stages[i].ms, m_rate);
+      bool rise = stages[i].state == env_attack;
+
+      st->curve = curveShape(stages[i].curve);
+      st->target = stages[i].target;
+      st->next = stages[i].next;
+      st->step = rise ? 1 / frames : -1 / frames;
+
+      /*
+       * The exponential shape approaches an asymptote beyond the
+       * target, and passes the full scale in the same time as the
+       * linear one does.
+       */
+      float ratio = stages[i].ratio;
+      st->coef = expf(-logf((1 + ratio) / ratio) / frames);
+      st->asym = rise ? 1 + ratio : st->target - ratio;
+      st->base = st->asym * (1 - st->coef);
+    }
+
+  m_stages[env_idle].next = env_idle;
+  m_stages[env_sustain].next = env_sustain;
 }
 
-inline int
-ADSRImpl::genenv()
+/*
+ * Switch to a stage.
+ */
+void
+ADSRImpl::enterStage(int state)
 {
-  /*
-   * State machine of envelope generator
-   */
-  switch (m_state)
-  {
-    case env_idle:
-      break;
+  m_state = (envState)state;
+  m_stageStart = m_level;
+  m_phase = 0;
+}
 
-    //
-    // Attack stage
-    //
-    case env_attack:
-      {
-        if (m_accum < m_attackRate)
+/**
+ * Render the envelope of a block. Each stage is a segment of the chosen
+ * shape, and the frame where it reaches its target is worked out at once
+ * instead of checking the state for every sample.
+ * @param env         Where to store the level of each frame.
+ * @param nframes     How many frames to render.
+ * @return the number of frames rendered.
+ */
+size_t
+ADSRImpl::genenv(float *env, size_t nframes)
+{
+  size_t done = 0;
+
+  while (done < nframes)
+    {
+      size_t n = nframes - done;
+      const envStage *st = &m_stages[m_state];
+      float *out = env + done;
+
+      if (m_state == env_idle || m_state == env_sustain)
+        {
+          /*
+           * Constant segment, it lasts until the next gate.
+           */
+          for (size_t i = 0; i < n; i++)
+            out[i] = m_level;
           break;
-        else
-          m_accum = 0;
+        }
 
-        /* inner processing */
-        m_output++;
-        if (m_output >= ADSR_MAXVOLUME)
-          {
-            m_output = ADSR_MAXVOLUME;
-            m_state = env_decay;
-          }
-      }
-      break;
+      float target = st->target;
+      float dist = target - m_level;
+      bool rise = st->step > 0;
+
+      if (rise ? dist <= 0 : dist >= 0)
+        {
+          m_level = target;
+          enterStage(st->next);
+          continue;
+        }
 
-    //
-    // Decay stage
-    //
-    case env_decay:
+      /*
+       * Work out the number of frames before the stage boundary.
+       */
+      float span;
+      switch (st->curve)
       {
-        if (m_accum < m_decayRate)
+        case kCurveExponential:
+          span = logf((target - st->asym) / (m_level - st->asym)) / logf(st->coef);
           break;
-        else
-          m_accum = 0;
-
-        /* inner processing */
-        m_output--;
-        if (m_output <= (int)m_sustainLevel)
+        case kCurveTable:
           {
-            m_output = m_sustainLevel;
-            m_state = env_sustain;
+            float full = target - m_stageStart;
+            span = (1 - m_phase) * full / st->step;
           }
+          break;
+        default:
+          span = dist / st->step;
       }
-      break;
 
-    //
-    // Sustain stage (just keep the level)
-    //
-    case env_sustain:
-      break;
+      size_t reach = span > 0 ? (size_t)ceilf(span) : 0;
+      bool finished = reach <= n;
+      if (finished)
+        n = reach;
 
-    //
-    // Release stage
-    //
-    case env_release:
+      switch (st->curve)
       {
-        if (m_accum < m_releaseRate)
+        case kCurveExponential:
+          {
+            /*
+             * One multiply per frame.
+             */
+            register float level = m_level;
+            for (size_t i = 0; i < n; i++)
+              {
+                level = level * st->coef + st->base;
+                out[i] = level;
+              }
+            m_level = level;
+          }
           break;
-        else
-          m_accum = 0;
 
-        /* inner processing */
-        m_output--;
-        if (m_output <= 0)
+        case kCurveTable:
           {
-            m_output = 0;
-            m_state = env_idle;
+            float full = target - m_stageStart;
+            float dphase = st->step / full;
+            for (size_t i = 0; i < n; i++)
+              {
+                float pos = (m_phase + dphase * (i + 1)) * ADSR_CURVE_POINTS;
+                int k = (int)pos;
+                if (k >= ADSR_CURVE_POINTS)
+                  k = ADSR_CURVE_POINTS - 1;
+                float shape = m_curveTable[k] + (m_curveTable[k + 1] - m_curveTable[k]) * (pos - k);
+                out[i] = m_stageStart + full * shape;
+              }
+            m_phase += dphase * n;
+            if (n)
+              m_level = out[n - 1];
           }
+          break;
+
+        default:
+          for (size_t i = 0; i < n; i++)
+            out[i] = m_level + st->step * (i + 1);
+          m_level += st->step * n;
       }
-  }
-  return m_output;
+
+      if (finished)
+        {
+          if (n)
+            out[n - 1] = target;
+          m_level = target;
+          enterStage(st->next);
+        }
+
+      done += n;
+    }
+  return done;
 }
 
 /*
@@ -329,9 +543,83 @@ void
 ADSRImpl::gate(bool gate)
 {
   if (gate)
-    m_state = env_attack;
+    enterStage(env_attack);
   else if (m_state != env_idle)
-    m_state = env_release;
+    enterStage(env_release);
+}
+
+/**
+ * The envelope only scales the input, the silence stays silent.
+ * @return the number of frames.
+ */
+size_t
+ADSRImpl::tail()
+{
+  return 0;
+}
+
+/**
+ * The level of the envelope, the peak while in the attack.
+ * @return the gain.
+ */
+float
+ADSRImpl::level()
+{
+  if (m_bypass || m_state == env_attack)
+    return 1;
+  return m_level;
+}
+
+/*
+ * Apply the gain of each frame to the interleaved channels. The loops
+ * are kept simple so that the compiler can vectorize them.
+ */
+static inline void
+applyGain(Sample_t *buff, const float *env, size_t nframes, int channels)
+{
+  switch (channels)
+  {
+    case 1:
+      for (size_t i = 0; i < nframes; i++)
+        buff[i] = (Sample_t)(buff[i] * env[i]);
+      break;
+
+    case 2:
+      for (size_t i = 0; i < nframes; i++)
+        {
+          buff[2 * i]     = (Sample_t)(buff[2 * i] * env[i]);
+          buff[2 * i + 1] = (Sample_t)(buff[2 * i + 1] * env[i]);
+        }
+      break;
+
+    default:
+      for (size_t i = 0; i < nframes; i++)
+        for (int n = 0; n < channels; n++)
+          buff[i * channels + n] = (Sample_t)(buff[i * channels + n] * env[i]);
+  }
+}
+
+/**
+ * The envelope is a gain per frame, see IEffector::pointOp().
+ * @param op          Where to store the operation.
+ * @param nframes     How many frames, up to _EFFECT_BLOCK_FRAMES.
+ * @return status code.
+ */
+int
+ADSRImpl::pointOp(PointOp *op, size_t nframes)
+{
+  V_ASSERT(nframes <= _EFFECT_BLOCK_FRAMES);
+
+  if (m_bypass)
+    op->kind = POINT_OP_NONE;
+  else if (m_state == env_idle && m_level == 0)
+    op->kind = POINT_OP_SILENCE;
+  else
+    {
+      op->kind = POINT_OP_ENVELOPE;
+      genenv(op->env, nframes);
+    }
+  return VINF_SUCCEEDED;
 }
 
 /**
@@ -343,21 +631,343 @@ ADSRImpl::gate(bool gate)
 int
 ADSRImpl::process(Sample_t *buff, size_t nframes)
 {
-  register int64_t sample;
-  register int n = 0;
+  float env[_EFFECT_BLOCK_FRAMES];
 
   if (m_bypass) return VINF_SUCCEEDED;
 
-  while ( nframes-- )
+  if (m_state == env_idle && m_level == 0)
+    {
+      std::memset(buff, 0, nframes * m_channels * sizeof(Sample_t));
+      return VINF_SILENCE;
+    }
+
+  while (nframes)
+    {
+      size_t n = nframes < _EFFECT_BLOCK_FRAMES ? nframes : _EFFECT_BLOCK_FRAMES;
+
+      genenv(env, n);
+      applyGain(buff, env, n, m_channels);
+
+      buff += n * m_channels;
+      nframes -= n;
+    }
+  return VINF_SUCCEEDED;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+typedef float adsr_v4sf __attribute__((vector_size(_EFFECT_BATCH_LANES * sizeof(float))));
+
+/**
+ * Create the envelopes of all the voices, see IEffector::createBatch().
+ * @param voices      The number of voices.
+ * @return 0 if the custom shape is used, it is left to the instances.
+ * @return !=0 Pointer to the new batch.
+ */
+IEffectorBatch *
+ADSRImpl::createBatch(int voices) const
+{
+  if (curveShape(m_kAttackCurve) == kCurveTable ||
+      curveShape(m_kDecayCurve) == kCurveTable ||
+      curveShape(m_kReleaseCurve) == kCurveTable)
+    {
+      return 0;
+    }
+
+  ADSRBatch *batch = new (/*MEM_TAG_EFFECTOR_INSTANCE,*/ std::nothrow) ADSRBatch(*this, voices);
+  if (batch)
+    {
+      if (V_SUCCESS(batch->init()))
+        {
+          return batch;
+        }
+      delete batch;
+    }
+  return 0;
+}
+
+/**
+ * Constructor of ADSRBatch.
+ * @param src         The ADSR which gives the stages.
+ * @param voices      The number of voices.
+ */
+ADSRBatch::ADSRBatch(const ADSRImpl &src, int voices)
+  : IEffectorBatch(voices, src.m_channels),
+    m_proto(src),
+    m_dirty(false),
+    m_level(0),
+    m_state(0),
+    m_bypass(0)
+{
+  /*
+   * The source may not have been set up, work out the stages
+   * from its parameters.
+   */
+  m_proto.updateParameters();
+  std::memcpy(m_stages, m_proto.m_stages, sizeof(m_stages));
+}
+
+ADSRBatch::~ADSRBatch()
+{
+  delete [] m_level;
+  delete [] m_state;
+  delete [] m_bypass;
+}
+
+/**
+ * Allocate the state of the voices.
+ * @return status code.
+ */
+int
+ADSRBatch::init()
+{
+  m_level = new (MEM_TAG_EFFECTOR_INSTANCE, std::nothrow) float[m_voices];
+  m_state = new (MEM_TAG_EFFECTOR_INSTANCE, std::nothrow) uint8_t[m_voices];
+  m_bypass = new (MEM_TAG_EFFECTOR_INSTANCE, std::nothrow) bool[m_voices];
+  if (!m_level || !m_state || !m_bypass)
+    {
+      return VERR_ALLOC_MEMORY;
+    }
+
+  for (int v = 0; v < m_voices; v++)
+    {
+      m_level[v] = 0;
+      m_state[v] = ADSRImpl::env_idle;
+      m_bypass[v] = false;
+    }
+  return VINF_SUCCEEDED;
+}
+
+/*
+ * Set the GATE signal of a voice.
+ * @param voice     Index of the voice.
+ * @param gate      true = on, false = off.
+ */
+void
+ADSRBatch::gate(int voice, bool gate)
+{
+  V_ASSERT(voice >= 0 && voice < m_voices);
+
+  if (gate)
+    m_state[voice] = ADSRImpl::env_attack;
+  else if (m_state[voice] != ADSRImpl::env_idle)
+    m_state[voice] = ADSRImpl::env_release;
+}
+
+void
+ADSRBatch::bypass(int voice, bool y)
+{
+  V_ASSERT(voice >= 0 && voice < m_voices);
+  m_bypass[voice] = y;
+}
+
+void
+ADSRBatch::reset(int voice)
+{
+  V_ASSERT(voice >= 0 && voice < m_voices);
+  m_level[voice] = 0;
+  m_state[voice] = ADSRImpl::env_idle;
+}
+
+/*
+ * Set a parameter of the envelopes, the stages are worked out again
+ * by the next process(). The custom shape is not batched, a stage set
+ * to it runs linear here.
+ */
+void
+ADSRBatch::setParameter(int index, float v)
+{
+  m_proto.storeParameter(index, v);
+  m_dirty = true;
+}
+
+/**
+ * The level of the envelope of a voice, see ADSRImpl::level().
+ * @param voice     Index of the voice.
+ * @return the gain.
+ */
+float
+ADSRBatch::level(int voice)
+{
+  V_ASSERT(voice >= 0 && voice < m_voices);
+
+  if (m_bypass[voice] || m_state[voice] == ADSRImpl::env_attack)
+    return 1;
+  return m_level[voice];
+}
+
+/**
+ * Pass the stage boundaries the voice has reached, as genenv() does.
+ * @param voice       Index of the voice.
+ * @return the number of frames before the next boundary,
+ *         (size_t)-1 for a constant stage.
+ */
+size_t
+ADSRBatch::settle(int voice)
+{
+  for (;;)
     {
-      accum();
-      for (n = 0; n < m_channels; n++)
+      const ADSRImpl::envStage *st = &m_stages[m_state[voice]];
+      float level = m_level[voice];
+
+      if (m_state[voice] == ADSRImpl::env_idle || m_state[voice] == ADSRImpl::env_sustain)
+        return (size_t)-1;
+
+      float dist = st->target - level;
+      bool rise = st->step > 0;
+      float span = 0;
+
+      if (!(rise ? dist <= 0 : dist >= 0))
         {
-          sample = *buff;
-          sample = sample * genenv() / ADSR_MAXVOLUME;
-          *buff++ = sample;
+          if (st->curve == kCurveExponential)
+            span = logf((st->target - st->asym) / (level - st->asym)) / logf(st->coef);
+          else
+            span = dist / st->step;
         }
+
+      size_t reach = span > 0 ? (size_t)ceilf(span) : 0;
+      if (reach)
+        return reach;
+
+      m_level[voice] = st->target;
+      m_state[voice] = st->next;
     }
+}
+
+/*
+ * Shape the buffers of up to _EFFECT_BATCH_LANES voices. The levels
+ * are stepped in the lanes of one register until a voice reaches the
+ * boundary of its stage, then the stages are looked up again.
+ */
+void
+ADSRBatch::run(const int *lanes, Sample_t *const *buffs, int count, size_t nframes)
+{
+  float env[_EFFECT_BATCH_LANES][_EFFECT_BLOCK_FRAMES];
+  size_t reach[_EFFECT_BATCH_LANES];
+  adsr_v4sf level, coef, base;
+  size_t done = 0;
+
+  for (int k = 0; k < _EFFECT_BATCH_LANES; k++)
+    {
+      level[k] = 0;
+      coef[k] = 1;
+      base[k] = 0;
+    }
+
+  while (done < nframes)
+    {
+      size_t n = nframes - done < _EFFECT_BLOCK_FRAMES ? nframes - done : _EFFECT_BLOCK_FRAMES;
+      size_t pos = 0;
+
+      while (pos < n)
+        {
+          size_t seg = n - pos;
+
+          for (int k = 0; k < count; k++)
+            {
+              int v = lanes[k];
+              reach[k] = settle(v);
+              if (reach[k] < seg)
+                seg = reach[k];
+
+              const ADSRImpl::envStage *st = &m_stages[m_state[v]];
+              level[k] = m_level[v];
+              if (reach[k] == (size_t)-1)
+                {
+                  coef[k] = 1;
+                  base[k] = 0;
+                }
+              else if (st->curve == kCurveExponential)
+                {
+                  coef[k] = st->coef;
+                  base[k] = st->base;
+                }
+              else
+                {
+                  coef[k] = 1;
+                  base[k] = st->step;
+                }
+            }
+
+          for (size_t i = 0; i < seg; i++)
+            {
+              level = level * coef + base;
+              for (int k = 0; k < count; k++)
+                env[k][pos + i] = level[k];
+            }
+
+          for (int k = 0; k < count; k++)
+            {
+              int v = lanes[k];
+              m_level[v] = level[k];
+              if (reach[k] == seg)
+                {
+                  const ADSRImpl::envStage *st = &m_stages[m_state[v]];
+                  env[k][pos + seg - 1] = st->target;
+                  m_level[v] = st->target;
+                  m_state[v] = st->next;
+                }
+            }
+          pos += seg;
+        }
+
+      for (int k = 0; k < count; k++)
+        applyGain(buffs[k] + done * m_channels, env[k], n, m_channels);
+
+      done += n;
+    }
+}
+
+/**
+ * Process the buffers of the voices. The envelope has no tail, so the
+ * silent voices are skipped at once.
+ * @param voices      Indexes of the voices.
+ * @param buffs       The buffer of each voice.
+ * @param silent      Whether each buffer is all zero, updated.
+ * @param count       The number of voices.
+ * @param nframes     How many frames are there in each buffer.
+ * @return status code.
+ */
+int
+ADSRBatch::process(const int *voices, Sample_t *const *buffs, bool *silent, int count, size_t nframes)
+{
+  int lanes[_EFFECT_BATCH_LANES];
+  Sample_t *lanesBuffs[_EFFECT_BATCH_LANES];
+  int k = 0;
+
+  if (m_dirty)
+    {
+      m_dirty = false;
+      m_proto.updateParameters();
+      std::memcpy(m_stages, m_proto.m_stages, sizeof(m_stages));
+    }
+
+  for (int i = 0; i < count; i++)
+    {
+      int v = voices[i];
+      V_ASSERT(v >= 0 && v < m_voices);
+
+      if (m_bypass[v] || silent[i])
+        continue;
+
+      if (m_state[v] == ADSRImpl::env_idle && m_level[v] == 0)
+        {
+          std::memset(buffs[i], 0, nframes * m_channels * sizeof(Sample_t));
+          silent[i] = true;
+          continue;
+        }
+
+      lanes[k] = v;
+      lanesBuffs[k] = buffs[i];
+      if (++k == _EFFECT_BATCH_LANES)
+        {
+          run(lanes, lanesBuffs, k, nframes);
+          k = 0;
+        }
+    }
+  if (k)
+    run(lanes, lanesBuffs, k, nframes);
+
   return VINF_SUCCEEDED;
 }
 
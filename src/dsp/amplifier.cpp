@@ -223,6 +223,37 @@ AmplifierImpl::gate(bool gate)
 {
 }
 
+/**
+ * The gain lifts the silence by itself, so there is no end of the
+ * tail unless it is 0.
+ * @return the number of frames.
+ */
+size_t
+AmplifierImpl::tail()
+{
+  return m_gainSmpl ? EFFECT_TAIL_INFINITE : 0;
+}
+
+/**
+ * The gain works on each sample on its own, see IEffector::pointOp().
+ * @param op          Where to store the operation.
+ * @param nframes     How many frames.
+ * @return status code.
+ */
+int
+AmplifierImpl::pointOp(PointOp *op, size_t nframes)
+{
+  if (m_bypass)
+    op->kind = POINT_OP_NONE;
+  else
+    {
+      op->kind = POINT_OP_GAIN;
+      op->gain = m_gainSmpl;
+      op->line = m_line;
+    }
+  return VINF_SUCCEEDED;
+}
+
 static inline void
 limitSampleLevel(int64_t &dst_sample)
 {
@@ -0,0 +1,425 @@
+/** @file
+ * Qin - Biquad filter design and banks.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <cmath>
+
+#include "dsp/biquad.h"
+#include "util/misc.h"
+#include "util/error.h"
+#include "memory/mmu.h"
+
+#define PI (4.*atan(1.))
+
+namespace dsp
+{
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Second order low pass or high pass section with the damping 1/Q.
+ * t is tan(pi * freq / rate).
+ */
+static void
+designPassSection(int cls, double t, double damp, BiquadCoeffs *c)
+{
+  double k, a0;
+
+  if (cls == BIQUAD_LOWPASS)
+    {
+      k = 1.0 / t;
+      a0 = 1.0 / (1.0 + damp * k + k * k);
+      c->a0 = a0;
+      c->a1 = 2 * a0;
+      c->a2 = a0;
+      c->b1 = 2 * a0 * (1 - k * k);
+      c->b2 = a0 * (1 - damp * k + k * k);
+    }
+  else
+    {
+      k = t;
+      a0 = 1.0 / (1.0 + damp * k + k * k);
+      c->a0 = a0;
+      c->a1 = -2 * a0;
+      c->a2 = a0;
+      c->b1 = 2 * a0 * (k * k - 1);
+      c->b2 = a0 * (1 - damp * k + k * k);
+    }
+}
+
+/*
+ * Second order band pass or band notch section.
+ * t is tan(pi * bandwidth / rate), d is 2 cos(2 pi * freq / rate).
+ */
+static void
+designBandSection(int cls, double t, double d, BiquadCoeffs *c)
+{
+  double k, a0;
+
+  if (cls == BIQUAD_BANDPASS)
+    {
+      k = 1.0 / t;
+      a0 = 1.0 / (1.0 + k);
+      c->a0 = a0;
+      c->a1 = 0;
+      c->a2 = -a0;
+      c->b1 = -a0 * k * d;
+      c->b2 = a0 * (k - 1);
+    }
+  else
+    {
+      k = t;
+      a0 = 1.0 / (1.0 + k);
+      c->a0 = a0;
+      c->a1 = -a0 * d;
+      c->a2 = a0;
+      c->b1 = -a0 * d;
+      c->b2 = a0 * (1 - k);
+    }
+}
+
+/*
+ * Damping of each section of a butterworth cascade,
+ * 1/Q = 2 cos((2k-1) pi / 2N).
+ */
+static double
+butterworthDamping(int order, int section)
+{
+  return 2.0 * cos((2 * section + 1) * PI / (2 * order));
+}
+
+/**
+ * Work out the coefficients of a second order butterworth section.
+ * @param cls         Class of the response, see BiquadClass.
+ * @param rate        Sample rate.
+ * @param freq        Cutoff (or center) frequency in Hz.
+ * @param q           Q factor, only used by the band classes.
+ * @param c           Where to store the coefficients.
+ * @return status code.
+ */
+int
+designBiquad(int cls, float rate, float freq, float q, BiquadCoeffs *c)
+{
+  if (rate <= 0 || freq <= 0 || freq >= rate / 2 || q <= 0)
+    {
+      return VERR_INVALID_PARAMETER;
+    }
+
+  switch (cls)
+  {
+    case BIQUAD_LOWPASS:
+    case BIQUAD_HIGHPASS:
+      designPassSection(cls, tan(PI * freq / rate), sqrt(2.0), c);
+      break;
+    case BIQUAD_BANDPASS:
+    case BIQUAD_BANDNOTCH:
+      designBandSection(cls, tan(PI * freq / q / rate), 2.0 * cos(2.0 * PI * freq / rate), c);
+      break;
+
+    default:
+      return VERR_INVALID_PARAMETER;
+  }
+
+  return VINF_SUCCEEDED;
+}
+
+/**
+ * Work out a butterworth cascade of the given order.
+ * The low pass and high pass sections take the poles of the analog
+ * prototype in pairs, so the cascade is maximally flat. The band
+ * classes just repeat the second order section, which makes the
+ * skirts steeper and the band a bit narrower.
+ * @param cls         Class of the response, see BiquadClass.
+ * @param rate        Sample rate.
+ * @param freq        Cutoff (or center) frequency in Hz.
+ * @param q           Q factor, only used by the band classes.
+ * @param order       Order of the cascade, 2, 4, 6 or 8.
+ * @param sections    Where to store the coefficients, BIQUAD_MAX_SECTIONS.
+ * @param nsections   Where to store the number of sections.
+ * @return status code.
+ */
+int
+designButterworth(int cls, float rate, float freq, float q, int order, BiquadCoeffs *sections, int *nsections)
+{
+  if (order < 2 || order > BIQUAD_MAX_ORDER || (order & 1))
+    {
+      return VERR_INVALID_PARAMETER;
+    }
+
+  int rc = designBiquad(cls, rate, freq, q, &sections[0]);
+  if (V_FAILURE(rc))
+    return rc;
+
+  int n = order / 2;
+
+  for (int s = 0; s < n; s++)
+    {
+      if (cls == BIQUAD_LOWPASS || cls == BIQUAD_HIGHPASS)
+        designPassSection(cls, tan(PI * freq / rate), butterworthDamping(order, s), &sections[s]);
+      else
+        sections[s] = sections[0];
+    }
+
+  *nsections = n;
+  return VINF_SUCCEEDED;
+}
+
+/***************************************************
+  *****          Quantized design table        *****
+  ***************************************************/
+
+/*
+ * tan(pi w) and 2 cos(2 pi w) for the normalized frequencies
+ * w = 0.5 * 2^(i / BIQUAD_TABLE_STEPS - BIQUAD_TABLE_OCTAVES).
+ * Being normalized, the table serves any sample rate.
+ */
+#define BIQUAD_TABLE_SIZE (BIQUAD_TABLE_OCTAVES * BIQUAD_TABLE_STEPS)
+
+static float biquadTan[BIQUAD_TABLE_SIZE];
+static float biquadCos[BIQUAD_TABLE_SIZE];
+static float biquadDamp[BIQUAD_MAX_SECTIONS][BIQUAD_MAX_SECTIONS];
+static volatile bool biquadTableReady = false;
+
+/**
+ * Fill the design table, it is shared by all the filters. Call this
+ * outside of the audio thread, before lookupButterworth().
+ * @return status code.
+ */
+int
+initBiquadTable()
+{
+  if (biquadTableReady)
+    return VINF_SUCCEEDED;
+
+  for (int i = 0; i < BIQUAD_TABLE_SIZE; i++)
+    {
+      double w = 0.5 * pow(2.0, (double)i / BIQUAD_TABLE_STEPS - BIQUAD_TABLE_OCTAVES);
+      biquadTan[i] = tan(PI * w);
+      biquadCos[i] = 2.0 * cos(2.0 * PI * w);
+    }
+
+  for (int n = 0; n < BIQUAD_MAX_SECTIONS; n++)
+    for (int s = 0; s <= n; s++)
+      biquadDamp[n][s] = butterworthDamping((n + 1) * 2, s);
+
+  biquadTableReady = true;
+  return VINF_SUCCEEDED;
+}
+
+/*
+ * Index of a ratio in the table, 2^(1/BIQUAD_TABLE_STEPS) per step.
+ */
+static inline int
+biquadTableIndex(float ratio)
+{
+  return (int)floorf(log2f(ratio) * BIQUAD_TABLE_STEPS + 0.5f);
+}
+
+static inline int
+biquadTableClamp(int i)
+{
+  if (i < 0) return 0;
+  if (i >= BIQUAD_TABLE_SIZE) return BIQUAD_TABLE_SIZE - 1;
+  return i;
+}
+
+/**
+ * Work out a butterworth cascade the same as designButterworth(), but
+ * with the cutoff and the Q quantized to 1/BIQUAD_TABLE_STEPS octave
+ * and the trigonometry read from the table. There is no libm call
+ * apart from one logarithm for each of freq and q, so this is cheap
+ * enough for the audio thread.
+ * @param cls         Class of the response, see BiquadClass.
+ * @param rate        Sample rate.
+ * @param freq        Cutoff (or center) frequency in Hz.
+ * @param q           Q factor, only used by the band classes.
+ * @param order       Order of the cascade, 2, 4, 6 or 8.
+ * @param sections    Where to store the coefficients, BIQUAD_MAX_SECTIONS.
+ * @param nsections   Where to store the number of sections.
+ * @return status code.
+ */
+int
+lookupButterworth(int cls, float rate, float freq, float q, int order, BiquadCoeffs *sections, int *nsections)
+{
+  V_ASSERT(biquadTableReady);
+
+  if (rate <= 0 || freq <= 0 || freq >= rate / 2 || q <= 0 ||
+      order < 2 || order > BIQUAD_MAX_ORDER || (order & 1))
+    {
+      return VERR_INVALID_PARAMETER;
+    }
+
+  int n = order / 2;
+  int fi = biquadTableClamp(BIQUAD_TABLE_SIZE + biquadTableIndex(freq * 2 / rate));
+
+  switch (cls)
+  {
+    case BIQUAD_LOWPASS:
+    case BIQUAD_HIGHPASS:
+      for (int s = 0; s < n; s++)
+        designPassSection(cls, biquadTan[fi], biquadDamp[n - 1][s], &sections[s]);
+      break;
+    case BIQUAD_BANDPASS:
+    case BIQUAD_BANDNOTCH:
+      {
+        int bi = biquadTableClamp(fi - biquadTableIndex(q));
+        designBandSection(cls, biquadTan[bi], biquadCos[fi], &sections[0]);
+        for (int s = 1; s < n; s++)
+          sections[s] = sections[0];
+      }
+      break;
+
+    default:
+      return VERR_INVALID_PARAMETER;
+  }
+
+  *nsections = n;
+  return VINF_SUCCEEDED;
+}
+
+/**
+ * Work out how long a cascade keeps ringing after its input stops, from
+ * the largest pole of each section. There is no allocation here, only
+ * a logarithm per section.
+ * @param sections    The coefficients of each section.
+ * @param nsections   The number of sections.
+ * @param floor       Where the ringing ends, relative to its start.
+ * @return the number of frames, (size_t)-1 if a section is unstable.
+ */
+size_t
+biquadTail(const BiquadCoeffs *sections, int nsections, float floor)
+{
+  size_t frames = 0;
+
+  for (int s = 0; s < nsections; s++)
+    {
+      const BiquadCoeffs &c = sections[s];
+      float disc = c.b1 * c.b1 - 4 * c.b2;
+      float r;
+
+      /*
+       * The poles are the roots of z^2 + b1 z + b2.
+       */
+      if (disc < 0)
+        r = sqrtf(c.b2);
+      else
+        r = (fabsf(c.b1) + sqrtf(disc)) / 2;
+
+      if (r >= 1)
+        return (size_t)-1;
+
+      /* the zeros last 2 frames */
+      frames += 2;
+      if (r > 0)
+        frames += (size_t)ceilf(logf(floor) / logf(r));
+    }
+  return frames;
+}
+
+/***************************************************
+  *****           Biquad bank object           *****
+  ***************************************************/
+
+BiquadBank::BiquadBank()
+  : m_lanes(0),
+    m_filters(0)
+{
+}
+
+BiquadBank::~BiquadBank()
+{
+  uninit();
+}
+
+/**
+ * Allocate the filters of the bank, all of them pass the signal
+ * through until setFilter().
+ * @param filters     Number of filters.
+ * @return status code.
+ */
+int
+BiquadBank::init(int filters)
+{
+  if (filters <= 0)
+    {
+      return VERR_INVALID_PARAMETER;
+    }
+
+  uninit();
+
+  m_lanes = new (MEM_TAG_EFFECTOR_INSTANCE, std::nothrow) BiquadLanes[(filters + BIQUAD_LANES - 1) / BIQUAD_LANES];
+  if (!m_lanes)
+    {
+      return VERR_ALLOC_MEMORY;
+    }
+  m_filters = filters;
+  return VINF_SUCCEEDED;
+}
+
+void
+BiquadBank::uninit()
+{
+  delete [] m_lanes;
+  m_lanes = 0;
+  m_filters = 0;
+}
+
+/**
+ * Clear the state of all the filters.
+ */
+void
+BiquadBank::reset()
+{
+  for (int i = 0; i < m_filters; i += BIQUAD_LANES)
+    {
+      m_lanes[i / BIQUAD_LANES].reset();
+    }
+}
+
+/**
+ * Clear the state of a filter.
+ * @param index       Index of the filter.
+ */
+void
+BiquadBank::reset(int index)
+{
+  V_ASSERT(index >= 0 && index < m_filters);
+  m_lanes[index / BIQUAD_LANES].reset(index % BIQUAD_LANES);
+}
+
+/**
+ * Set the cascade of a filter.
+ * @param index       Index of the filter.
+ * @param sections    The coefficients of each section.
+ * @param nsections   The number of sections, 1 ~ BIQUAD_MAX_SECTIONS.
+ * @param smooth      Glide to the new coefficients over the next block.
+ * @return status code.
+ */
+int
+BiquadBank::setFilter(int index, const BiquadCoeffs *sections, int nsections, bool smooth)
+{
+  if (index < 0 || index >= m_filters || nsections < 1 || nsections > BIQUAD_MAX_SECTIONS)
+    {
+      return VERR_OUT_OF_RANGE;
+    }
+
+  m_lanes[index / BIQUAD_LANES].setCoeffs(index % BIQUAD_LANES, sections, nsections, smooth);
+  return VINF_SUCCEEDED;
+}
+
+} // namespace dsp
@@ -0,0 +1,276 @@
+/** @file
+ * Qin - Compiled effector chains.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <cstring>
+
+#include "dsp/chain.h"
+#include "dsp/effect.h"
+#include "util/misc.h"
+#include "util/error.h"
+#include "util/assert.h"
+
+namespace dsp
+{
+
+////////////////////////////////////////////////////////////////////////////////
+
+EffectChain::EffectChain()
+  : m_count(0),
+    m_channels(0)
+{
+}
+
+/**
+ * Flatten the slot list into the kernels. Call this again whenever
+ * the list changes, the bypass and the parameters are read at the
+ * time of processing so they can change freely.
+ * @param slots       The effectors, in the order of processing.
+ * @param channels    The number of channels in each frame.
+ * @return status code.
+ */
+int
+EffectChain::compile(const V_LIST<IEffector> &slots, int channels)
+{
+  PointOp probe;
+  probe.env = 0;
+
+  if (channels <= 0 || channels > _MAX_EFFECT_CHANNELS)
+    {
+      return VERR_OUT_OF_RANGE;
+    }
+
+  m_count = 0;
+  m_channels = channels;
+
+  for (IEffector *e = slots.root; e; )
+    {
+      if (m_count >= CHAIN_MAX_STAGES)
+        {
+          m_count = 0;
+          return VERR_BUFFER_OVERFLOW;
+        }
+
+      fusedGroup *group = &m_groups[m_count];
+      group->count = 0;
+
+      while (e && group->count < CHAIN_MAX_FUSED && V_SUCCESS(e->pointOp(&probe, 0)))
+        {
+          group->effectors[group->count++] = e;
+          e = e->next;
+        }
+
+      if (group->count > 1)
+        {
+          m_stages[m_count].kernel = fusedKernel;
+          m_stages[m_count].state = group;
+        }
+      else
+        {
+          /*
+           * A lone point operation runs its own loop, which is
+           * specialized and no slower than the fused one.
+           */
+          if (!group->count)
+            {
+              group->effectors[0] = e;
+              group->count = 1;
+              e = e->next;
+            }
+          m_stages[m_count].kernel = effectorKernel;
+          m_stages[m_count].state = group->effectors[0];
+        }
+      m_stages[m_count].quiet = 0;
+      m_count++;
+    }
+
+  return VINF_SUCCEEDED;
+}
+
+/*
+ * The tail of a kernel, the longest of its effectors. A bypassed
+ * effector passes the silence through as it is.
+ */
+size_t
+EffectChain::tail(int index) const
+{
+  const fusedGroup *group = &m_groups[index];
+  size_t frames = 0;
+
+  for (int k = 0; k < group->count; k++)
+    {
+      IEffector *e = group->effectors[k];
+      size_t t = e->m_bypass ? 0 : e->tail();
+      if (t > frames)
+        frames = t;
+    }
+  return frames;
+}
+
+/**
+ * Run the kernels over the buffer. The kernels which have been given
+ * the silence for longer than their tail are skipped.
+ * @param buff        Pointer to the target buffer.
+ * @param nframes     How many frames are there in the target buffer.
+ * @param silent      Whether the buffer is all zero.
+ * @return VINF_SILENCE if the buffer is all zero after the chain.
+ * @return status code.
+ */
+int
+EffectChain::process(Sample_t *buff, size_t nframes, bool silent)
+{
+  int rc;
+
+  for (int i = 0; i < m_count; i++)
+    {
+      stage *st = &m_stages[i];
+
+      if (silent)
+        {
+          if (st->quiet >= tail(i))
+            continue;
+          st->quiet += nframes;
+        }
+      else
+        st->quiet = 0;
+
+      rc = st->kernel(st->state, buff, nframes, m_channels);
+      if (V_FAILURE(rc)) return rc;
+
+      silent = rc == VINF_SILENCE;
+    }
+  return silent ? VINF_SILENCE : VINF_SUCCEEDED;
+}
+
+/*
+ * Kernel of an effector which is not fused.
+ */
+int
+EffectChain::effectorKernel(void *state, Sample_t *buff, size_t nframes, int channels)
+{
+  return static_cast<IEffector *>(state)->process(buff, nframes);
+}
+
+static inline void
+clipSample(int64_t &sample)
+{
+  const int64_t max_audioval = ((int64_t)1 << (sizeof(Sample_t) * 8 - 1)) - 1;
+  const int64_t min_audioval = -((int64_t)1 << (sizeof(Sample_t) * 8 - 1));
+
+  if (sample > max_audioval)
+    sample = max_audioval;
+  else if (sample < min_audioval)
+    sample = min_audioval;
+}
+
+/*
+ * Kernel of a run of point operations. Each frame is loaded once, goes
+ * through all the operations in the registers and is stored once.
+ */
+int
+EffectChain::fusedKernel(void *state, Sample_t *buff, size_t nframes, int channels)
+{
+  const fusedGroup *group = static_cast<const fusedGroup *>(state);
+  float env[CHAIN_MAX_FUSED][_EFFECT_BLOCK_FRAMES];
+  PointOp ops[CHAIN_MAX_FUSED];
+  int64_t frame[_MAX_EFFECT_CHANNELS];
+  int64_t sample;
+  bool silent = true;
+
+  while (nframes)
+    {
+      size_t n = nframes < _EFFECT_BLOCK_FRAMES ? nframes : _EFFECT_BLOCK_FRAMES;
+      int count = 0;
+      bool zero = false;
+
+      for (int k = 0; k < group->count; k++)
+        {
+          ops[count].env = env[count];
+          group->effectors[k]->pointOp(&ops[count], n);
+
+          /*
+           * The silence stays unless a gain lifts it.
+           */
+          if (ops[count].kind == POINT_OP_SILENCE)
+            zero = true;
+          else if (ops[count].kind == POINT_OP_GAIN && ops[count].gain)
+            zero = false;
+
+          if (ops[count].kind != POINT_OP_NONE)
+            count++;
+        }
+
+      if (zero)
+        {
+          std::memset(buff, 0, n * channels * sizeof(Sample_t));
+          count = 0;
+        }
+      silent = silent && zero;
+
+      Sample_t *p = buff;
+      for (size_t i = 0; count && i < n; i++, p += channels)
+        {
+          for (int c = 0; c < channels; c++)
+            frame[c] = p[c];
+
+          for (int k = 0; k < count; k++)
+            {
+              const PointOp &op = ops[k];
+              switch (op.kind)
+              {
+                case POINT_OP_SILENCE:
+                  for (int c = 0; c < channels; c++)
+                    frame[c] = 0;
+                  break;
+
+                case POINT_OP_ENVELOPE:
+                  for (int c = 0; c < channels; c++)
+                    frame[c] = (Sample_t)((Sample_t)frame[c] * op.env[i]);
+                  break;
+
+                case POINT_OP_GAIN:
+                  for (int c = 0; c < channels; c++)
+                    {
+                      sample = frame[c];
+                      sample += sample > 0 ? sample + op.gain : sample - op.gain;
+                      clipSample(sample);
+                      sample = sample * op.line / 100;
+                      clipSample(sample);
+                      frame[c] = sample;
+                    }
+                  break;
+
+                case POINT_OP_SWAP:
+                  sample = frame[0];
+                  frame[0] = frame[1];
+                  frame[1] = sample;
+                  break;
+              }
+            }
+
+          for (int c = 0; c < channels; c++)
+            p[c] = (Sample_t)frame[c];
+        }
+
+      buff += n * channels;
+      nframes -= n;
+    }
+  return silent ? VINF_SILENCE : VINF_SUCCEEDED;
+}
+
+} // namespace dsp
@@ -1,5 +1,20 @@
 /** @file
  * Effector - Delay.
+ *
+ * The ring length is a power of two, so the positions wrap with a mask.
+ * While the delay length holds still, each channel is done a block at
+ * a time: the delayed samples are copied out of the ring in at most two
+ * runs, the feedback and the output are worked out with SIMD multiply-
+ * add, and the new samples are copied back in. While the delay length
+ * glides to a new value the positions are interpolated per sample.
+ *
+ * The rings are sized from the longer of "Samples" and "Max samples"
+ * rather than the largest delay possible, the latter leaves room to
+ * glide without taking the rings again. They are only taken when the
+ * effector first processes audio, so the per-voice clones which never
+ * sound cost nothing. They are carved out of a pool allocated up front
+ * by the first init(), split and merged by halves, so the audio thread
+ * never reaches the heap.
  */
 
 /*
@@ -27,12 +42,39 @@
 #include "memory/mmu.h"
 
 
-#define RING_BUFFER_LENGTH 192000
+#define RING_BUFFER_MIN_ORDER 10
+#define RING_BUFFER_MAX_ORDER 18
+#define MIN_DELAY_SAMPLES 1
 #define MAX_DELAY_SAMPLES 192000
 #define MAX_FEEDBACK 1
 #define MAX_DELAY_LEVEL 1
 
-#define MULT_COEFF 100
+/*
+ * The bytes of ring all the delays may hold together.
+ */
+#ifndef DELAY_POOL_BUDGET
+# define DELAY_POOL_BUDGET (16 * 1024 * 1024)
+#endif
+
+/* a block must not catch up with the delayed samples it reads */
+#if MAX_DELAY_SAMPLES + 1 + _EFFECT_BLOCK_FRAMES > (1 << RING_BUFFER_MAX_ORDER)
+# error "RING_BUFFER_MAX_ORDER is too small for MAX_DELAY_SAMPLES!"
+#endif
+
+#if DELAY_POOL_BUDGET % (4 << RING_BUFFER_MAX_ORDER)
+# error "DELAY_POOL_BUDGET must hold a whole number of the largest rings!"
+#endif
+
+/* the pool is tracked in units of the smallest ring */
+#define DELAY_POOL_UNITS (DELAY_POOL_BUDGET / (4 << RING_BUFFER_MIN_ORDER))
+
+#if COMPILER(GCC)
+# define DELAY_POOL_LOCK()      while (__sync_lock_test_and_set(&delayPoolLock, 1)) {}
+# define DELAY_POOL_UNLOCK()    __sync_lock_release(&delayPoolLock)
+#else
+# define DELAY_POOL_LOCK()      do {} while (0)
+# define DELAY_POOL_UNLOCK()    do {} while (0)
+#endif
 
 namespace dsp
 {
@@ -41,9 +83,160 @@ enum {
   kSamples = 0,
   kLevel,
   kFeedback,
+  kMaxSamples,
+  kDry,
   kMaxCount
 };
 
+typedef float delay_v4sf __attribute__((vector_size(16)));
+typedef float delay_v4sf_u __attribute__((vector_size(16), aligned(4)));
+
+#define DELAY_VECTOR (sizeof(delay_v4sf) / sizeof(float))
+
+/***************************************************
+  *****            Delay ring pool             *****
+  ***************************************************/
+
+/*
+ * A free block of the pool, linked through its own memory.
+ */
+struct delayFreeRing
+{
+  delayFreeRing *next;
+  delayFreeRing *prev;
+};
+
+static float *delayPool = 0;
+static int delayPoolUsers = 0;
+static volatile int delayPoolLock = 0;
+static delayFreeRing *delayFreeRings[RING_BUFFER_MAX_ORDER + 1];
+/* order + 1 of the free block starting at each unit, 0 if none */
+static uint8_t delayFreeOrder[DELAY_POOL_UNITS];
+
+/*
+ * Put a block on the free list of its order.
+ */
+static void
+poolPush(float *block, int order)
+{
+  delayFreeRing *node = (delayFreeRing *)block;
+  node->prev = 0;
+  node->next = delayFreeRings[order];
+  if (node->next)
+    node->next->prev = node;
+  delayFreeRings[order] = node;
+  delayFreeOrder[(block - delayPool) >> RING_BUFFER_MIN_ORDER] = order + 1;
+}
+
+/*
+ * Take a block off the free list of its order.
+ */
+static void
+poolUnlink(float *block, int order)
+{
+  delayFreeRing *node = (delayFreeRing *)block;
+  if (node->prev)
+    node->prev->next = node->next;
+  else
+    delayFreeRings[order] = node->next;
+  if (node->next)
+    node->next->prev = node->prev;
+  delayFreeOrder[(block - delayPool) >> RING_BUFFER_MIN_ORDER] = 0;
+}
+
+/*
+ * Allocate the pool for the first user, all of it free in the
+ * largest rings. Called on the control thread.
+ * @return status code.
+ */
+static int
+delayPoolInit()
+{
+  if (delayPoolUsers++)
+    return VINF_SUCCEEDED;
+
+  delayPool = (float *)AllocLargeMem(DELAY_POOL_BUDGET, MEM_TAG_EFFECTOR_BUFFER, 0);
+  if (!delayPool)
+    {
+      delayPoolUsers = 0;
+      return VERR_ALLOC_MEMORY;
+    }
+
+  std::memset(delayFreeRings, 0, sizeof(delayFreeRings));
+  std::memset(delayFreeOrder, 0, sizeof(delayFreeOrder));
+  for (size_t i = 0; i < DELAY_POOL_BUDGET / sizeof(float); i += (size_t)1 << RING_BUFFER_MAX_ORDER)
+    {
+      poolPush(delayPool + i, RING_BUFFER_MAX_ORDER);
+    }
+  return VINF_SUCCEEDED;
+}
+
+/*
+ * Free the pool after the last user gave its rings back.
+ */
+static void
+delayPoolUninit()
+{
+  V_ASSERT(delayPoolUsers > 0);
+  if (--delayPoolUsers)
+    return;
+
+  FreeLargeMem(delayPool);
+  delayPool = 0;
+}
+
+/*
+ * Take a ring of 2^order samples, splitting a larger free block if
+ * there is none of the size. Nothing is allocated, so this is safe
+ * on the audio thread.
+ * @return 0 if the pool is exhausted.
+ */
+static float *
+acquireRing(int order)
+{
+  float *ring = 0;
+  int o;
+
+  DELAY_POOL_LOCK();
+  for (o = order; o <= RING_BUFFER_MAX_ORDER && !delayFreeRings[o]; o++);
+  if (o <= RING_BUFFER_MAX_ORDER)
+    {
+      ring = (float *)delayFreeRings[o];
+      poolUnlink(ring, o);
+      while (o > order)
+        {
+          o--;
+          poolPush(ring + ((size_t)1 << o), o);
+        }
+    }
+  DELAY_POOL_UNLOCK();
+
+  if (ring)
+    std::memset(ring, 0, ((size_t)1 << order) * sizeof(float));
+  return ring;
+}
+
+/*
+ * Give a ring back to the pool, merging it with its free halves.
+ */
+static void
+releaseRing(float *ring, int order)
+{
+  DELAY_POOL_LOCK();
+  size_t offset = ring - delayPool;
+  while (order < RING_BUFFER_MAX_ORDER)
+    {
+      size_t buddy = offset ^ ((size_t)1 << order);
+      if (delayFreeOrder[buddy >> RING_BUFFER_MIN_ORDER] != order + 1)
+        break;
+      poolUnlink(delayPool + buddy, order);
+      offset &= ~((size_t)1 << order);
+      order++;
+    }
+  poolPush(delayPool + offset, order);
+  DELAY_POOL_UNLOCK();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 /**
@@ -54,9 +247,15 @@ enum {
 DelayImpl::DelayImpl(int rate, int channels)
   : IEffector(rate, channels),
     m_inited(false),
-    m_delaySamples(0),
+    m_dirty(false),
+    m_ringOrder(0),
+    m_ringMask(0),
+    m_index(0),
+    m_delay(0),
+    m_delayTarget(0),
     m_delayLevel(0),
-    m_feedback(0)
+    m_feedback(0),
+    m_dryLevel(1)
 {
   /*
    * set up the default values
@@ -64,10 +263,18 @@ DelayImpl::DelayImpl(int rate, int channels)
   m_kSamples = 50000;
   m_kLevel = 0.5;
   m_kFeedback = 0.5;
+  m_kMaxSamples = m_kSamples;
+  m_kDry = 1;
+
+  for (int i = 0; i < _MAX_EFFECT_CHANNELS; i++)
+    {
+      m_ringBuffs[i] = 0;
+    }
 }
 
 DelayImpl::~DelayImpl()
 {
+  uninit(0);
 }
 
 const char *DelayImpl::getname() const {
@@ -99,6 +306,8 @@ DelayImpl::getParameter(int index, float *v)
     case kSamples:  *v = m_kSamples;    break;
     case kLevel:    *v = m_kLevel;      break;
     case kFeedback: *v = m_kFeedback;   break;
+    case kMaxSamples: *v = m_kMaxSamples; break;
+    case kDry:      *v = m_kDry;        break;
   }
 }
 
@@ -111,6 +320,8 @@ DelayImpl::getParameterName(int index, std::string &s)
     case kSamples:  s = "Samples";    break;
     case kLevel:    s = "Level";      break;
     case kFeedback: s = "Feedback";   break;
+    case kMaxSamples: s = "Max samples"; break;
+    case kDry:      s = "Dry";        break;
   }
 }
 
@@ -123,6 +334,8 @@ DelayImpl::getParameterLable(int index, std::string &s)
     case kSamples:  s = "smpl";    break;
     case kLevel:    s = "dB";      break;
     case kFeedback: s = "dB";   break;
+    case kMaxSamples: s = "smpl"; break;
+    case kDry:      s = "dB";      break;
   }
 }
 
@@ -136,6 +349,8 @@ DelayImpl::getParameterDisplay(int index, std::string &s)
     case kSamples:  gcvt(m_kSamples, 8, buff);  break;
     case kLevel:    gcvt(m_kLevel, 8, buff);    break;
     case kFeedback: gcvt(m_kFeedback, 8, buff); break;
+    case kMaxSamples: gcvt(m_kMaxSamples, 8, buff); break;
+    case kDry:      gcvt(m_kDry, 8, buff);      break;
   }
   s = buff;
 }
@@ -149,9 +364,14 @@ DelayImpl::setParameter(int index, float v)
     case kSamples:  m_kSamples = v;    break;
     case kLevel:    m_kLevel = v;      break;
     case kFeedback: m_kFeedback = v;   break;
+    case kMaxSamples: m_kMaxSamples = v; break;
+    case kDry:      m_kDry = v;        break;
   }
 
-  updateParameters();
+  /*
+   * The rings may change size, leave it to process().
+   */
+  m_dirty = true;
 }
 
 /**
@@ -186,17 +406,20 @@ DelayImpl::init(int flags)
     {
       return VERR_OUT_OF_RANGE;
     }
-  for (int i = 0; i < m_channels; i++)
+
+  /*
+   * The rings are taken by process(), see acquireRings().
+   */
+  if (!m_inited)
     {
-      m_ringBuffs[i].buffer = new (MEM_TAG_EFFECTOR_BUFFER, std::nothrow) Sample_t[RING_BUFFER_LENGTH];
-      if (!m_ringBuffs[i].buffer)
+      int rc = delayPoolInit();
+      if (V_FAILURE(rc))
         {
-          return VERR_ALLOC_MEMORY;
+          return rc;
         }
-      m_ringBuffs[i].index = 0;
     }
-
   updateParameters();
+  m_delay = m_delayTarget;
 
   bypass(false);
   reset();
@@ -215,15 +438,47 @@ DelayImpl::uninit(int flags)
 {
   if (m_inited)
     {
-      for (int i = 0; i < m_channels; i++)
+      releaseRings();
+      delayPoolUninit();
+      m_inited = false;
+    }
+  return VINF_SUCCEEDED;
+}
+
+/**
+ * Take the rings of all the channels from the pool.
+ * @return status code.
+ */
+int
+DelayImpl::acquireRings()
+{
+  for (int i = 0; i < m_channels; i++)
+    {
+      m_ringBuffs[i] = acquireRing(m_ringOrder);
+      if (!m_ringBuffs[i])
         {
-          delete [] m_ringBuffs[i].buffer;
+          releaseRings();
+          return VERR_ALLOC_MEMORY;
         }
-      m_inited = false;
     }
+  m_index = 0;
   return VINF_SUCCEEDED;
 }
 
+/**
+ * Give the rings back to the pool.
+ */
+void
+DelayImpl::releaseRings()
+{
+  for (int i = 0; i < m_channels; i++)
+    {
+      if (m_ringBuffs[i])
+        releaseRing(m_ringBuffs[i], m_ringOrder);
+      m_ringBuffs[i] = 0;
+    }
+}
+
 /**
  * RESET the effector.
  * @return status code.
@@ -231,10 +486,11 @@ DelayImpl::uninit(int flags)
 int
 DelayImpl::reset()
 {
+  m_index = 0;
   for (int i = 0; i < m_channels; i++)
     {
-      m_ringBuffs[i].index = 0;
-      std::memset(m_ringBuffs[i].buffer, 0, RING_BUFFER_LENGTH * sizeof(Sample_t));
+      if (m_ringBuffs[i])
+        std::memset(m_ringBuffs[i], 0, (m_ringMask + 1) * sizeof(float));
     }
   return VINF_SUCCEEDED;
 }
@@ -248,19 +504,52 @@ DelayImpl::updateParameters()
   /*
    * Validate the parameters
    */
-  if (m_kSamples <= 0 || m_kSamples > MAX_DELAY_SAMPLES)
+  if (m_kMaxSamples < MIN_DELAY_SAMPLES)
+    m_kMaxSamples = MIN_DELAY_SAMPLES;
+  if (m_kMaxSamples > MAX_DELAY_SAMPLES)
+    m_kMaxSamples = MAX_DELAY_SAMPLES;
+  if (m_kSamples < MIN_DELAY_SAMPLES)
+    m_kSamples = MIN_DELAY_SAMPLES;
+  if (m_kSamples > MAX_DELAY_SAMPLES)
     m_kSamples = MAX_DELAY_SAMPLES;
-  if (m_kLevel <= 0 || m_kLevel > MAX_DELAY_LEVEL)
-    m_delayLevel = MAX_DELAY_LEVEL;
-  if (m_kFeedback <= 0 || m_kFeedback > MAX_FEEDBACK)
-    m_feedback = MAX_FEEDBACK;
+  if (m_kLevel < 0)
+    m_kLevel = 0;
+  if (m_kLevel > MAX_DELAY_LEVEL)
+    m_kLevel = MAX_DELAY_LEVEL;
+  if (m_kFeedback < 0)
+    m_kFeedback = 0;
+  if (m_kFeedback > MAX_FEEDBACK)
+    m_kFeedback = MAX_FEEDBACK;
+  if (m_kDry < 0)
+    m_kDry = 0;
+  if (m_kDry > MAX_DELAY_LEVEL)
+    m_kDry = MAX_DELAY_LEVEL;
 
   /*
-   * Calculating parameters
+   * Calculating parameters. The delay length is not set directly,
+   * process() glides to it.
    */
-  m_delaySamples  = m_kSamples;
-  m_delayLevel = m_kLevel * MULT_COEFF;
-  m_feedback = m_kFeedback * MULT_COEFF;
+  m_delayTarget = m_kSamples;
+  m_delayLevel = m_kLevel;
+  m_feedback = m_kFeedback;
+  m_dryLevel = m_wetOnly ? 0 : m_kDry;
+
+  /*
+   * The ring has to hold the longest delay plus a block, if the size
+   * changes the rings are taken again (empty) by the next process().
+   */
+  float longest = m_kSamples > m_kMaxSamples ? m_kSamples : m_kMaxSamples;
+  int order = RING_BUFFER_MIN_ORDER;
+  while (((size_t)1 << order) < (size_t)longest + 1 + _EFFECT_BLOCK_FRAMES)
+    order++;
+
+  if (order != m_ringOrder)
+    {
+      releaseRings();
+      m_ringOrder = order;
+      m_ringMask = ((uint32_t)1 << order) - 1;
+      m_delay = m_delayTarget;
+    }
 }
 
 
@@ -273,6 +562,196 @@ DelayImpl::gate(bool gate)
 {
 }
 
+/**
+ * Leave the dry signal out, see IEffector::setWetOnly(). The "Dry"
+ * level is kept and applies again once this is cleared. Like the
+ * parameters, it takes effect in the next process().
+ * @param y         true = wet only.
+ */
+void
+DelayImpl::setWetOnly(bool y)
+{
+  IEffector::setWetOnly(y);
+  m_dirty = true;
+}
+
+/*
+ * Convert a float back to the sample, with clip.
+ */
+static inline Sample_t
+delayClip(float v)
+{
+  if (v >= 2147483520.0f)
+    return 2147483520;
+  if (v <= -2147483648.0f)
+    return (Sample_t)(-2147483647 - 1);
+  return (Sample_t)v;
+}
+
+/*
+ * Copy n samples out of the ring, starting at pos.
+ */
+static inline void
+ringRead(const float *ring, uint32_t mask, uint32_t pos, float *dst, size_t n)
+{
+  size_t run = mask + 1 - pos;
+  if (run >= n)
+    {
+      std::memcpy(dst, ring + pos, n * sizeof(float));
+    }
+  else
+    {
+      std::memcpy(dst, ring + pos, run * sizeof(float));
+      std::memcpy(dst + run, ring, (n - run) * sizeof(float));
+    }
+}
+
+/*
+ * Copy n samples into the ring, starting at pos.
+ */
+static inline void
+ringWrite(float *ring, uint32_t mask, uint32_t pos, const float *src, size_t n)
+{
+  size_t run = mask + 1 - pos;
+  if (run >= n)
+    {
+      std::memcpy(ring + pos, src, n * sizeof(float));
+    }
+  else
+    {
+      std::memcpy(ring + pos, src, run * sizeof(float));
+      std::memcpy(ring, src + run, (n - run) * sizeof(float));
+    }
+}
+
+/**
+ * Process a run of frames while the delay length holds still. The
+ * caller makes sure nframes does not exceed the integer delay, so that
+ * nothing written here is read back within the same run.
+ * @param buff        Pointer to the target buffer.
+ * @param nframes     How many frames, up to _EFFECT_BLOCK_FRAMES.
+ */
+void
+DelayImpl::processBlock(Sample_t *buff, size_t nframes)
+{
+  float x[_EFFECT_BLOCK_FRAMES + DELAY_VECTOR] __attribute__((aligned(16)));
+  float t[_EFFECT_BLOCK_FRAMES + DELAY_VECTOR + 1] __attribute__((aligned(16)));
+  float y[_EFFECT_BLOCK_FRAMES + DELAY_VECTOR] __attribute__((aligned(16)));
+
+  const uint32_t di = (uint32_t)m_delay;
+  const float fr = m_delay - di;
+  const delay_v4sf c0 = { 1 - fr, 1 - fr, 1 - fr, 1 - fr };
+  const delay_v4sf c1 = { fr, fr, fr, fr };
+  const delay_v4sf fb = { m_feedback, m_feedback, m_feedback, m_feedback };
+  const delay_v4sf lv = { m_delayLevel, m_delayLevel, m_delayLevel, m_delayLevel };
+  const delay_v4sf dr = { m_dryLevel, m_dryLevel, m_dryLevel, m_dryLevel };
+  const size_t nvec = (nframes + DELAY_VECTOR - 1) / DELAY_VECTOR * DELAY_VECTOR;
+
+  V_ASSERT(nframes <= _EFFECT_BLOCK_FRAMES && nframes <= di);
+
+  std::memset(x + nframes, 0, (nvec - nframes) * sizeof(float));
+  std::memset(t + nframes + 1, 0, (nvec - nframes) * sizeof(float));
+
+  for (int n = 0; n < m_channels; n++)
+    {
+      float *ring = m_ringBuffs[n];
+      Sample_t *in = buff + n;
+
+      for (size_t i = 0; i < nframes; i++, in += m_channels)
+        x[i] = (float)*in;
+
+      /*
+       * t[i + 1] is delayed by di and t[i] by di + 1,
+       * the fraction interpolates between them.
+       */
+      ringRead(ring, m_ringMask, (m_index - di - 1) & m_ringMask, t, nframes + 1);
+
+      for (size_t i = 0; i < nvec; i += DELAY_VECTOR)
+        {
+          delay_v4sf xv = *(delay_v4sf *)&x[i];
+          delay_v4sf dv = c0 * *(delay_v4sf_u *)&t[i + 1] + c1 * *(delay_v4sf *)&t[i];
+
+          *(delay_v4sf *)&y[i] = xv + fb * dv;
+          *(delay_v4sf *)&x[i] = dr * xv + lv * dv;
+        }
+
+      ringWrite(ring, m_ringMask, m_index, y, nframes);
+
+      in = buff + n;
+      for (size_t i = 0; i < nframes; i++, in += m_channels)
+        *in = delayClip(x[i]);
+    }
+
+  m_index = (m_index + nframes) & m_ringMask;
+}
+
+/**
+ * Process a run of frames while the delay length glides to the target,
+ * arriving there on the last frame. The positions are worked out per
+ * sample and wrap by the mask, there is no branch in the loop.
+ * @param buff        Pointer to the target buffer.
+ * @param nframes     How many frames.
+ */
+void
+DelayImpl::processGlide(Sample_t *buff, size_t nframes)
+{
+  const float step = (m_delayTarget - m_delay) / nframes;
+  const uint32_t mask = m_ringMask;
+  float delay = m_delay;
+  uint32_t index = m_index;
+
+  for (size_t i = 0; i < nframes; i++)
+    {
+      delay += step;
+
+      const uint32_t di = (uint32_t)delay;
+      const float fr = delay - di;
+      const uint32_t p0 = (index - di) & mask;
+      const uint32_t p1 = (index - di - 1) & mask;
+
+      for (int n = 0; n < m_channels; n++)
+        {
+          float *ring = m_ringBuffs[n];
+          float sample = (float)*buff;
+          float delayed = ring[p0] + fr * (ring[p1] - ring[p0]);
+
+          ring[index] = sample + m_feedback * delayed;
+          *buff++ = delayClip(m_dryLevel * sample + m_delayLevel * delayed);
+        }
+
+      index = (index + 1) & mask;
+    }
+
+  m_index = index;
+  m_delay = m_delayTarget;
+}
+
+/**
+ * The echoes go on after the input stops, until the feedback has
+ * brought them below the floor.
+ * @return the number of frames, EFFECT_TAIL_INFINITE if the feedback
+ *         does not decay.
+ */
+size_t
+DelayImpl::tail()
+{
+  if (m_delayLevel <= 0)
+    return 0;
+  if (m_feedback >= 1)
+    return EFFECT_TAIL_INFINITE;
+
+  /*
+   * Each echo is m_feedback of the one before, count them until
+   * they fall below the floor.
+   */
+  size_t echoes = 1;
+  if (m_feedback > 0 && m_delayLevel > EFFECT_TAIL_FLOOR)
+    echoes += (size_t)ceilf(logf(EFFECT_TAIL_FLOOR / m_delayLevel) / logf(m_feedback));
+
+  float delay = m_delay > m_delayTarget ? m_delay : m_delayTarget;
+  return ((size_t)ceilf(delay) + 1) * echoes;
+}
+
 /**
  * Process the audio buffer.
  * @param buff        Pointer to the target buffer.
@@ -282,42 +761,40 @@ DelayImpl::gate(bool gate)
 int
 DelayImpl::process(Sample_t *buff, size_t nframes)
 {
-  register int64_t  sample;
-  register int      n = 0;
-  register int64_t  delayed_sample;
-  int               cursor;
-  ringBuffer        *rb;
-  
   if (m_bypass) return VINF_SUCCEEDED;
 
-  
-  while ( nframes-- )
+  if (m_dirty)
     {
-      for (n = 0; n < m_channels; n++)
-        {
-          sample = *buff;
-
-          rb = &m_ringBuffs[n];
-
-          cursor = ((rb->index - m_delaySamples + RING_BUFFER_LENGTH) % RING_BUFFER_LENGTH);
-          //LOG(VERBOSE) << "cursor = " << cursor << "\n";
-          delayed_sample = (rb->buffer)[cursor];
+      m_dirty = false;
+      updateParameters();
+    }
 
-          /*
-           * write current sample to buffer
-           */
-          (rb->buffer)[rb->index] = sample + (delayed_sample * m_feedback / MULT_COEFF);
+  if (UNLIKELY(!m_ringBuffs[0]))
+    {
+      int rc = acquireRings();
+      if (V_FAILURE(rc))
+        return rc;
+    }
 
-          /*
-           * Calculate + write output sample
-           */
-          *buff++ = sample + (m_delayLevel * delayed_sample / MULT_COEFF);
+  while ( nframes )
+    {
+      size_t n = nframes;
+      if (n > _EFFECT_BLOCK_FRAMES)
+        n = _EFFECT_BLOCK_FRAMES;
 
-          /*
-           * Increment buffer index
-           */
-          rb->index = (rb->index+1) % RING_BUFFER_LENGTH;
+      if (UNLIKELY(m_delay != m_delayTarget))
+        {
+          processGlide(buff, n);
         }
+      else
+        {
+          if (n > (size_t)m_delay)
+            n = (size_t)m_delay;
+          processBlock(buff, n);
+        }
+
+      buff += n * m_channels;
+      nframes -= n;
     }
 
   return VINF_SUCCEEDED;
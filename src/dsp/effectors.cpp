@@ -22,16 +22,59 @@
 #include <string.h>
 
 #include "dsp/effect.h"
+#include "dsp/voice.h"
 #include "util/misc.h"
 #include "util/error.h"
 #include "util/assert.h"
 #include "util/log.h"
+#include "memory/mmu.h"
+#include "mixer/mixer.h"
 
 namespace dsp
 {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+Effectors::Effectors()
+  : m_voices(0),
+    m_slotsGroup(0),
+    m_chainsGroup(0),
+    m_voiceRenderers(0),
+    m_voiceEffectors(0),
+    m_layout(VOICE_LAYOUT_CHAIN),
+    m_voiceBuffs(0),
+    m_voiceSamples(0),
+    m_voicesPending(0),
+    m_voicesSilent(0),
+    m_voicesCount(0),
+    m_voicesMixed(0),
+    m_voicesDecayed(0),
+    m_voicesLast(0),
+    m_declickFrom(0),
+    m_declickLeft(0),
+    m_declickCount(0),
+    m_auxSamples(0)
+{
+  for (int n = 0; n < _MAX_AUX_BUS; n++)
+    {
+      m_aux[n].buffer = 0;
+      m_aux[n].sent = false;
+      m_aux[n].send = 0;
+      m_aux[n].ret = MIXER_MAXVOLUME;
+    }
+}
+
+Effectors::~Effectors()
+{
+  for (int n = 0; n < _MAX_AUX_BUS; n++)
+    {
+      delete [] m_aux[n].buffer;
+    }
+  m_batchGroup.earseRefs();
+  freeVoices();
+  delete [] m_voiceBuffs;
+}
+
 /**
  * Create and add effector to the list. This will
  * create new instances of the source effector and the
@@ -51,7 +94,14 @@ Effectors::add(EffectScope scope, const IEffector &src)
   {
     case EFFECT_SCOPE_GROUP:
       {
-        for (int n = 0; n < _MAX_POLYPHONY_NUM; n++)
+        if (m_layout == VOICE_LAYOUT_BATCH)
+          {
+            return addBatch(src);
+          }
+
+        V_ASSERT(m_voices);
+
+        for (int n = 0; n < m_voices; n++)
           {
             /*
              * Each slot has its independent effector instance, so
@@ -65,6 +115,11 @@ Effectors::add(EffectScope scope, const IEffector &src)
 
             rc = m_slotsGroup[n].push(instance);
             if (V_FAILURE(rc)) return rc;
+
+            rc = m_chainsGroup[n].compile(m_slotsGroup[n], instance->m_channels);
+            if (V_FAILURE(rc)) return rc;
+
+            bindVoiceKernel(n, instance->m_channels);
           }
         return VINF_SUCCEEDED;
       }
@@ -77,6 +132,8 @@ Effectors::add(EffectScope scope, const IEffector &src)
             return VERR_ALLOC_MEMORY;
           }
         rc = m_slotsInstrument.push(instance);
+        if (V_SUCCESS(rc))
+          rc = m_chainInstrument.compile(m_slotsInstrument, instance->m_channels);
       }
       break;
 
@@ -89,6 +146,116 @@ Effectors::add(EffectScope scope, const IEffector &src)
 
 }
 
+/**
+ * Add a group effector in VOICE_LAYOUT_BATCH. One batch holds the state
+ * of all the voices, the effectors with no batch form fall back to an
+ * instance per voice.
+ * @param src       Reference of source effector.
+ * @return status code.
+ */
+int
+Effectors::addBatch(const IEffector &src)
+{
+  V_ASSERT(m_voices);
+
+  IEffectorBatch *batch = src.createBatch(m_voices);
+  if (!batch)
+    {
+      InstanceBatch *instances = new (/*MEM_TAG_EFFECTOR_INSTANCE,*/ std::nothrow) InstanceBatch(m_voices, src.m_channels);
+      if (instances && V_FAILURE(instances->init(src)))
+        {
+          delete instances;
+          instances = 0;
+        }
+      batch = instances;
+    }
+  if (!batch)
+    {
+      return VERR_ALLOC_MEMORY;
+    }
+  return m_batchGroup.push(batch);
+}
+
+/**
+ * Pick the fused kernel for a group chain which is one of the common
+ * ones: an ADSR, optionally followed by an amplifier.
+ * @param nPoly       Index of target polyphony unit.
+ * @param channels    The number of channels in each frame.
+ */
+void
+Effectors::bindVoiceKernel(int nPoly, int channels)
+{
+  IEffector *first = m_slotsGroup[nPoly].root;
+  IEffector *second = first ? first->next : 0;
+
+  m_voiceRenderers[nPoly] = 0;
+
+  if (!dynamic_cast<ADSRImpl *>(first))
+    return;
+  if (second && (second->next || !dynamic_cast<AmplifierImpl *>(second)))
+    return;
+
+  m_voiceEffectors[nPoly][0] = first;
+  m_voiceEffectors[nPoly][1] = second;
+
+  switch (channels)
+  {
+    case 1:
+      m_voiceRenderers[nPoly] = second ? VoiceKernel<ADSRImpl, AmplifierImpl, 1>::render
+                                       : VoiceKernel<ADSRImpl, NullEffector, 1>::render;
+      break;
+    case 2:
+      m_voiceRenderers[nPoly] = second ? VoiceKernel<ADSRImpl, AmplifierImpl, 2>::render
+                                       : VoiceKernel<ADSRImpl, NullEffector, 2>::render;
+      break;
+  }
+}
+
+/**
+ * Set a parameter of a group insert effector in all the voices. In
+ * VOICE_LAYOUT_BATCH the batch takes it, otherwise each voice's
+ * instance does.
+ * @param slot        Position of the effector in the group chain, the
+ *                    order they were added in.
+ * @param index       Index of the parameter.
+ * @param v           The value.
+ * @return status code.
+ */
+int
+Effectors::setGroupParameter(int slot, int index, float v)
+{
+  if (slot < 0)
+    {
+      return VERR_OUT_OF_RANGE;
+    }
+
+  if (m_batchGroup.root)
+    {
+      IEffectorBatch *b = m_batchGroup.root;
+      for (int i = 0; b && i < slot; i++)
+        b = b->next;
+      if (!b)
+        {
+          return VERR_OUT_OF_RANGE;
+        }
+      b->setParameter(index, v);
+      return VINF_SUCCEEDED;
+    }
+
+  for (int n = 0; n < m_voices; n++)
+    {
+      IEffector *e = m_slotsGroup[n].root;
+      for (int i = 0; e && i < slot; i++)
+        e = e->next;
+      if (!e)
+        {
+          return VERR_OUT_OF_RANGE;
+        }
+      e->setParameter(index, v);
+    }
+  return m_voices ? VINF_SUCCEEDED : VERR_OUT_OF_RANGE;
+}
+
 /**
  * Send the gate signal to the group insert effector.
  * @param nPoly       Index of target polyphony unit.
@@ -98,12 +265,16 @@ Effectors::add(EffectScope scope, const IEffector &src)
 void
 Effectors::groupGate(int nPoly, bool gate)
 {
-  V_ASSERT(nPoly >=0 && nPoly < _MAX_POLYPHONY_NUM);
+  V_ASSERT(nPoly >=0 && nPoly < m_voices);
 
   for (IEffector *e = m_slotsGroup[nPoly].root; e; e = e->next)
     {
       e->gate(gate);
     }
+  for (IEffectorBatch *b = m_batchGroup.root; b; b = b->next)
+    {
+      b->gate(nPoly, gate);
+    }
 }
 
 /**
@@ -115,12 +286,240 @@ Effectors::groupGate(int nPoly, bool gate)
 void
 Effectors::groupBypass(int nPoly, bool y)
 {
-  V_ASSERT(nPoly >=0 && nPoly < _MAX_POLYPHONY_NUM);
+  V_ASSERT(nPoly >=0 && nPoly < m_voices);
 
   for (IEffector *e = m_slotsGroup[nPoly].root; e; e = e->next)
     {
       e->bypass(y);
     }
+  for (IEffectorBatch *b = m_batchGroup.root; b; b = b->next)
+    {
+      b->bypass(nPoly, y);
+    }
+}
+
+/**
+ * Allocate the state and the buffers of the voices, and choose how the
+ * group effectors hold them. This must be done before any group effector
+ * is added, the polyphony and the layout can't change after that.
+ * @param voices      The number of voices, 1 ~ _MAX_POLYPHONY_NUM.
+ * @param nsamples    The most samples renderVoice() will be given.
+ * @param layout      VOICE_LAYOUT_CHAIN or VOICE_LAYOUT_BATCH.
+ * @return status code.
+ */
+int
+Effectors::initVoices(int voices, size_t nsamples, VoiceLayout layout)
+{
+  int rc;
+  bool grouped = (m_voices && m_slotsGroup[0].root) || m_batchGroup.root;
+
+  if (voices <= 0 || voices > _MAX_POLYPHONY_NUM)
+    {
+      return VERR_OUT_OF_RANGE;
+    }
+  if (grouped && (layout != m_layout || voices != m_voices))
+    {
+      return VERR_INVALID_PARAMETER;
+    }
+
+  if (voices != m_voices)
+    {
+      rc = allocVoices(voices);
+      if (V_FAILURE(rc)) return rc;
+    }
+
+  /*
+   * Each voice starts on the alignment of the tag, so that the buffers
+   * can be mixed by Mixer::MixAligned().
+   */
+  size_t stride = GetMemTagAlignment(MEM_TAG_AUDIO_BUFFER) / sizeof(Sample_t);
+  nsamples = (nsamples + stride - 1) / stride * stride;
+
+  delete [] m_voiceBuffs;
+  m_voiceBuffs = new (MEM_TAG_AUDIO_BUFFER, MEM_ALIGN_DEFAULT, std::nothrow) Sample_t[nsamples * voices];
+  if (!m_voiceBuffs)
+    {
+      m_voiceSamples = 0;
+      return VERR_ALLOC_MEMORY;
+    }
+  m_voiceSamples = nsamples;
+  m_voicesCount = 0;
+  m_layout = layout;
+  return VINF_SUCCEEDED;
+}
+
+/*
+ * Allocate the arrays of the voices, the old ones are freed.
+ */
+int
+Effectors::allocVoices(int voices)
+{
+  freeVoices();
+
+  m_slotsGroup = new (MEM_TAG_EFFECTOR_INSTANCE, std::nothrow) V_LIST<IEffector>[voices];
+  m_chainsGroup = new (MEM_TAG_EFFECTOR_INSTANCE, std::nothrow) EffectChain[voices];
+  m_voiceRenderers = new (MEM_TAG_EFFECTOR_INSTANCE, std::nothrow) VoiceRenderer[voices];
+  m_voiceEffectors = new (MEM_TAG_EFFECTOR_INSTANCE, std::nothrow) IEffector *[voices][2];
+  m_voicesPending = new (MEM_TAG_EFFECTOR_BUFFER, std::nothrow) int[voices];
+  m_voicesSilent = new (MEM_TAG_EFFECTOR_BUFFER, std::nothrow) bool[voices];
+  m_voicesMixed = new (MEM_TAG_EFFECTOR_BUFFER, std::nothrow) Sample_t *[voices];
+  m_voicesDecayed = new (MEM_TAG_EFFECTOR_BUFFER, std::nothrow) bool[voices];
+  m_voicesLast = new (MEM_TAG_EFFECTOR_BUFFER, std::nothrow) Sample_t[voices][_MAX_EFFECT_CHANNELS];
+  m_declickFrom = new (MEM_TAG_EFFECTOR_BUFFER, std::nothrow) Sample_t[voices][_MAX_EFFECT_CHANNELS];
+  m_declickLeft = new (MEM_TAG_EFFECTOR_BUFFER, std::nothrow) size_t[voices];
+
+  if (!m_slotsGroup || !m_chainsGroup || !m_voiceRenderers || !m_voiceEffectors ||
+      !m_voicesPending || !m_voicesSilent || !m_voicesMixed || !m_voicesDecayed ||
+      !m_voicesLast || !m_declickFrom || !m_declickLeft)
+    {
+      freeVoices();
+      return VERR_ALLOC_MEMORY;
+    }
+
+  for (int n = 0; n < voices; n++)
+    {
+      m_voiceRenderers[n] = 0;
+      m_voicesDecayed[n] = false;
+      m_declickLeft[n] = 0;
+    }
+  std::memset(m_voicesLast, 0, voices * sizeof(m_voicesLast[0]));
+
+  m_voices = voices;
+  m_voicesCount = 0;
+  m_declickCount = 0;
+  return VINF_SUCCEEDED;
+}
+
+/*
+ * Free the arrays of the voices.
+ */
+void
+Effectors::freeVoices()
+{
+  delete [] m_slotsGroup;
+  delete [] m_chainsGroup;
+  delete [] m_voiceRenderers;
+  delete [] m_voiceEffectors;
+  delete [] m_voicesPending;
+  delete [] m_voicesSilent;
+  delete [] m_voicesMixed;
+  delete [] m_voicesDecayed;
+  delete [] m_voicesLast;
+  delete [] m_declickFrom;
+  delete [] m_declickLeft;
+
+  m_slotsGroup = 0;
+  m_chainsGroup = 0;
+  m_voiceRenderers = 0;
+  m_voiceEffectors = 0;
+  m_voicesPending = 0;
+  m_voicesSilent = 0;
+  m_voicesMixed = 0;
+  m_voicesDecayed = 0;
+  m_voicesLast = 0;
+  m_declickFrom = 0;
+  m_declickLeft = 0;
+  m_voices = 0;
+}
+
+/**
+ * Allocate the send buffers of the aux buses.
+ * @param nsamples    The most samples processGroup() will be given.
+ * @return status code.
+ */
+int
+Effectors::initAux(size_t nsamples)
+{
+  for (int n = 0; n < _MAX_AUX_BUS; n++)
+    {
+      delete [] m_aux[n].buffer;
+      m_aux[n].buffer = new (MEM_TAG_AUDIO_BUFFER, MEM_ALIGN_CACHELINE, std::nothrow) Sample_t[nsamples];
+      if (!m_aux[n].buffer)
+        {
+          m_auxSamples = 0;
+          return VERR_ALLOC_MEMORY;
+        }
+      memset(m_aux[n].buffer, 0, nsamples * sizeof(Sample_t));
+    }
+  m_auxSamples = nsamples;
+  return VINF_SUCCEEDED;
+}
+
+/**
+ * Create and add effector to the chain of an aux bus. Only one
+ * instance is created, it is shared by all the voices. The master
+ * keeps the dry signal, so the instance runs wet only.
+ * @param bus         Index of the aux bus.
+ * @param src         Reference of source effector.
+ * @return status code.
+ */
+int
+Effectors::addAux(int bus, const IEffector &src)
+{
+  if (bus < 0 || bus >= _MAX_AUX_BUS)
+    {
+      return VERR_OUT_OF_RANGE;
+    }
+
+  IEffector *instance = src.create();
+  if (!instance)
+    {
+      return VERR_ALLOC_MEMORY;
+    }
+  instance->setWetOnly(true);
+  int rc = m_aux[bus].slots.push(instance);
+  if (V_FAILURE(rc))
+    return rc;
+  return m_aux[bus].chain.compile(m_aux[bus].slots, instance->m_channels);
+}
+
+/**
+ * Set how much of each voice is sent to an aux bus.
+ * @param bus         Index of the aux bus.
+ * @param volume      0 ~ MIXER_MAXVOLUME, 0 = no send.
+ */
+void
+Effectors::auxSend(int bus, int volume)
+{
+  V_ASSERT(bus >= 0 && bus < _MAX_AUX_BUS);
+  m_aux[bus].send = volume;
+}
+
+/**
+ * Set how much of an aux bus returns to the master.
+ * @param bus         Index of the aux bus.
+ * @param volume      0 ~ MIXER_MAXVOLUME.
+ */
+void
+Effectors::auxReturn(int bus, int volume)
+{
+  V_ASSERT(bus >= 0 && bus < _MAX_AUX_BUS);
+  m_aux[bus].ret = volume;
+}
+
+/**
+ * Add a voice into the send buffers of the aux buses.
+ * @param buff        Pointer to the voice buffer.
+ * @param nsamples    How many samples are there in the voice buffer.
+ * @return status code.
+ */
+int
+Effectors::sendAux(const Sample_t *buff, size_t nsamples)
+{
+  for (int n = 0; n < _MAX_AUX_BUS; n++)
+    {
+      auxBus *aux = &m_aux[n];
+      if (!aux->send || !aux->slots.root)
+        continue;
+
+      if (nsamples > m_auxSamples)
+        {
+          return VERR_BUFFER_OVERFLOW;
+        }
+      mixer::Mixer::MixAudio(aux->buffer, buff, nsamples, aux->send);
+      aux->sent = true;
+    }
+  return VINF_SUCCEEDED;
 }
 
 /**
@@ -129,45 +528,477 @@ Effectors::groupBypass(int nPoly, bool y)
  * @param buff        Pointer to the target buffer.
  * @param nsamples    How many frames are there in the target buffer.
  * @param channels    The number of channels in each frame.
+ * @param silent      Whether the buffer is all zero.
+ * @return VINF_SILENCE if the buffer is all zero after the effectors.
  * @return status code.
  */
 int
-Effectors::processGroup(int nPoly, Sample_t *buff, size_t nsamples, size_t channels)
+Effectors::processGroup(int nPoly, Sample_t *buff, size_t nsamples, size_t channels, bool silent)
 {
   int rc;
-  V_ASSERT(nPoly >=0 && nPoly < _MAX_POLYPHONY_NUM);
+  V_ASSERT(nPoly >=0 && nPoly < m_voices);
   V_ASSERT(nsamples % channels == 0);
 
-  V_LIST<IEffector> slots = m_slotsGroup[nPoly];
+  rc = m_chainsGroup[nPoly].process(buff, nsamples / channels, silent);
+  if (V_FAILURE(rc) || rc == VINF_SILENCE) return rc;
+
+  return sendAux(buff, nsamples);
+}
 
-  for (IEffector *e = slots.root; e; e = e->next)
+/**
+ * Render a voice from its original data. A common chain runs as one
+ * fused kernel, the others are decoded and processed by the chain.
+ * @param nPoly       Index of targte poly unit.
+ * @param chunk       The data given by WaveTable::FetchPipeChannel().
+ * @param buff        Where to store the samples.
+ * @param nsamples    How many samples to render.
+ * @param channels    The number of channels in each frame.
+ * @return VINF_SILENCE if the voice is all zero.
+ * @return status code.
+ */
+int
+Effectors::processVoice(int nPoly, const wavetable::PipeChunk &chunk, Sample_t *buff, size_t nsamples, size_t channels)
+{
+  int rc;
+  V_ASSERT(nPoly >=0 && nPoly < m_voices);
+  V_ASSERT(nsamples % channels == 0);
+
+  VoiceRenderer render = m_voiceRenderers[nPoly];
+  if (render && chunk.pcm)
     {
-      rc = e->process(buff, nsamples / channels);
-      if (V_FAILURE(rc)) return rc;
+      rc = render(m_voiceEffectors[nPoly][0], m_voiceEffectors[nPoly][1], chunk, buff, nsamples / channels);
+      if (V_FAILURE(rc) || rc == VINF_SILENCE) return rc;
+
+      return sendAux(buff, nsamples);
     }
 
+  rc = wavetable::WaveTable::DecodePipeChunk(chunk, buff, nsamples);
+  if (V_FAILURE(rc)) return rc;
+
+  return processGroup(nPoly, buff, nsamples, channels, rc == VINF_SILENCE);
+}
+
+/**
+ * Render a voice into its buffer, the voices rendered are processed and
+ * mixed by mixVoices(). In VOICE_LAYOUT_CHAIN the voice is processed by
+ * its chain at once, in VOICE_LAYOUT_BATCH it is only decoded here.
+ * @param nPoly       Index of targte poly unit.
+ * @param chunk       The data given by WaveTable::FetchPipeChannel().
+ * @param nsamples    How many samples to render.
+ * @param channels    The number of channels in each frame.
+ * @return status code.
+ */
+int
+Effectors::renderVoice(int nPoly, const wavetable::PipeChunk &chunk, size_t nsamples, size_t channels)
+{
+  int rc;
+  V_ASSERT(nPoly >=0 && nPoly < m_voices);
+  V_ASSERT(m_voicesCount < m_voices);
+
+  if (nsamples > m_voiceSamples)
+    {
+      return VERR_BUFFER_OVERFLOW;
+    }
+
+  Sample_t *buff = m_voiceBuffs + nPoly * m_voiceSamples;
+
+  if (m_layout == VOICE_LAYOUT_BATCH)
+    rc = wavetable::WaveTable::DecodePipeChunk(chunk, buff, nsamples);
+  else
+    rc = processVoice(nPoly, chunk, buff, nsamples, channels);
+  if (V_FAILURE(rc)) return rc;
+
+  m_voicesPending[m_voicesCount] = nPoly;
+  m_voicesSilent[m_voicesCount] = rc == VINF_SILENCE;
+  m_voicesCount++;
+  return VINF_SUCCEEDED;
+}
+
+/**
+ * Process the voices rendered since the last time and mix them. In
+ * VOICE_LAYOUT_BATCH each group effector runs once for all the voices.
+ * The silent voices are not mixed.
+ * @param buff        Where to store the mix, it is overwritten. Aligned to
+ *                    the cache line, like MEM_TAG_AUDIO_BUFFER.
+ * @param nsamples    How many samples, the same as renderVoice() was given.
+ * @param channels    The number of channels in each frame.
+ * @return VINF_SILENCE if the mix is all zero.
+ * @return status code.
+ */
+int
+Effectors::mixVoices(Sample_t *buff, size_t nsamples, size_t channels)
+{
+  Sample_t **buffs = m_voicesMixed;
+  int count = m_voicesCount;
+  int rc = VINF_SUCCEEDED;
+
+  V_ASSERT(nsamples % channels == 0);
+  V_ASSERT(nsamples <= m_voiceSamples);
+  V_ASSERT(channels <= _MAX_EFFECT_CHANNELS);
+
+  m_voicesCount = 0;
+
+  for (int i = 0; i < count; i++)
+    {
+      buffs[i] = m_voiceBuffs + m_voicesPending[i] * m_voiceSamples;
+    }
+
+  if (m_layout == VOICE_LAYOUT_BATCH)
+    {
+      for (IEffectorBatch *b = m_batchGroup.root; b; b = b->next)
+        {
+          rc = b->process(m_voicesPending, buffs, m_voicesSilent, count, nsamples / channels);
+          if (V_FAILURE(rc)) return rc;
+        }
+      for (int i = 0; i < count; i++)
+        {
+          if (m_voicesSilent[i])
+            continue;
+          rc = sendAux(buffs[i], nsamples);
+          if (V_FAILURE(rc)) return rc;
+        }
+    }
+
+  bool silent = true;
+  for (int i = 0; i < count; i++)
+    {
+      int nPoly = m_voicesPending[i];
+      m_voicesDecayed[nPoly] = m_voicesSilent[i];
+      if (m_voicesSilent[i])
+        {
+          memset(m_voicesLast[nPoly], 0, sizeof(m_voicesLast[nPoly]));
+          continue;
+        }
+      memcpy(m_voicesLast[nPoly], buffs[i] + nsamples - channels, channels * sizeof(Sample_t));
+
+      if (silent)
+        memcpy(buff, buffs[i], nsamples * sizeof(Sample_t));
+      else
+        mixer::Mixer::MixAligned(buff, buffs[i], nsamples);
+      silent = false;
+    }
+
+  if (m_declickCount)
+    {
+      if (silent)
+        memset(buff, 0, nsamples * sizeof(Sample_t));
+      mixDeclicks(buff, nsamples, channels);
+      silent = false;
+    }
+
+  if (silent)
+    {
+      memset(buff, 0, nsamples * sizeof(Sample_t));
+      return VINF_SILENCE;
+    }
   return VINF_SUCCEEDED;
 }
 
+/*
+ * Add the fades of the voices cut off into the mix.
+ */
+void
+Effectors::mixDeclicks(Sample_t *buff, size_t nsamples, size_t channels)
+{
+  const int64_t max_audioval = ((int64_t)1 << (sizeof(Sample_t) * 8 - 1)) - 1;
+  const int64_t min_audioval = -((int64_t)1 << (sizeof(Sample_t) * 8 - 1));
+
+  for (int n = 0; n < m_voices && m_declickCount; n++)
+    {
+      size_t left = m_declickLeft[n];
+      if (!left)
+        continue;
+
+      for (size_t i = 0; i < nsamples && left; i += channels)
+        {
+          left--;
+          for (size_t c = 0; c < channels; c++)
+            {
+              int64_t sample = buff[i + c] + (int64_t)m_declickFrom[n][c] * (int64_t)left / _EFFECT_DECLICK_FRAMES;
+              if (sample > max_audioval) sample = max_audioval;
+              else if (sample < min_audioval) sample = min_audioval;
+              buff[i + c] = (Sample_t)sample;
+            }
+        }
+
+      m_declickLeft[n] = left;
+      if (!left)
+        m_declickCount--;
+    }
+}
+
+/**
+ * Query the gain the group effectors hold a voice at, the product of
+ * IEffector::level() of them.
+ * @param nPoly       Index of target poly unit.
+ * @return the gain, 0 ~ 1.
+ */
+float
+Effectors::voiceLevel(int nPoly)
+{
+  float level = 1;
+  V_ASSERT(nPoly >=0 && nPoly < m_voices);
+
+  for (IEffector *e = m_slotsGroup[nPoly].root; e; e = e->next)
+    {
+      level *= e->level();
+    }
+  for (IEffectorBatch *b = m_batchGroup.root; b; b = b->next)
+    {
+      level *= b->level(nPoly);
+    }
+  return level;
+}
+
+/**
+ * Cut off a voice for a new note: what it was playing fades out in
+ * the next mixVoices(), and the group effectors start over.
+ * @param nPoly       Index of target poly unit.
+ */
+void
+Effectors::declickVoice(int nPoly)
+{
+  const int64_t max_audioval = ((int64_t)1 << (sizeof(Sample_t) * 8 - 1)) - 1;
+  const int64_t min_audioval = -((int64_t)1 << (sizeof(Sample_t) * 8 - 1));
+  V_ASSERT(nPoly >=0 && nPoly < m_voices);
+
+  Sample_t *from = m_declickFrom[nPoly];
+  size_t left = m_declickLeft[nPoly];
+
+  /*
+   * A fade still going on carries on from where it is.
+   */
+  for (int c = 0; c < _MAX_EFFECT_CHANNELS; c++)
+    {
+      int64_t sample = m_voicesLast[nPoly][c];
+      if (left)
+        sample += (int64_t)from[c] * (int64_t)left / _EFFECT_DECLICK_FRAMES;
+      if (sample > max_audioval) sample = max_audioval;
+      else if (sample < min_audioval) sample = min_audioval;
+      from[c] = (Sample_t)sample;
+    }
+  memset(m_voicesLast[nPoly], 0, sizeof(m_voicesLast[nPoly]));
+
+  if (!left)
+    m_declickCount++;
+  m_declickLeft[nPoly] = _EFFECT_DECLICK_FRAMES;
+
+  for (IEffector *e = m_slotsGroup[nPoly].root; e; e = e->next)
+    {
+      e->reset();
+    }
+  for (IEffectorBatch *b = m_batchGroup.root; b; b = b->next)
+    {
+      b->reset(nPoly);
+    }
+}
+
+/**
+ * Query whether a voice has decayed away: it was given to the last
+ * mixVoices() and came out of the group effectors as silence, that is
+ * the envelope has released to zero and the tails of the effectors
+ * after it are below EFFECT_TAIL_FLOOR. Its source can be stopped.
+ * @param nPoly       Index of target poly unit.
+ * @return true if it has.
+ */
+bool
+Effectors::voiceDecayed(int nPoly) const
+{
+  V_ASSERT(nPoly >=0 && nPoly < m_voices);
+  return m_voicesDecayed[nPoly];
+}
+
+/**
+ * Process the aux buses and return them to the master. The buses
+ * run even if no voice was sent this time, so the tails ring out,
+ * then they sleep until a voice is sent again.
+ * @param buff        Pointer to the master buffer.
+ * @param nsamples    How many samples are there in the master buffer.
+ * @param channels    The number of channels in each frame.
+ * @return VINF_SILENCE if nothing was returned to the master.
+ * @return status code.
+ */
+int
+Effectors::processAux(Sample_t *buff, size_t nsamples, size_t channels)
+{
+  int rc;
+  bool silent = true;
+  V_ASSERT(nsamples % channels == 0);
+
+  for (int n = 0; n < _MAX_AUX_BUS; n++)
+    {
+      auxBus *aux = &m_aux[n];
+      if (!aux->slots.root || !aux->buffer)
+        continue;
+
+      if (nsamples > m_auxSamples)
+        {
+          return VERR_BUFFER_OVERFLOW;
+        }
+
+      rc = aux->chain.process(aux->buffer, nsamples / channels, !aux->sent);
+      if (V_FAILURE(rc)) return rc;
+
+      aux->sent = false;
+      if (rc == VINF_SILENCE)
+        continue;
+
+      if (aux->ret)
+        {
+          mixer::Mixer::MixAudio(buff, aux->buffer, nsamples, aux->ret);
+          silent = false;
+        }
+
+      memset(aux->buffer, 0, nsamples * sizeof(Sample_t));
+    }
+
+  return silent ? VINF_SILENCE : VINF_SUCCEEDED;
+}
+
 /**
  * Process the audio buffer.
  * @param buff        Pointer to the target buffer.
  * @param nsamples    How many frames are there in the target buffer.
  * @param channels    The number of channels in each frame.
+ * @param silent      Whether the buffer is all zero.
+ * @return VINF_SILENCE if the buffer is all zero after the effectors.
  * @return status code.
  */
 int
-Effectors::processInstrument(Sample_t *buff, size_t nsamples, size_t channels)
+Effectors::processInstrument(Sample_t *buff, size_t nsamples, size_t channels, bool silent)
 {
-  int rc;
   V_ASSERT(nsamples % channels == 0);
 
-  for (IEffector *e = m_slotsInstrument.root; e; e = e->next)
+  return m_chainInstrument.process(buff, nsamples / channels, silent);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Constructor of InstanceBatch.
+ * @param voices      The number of voices.
+ * @param channels    number of channels
+ */
+InstanceBatch::InstanceBatch(int voices, int channels)
+  : IEffectorBatch(voices, channels),
+    m_instances(0),
+    m_quiet(0)
+{
+}
+
+InstanceBatch::~InstanceBatch()
+{
+  if (m_instances)
     {
-      rc = e->process(buff, nsamples / channels);
-      if (V_FAILURE(rc)) return rc;
+      for (int v = 0; v < m_voices; v++)
+        delete m_instances[v];
+      delete [] m_instances;
+    }
+  delete [] m_quiet;
+}
+
+/**
+ * Create the instances of the voices.
+ * @param src         Reference of source effector.
+ * @return status code.
+ */
+int
+InstanceBatch::init(const IEffector &src)
+{
+  m_instances = new (MEM_TAG_EFFECTOR_INSTANCE, std::nothrow) IEffector *[m_voices];
+  m_quiet = new (MEM_TAG_EFFECTOR_INSTANCE, std::nothrow) size_t[m_voices];
+  if (!m_instances || !m_quiet)
+    {
+      delete [] m_instances;
+      m_instances = 0;
+      return VERR_ALLOC_MEMORY;
+    }
+  for (int v = 0; v < m_voices; v++)
+    {
+      m_instances[v] = 0;
+      m_quiet[v] = 0;
     }
+  for (int v = 0; v < m_voices; v++)
+    {
+      m_instances[v] = src.create();
+      if (!m_instances[v])
+        {
+          return VERR_ALLOC_MEMORY;
+        }
+    }
+  return VINF_SUCCEEDED;
+}
+
+void
+InstanceBatch::gate(int voice, bool gate)
+{
+  V_ASSERT(voice >= 0 && voice < m_voices);
+  m_instances[voice]->gate(gate);
+}
+
+void
+InstanceBatch::bypass(int voice, bool y)
+{
+  V_ASSERT(voice >= 0 && voice < m_voices);
+  m_instances[voice]->bypass(y);
+}
+
+void
+InstanceBatch::reset(int voice)
+{
+  V_ASSERT(voice >= 0 && voice < m_voices);
+  m_instances[voice]->reset();
+  m_quiet[voice] = 0;
+}
+
+void
+InstanceBatch::setParameter(int index, float v)
+{
+  for (int n = 0; n < m_voices; n++)
+    m_instances[n]->setParameter(index, v);
+}
 
+float
+InstanceBatch::level(int voice)
+{
+  V_ASSERT(voice >= 0 && voice < m_voices);
+  return m_instances[voice]->level();
+}
+
+/**
+ * Process the buffers of the voices, one instance after another.
+ * @param voices      Indexes of the voices.
+ * @param buffs       The buffer of each voice.
+ * @param silent      Whether each buffer is all zero, updated.
+ * @param count       The number of voices.
+ * @param nframes     How many frames are there in each buffer.
+ * @return status code.
+ */
+int
+InstanceBatch::process(const int *voices, Sample_t *const *buffs, bool *silent, int count, size_t nframes)
+{
+  int rc;
+
+  for (int i = 0; i < count; i++)
+    {
+      int v = voices[i];
+      V_ASSERT(v >= 0 && v < m_voices);
+
+      IEffector *e = m_instances[v];
+      if (silent[i])
+        {
+          if (m_quiet[v] >= (e->m_bypass ? 0 : e->tail()))
+            continue;
+          m_quiet[v] += nframes;
+        }
+      else
+        m_quiet[v] = 0;
+
+      rc = e->process(buffs[i], nframes);
+      if (V_FAILURE(rc)) return rc;
+
+      silent[i] = rc == VINF_SILENCE;
+    }
   return VINF_SUCCEEDED;
 }
 
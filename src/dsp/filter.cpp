@@ -1,17 +1,17 @@
 /** @file
  * Effector - Filter.
  * In this code we use a butterworth filter to process the samples.
- * and it is all fixed-point operation within the audio pipe.
  *
- * NOTE: See MULT_COEFF, the method above is a temporary settlement as it avoid the
- * FPU fault interrupt caused and at least we will never enter the kernel mode
- * within these simple ALU instructions executing (we assume that there is no
- * other interrupts).
- * On the other hand, the low accuracy will damage the running of filter, so
- * we should do some Error Compensations.
+ * NOTE: It used to be a fixed-point operation scaled by 1000, but the
+ * coefficients were quantized so coarsely that the low cutoffs went
+ * unstable. Now the biquads run in float, transposed direct form II,
+ * with all the channels of a frame in one SIMD register (see dsp/biquad.h).
+ * The order can be raised up to 8 by cascading the sections.
  *
- * If we implement this instrument at the other CPU that has hardware FPU,
- * we should take measure of float instead of keeping using it.
+ * The parameters are only recorded by setParameter(), process() picks
+ * them up at the start of the next block and glides the coefficients
+ * across it, so a cutoff sweep does not zipper. The designs come from
+ * a quantized table instead of libm, see lookupButterworth().
  */
 
 /*
@@ -39,16 +39,6 @@
 #include "memory/mmu.h"
 
 
-#define PI (4.*tan(1.))
-
-/**@def MULT_COEFF
- * this coeff is used for scaling the data to avoid the float
- * operation, so it determines the accuracy of the filter.
- * The larger this coeff is, the more accurate can you get,
- * but it may causes overflow as well.
- */
-#define MULT_COEFF (1000)
-
 namespace dsp
 {
 
@@ -57,66 +47,19 @@ enum {
   kQu,
   kGain,
   kClass,
+  kOrder,
   kMaxCount
 };
 
 enum {
-  kLowpass = 0,
-  kHighpass,
-  kBandpass,
-  kBandnotch
+  kLowpass = BIQUAD_LOWPASS,
+  kHighpass = BIQUAD_HIGHPASS,
+  kBandpass = BIQUAD_BANDPASS,
+  kBandnotch = BIQUAD_BANDNOTCH
 };
 
 ////////////////////////////////////////////////////////////////////////////////
 
-class biquad
-{
-private:
-  int64_t a0, a1, a2, b1, b2;
-  int64_t i0, i1, i2;
-  int64_t o0, o1, o2;
-
-public:
-  biquad()
-    : a0(1 * MULT_COEFF), a1(0), a2(0),
-      b1(0), b2(0)
-  {
-    reset();
-  }
-
-  void reset()
-  {
-    // chaining these together to assign 0 easily.
-    i0 = i1 = i2 = /*a0*/ o0 = o1 = o2 = 0.0f;
-  }
-
-  void setCoeffs(int64_t a0, int64_t a1, int64_t a2, int64_t b1, int64_t b2)
-  {
-    this->a0 = a0;
-    this->a1 = a1;
-    this->a2 = a2;
-    this->b1 = b1;
-    this->b2 = b2;
-  }
-
-  inline Sample_t getSample(const Sample_t &src)
-  {
-    i0 = src;
-
-    //o0 = a0 * i0 + a1 * i1 + a2 * i2;
-    //o0 -= b2 * o2 + b1 * o1;
-
-    o0 = a0 * i0 / MULT_COEFF + a1 * i1 / MULT_COEFF + a2 * i2 / MULT_COEFF;
-    o0 -= b2 * o2 / MULT_COEFF + b1 * o1 / MULT_COEFF;
-
-    i2 = i1;
-    i1 = i0;
-    o2 = o1;
-    o1 = o0;
-    return o0;
-  }
-};
-
 /**
  * Constructor of FilterImpl.
  * @param rate        sample rate
@@ -124,7 +67,9 @@ public:
  */
 FilterImpl::FilterImpl(int rate, int channels)
   : IEffector(rate, channels),
-    m_inited(false)
+    m_inited(false),
+    m_dirty(false),
+    m_tail(0)
 {
   /*
    * set up the default values
@@ -133,6 +78,7 @@ FilterImpl::FilterImpl(int rate, int channels)
   m_kGain = 1.0f;
   m_kQu = 1.0f;
   m_kClass = kBandnotch;
+  m_kOrder = 2.0f;
 
   reset();
 }
@@ -171,6 +117,7 @@ FilterImpl::getParameter(int index, float *v)
     case kQu:     *v = m_kQu;    break;
     case kGain:   *v = m_kGain;  break;
     case kClass:  *v = m_kClass; break;
+    case kOrder:  *v = m_kOrder; break;
   }
 }
 
@@ -184,6 +131,7 @@ FilterImpl::getParameterName(int index, std::string &s)
     case kQu:     s = "Q";    break;
     case kGain:   s = "Gain"; break;
     case kClass:  s = "Class"; break;
+    case kOrder:  s = "Order"; break;
   }
 }
 
@@ -197,6 +145,7 @@ FilterImpl::getParameterLable(int index, std::string &s)
     case kQu:     s = "Q";  break;
     case kGain:   s = "dB"; break;
     case kClass:  s = "";   break;
+    case kOrder:  s = "";   break;
   }
 }
 
@@ -210,6 +159,7 @@ FilterImpl::getParameterDisplay(int index, std::string &s)
     case kFreq:   gcvt(m_kFreq, 8, buff);  break;
     case kQu:     gcvt(m_kQu, 8, buff);    break;
     case kGain:   gcvt(m_kGain, 8, buff);  break;
+    case kOrder:  gcvt(m_kOrder, 8, buff); break;
     case kClass:
       {
         switch ((int)m_kClass)
@@ -240,8 +190,9 @@ FilterImpl::setParameter(int index, float v)
     case kQu:     m_kQu   = v; break;
     case kGain:   m_kGain = v; break;
     case kClass:  m_kClass = v; break;
+    case kOrder:  m_kOrder = v; break;
   }
-  updateParameters();
+  m_dirty = true;
 }
 
 /**
@@ -277,15 +228,14 @@ FilterImpl::init(int flags)
       return VERR_OUT_OF_RANGE;
     }
 
-  for (int i = 0; i < m_channels; i++)
+  int rc = initBiquadTable();
+  if (V_SUCCESS(rc))
+    rc = m_bank.init(m_channels);
+  if (V_FAILURE(rc))
     {
-      m_biquads[i] = (void*) new (/*MEM_TAG_EFFECTOR_INSTANCE,*/ std::nothrow) biquad;
-      if (!m_biquads[i])
-        {
-          return VERR_ALLOC_MEMORY;
-        }
+      return rc;
     }
-  updateParameters();
+  updateParameters(false);
 
   bypass(false);
   reset();
@@ -304,10 +254,7 @@ FilterImpl::uninit(int flags)
 {
   if (m_inited)
     {
-      for (int i = 0; i < m_channels; i++)
-        {
-          delete static_cast<biquad*>(m_biquads[i]);
-        }
+      m_bank.uninit();
       m_inited = false;
     }
   return VINF_SUCCEEDED;
@@ -324,110 +271,30 @@ FilterImpl::reset()
 }
 
 /**
- * Recalculate the parameters.
+ * Recalculate the parameters. This runs in the audio thread, so there
+ * must be no allocation, no logging and no libm design here.
+ * @param smooth      Glide to the new coefficients over the next block.
  */
 void
-FilterImpl::updateParameters()
+FilterImpl::updateParameters(bool smooth)
 {
   this->cf = m_kFreq;
   this->q = m_kQu;
   this->g = m_kGain;
   this->sr = m_rate;
 
-  reset();
-
-  float bw = 0.f;
-  float c = 0.f;
-  float d = 0.f;
-
-  float _a0 = 0.f;
-  float _a1 = 0.f;
-  float _a2 = 0.f;
-  float _b1 = 0.f;
-  float _b2 = 0.f;
-
-  /*
-   * Calculating the coeffs
-   */
-  switch((int)m_kClass)
-  {
-    case (kLowpass):
-      {
-        c = 1.0f / tan(PI * cf / sr);
-        _a0 = 1.0f / (1.0f + sqrt(2) * c + pow(c, 2));
-        _a1 = 2 * _a0;
-        _a2 = _a0;
-        _b1 = 2 * _a0 * (1 - pow(c,2));
-        _b2 = _a0 * (1 - sqrt(2) * c + pow(c, 2));
-      }
-      break;
-    case (kHighpass):
-      {
-        c = tan(PI * cf / sr);
-        _a0 = 1.f / (1.f + (sqrt(2) * c) + pow(c, 2));
-        _a1 = (2.f * _a0) * - 1;
-        _a2 = _a0;
-        _b1 = 2.f * _a0 * (pow(c, 2) - 1.f);
-        _b2 = _a0 * (1.f - (sqrt(2) * c) + pow(c, 2));
-      }
-      break;
-    case (kBandpass):
-      {
-        bw = cf / q;
-        c = 1.f / tan(PI * (bw / sr));
-        d = 2.f * cos(2.f * PI * (cf / sr));
-        _a0 = 1.f / (1.f + c);
-        _a1 = 0.f;
-        _a2 = -1.f * _a0;
-        _b1 = (-1.f * _a0) * c * d;
-        _b2 = _a0 * (c - 1.f);
-      }
-      break;
-    case (kBandnotch):
-      {
-        bw = cf / q;
-        c = tan(PI * bw / sr);
-        d = 2.f * cos(2.f * PI * (cf / sr));
-        _a0 = 1.f / (1.f + c);
-        _a1 = (-1.f * _a0) * d;
-        _a2 = _a0;
-        _b1 = (-1.f * _a0) * d;
-        _b2 = _a0 * (1.f - c);
-      }
-      break;
-
-    default:
+  BiquadCoeffs c[BIQUAD_MAX_SECTIONS];
+  int sections;
+  if (V_FAILURE(lookupButterworth((int)m_kClass, sr, cf, q, (int)m_kOrder, c, &sections)))
+    {
       return;
-  }
+    }
 
-  _a0 *= MULT_COEFF;
-  _a1 *= MULT_COEFF;
-  _a2 *= MULT_COEFF;
-  _b1 *= MULT_COEFF;
-  _b2 *= MULT_COEFF;
-
-  int32_t a0 = static_cast<int64_t>(_a0);
-  int32_t a1 = static_cast<int64_t>(_a1);
-  int32_t a2 = static_cast<int64_t>(_a2);
-  int32_t b1 = static_cast<int64_t>(_b1);
-  int32_t b2 = static_cast<int64_t>(_b2);
-
-#if 1
-  LOG(INFO) << "\nfiler params:\n" <<
-      "_a0 = " << _a0 << "\n" <<
-      "_a1 = " << _a1 << "\n" <<
-      "_b1 = " << _b1 << "\n" <<
-      "_b2 = " << _b2 << "\n" <<
-      "a0 = " << a0 << "\n" <<
-      "a1 = " << a1 << "\n" <<
-      "b1 = " << b1 << "\n" <<
-      "b2 = " << b2 << "\n";
-#endif
-
-  for (int i = 0;i < m_channels; i++)
+  for (int i = 0; i < m_bank.filters(); i++)
     {
-      static_cast<biquad*>(m_biquads[i])->setCoeffs(a0, a1, a2, b1, b2);
+      m_bank.setFilter(i, c, sections, smooth);
     }
+  m_tail = biquadTail(c, sections, EFFECT_TAIL_FLOOR);
 }
 
 /*
@@ -439,6 +306,16 @@ FilterImpl::gate(bool gate)
 {
 }
 
+/**
+ * The filter rings on after the input stops, see biquadTail().
+ * @return the number of frames.
+ */
+size_t
+FilterImpl::tail()
+{
+  return m_tail;
+}
+
 /**
  * Process the audio buffer.
  * @param buff        Pointer to the target buffer.
@@ -448,20 +325,246 @@ FilterImpl::gate(bool gate)
 int
 FilterImpl::process(Sample_t *buff, size_t nframes)
 {
-  register int64_t sample;
-  register int n = 0;
-
   if (m_bypass) return VINF_SUCCEEDED;
 
-  while ( nframes-- )
+  if (m_dirty)
+    {
+      m_dirty = false;
+      updateParameters(true);
+    }
+
+  Sample_t *buffs[_MAX_EFFECT_CHANNELS];
+  for (int i = 0; i < m_channels; i++)
+    {
+      buffs[i] = buff + i;
+    }
+
+  m_bank.process(buffs, nframes, m_channels);
+
+  return VINF_SUCCEEDED;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Create the filters of all the voices, see IEffector::createBatch().
+ * @param voices      The number of voices.
+ * @return 0 failed.
+ * @return !=0 Pointer to the new batch.
+ */
+IEffectorBatch *
+FilterImpl::createBatch(int voices) const
+{
+  FilterBatch *batch = new (/*MEM_TAG_EFFECTOR_INSTANCE,*/ std::nothrow) FilterBatch(*this, voices);
+  if (batch)
     {
-      for (n = 0; n < m_channels; n++)
+      if (V_SUCCESS(batch->init()))
         {
-          sample = *buff;
-          *buff++ = static_cast<biquad*>(m_biquads[n])->getSample(sample);
+          return batch;
         }
+      delete batch;
     }
+  return 0;
+}
+
+/**
+ * Constructor of FilterBatch.
+ * @param src         The filter which gives the parameters.
+ * @param voices      The number of voices.
+ */
+FilterBatch::FilterBatch(const FilterImpl &src, int voices)
+  : IEffectorBatch(voices, src.m_channels),
+    m_rate(src.m_rate),
+    m_kFreq(src.m_kFreq),
+    m_kQu(src.m_kQu),
+    m_kClass(src.m_kClass),
+    m_kOrder(src.m_kOrder),
+    m_dirty(false),
+    m_tail(0),
+    m_bypass(0),
+    m_quiet(0),
+    m_buffs(0),
+    m_asleep(0)
+{
+}
+
+FilterBatch::~FilterBatch()
+{
+  m_bank.uninit();
+  delete [] m_bypass;
+  delete [] m_quiet;
+  delete [] m_buffs;
+  delete [] m_asleep;
+}
 
+/**
+ * Set up the bank, one filter per channel of each voice.
+ * @return status code.
+ */
+int
+FilterBatch::init()
+{
+  BiquadCoeffs c[BIQUAD_MAX_SECTIONS];
+  int sections;
+  int filters = m_voices * m_channels;
+
+  if (m_channels > _MAX_EFFECT_CHANNELS)
+    {
+      return VERR_OUT_OF_RANGE;
+    }
+
+  m_bypass = new (MEM_TAG_EFFECTOR_INSTANCE, std::nothrow) bool[m_voices];
+  m_quiet = new (MEM_TAG_EFFECTOR_INSTANCE, std::nothrow) size_t[m_voices];
+  m_buffs = new (MEM_TAG_EFFECTOR_INSTANCE, std::nothrow) Sample_t *[filters];
+  m_asleep = new (MEM_TAG_EFFECTOR_INSTANCE, std::nothrow) bool[m_voices];
+  if (!m_bypass || !m_quiet || !m_buffs || !m_asleep)
+    {
+      return VERR_ALLOC_MEMORY;
+    }
+  for (int v = 0; v < m_voices; v++)
+    {
+      m_bypass[v] = false;
+      m_quiet[v] = 0;
+    }
+
+  int rc = initBiquadTable();
+  if (V_SUCCESS(rc))
+    rc = m_bank.init(filters);
+  if (V_SUCCESS(rc))
+    rc = lookupButterworth((int)m_kClass, m_rate, m_kFreq, m_kQu, (int)m_kOrder, c, &sections);
+  if (V_FAILURE(rc))
+    {
+      return rc;
+    }
+
+  updateParameters(false);
+  return VINF_SUCCEEDED;
+}
+
+void
+FilterBatch::gate(int voice, bool gate)
+{
+}
+
+void
+FilterBatch::bypass(int voice, bool y)
+{
+  V_ASSERT(voice >= 0 && voice < m_voices);
+  m_bypass[voice] = y;
+}
+
+/*
+ * Clear the filters of a voice, it has nothing left to ring out.
+ */
+void
+FilterBatch::reset(int voice)
+{
+  V_ASSERT(voice >= 0 && voice < m_voices);
+
+  for (int c = 0; c < m_channels; c++)
+    {
+      m_bank.reset(voice * m_channels + c);
+    }
+  m_quiet[voice] = m_tail;
+}
+
+//------------------------------------------------------------------------
+void
+FilterBatch::setParameter(int index, float v)
+{
+  switch ( index )
+  {
+    case kFreq:   m_kFreq = v; break;
+    case kQu:     m_kQu   = v; break;
+    case kClass:  m_kClass = v; break;
+    case kOrder:  m_kOrder = v; break;
+  }
+  m_dirty = true;
+}
+
+/**
+ * Recalculate the filters of all the voices, see
+ * FilterImpl::updateParameters().
+ * @param smooth      Glide to the new coefficients over the next block.
+ */
+void
+FilterBatch::updateParameters(bool smooth)
+{
+  BiquadCoeffs c[BIQUAD_MAX_SECTIONS];
+  int sections;
+  if (V_FAILURE(lookupButterworth((int)m_kClass, m_rate, m_kFreq, m_kQu, (int)m_kOrder, c, &sections)))
+    {
+      return;
+    }
+
+  for (int i = 0; i < m_bank.filters(); i++)
+    {
+      m_bank.setFilter(i, c, sections, smooth);
+    }
+  m_tail = biquadTail(c, sections, EFFECT_TAIL_FLOOR);
+}
+
+/**
+ * Process the buffers of the voices. The lanes of the voices asleep
+ * are left idle.
+ * @param voices      Indexes of the voices.
+ * @param buffs       The buffer of each voice.
+ * @param silent      Whether each buffer is all zero, updated.
+ * @param count       The number of voices.
+ * @param nframes     How many frames are there in each buffer.
+ * @return status code.
+ */
+int
+FilterBatch::process(const int *voices, Sample_t *const *buffs, bool *silent, int count, size_t nframes)
+{
+  Sample_t idle[_EFFECT_BLOCK_FRAMES * _MAX_EFFECT_CHANNELS];
+  int filters = m_voices * m_channels;
+  bool *asleep = m_asleep;
+
+  if (m_dirty)
+    {
+      m_dirty = false;
+      updateParameters(true);
+    }
+
+  for (int i = 0; i < count; i++)
+    {
+      int v = voices[i];
+      V_ASSERT(v >= 0 && v < m_voices);
+
+      asleep[i] = m_bypass[v];
+      if (!silent[i])
+        m_quiet[v] = 0;
+      else if (m_quiet[v] >= m_tail)
+        asleep[i] = true;
+      else
+        m_quiet[v] += nframes;
+
+      if (!asleep[i])
+        silent[i] = false;
+    }
+
+  for (size_t done = 0; done < nframes; )
+    {
+      size_t n = nframes - done < _EFFECT_BLOCK_FRAMES ? nframes - done : _EFFECT_BLOCK_FRAMES;
+
+      for (int i = 0; i < filters; i++)
+        {
+          m_buffs[i] = 0;
+        }
+      for (int i = 0; i < count; i++)
+        {
+          int v = voices[i];
+
+          if (asleep[i])
+            continue;
+          for (int c = 0; c < m_channels; c++)
+            m_buffs[v * m_channels + c] = buffs[i] + done * m_channels + c;
+        }
+
+      m_bank.process(m_buffs, n, m_channels, idle);
+      done += n;
+    }
   return VINF_SUCCEEDED;
 }
 
@@ -209,6 +209,29 @@ InverterImpl::gate(bool gate)
 {
 }
 
+/**
+ * Swapping the channels of the silence is the silence.
+ * @return the number of frames.
+ */
+size_t
+InverterImpl::tail()
+{
+  return 0;
+}
+
+/**
+ * Swapping works on each frame on its own, see IEffector::pointOp().
+ * @param op          Where to store the operation.
+ * @param nframes     How many frames.
+ * @return status code.
+ */
+int
+InverterImpl::pointOp(PointOp *op, size_t nframes)
+{
+  op->kind = (m_bypass || !m_invert) ? POINT_OP_NONE : POINT_OP_SWAP;
+  return VINF_SUCCEEDED;
+}
+
 /**
  * Process the audio buffer.
  * @param buff        Pointer to the target buffer.
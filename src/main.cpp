@@ -25,9 +25,11 @@
 #include "util/error.h"
 #include "util/log.h"
 #include "util/timer.h"
+#include "util/string.h"
 
 #include "memory/mmu.h"
 #include "wavetable/wavetable.h"
+#include "wavetable/wavebank.h"
 #include "mixer/mixer.h"
 #include "audiosys/audiosystem.h"
 #include "dsp/effect.h"
@@ -38,6 +40,34 @@
 
 #define DEBUG_LEVEL 0
 
+/*
+ * The number of voices, which the CPU of the deployment has to sustain.
+ * It can be given by "-p N" as well.
+ */
+#if !defined(CONF_POLYPHONY)
+# define CONF_POLYPHONY _DEFAULT_POLYPHONY_NUM
+#endif
+
+/*
+ * Whether the asynchronous streams read the bank with O_DIRECT, the
+ * bank had better be compiled aligned (compiler -cwa).
+ */
+#if !defined(CONF_STREAM_DIRECT)
+# define CONF_STREAM_DIRECT 0
+#endif
+
+/*
+ * Preload the whole bank compressed, WAVE_CODEC_RICE (lossless) or
+ * WAVE_CODEC_ADPCM (4 bits, lossy), 0 = the sample cache holds PCM.
+ * CONF_SAMPLE_CACHE_SIZE limits it as well, 0 = all the samples.
+ */
+#if !defined(CONF_SAMPLE_CACHE_CODEC)
+# define CONF_SAMPLE_CACHE_CODEC 0
+#endif
+#if CONF_SAMPLE_CACHE_CODEC && !defined(CONF_SAMPLE_CACHE_SIZE)
+# define CONF_SAMPLE_CACHE_SIZE 0
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 
 
@@ -65,10 +95,24 @@ int main(int argc, char *argv[])
   ports     = new midi::Ports;
   mdev      = new mididev::MidiDev;
 
+  int polyphony = CONF_POLYPHONY;
+  for (int n = 1; n + 1 < argc; n++)
+    {
+      if (std::strcmp(argv[n], "-p") == 0)
+        {
+          rc = stringToInteger(argv[n + 1], (int)std::strlen(argv[n + 1]), &polyphony);
+          if (V_FAILURE(rc))
+            {
+              LOG(ERR) << "invalid polyphony: " << argv[n + 1] << "\n";
+              return 1;
+            }
+        }
+    }
+
   /*
    * initiate the wave table
    */
-  rc = wavetable->init();
+  rc = wavetable->init(polyphony);
   if (V_SUCCESS(rc))
     {
       rc = wavetable->LoadTimbres("./../samples/qin2.syntab");
@@ -76,6 +120,52 @@ int main(int argc, char *argv[])
         {
           LOG(INFO) << "successed.\n";
 
+#if CONF_SAMPLE_CACHE_CODEC
+          /*
+           * Keep the whole bank resident in a compressed form, the
+           * voices decode it as they read.
+           */
+          rc = wavetable->CompressSamples(CONF_SAMPLE_CACHE_SIZE, CONF_SAMPLE_CACHE_CODEC,
+                                          MEM_LARGE_HUGETLB | MEM_LARGE_THP);
+          if (V_FAILURE(rc))
+            {
+              LOG(WARNING) << "failed on compressing the samples, reading them from the disk.\n";
+            }
+#elif defined(CONF_SAMPLE_CACHE_SIZE) && CONF_SAMPLE_CACHE_SIZE > 0
+          /*
+           * Keep the samples resident, the store is backed by huge pages
+           * where the system has them.
+           */
+          rc = wavetable->CacheSamples(CONF_SAMPLE_CACHE_SIZE, MEM_LARGE_HUGETLB | MEM_LARGE_THP);
+          if (V_FAILURE(rc))
+            {
+              LOG(WARNING) << "failed on caching the samples, reading them from the disk.\n";
+            }
+#endif
+
+#if defined(CONF_BLOCK_CACHE_SIZE) && CONF_BLOCK_CACHE_SIZE > 0
+          /*
+           * Keep the blocks of the samples streamed from the disk, the
+           * notes played again are read from the memory.
+           */
+          rc = wavetable->CacheBlocks(CONF_BLOCK_CACHE_SIZE);
+          if (V_FAILURE(rc))
+            {
+              LOG(WARNING) << "failed on allocating the block cache, reading the disk directly.\n";
+            }
+#endif
+
+#if defined(CONF_STREAM_ASYNC) && CONF_STREAM_ASYNC
+          /*
+           * Read the samples ahead of the voices through io_uring.
+           */
+          rc = wavetable->InitStreams(CONF_STREAM_DIRECT);
+          if (V_FAILURE(rc))
+            {
+              LOG(WARNING) << "asynchronous streams are unavailable, reading the samples synchronously.\n";
+            }
+#endif
+
           int bps = wavetable->GetBps();
           int rate = wavetable->GetSampleRate();
           int channels = wavetable->GetChannels();
@@ -199,7 +289,6 @@ int main(int argc, char *argv[])
               uint8_t *buf;
               uint8_t *ori;
               Sample_t *samples;
-              Sample_t *samples2;
 
               size_t padsize = 0;
               size_t targetsize = 0;
@@ -210,12 +299,11 @@ int main(int argc, char *argv[])
               size_t a_out_buffer_size = 2048 + MAX_OUTBURST;
               unsigned char *a_out_buffer = 0;
 
-              buf = new (MEM_TAG_AUDIO_BUFFER, std::nothrow) uint8_t[a_out_buffer_size];
-              ori = new (MEM_TAG_AUDIO_BUFFER, std::nothrow) uint8_t[a_out_buffer_size];
-              samples = new (MEM_TAG_AUDIO_BUFFER, std::nothrow) Sample_t[a_out_buffer_size];
-              samples2 = new (MEM_TAG_AUDIO_BUFFER, std::nothrow) Sample_t[a_out_buffer_size];
+              buf = new (MEM_TAG_AUDIO_BUFFER, MEM_ALIGN_CACHELINE, std::nothrow) uint8_t[a_out_buffer_size];
+              ori = new (MEM_TAG_AUDIO_BUFFER, MEM_ALIGN_CACHELINE, std::nothrow) uint8_t[a_out_buffer_size];
+              samples = new (MEM_TAG_AUDIO_BUFFER, MEM_ALIGN_CACHELINE, std::nothrow) Sample_t[a_out_buffer_size];
 
-              if (!buf || !ori || !samples || !samples2)
+              if (!buf || !ori || !samples)
                 {
                   return VERR_ALLOC_MEMORY;
                 }
@@ -227,12 +315,23 @@ int main(int argc, char *argv[])
 
               int polySum = wavetable->GetPipeChannelNum();
 
+              /*
+               * Each voice renders into its own buffer. With the batch
+               * layout the group effectors run once for all the voices.
+               */
+#if defined(CONF_VOICE_BATCH) && CONF_VOICE_BATCH
+              rc = effects->initVoices(polySum, a_out_buffer_size, dsp::VOICE_LAYOUT_BATCH);
+#else
+              rc = effects->initVoices(polySum, a_out_buffer_size, dsp::VOICE_LAYOUT_CHAIN);
+#endif
+
               /*
                * Create effectors.
                */
-              rc = effects->add(
-                  dsp::EFFECT_SCOPE_GROUP,
-                  dsp::ADSRImpl(rate, channels));
+              if (V_SUCCESS(rc))
+                rc = effects->add(
+                    dsp::EFFECT_SCOPE_GROUP,
+                    dsp::ADSRImpl(rate, channels));
 
               if (V_FAILURE(rc))
                 {
@@ -245,13 +344,22 @@ int main(int argc, char *argv[])
               //rc = effects->add(effect::EFFECT_SCOPE_INSTRUMENT, effect::DelayImpl(rate, channels));
               //rc = effects->add(effect::EFFECT_SCOPE_INSTRUMENT, effect::InverterImpl(rate, channels));
 
+              /*
+               * The time based effectors go on the aux buses, all the
+               * voices share one instance there.
+               */
+              if (V_SUCCESS(rc))
+                rc = effects->initAux(a_out_buffer_size);
+              //rc = effects->addAux(0, dsp::DelayImpl(rate, channels));
+              //effects->auxSend(0, MIXER_MAXVOLUME / 4);
+
               if (V_FAILURE(rc))
                 {
                   LOG(ERR) << "failed on setup instrument insert effectors.\n";
                   return 1;
                 }
 
-              for (int j=0;j < 16; j++) {
+              for (int j=0;j < polySum; j++) {
               effects->groupBypass(j, true);
               effects->groupGate(j, true);
               }
@@ -296,8 +404,17 @@ int main(int argc, char *argv[])
                               return 1;
                             }
 
-                          // send it to effectors
-                          effects->groupGate(eventPoly, true);
+                          /*
+                           * Send it to effectors, the envelope opens on
+                           * NoteOn and releases on NoteOff. A voice cut
+                           * off by the note fades out.
+                           */
+                          if (eventPoly >= 0)
+                            {
+                              if (rc == VINF_REPLACED)
+                                effects->declickVoice(eventPoly);
+                              effects->groupGate(eventPoly, !wavetable->PipeReleased(eventPoly));
+                            }
                         }
 
                       padsize = (targetsize > MAX_OUTBURST)?MAX_OUTBURST:targetsize;
@@ -331,41 +448,64 @@ int main(int argc, char *argv[])
 //clock_t clk0, clk1;
 //clk0 = clock();
                           /*
-                           * Rendering the audio data from each channel,
-                           * Specifically, processing the 1st channel to fill in
-                           * the initial data.
+                           * Rendering the audio data of the busy units
+                           * only, the idle ones cost nothing. The voices
+                           * are mixed into the samples after the group
+                           * effectors, the mix is silence if there is
+                           * no voice. The list is walked from the end,
+                           * see GetActivePipes().
                            */
-                          rc = wavetable->ReadPipeChannel(0, ori, samples, outn);
-                      if (V_SUCCESS(rc))
-                        {
-                          rc = effects->processGroup(0, samples, outn, channels);
+                          wavetable::PipeChunk chunk;
+                          const int *active;
+                          int nactive = wavetable->GetActivePipes(&active);
+
+                          rc = VINF_SUCCEEDED;
+                          for (int i = nactive - 1; i >= 0; i--)
+                            {
+                              int nPoly = active[i];
+
+                              rc = wavetable->FetchPipeChannel(nPoly, ori, outn, &chunk);
+                              if (V_FAILURE(rc)) break;
+
+                              rc = effects->renderVoice(nPoly, chunk, outn, channels);
+                              if (V_FAILURE(rc))
+                                {
+                                  LOG(ERR) << "Process the group insert effectors.\n";
+                                  return 1;
+                                }
+                            }
+
+                          /*
+                           * Submit the refills of the voices in one go.
+                           */
+                          if (V_SUCCESS(rc))
+                            rc = wavetable->PollStreams();
 
                           if (V_SUCCESS(rc))
                             {
-                              for (int nPoly = polySum -1; nPoly; nPoly--)
+                              rc = effects->mixVoices(samples, outn, channels);
+                              if (V_FAILURE(rc))
                                 {
-                                  if (!wavetable->PipeBusy(nPoly))
-                                    continue;
-
-                                  rc = wavetable->ReadPipeChannel(nPoly, ori, samples2, outn);
-                                  if (V_FAILURE(rc)) break;
-
-                                  rc = effects->processGroup(nPoly, samples2, outn, channels);
-                                  if (V_FAILURE(rc))
-                                    {
-                                      LOG(ERR) << "Process the group insert effectors.\n";
-                                      return 1;
-                                    }
-
-                                  rc = mixer->MixAudio(samples, samples2, outn, MIXER_MAXVOLUME);
-                                  if (V_FAILURE(rc))
-                                    {
-                                      LOG(ERR) << "failed on mixing the audio.\n";
-                                      return 1;
-                                    }
+                                  LOG(ERR) << "failed on mixing the audio.\n";
+                                  return 1;
+                                }
+
+                              /*
+                               * A voice decayed away needs no more data,
+                               * free its unit instead of streaming the
+                               * rest of the sample. The others tell how
+                               * loud they are for the voice stealing.
+                               */
+                              nactive = wavetable->GetActivePipes(&active);
+                              for (int i = nactive - 1; i >= 0; i--)
+                                {
+                                  int nPoly = active[i];
+                                  if (effects->voiceDecayed(nPoly))
+                                    wavetable->ClosePipeChannel(nPoly);
+                                  else
+                                    wavetable->SetPipeLoudness(nPoly, effects->voiceLevel(nPoly));
                                 }
                             }
-                        }
 
                           /*
                            * The audio is at the end?
@@ -381,11 +521,25 @@ int main(int argc, char *argv[])
                               LOG(INFO) << "Audio output truncated at end.\n";
                               break;
                             }
+                          bool silent = rc == VINF_SILENCE;
+
+                          /*
+                           * Return the aux buses to the master.
+                           */
+                          rc = effects->processAux(samples, outn, channels);
+                          if (V_FAILURE(rc))
+                            {
+                              LOG(ERR) << "Process the aux buses.\n";
+                              return 1;
+                            }
+                          if (rc != VINF_SILENCE)
+                            silent = false;
 
                           /*
-                           * Apply the instrument insert effectors.
+                           * Apply the instrument insert effectors, they
+                           * sleep once their tails have passed.
                            */
-                          rc = effects->processInstrument(samples, outn, channels);
+                          rc = effects->processInstrument(samples, outn, channels, silent);
                           if (V_FAILURE(rc))
                             {
                               return 1;
@@ -454,6 +608,43 @@ int main(int argc, char *argv[])
               /* END - KEY AUDIO PIPE */
               /******************************************************************************/
 
+              wavetable::VoiceStats vstats;
+              wavetable->GetVoiceStats(&vstats);
+              LOG(INFO) << "voices: notes = " << vstats.notes <<
+                  ", stolen = " << vstats.stolen <<
+                  ", peak = " << vstats.peak << "\n";
+
+              wavetable::PrefetchStats pstats;
+              wavetable->GetPrefetchStats(&pstats);
+              LOG(INFO) << "prefetch: issued = " << pstats.issued <<
+                  ", hits = " << pstats.hits <<
+                  ", misses = " << pstats.misses <<
+                  ", resident = " << pstats.resident << "\n";
+
+              wavetable::BlockCacheStats bstats;
+              wavetable->GetBlockCacheStats(&bstats);
+              LOG(INFO) << "block cache: hits = " << bstats.hits <<
+                  ", misses = " << bstats.misses <<
+                  ", evictions = " << bstats.evictions <<
+                  ", resident = " << bstats.resident / 1024 << " KBytes\n";
+
+              wavetable::StreamStats sstats;
+              wavetable->GetStreamStats(&sstats);
+              LOG(INFO) << "streams: submitted = " << sstats.submitted <<
+                  ", completed = " << sstats.completed <<
+                  ", syscalls = " << sstats.syscalls <<
+                  ", stalls = " << sstats.stalls <<
+                  ", peak = " << sstats.peak << "\n";
+
+              wavetable::SampleCacheStats cstats;
+              wavetable->GetSampleCacheStats(&cstats);
+              if (cstats.resident)
+                {
+                  LOG(INFO) << "sample cache: resident = " << cstats.resident / 1024 <<
+                      " KBytes, pcm = " << cstats.original / 1024 <<
+                      " KBytes, ratio = " << (float)cstats.original / cstats.resident << "\n";
+                }
+
             }
         }
       else
@@ -466,6 +657,17 @@ int main(int argc, char *argv[])
 
   LOG(INFO) << "current memory: " << GetBytesMemAllocated() / 1024 << " KBytes.\n";
 
+  for (int tag = 0; tag < _MAX_MEM_TAG_NUM; tag++)
+    {
+      MemoryStats stats;
+      GetMemoryStats((MemoryTag)tag, &stats);
+      LOG(INFO) << "memory tag #" << tag << ": current = " << stats.current / 1024 <<
+          " KBytes, peak = " << stats.peak / 1024 <<
+          " KBytes, allocs = " << stats.allocs <<
+          ", huge pages = " << stats.huge / 1024 <<
+          " KBytes, advised = " << stats.advised / 1024 << " KBytes\n";
+    }
+
   ReleaseReservedMem();
 
   return 0;
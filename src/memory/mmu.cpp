@@ -25,6 +25,7 @@
 *******************************************************************************/
 #include <new>
 #include <cstdlib>
+#include <cstddef>
 
 #include "util/assert.h"
 #include "util/types.h"
@@ -32,12 +33,16 @@
 
 #include "memory/mmu.h"
 
+#if OS(LINUX)
+# include <sys/mman.h>
+#endif
+
 /*******************************************************************************
 *   Typedefs and structures                                                    *
 *******************************************************************************/
 
 /*
- * Memory track header
+ * Memory track header, it is placed just before the user block.
  */
 struct MEMTRACKHDR
 {
@@ -45,28 +50,227 @@ struct MEMTRACKHDR
   uint32_t      magic;
   /** tag description */
   MemoryTag     tag;
-  /** the length of this block */
-  std::size_t   len;
+  /** the number of bytes accounted for this block */
+  std::size_t   size;
+  /** distance from the start of raw block to the user block */
+  std::size_t   offset;
 };
 
 #define MEMBLOCK_MAGIC (0x514d424b)
 
+/*
+ * Statistics shard. Each of them is padded to a cache line so
+ * that threads updating different shards never share a line.
+ */
+struct MEMSTATSHARD
+{
+  volatile std::size_t current[_MAX_MEM_TAG_NUM];
+  volatile std::size_t allocs[_MAX_MEM_TAG_NUM];
+  /** current of the shard when the peak was last raised, see accountAlloc() */
+  volatile std::size_t mark[_MAX_MEM_TAG_NUM];
+} __attribute__((aligned(MEM_CACHELINE_SIZE)));
+
+/*
+ * Large block header, it takes the first cache line of the mapping
+ * so the user block keeps the cache line alignment.
+ */
+struct LARGEMEMHDR
+{
+  /** magic number for debugging */
+  uint32_t      magic;
+  /** tag description */
+  MemoryTag     tag;
+  /** the number of bytes mapped */
+  std::size_t   size;
+  /** the number of bytes backed by the explicit huge pages */
+  std::size_t   huge;
+  /** the number of bytes advised to the transparent huge pages */
+  std::size_t   advised;
+  /** whether the block was mapped rather than allocated by malloc */
+  bool          mapped;
+} __attribute__((aligned(MEM_CACHELINE_SIZE)));
+
+#define LARGEBLOCK_MAGIC (0x514d4c47)
+
+#if COMPILER(GCC)
+# define MEM_ATOMIC_ADD(p, v)   __sync_fetch_and_add((p), (v))
+# define MEM_ATOMIC_SUB(p, v)   __sync_fetch_and_sub((p), (v))
+# define MEM_ATOMIC_CAS(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+# define MEM_THREAD_LOCAL       __thread
+#else
+# define MEM_ATOMIC_ADD(p, v)   (*(p) += (v))
+# define MEM_ATOMIC_SUB(p, v)   (*(p) -= (v))
+# define MEM_ATOMIC_CAS(p, o, n) (*(p) = (n), true)
+# define MEM_THREAD_LOCAL
+#endif
+
 
 /*******************************************************************************
 *   Global Variables                                                           *
 *******************************************************************************/
 
-static std::size_t  bytesMemAllocated[_MAX_MEM_TAG_NUM] = {0};
+static MEMSTATSHARD memStatShards[MEM_STAT_SHARDS];
+static volatile std::size_t memPeak[_MAX_MEM_TAG_NUM] = {0};
+static volatile std::size_t memHuge[_MAX_MEM_TAG_NUM] = {0};
+static volatile std::size_t memAdvised[_MAX_MEM_TAG_NUM] = {0};
+static volatile int memShardSeed = 0;
+
+/*
+ * Preferred alignment of each tag. The audio and effector buffers are
+ * walked by the vector kernels, so keep them at the cache line.
+ */
+static const std::size_t memTagAlignment[_MAX_MEM_TAG_NUM] =
+{
+  MEM_ALIGNMENT,        /* MEM_TAG_DEFAULT */
+  MEM_ALIGNMENT,        /* MEM_TAG_RESERVED */
+  MEM_CACHELINE_SIZE,   /* MEM_TAG_AUDIO_BUFFER */
+  MEM_ALIGNMENT,        /* MEM_TAG_EFFECTOR_INSTANCE */
+  MEM_CACHELINE_SIZE,   /* MEM_TAG_EFFECTOR_BUFFER */
+  MEM_CACHELINE_SIZE    /* MEM_TAG_SAMPLE_CACHE */
+};
+static MEM_THREAD_LOCAL int memShardIndex = -1;
 static char *reservedMem = 0;
 
 ////////////////////////////////////////////////////////////////////////////////
 
-inline void
-initMemTrackHdr(MEMTRACKHDR *src, std::size_t count, MemoryTag tag)
+/*
+ * Get the statistics shard of the calling thread.
+ */
+static inline MEMSTATSHARD *
+currentShard()
 {
-  src->magic = MEMBLOCK_MAGIC;
-  src->tag = tag;
-  src->len = count;
+  if (UNLIKELY(memShardIndex < 0))
+    {
+      memShardIndex = MEM_ATOMIC_ADD(&memShardSeed, 1) % MEM_STAT_SHARDS;
+    }
+  return &memStatShards[memShardIndex];
+}
+
+/*
+ * Sum up the current bytes of a tag over all the shards.
+ */
+static inline std::size_t
+sumCurrent(MemoryTag tag)
+{
+  std::size_t total = 0;
+  for (int i = 0; i < MEM_STAT_SHARDS; i++)
+    {
+      total += memStatShards[i].current[tag];
+    }
+  return total;
+}
+
+/*
+ * Raise the high-water mark of a tag to the sum of the shards. The sum
+ * is not a snapshot when other threads are allocating, but it never
+ * exceeds the real peak.
+ */
+static inline void
+raisePeak(MemoryTag tag)
+{
+  std::size_t now = sumCurrent(tag);
+  std::size_t peak;
+  while (now > (peak = memPeak[tag]))
+    {
+      if (MEM_ATOMIC_CAS(&memPeak[tag], peak, now))
+        break;
+    }
+}
+
+static inline void
+accountAlloc(MemoryTag tag, std::size_t size)
+{
+  MEMSTATSHARD *shard = currentShard();
+
+  MEM_ATOMIC_ADD(&shard->current[tag], size);
+  MEM_ATOMIC_ADD(&shard->allocs[tag], 1);
+  std::size_t now = shard->current[tag];
+
+  /*
+   * Summing the shards touches the lines of the other threads, so only
+   * do it once the shard has grown by MEM_PEAK_STEP since the last time.
+   * The peak may miss up to a step per shard, GetMemoryStats() catches
+   * up with the current sum.
+   */
+  std::ptrdiff_t grown = (std::ptrdiff_t)(now - shard->mark[tag]);
+  if (grown < 0)
+    {
+      shard->mark[tag] = now; // shrunk since, follow it down
+    }
+  else if (grown >= MEM_PEAK_STEP)
+    {
+      shard->mark[tag] = now;
+      raisePeak(tag);
+    }
+}
+
+/*
+ * The block may be released by another thread than the one allocated it,
+ * so a single shard could wrap around, but the sum is still correct.
+ */
+static inline void
+accountFree(MemoryTag tag, std::size_t size)
+{
+  MEM_ATOMIC_SUB(&currentShard()->current[tag], size);
+}
+
+/*
+ * Inner, allocate a tracked block.
+ * @param count         The number of bytes requested.
+ * @param tag           Tag description of memory block.
+ * @param alignment     Alignment of the user block. Power of two!
+ *                      0 = the preferred alignment of tag.
+ * @return 0 failed.
+ * @return !=0 Pointer to the user block.
+ */
+static void *
+allocTracked(std::size_t count, MemoryTag tag, std::size_t alignment)
+{
+  V_ASSERT(tag >= MEM_TAG_DEFAULT && tag < _MAX_MEM_TAG_NUM);
+  V_ASSERT(!(alignment & (alignment - 1)));
+
+  if (alignment < memTagAlignment[tag])
+    alignment = memTagAlignment[tag];
+
+  register std::size_t size = count + sizeof(MEMTRACKHDR) + alignment - 1;
+  char *raw = (char*)malloc(size);
+  if (!raw)
+    {
+      return 0;
+    }
+
+  char *user = (char*)ALIGN_PTR(raw + sizeof(MEMTRACKHDR), alignment);
+  MEMTRACKHDR *p = (MEMTRACKHDR*)user - 1;
+
+  p->magic = MEMBLOCK_MAGIC;
+  p->tag = tag;
+  p->size = size;
+  p->offset = user - raw;
+
+  accountAlloc(tag, size);
+
+  return (void*)user;
+}
+
+/*
+ * Inner, release a tracked block.
+ * @param pointer       Pointer to the user block.
+ */
+static void
+freeTracked(void *pointer)
+{
+  if (!pointer)
+    return;
+
+  MEMTRACKHDR *p = (MEMTRACKHDR*)pointer - 1;
+
+  V_ASSERT(p->magic == MEMBLOCK_MAGIC);
+  V_ASSERT(p->tag >= MEM_TAG_DEFAULT && p->tag < _MAX_MEM_TAG_NUM);
+
+  p->magic = 0;
+  accountFree(p->tag, p->size);
+
+  free((char*)pointer - p->offset);
 }
 
 /*
@@ -77,23 +281,13 @@ initMemTrackHdr(MEMTRACKHDR *src, std::size_t count, MemoryTag tag)
 void *
 operator new(std::size_t count, MemoryTag tag) throw(std::bad_alloc)
 {
-  register std::size_t size = count + sizeof(MEMTRACKHDR);
-  MEMTRACKHDR *p = (MEMTRACKHDR*)malloc(size);
+  void *p = allocTracked(count, tag, MEM_ALIGN_DEFAULT);
   if (!p)
     {
       std::bad_alloc e;
       throw(e);
     }
-
-  initMemTrackHdr(p, count, tag); p++;
-
-  V_ASSERT( count < MEM_ALIGNMENT ||
-            !((uintptr_t)p & (MEM_ALIGNMENT - 1)) ||
-            ( (count & MEM_ALIGNMENT) + ((uintptr_t)p & MEM_ALIGNMENT)) == MEM_ALIGNMENT );
-
-  bytesMemAllocated[tag] += size;
-
-  return (void*)(p);
+  return p;
 }
 
 void *
@@ -105,19 +299,7 @@ operator new(std::size_t count) throw(std::bad_alloc)
 void *
 operator new(std::size_t count, MemoryTag tag, const std::nothrow_t&t) throw()
 {
-  register std::size_t size = count + sizeof(MEMTRACKHDR);
-  MEMTRACKHDR *p = (MEMTRACKHDR*)malloc(size);
-  if (p)
-    {
-      initMemTrackHdr(p, count, tag); p++;
-
-      V_ASSERT( count < MEM_ALIGNMENT ||
-                !((uintptr_t)p & (MEM_ALIGNMENT - 1)) ||
-                ( (count & MEM_ALIGNMENT) + ((uintptr_t)p & MEM_ALIGNMENT)) == MEM_ALIGNMENT );
-
-      bytesMemAllocated[tag] += size;
-    }
-  return (void*)p;
+  return allocTracked(count, tag, MEM_ALIGN_DEFAULT);
 }
 
 void *
@@ -150,18 +332,40 @@ operator new[](std::size_t count, const std::nothrow_t&t) throw()
   return ::operator new(count, MEM_TAG_DEFAULT, t);
 }
 
-void
-operator delete(void* pointer)
+void *
+operator new(std::size_t count, MemoryTag tag, MemoryAlign align) throw(std::bad_alloc)
 {
-  MEMTRACKHDR *p = (MEMTRACKHDR*)pointer;
-  p--;
+  void *p = allocTracked(count, tag, align);
+  if (!p)
+    {
+      std::bad_alloc e;
+      throw(e);
+    }
+  return p;
+}
 
-  V_ASSERT(p->magic == MEMBLOCK_MAGIC);
-  V_ASSERT(p->tag >= MEM_TAG_DEFAULT && p->tag < _MAX_MEM_TAG_NUM);
+void *
+operator new(std::size_t count, MemoryTag tag, MemoryAlign align, const std::nothrow_t&t) throw()
+{
+  return allocTracked(count, tag, align);
+}
 
-  bytesMemAllocated[p->tag] -= p->len;
+void *
+operator new[](std::size_t count, MemoryTag tag, MemoryAlign align) throw(std::bad_alloc)
+{
+  return ::operator new(count, tag, align);
+}
 
-  free(pointer);
+void *
+operator new[](std::size_t count, MemoryTag tag, MemoryAlign align, const std::nothrow_t&t) throw()
+{
+  return ::operator new(count, tag, align, t);
+}
+
+void
+operator delete(void* pointer)
+{
+  freeTracked(pointer);
 }
 
 void
@@ -170,6 +374,188 @@ operator delete[](void* pointer)
   ::operator delete(pointer);
 }
 
+void
+operator delete(void *pointer, MemoryTag tag) throw()
+{
+  freeTracked(pointer);
+}
+
+void
+operator delete(void *pointer, MemoryTag tag, const std::nothrow_t&t) throw()
+{
+  freeTracked(pointer);
+}
+
+void
+operator delete[](void *pointer, MemoryTag tag) throw()
+{
+  freeTracked(pointer);
+}
+
+void
+operator delete[](void *pointer, MemoryTag tag, const std::nothrow_t&t) throw()
+{
+  freeTracked(pointer);
+}
+
+void
+operator delete(void *pointer, MemoryTag tag, MemoryAlign align) throw()
+{
+  freeTracked(pointer);
+}
+
+void
+operator delete(void *pointer, MemoryTag tag, MemoryAlign align, const std::nothrow_t&t) throw()
+{
+  freeTracked(pointer);
+}
+
+void
+operator delete[](void *pointer, MemoryTag tag, MemoryAlign align) throw()
+{
+  freeTracked(pointer);
+}
+
+void
+operator delete[](void *pointer, MemoryTag tag, MemoryAlign align, const std::nothrow_t&t) throw()
+{
+  freeTracked(pointer);
+}
+
+/**
+ * Get the preferred alignment of a memory tag.
+ * @param tag           Tag description of memory block.
+ * @return the alignment in bytes.
+ */
+std::size_t
+GetMemTagAlignment(MemoryTag tag)
+{
+  V_ASSERT(tag >= MEM_TAG_DEFAULT && tag < _MAX_MEM_TAG_NUM);
+  return memTagAlignment[tag];
+}
+
+/**
+ * Allocate a large block, optionally backed by huge pages so that the
+ * TLB can cover it with a few entries. If the huge pages are unavailable
+ * this falls back to the normal pages silently, and if the mapping fails
+ * as well to the normal heap.
+ * The large blocks are NOT compatible with delete, use FreeLargeMem().
+ *
+ * @param size          The number of bytes requested.
+ * @param tag           Tag description of memory block.
+ * @param flags         MEM_LARGE_* flags.
+ * @return 0 failed.
+ * @return !=0 Pointer to the user block, aligned at the cache line.
+ */
+void *
+AllocLargeMem(std::size_t size, MemoryTag tag, int flags)
+{
+  V_ASSERT(tag >= MEM_TAG_DEFAULT && tag < _MAX_MEM_TAG_NUM);
+
+  LARGEMEMHDR *p = 0;
+  std::size_t mapsize = size + sizeof(LARGEMEMHDR);
+  std::size_t huge = 0;
+  std::size_t advised = 0;
+  bool mapped = false;
+
+#if OS(LINUX)
+  if (flags & (MEM_LARGE_HUGETLB | MEM_LARGE_THP))
+    {
+      std::size_t hugesize = ALIGN_SIZE(mapsize, MEM_HUGEPAGE_SIZE);
+
+# ifdef MAP_HUGETLB
+      if (flags & MEM_LARGE_HUGETLB)
+        {
+          void *m = mmap(0, hugesize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+          if (m != MAP_FAILED)
+            {
+              p = (LARGEMEMHDR *)m;
+              huge = hugesize;
+            }
+        }
+# endif
+      if (!p)
+        {
+          void *m = mmap(0, hugesize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+          if (m != MAP_FAILED)
+            {
+              p = (LARGEMEMHDR *)m;
+# ifdef MADV_HUGEPAGE
+              if (madvise(m, hugesize, MADV_HUGEPAGE) == 0)
+                {
+                  advised = hugesize;
+                }
+# endif
+            }
+        }
+      if (p)
+        {
+          mapsize = hugesize;
+          mapped = true;
+        }
+    }
+#endif
+
+  if (!p)
+    {
+      p = (LARGEMEMHDR *)allocTracked(mapsize, tag, MEM_ALIGN_CACHELINE);
+      if (!p)
+        {
+          return 0;
+        }
+    }
+
+  p->magic = LARGEBLOCK_MAGIC;
+  p->tag = tag;
+  p->size = mapsize;
+  p->huge = huge;
+  p->advised = advised;
+  p->mapped = mapped;
+
+  if (mapped)
+    {
+      accountAlloc(tag, mapsize);
+    }
+  MEM_ATOMIC_ADD(&memHuge[tag], huge);
+  MEM_ATOMIC_ADD(&memAdvised[tag], advised);
+
+  return (void *)(p + 1);
+}
+
+/**
+ * Release a large block.
+ * @param pointer       Pointer to the user block returned by AllocLargeMem().
+ */
+void
+FreeLargeMem(void *pointer)
+{
+  if (!pointer)
+    return;
+
+  LARGEMEMHDR *p = (LARGEMEMHDR *)pointer - 1;
+
+  V_ASSERT(p->magic == LARGEBLOCK_MAGIC);
+  V_ASSERT(p->tag >= MEM_TAG_DEFAULT && p->tag < _MAX_MEM_TAG_NUM);
+
+  p->magic = 0;
+  MEM_ATOMIC_SUB(&memHuge[p->tag], p->huge);
+  MEM_ATOMIC_SUB(&memAdvised[p->tag], p->advised);
+
+  if (p->mapped)
+    {
+      accountFree(p->tag, p->size);
+#if OS(LINUX)
+      munmap(p, p->size);
+#endif
+    }
+  else
+    {
+      freeTracked(p);
+    }
+}
+
 /**
  * Allocate the reserved memory for the emergent case.
  * When the memory got exhausted, we will use this reserved memory to
@@ -195,7 +581,8 @@ int AllocReservedMem()
 void
 ReleaseReservedMem()
 {
-  delete reservedMem;
+  delete [] reservedMem;
+  reservedMem = 0;
 }
 
 /**
@@ -207,7 +594,7 @@ std::size_t GetBytesMemAllocated()
   std::size_t total = 0;
   for (int i = 0; i < _MAX_MEM_TAG_NUM; i++)
     {
-      total += bytesMemAllocated[i];
+      total += sumCurrent((MemoryTag)i);
     }
   return total;
 }
@@ -220,5 +607,28 @@ std::size_t GetBytesMemAllocated()
 std::size_t GetBytesMemAllocated(MemoryTag tag)
 {
   V_ASSERT(tag >= MEM_TAG_DEFAULT && tag < _MAX_MEM_TAG_NUM);
-  return bytesMemAllocated[tag];
+  return sumCurrent(tag);
+}
+
+/**
+ * Get the statistics of a memory tag. The shards are aggregated
+ * at there, so don't call this within the audio pipe.
+ * @param tag           Tag description of memory block.
+ * @param stats         Where to store the result.
+ */
+void GetMemoryStats(MemoryTag tag, MemoryStats *stats)
+{
+  V_ASSERT(tag >= MEM_TAG_DEFAULT && tag < _MAX_MEM_TAG_NUM);
+
+  stats->current = 0;
+  stats->allocs = 0;
+  for (int i = 0; i < MEM_STAT_SHARDS; i++)
+    {
+      stats->current += memStatShards[i].current[tag];
+      stats->allocs += memStatShards[i].allocs[tag];
+    }
+  raisePeak(tag);
+  stats->peak = memPeak[tag];
+  stats->huge = memHuge[tag];
+  stats->advised = memAdvised[tag];
 }
@@ -21,6 +21,9 @@
 #include "util/types.h"
 #include "util/error.h"
 #include "util/log.h"
+#include "util/assert.h"
+
+#include "memory/mmu.h"
 
 #include "audiosys/audioformat.h"
 
@@ -31,6 +34,11 @@
 namespace mixer {
 
 
+typedef int32_t mixer_v4si __attribute__((vector_size(16)));
+typedef uint32_t mixer_v4su __attribute__((vector_size(16)));
+
+#define MIXER_VECTOR (sizeof(mixer_v4si) / sizeof(int32_t))
+
 /* The volume ranges from 0 - 128 */
 #define ADJUST_VOLUME(s, v)	(s = (s*v)/MIXER_MAXVOLUME)
 #define ADJUST_VOLUME_U8(s, v)	(s = (((s-128)*v)/MIXER_MAXVOLUME)+128)
@@ -87,6 +95,49 @@ Mixer::MixAudio (Sample_t *dst, const Sample_t *src, uint32_t nsamples, int volu
   return VINF_SUCCEEDED;
 }
 
+/**
+ * Mix the two audio stream at the full volume, the same as MixAudio()
+ * with MIXER_MAXVOLUME. Both buffers must be aligned to the cache line,
+ * like the tagged audio buffers are, the vectors are loaded aligned and
+ * the sums saturate without widening.
+ * @param dst       Pointer to the target buffer.
+ * @param src       Pointer to the source buffer.
+ * @param nsamples  The number of samples.
+ * @return status code.
+ */
+int
+Mixer::MixAligned (Sample_t *dst, const Sample_t *src, uint32_t nsamples)
+{
+  if (sizeof(Sample_t) != sizeof(int32_t))
+    {
+      return MixAudio(dst, src, nsamples, MIXER_MAXVOLUME);
+    }
+
+  V_ASSERT(((uintptr_t)dst | (uintptr_t)src) % MEM_ALIGN_CACHELINE == 0);
+
+  mixer_v4si *d = (mixer_v4si *)MEM_ASSUME_ALIGNED(dst, MEM_ALIGN_CACHELINE);
+  const mixer_v4si *s = (const mixer_v4si *)MEM_ASSUME_ALIGNED(src, MEM_ALIGN_CACHELINE);
+  const mixer_v4si max = { INT32_MAX, INT32_MAX, INT32_MAX, INT32_MAX };
+  uint32_t nvec = nsamples / MIXER_VECTOR;
+
+  for (uint32_t i = 0; i < nvec; i++)
+    {
+      mixer_v4si a = d[i];
+      mixer_v4si b = s[i];
+      mixer_v4si sum = (mixer_v4si)((mixer_v4su)a + (mixer_v4su)b);
+
+      /*
+       * The sum overflowed if its sign differs from both of the
+       * inputs, then it is clipped toward the sign of them.
+       */
+      mixer_v4si ovf = ((a ^ sum) & (b ^ sum)) >> 31;
+      d[i] = (((a >> 31) ^ max) & ovf) | (sum & ~ovf);
+    }
+
+  nvec *= MIXER_VECTOR;
+  return MixAudio(dst + nvec, src + nvec, nsamples - nvec, MIXER_MAXVOLUME);
+}
+
 } // namespace mixer
 
 
@@ -0,0 +1,345 @@
+/** @file
+ * Qin - Block cache of the sample files.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#include "util/misc.h"
+#include "util/types.h"
+#include "util/error.h"
+#include "util/assert.h"
+
+#include "memory/mmu.h"
+
+#include "wavetable/blockcache.h"
+
+#if OS(LINUX)
+# include <errno.h>
+# include <unistd.h>
+#endif
+
+/*
+ * The key of a block, the file in the upper half.
+ */
+#define BLOCK_KEY(file, index) (((uint64_t)(uint32_t)(file) << 32) | (uint32_t)(index))
+#define BLOCK_KEY_INDEX(key) ((uint32_t)(key))
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace wavetable {
+
+/**
+ * Read the bytes at a position of a file, leaving the position of the
+ * stream alone where the system can, so the units sharing a file do
+ * not race on it.
+ * @param fp            The file.
+ * @param pos           Where to read from.
+ * @param dst           Where to store the data.
+ * @param len           The bytes to read.
+ * @return the bytes read, short at the end of the file or on failure.
+ */
+size_t
+readFileAt(FILE *fp, uint64_t pos, void *dst, size_t len)
+{
+#if OS(LINUX)
+  int fd = fileno(fp);
+  size_t done = 0;
+  while (done < len)
+    {
+      ssize_t rd = pread(fd, (uint8_t *)dst + done, len - done, (off_t)(pos + done));
+      if (rd < 0 && errno == EINTR)
+        continue;
+      if (rd <= 0)
+        break;
+      done += (size_t)rd;
+    }
+  return done;
+#elif OS(WIN32)
+  if (_fseeki64(fp, (__int64)pos, SEEK_SET) != 0)
+    return 0;
+  return fread(dst, 1, len, fp);
+#else
+  if (fseeko(fp, (off_t)pos, SEEK_SET) != 0)
+    return 0;
+  return fread(dst, 1, len, fp);
+#endif
+}
+
+BlockCache::BlockCache()
+  : m_store(0),
+    m_blocks(0),
+    m_count(0),
+    m_buckets(0),
+    m_bucketMask(0),
+    m_hand(0)
+{
+  std::memset(&m_stats, 0, sizeof(m_stats));
+}
+
+BlockCache::~BlockCache()
+{
+  uninit();
+}
+
+/**
+ * Allocate the blocks, all of them empty.
+ * @param budget        The bytes of the file data to hold, rounded down
+ *                      to the blocks. 0 = no cache.
+ * @return status code.
+ */
+int
+BlockCache::init(size_t budget)
+{
+  uninit();
+
+  int count = (int)(budget / BLOCK_CACHE_BLOCK_SIZE);
+  if (!count)
+    {
+      return budget ? VERR_OUT_OF_RANGE : VINF_SUCCEEDED;
+    }
+
+  /*
+   * Twice the buckets of the blocks keep the chains short.
+   */
+  unsigned buckets = 1;
+  while (buckets < (unsigned)count * 2)
+    buckets <<= 1;
+
+  m_store = (uint8_t *)AllocLargeMem((size_t)count * BLOCK_CACHE_BLOCK_SIZE, MEM_TAG_SAMPLE_CACHE, MEM_LARGE_THP);
+  m_blocks = new (MEM_TAG_SAMPLE_CACHE, std::nothrow) block[count];
+  m_buckets = new (MEM_TAG_SAMPLE_CACHE, std::nothrow) int[buckets];
+  if (!m_store || !m_blocks || !m_buckets)
+    {
+      uninit();
+      return VERR_ALLOC_MEMORY;
+    }
+
+  for (int i = 0; i < count; i++)
+    {
+      m_blocks[i].key = 0;
+      m_blocks[i].len = 0;
+      m_blocks[i].next = -1;
+      m_blocks[i].valid = false;
+      m_blocks[i].referenced = false;
+    }
+  for (unsigned i = 0; i < buckets; i++)
+    {
+      m_buckets[i] = -1;
+    }
+
+  m_count = count;
+  m_bucketMask = buckets - 1;
+  m_hand = 0;
+  std::memset(&m_stats, 0, sizeof(m_stats));
+  return VINF_SUCCEEDED;
+}
+
+/**
+ * Free the blocks, the cache is disabled.
+ */
+void
+BlockCache::uninit()
+{
+  if (m_store)
+    FreeLargeMem(m_store);
+  delete [] m_blocks;
+  delete [] m_buckets;
+
+  m_store = 0;
+  m_blocks = 0;
+  m_buckets = 0;
+  m_count = 0;
+  m_bucketMask = 0;
+  m_hand = 0;
+  m_stats.resident = 0;
+}
+
+/**
+ * Read the data of a file through the cache.
+ * @param file          The identifier of the file.
+ * @param fp            The file stream to load the missing blocks from.
+ * @param pos           The offset of the data in the file.
+ * @param len           The bytes to read.
+ * @param dst           Where to copy the data if it spans the blocks.
+ * @param data          Where to store the pointer to the data. It points
+ *                      into the block if the data lies in one, and is
+ *                      valid until the next read.
+ * @return status code.
+ */
+int
+BlockCache::read(int file, FILE *fp, uint64_t pos, size_t len, void *dst, const uint8_t **data)
+{
+  V_ASSERT(m_count);
+
+  uint8_t *out = reinterpret_cast<uint8_t *>(dst);
+  *data = out;
+
+  while (len)
+    {
+      uint64_t key = BLOCK_KEY(file, pos / BLOCK_CACHE_BLOCK_SIZE);
+      size_t offset = (size_t)(pos % BLOCK_CACHE_BLOCK_SIZE);
+
+      int index = lookup(key);
+      if (index >= 0)
+        {
+          m_stats.hits++;
+        }
+      else
+        {
+          m_stats.misses++;
+          index = load(key, fp);
+          if (index < 0)
+            {
+              return VERR_READING_FILE;
+            }
+        }
+
+      block *b = &m_blocks[index];
+      b->referenced = true;
+
+      if (offset >= b->len)
+        {
+          return VERR_READING_FILE; // out of the file
+        }
+      size_t n = b->len - offset;
+      if (n > len)
+        n = len;
+
+      const uint8_t *src = m_store + (size_t)index * BLOCK_CACHE_BLOCK_SIZE + offset;
+      if (n == len && out == dst)
+        {
+          *data = src; // all in the block, no copy
+          return VINF_SUCCEEDED;
+        }
+
+      std::memcpy(out, src, n);
+      out += n;
+      pos += n;
+      len -= n;
+    }
+  return VINF_SUCCEEDED;
+}
+
+/**
+ * Get the counters of the cache.
+ * @param stats         Where to store the counters.
+ */
+void
+BlockCache::getStats(BlockCacheStats *stats) const
+{
+  *stats = m_stats;
+}
+
+inline unsigned
+BlockCache::bucketOf(uint64_t key) const
+{
+  return (unsigned)((key * 0x9E3779B97F4A7C15ULL) >> 32) & m_bucketMask;
+}
+
+/*
+ * Find the block of the key, -1 if it is not held.
+ */
+int
+BlockCache::lookup(uint64_t key) const
+{
+  for (int i = m_buckets[bucketOf(key)]; i >= 0; i = m_blocks[i].next)
+    {
+      if (m_blocks[i].key == key)
+        return i;
+    }
+  return -1;
+}
+
+/*
+ * Take the block the hand stops at. A referenced block loses its mark
+ * and the hand moves on, so a block survives a round if it has been read.
+ */
+int
+BlockCache::victim()
+{
+  for (;;)
+    {
+      block *b = &m_blocks[m_hand];
+      int index = m_hand;
+      m_hand = (m_hand + 1) % m_count;
+
+      if (b->valid && b->referenced)
+        {
+          b->referenced = false;
+          continue;
+        }
+      if (b->valid)
+        {
+          unlink(index);
+          m_stats.evictions++;
+        }
+      return index;
+    }
+}
+
+/*
+ * Take the block out of its bucket.
+ */
+void
+BlockCache::unlink(int index)
+{
+  block *b = &m_blocks[index];
+  int *link = &m_buckets[bucketOf(b->key)];
+
+  while (*link != index)
+    {
+      V_ASSERT(*link >= 0);
+      link = &m_blocks[*link].next;
+    }
+  *link = b->next;
+
+  m_stats.resident -= b->len;
+  b->valid = false;
+  b->next = -1;
+}
+
+/*
+ * Read a block from the file, -1 on failure.
+ */
+int
+BlockCache::load(uint64_t key, FILE *fp)
+{
+  int index = victim();
+  block *b = &m_blocks[index];
+
+  uint64_t pos = (uint64_t)BLOCK_KEY_INDEX(key) * BLOCK_CACHE_BLOCK_SIZE;
+  size_t rd = readFileAt(fp, pos, m_store + (size_t)index * BLOCK_CACHE_BLOCK_SIZE, BLOCK_CACHE_BLOCK_SIZE);
+  if (!rd)
+    {
+      return -1;
+    }
+
+  unsigned bucket = bucketOf(key);
+  b->key = key;
+  b->len = rd;
+  b->valid = true;
+  b->referenced = false;
+  b->next = m_buckets[bucket];
+  m_buckets[bucket] = index;
+
+  m_stats.resident += rd;
+  return index;
+}
+
+} // namespace wavetable
@@ -0,0 +1,552 @@
+/** @file
+ * Qin - Decoder of the coded samples.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+#include <cstdlib>
+#include <cstring>
+
+#include "util/types.h"
+#include "util/error.h"
+#include "util/assert.h"
+
+#include "wavetable/codec.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace wavetable {
+
+/*
+ * Reads the bits from the MSB of each byte. The cache is kept full, the
+ * bytes past the end read as zeros and the position tells whether the
+ * block has been overrun.
+ */
+struct bitReader
+{
+  const uint8_t *p;
+  const uint8_t *end;
+  uint64_t       cache;
+  int            bits;
+  size_t         pos;
+};
+
+static inline void
+refill(bitReader *br)
+{
+  while (br->bits <= 56)
+    {
+      if (br->p < br->end)
+        br->cache |= (uint64_t)*br->p++ << (56 - br->bits);
+      br->bits += 8;
+    }
+}
+
+/*
+ * Take n bits, 0 ~ 32, the cache must hold them.
+ */
+static inline uint32_t
+take(bitReader *br, int n)
+{
+  if (!n)
+    return 0;
+  uint32_t v = (uint32_t)(br->cache >> (64 - n));
+  br->cache <<= n;
+  br->bits -= n;
+  br->pos += n;
+  return v;
+}
+
+/*
+ * Decode the Rice coded residuals of a channel into s[from, frames).
+ */
+static int
+decodeResiduals(bitReader *br, int k, int32_t *s, size_t from, size_t frames)
+{
+  for (size_t i = from; i < frames; i++)
+    {
+      refill(br);
+      int q = br->cache ? __builtin_clzll(br->cache) : 64;
+
+      uint32_t u;
+      if (q < WAVE_CODEC_ESCAPE)
+        {
+          take(br, q + 1);
+          refill(br);
+          u = ((uint32_t)q << k) | take(br, k);
+        }
+      else if (q == WAVE_CODEC_ESCAPE)
+        {
+          take(br, q + 1);
+          refill(br);
+          u = take(br, 32);
+        }
+      else
+        {
+          return VERR_INVALID_DATA;
+        }
+
+      s[i] = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+    }
+  return VINF_SUCCEEDED;
+}
+
+/*
+ * Undo the fixed predictor in place, the residuals turn into samples.
+ */
+static void
+restore(int order, int32_t *s, size_t frames)
+{
+  switch (order)
+  {
+    case 1:
+      for (size_t i = 1; i < frames; i++)
+        s[i] += s[i - 1];
+      break;
+    case 2:
+      for (size_t i = 2; i < frames; i++)
+        s[i] += 2 * s[i - 1] - s[i - 2];
+      break;
+    case 3:
+      for (size_t i = 3; i < frames; i++)
+        s[i] += 3 * (s[i - 1] - s[i - 2]) + s[i - 3];
+      break;
+    case 4:
+      for (size_t i = 4; i < frames; i++)
+        s[i] += 4 * (s[i - 1] + s[i - 3]) - 6 * s[i - 2] - s[i - 4];
+      break;
+    default:
+      break;
+  }
+}
+
+/*
+ * Store the samples of a channel into the interleaved little endian
+ * data. The loop has no dependency between the frames, the compiler
+ * vectorizes it.
+ */
+template <int BYTES>
+  static void
+  pack(const int32_t *s, size_t frames, int channels, uint8_t *dst)
+{
+  const size_t stride = (size_t)channels * BYTES;
+
+  for (size_t i = 0; i < frames; i++)
+    {
+      uint32_t v = (uint32_t)s[i];
+      for (int b = 0; b < BYTES; b++)
+        dst[i * stride + b] = (uint8_t)(v >> (8 * b));
+    }
+}
+
+/**
+ * Decode a block of a sample coded by WAVE_CODEC_RICE.
+ * @param src           The coded block.
+ * @param len           Bytes of the coded block.
+ * @param channels      The channels of the sample.
+ * @param bytes         Bytes per sample, 1 ~ 3.
+ * @param frames        The frames of the block, up to WAVE_CODEC_BLOCK_FRAMES.
+ * @param dst           Where to store the data in the format of the bank.
+ * @return VERR_INVALID_DATA if the block is damaged.
+ * @return status code.
+ */
+int
+decodeRiceBlock(const uint8_t *src, size_t len, int channels, int bytes,
+                size_t frames, uint8_t *dst)
+{
+  int32_t s[WAVE_CODEC_BLOCK_FRAMES];
+
+  V_ASSERT(frames <= WAVE_CODEC_BLOCK_FRAMES);
+  if (bytes < 1 || bytes > 3)
+    {
+      return VERR_INVALID_FORMAT;
+    }
+
+  bitReader br;
+  br.p = src;
+  br.end = src + len;
+  br.cache = 0;
+  br.bits = 0;
+  br.pos = 0;
+
+  const int sbits = bytes * 8;
+
+  for (int c = 0; c < channels; c++)
+    {
+      /*
+       * Each channel starts at a byte.
+       */
+      refill(&br);
+      take(&br, (int)((8 - br.pos % 8) % 8));
+
+      uint32_t hdr = take(&br, 8);
+      int order = (int)(hdr >> 5);
+      int k = (int)(hdr & 0x1f);
+      if (order > WAVE_CODEC_MAX_ORDER || (size_t)order > frames || k > 30)
+        {
+          return VERR_INVALID_DATA;
+        }
+
+      for (int i = 0; i < order; i++)
+        {
+          refill(&br);
+          uint32_t v = take(&br, sbits);
+          s[i] = (int32_t)(v << (32 - sbits)) >> (32 - sbits);
+        }
+
+      int rc = decodeResiduals(&br, k, s, order, frames);
+      if (V_FAILURE(rc))
+        {
+          return rc;
+        }
+      if (br.pos > len * 8)
+        {
+          return VERR_INVALID_DATA; // overrun the block
+        }
+
+      restore(order, s, frames);
+
+      switch (bytes)
+      {
+        case 1: pack<1>(s, frames, channels, dst + c); break;
+        case 2: pack<2>(s, frames, channels, dst + c * 2); break;
+        case 3: pack<3>(s, frames, channels, dst + c * 3); break;
+      }
+    }
+  return VINF_SUCCEEDED;
+}
+
+/*
+ * Writes the bits from the MSB of each byte.
+ */
+struct bitWriter
+{
+  uint8_t       *p;
+  uint64_t       cache;
+  int            bits;
+};
+
+/*
+ * Put the low n bits of v, n = 0 ~ 32.
+ */
+static inline void
+put(bitWriter *bw, uint32_t v, int n)
+{
+  if (!n)
+    return;
+  bw->cache = (bw->cache << n) | (v & (0xffffffffu >> (32 - n)));
+  bw->bits += n;
+  while (bw->bits >= 8)
+    {
+      bw->bits -= 8;
+      *bw->p++ = (uint8_t)(bw->cache >> bw->bits);
+    }
+}
+
+/*
+ * Pad the bits with zeros up to a byte.
+ */
+static inline void
+flush(bitWriter *bw)
+{
+  if (bw->bits)
+    put(bw, 0, 8 - bw->bits);
+}
+
+/*
+ * The residual of the fixed predictor of the order at the frame.
+ */
+static inline int32_t
+residual(const int32_t *s, size_t i, int order)
+{
+  switch (order)
+  {
+    case 0: return s[i];
+    case 1: return s[i] - s[i - 1];
+    case 2: return s[i] - 2 * s[i - 1] + s[i - 2];
+    case 3: return s[i] - 3 * (s[i - 1] - s[i - 2]) - s[i - 3];
+    default: return s[i] - 4 * (s[i - 1] + s[i - 3]) + 6 * s[i - 2] + s[i - 4];
+  }
+}
+
+static inline uint32_t
+zigzag(int32_t r)
+{
+  return ((uint32_t)r << 1) ^ (uint32_t)(r >> 31);
+}
+
+/*
+ * Load the samples of a channel from the interleaved little endian data.
+ */
+template <int BYTES>
+  static void
+  unpack(const uint8_t *src, size_t frames, int channels, int32_t *s)
+{
+  const size_t stride = (size_t)channels * BYTES;
+
+  for (size_t i = 0; i < frames; i++)
+    {
+      uint32_t v = 0;
+      for (int b = 0; b < BYTES; b++)
+        v |= (uint32_t)src[i * stride + b] << (8 * (4 - BYTES + b));
+      s[i] = (int32_t)v >> (8 * (4 - BYTES));
+    }
+}
+
+/**
+ * Encode a block of a sample by WAVE_CODEC_RICE. Unlike the compiler,
+ * which tries all the parameters, the order and the parameter are
+ * estimated from the sums of the residuals, so the whole bank can be
+ * coded while loading.
+ * @param src           The data in the format of the bank.
+ * @param channels      The channels of the sample.
+ * @param bytes         Bytes per sample, 1 ~ 3.
+ * @param frames        The frames of the block, up to WAVE_CODEC_BLOCK_FRAMES.
+ * @param dst           Where to store the coded block, WAVE_CODEC_BLOCK_BOUND bytes.
+ * @param len           Where to store the bytes of the coded block.
+ * @return status code.
+ */
+int
+encodeRiceBlock(const uint8_t *src, int channels, int bytes, size_t frames,
+                uint8_t *dst, size_t *len)
+{
+  int32_t s[WAVE_CODEC_BLOCK_FRAMES];
+
+  V_ASSERT(frames <= WAVE_CODEC_BLOCK_FRAMES);
+  if (bytes < 1 || bytes > 3)
+    {
+      return VERR_INVALID_FORMAT;
+    }
+
+  bitWriter bw;
+  bw.p = dst;
+  bw.cache = 0;
+  bw.bits = 0;
+
+  const int sbits = bytes * 8;
+
+  for (int c = 0; c < channels; c++)
+    {
+      switch (bytes)
+      {
+        case 1: unpack<1>(src + c, frames, channels, s); break;
+        case 2: unpack<2>(src + c * 2, frames, channels, s); break;
+        case 3: unpack<3>(src + c * 3, frames, channels, s); break;
+      }
+
+      /*
+       * A Rice code of k costs about n * (k + 1) + sum >> k bits.
+       */
+      int best = 0, bestk = 0;
+      uint64_t bestcost = ~(uint64_t)0;
+      for (int order = 0; order <= WAVE_CODEC_MAX_ORDER && (size_t)order <= frames; order++)
+        {
+          uint64_t sum = 0;
+          for (size_t i = order; i < frames; i++)
+            sum += zigzag(residual(s, i, order));
+
+          uint64_t n = frames - order;
+          for (int k = 0; k <= 30; k++)
+            {
+              uint64_t cost = n * (k + 1) + (sum >> k) + (uint64_t)order * sbits;
+              if (cost < bestcost)
+                {
+                  bestcost = cost;
+                  best = order;
+                  bestk = k;
+                }
+            }
+        }
+
+      flush(&bw);
+      put(&bw, (uint32_t)(best << 5 | bestk), 8);
+      for (int i = 0; i < best; i++)
+        put(&bw, (uint32_t)s[i], sbits);
+
+      for (size_t i = best; i < frames; i++)
+        {
+          uint32_t u = zigzag(residual(s, i, best));
+          uint32_t q = u >> bestk;
+          if (q < WAVE_CODEC_ESCAPE)
+            {
+              put(&bw, 1, q + 1);
+              put(&bw, u, bestk);
+            }
+          else
+            {
+              put(&bw, 1, WAVE_CODEC_ESCAPE + 1);
+              put(&bw, u, 32);
+            }
+        }
+    }
+  flush(&bw);
+
+  *len = bw.p - dst;
+  return VINF_SUCCEEDED;
+}
+
+/*
+ * The steps of IMA ADPCM, and the moves of the step by the codes.
+ */
+static const int16_t g_adpcmSteps[89] =
+{
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41,
+  45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190,
+  209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724,
+  796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272,
+  2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132,
+  7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350,
+  22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t g_adpcmMoves[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+/*
+ * Step the predictor of IMA ADPCM by a code.
+ */
+static inline void
+adpcmStep(int code, int32_t *pred, int *index)
+{
+  int step = g_adpcmSteps[*index];
+  int diff = step >> 3;
+  if (code & 4) diff += step;
+  if (code & 2) diff += step >> 1;
+  if (code & 1) diff += step >> 2;
+
+  int32_t p = (code & 8) ? *pred - diff : *pred + diff;
+  *pred = p < -32768 ? -32768 : (p > 32767 ? 32767 : p);
+
+  int i = *index + g_adpcmMoves[code & 7];
+  *index = i < 0 ? 0 : (i > 88 ? 88 : i);
+}
+
+/**
+ * Decode a block of a 16 bits sample coded by WAVE_CODEC_ADPCM.
+ * @param src           The coded block.
+ * @param len           Bytes of the coded block.
+ * @param channels      The channels of the sample.
+ * @param frames        The frames of the block, up to WAVE_CODEC_BLOCK_FRAMES.
+ * @param dst           Where to store the 16 bits data.
+ * @return VERR_INVALID_DATA if the block is damaged.
+ * @return status code.
+ */
+int
+decodeAdpcmBlock(const uint8_t *src, size_t len, int channels,
+                 size_t frames, uint8_t *dst)
+{
+  V_ASSERT(frames && frames <= WAVE_CODEC_BLOCK_FRAMES);
+  if (len < (size_t)WAVE_ADPCM_BLOCK_BOUND(frames, channels))
+    {
+      return VERR_INVALID_DATA;
+    }
+
+  const size_t stride = (size_t)channels * 2;
+
+  for (int c = 0; c < channels; c++)
+    {
+      /*
+       * Each channel starts with the first sample and the index of
+       * the step, the codes of the rest follow, the low nibble first.
+       */
+      int32_t pred = (int16_t)(src[0] | src[1] << 8);
+      int index = src[2];
+      if (index > 88)
+        {
+          return VERR_INVALID_DATA;
+        }
+      src += 4;
+
+      uint8_t *out = dst + c * 2;
+      out[0] = (uint8_t)pred;
+      out[1] = (uint8_t)(pred >> 8);
+
+      for (size_t i = 1; i < frames; i++)
+        {
+          int code = (src[(i - 1) >> 1] >> (((i - 1) & 1) * 4)) & 0xf;
+          adpcmStep(code, &pred, &index);
+          out += stride;
+          out[0] = (uint8_t)pred;
+          out[1] = (uint8_t)(pred >> 8);
+        }
+      src += frames / 2;
+    }
+  return VINF_SUCCEEDED;
+}
+
+/**
+ * Encode a block of a 16 bits sample by WAVE_CODEC_ADPCM, 4 bits per
+ * sample. The coding is lossy, the predictor follows the decoder so
+ * the error does not build up.
+ * @param src           The 16 bits data.
+ * @param channels      The channels of the sample.
+ * @param frames        The frames of the block, up to WAVE_CODEC_BLOCK_FRAMES.
+ * @param dst           Where to store the coded block, WAVE_ADPCM_BLOCK_BOUND bytes.
+ * @param len           Where to store the bytes of the coded block.
+ * @return status code.
+ */
+int
+encodeAdpcmBlock(const uint8_t *src, int channels, size_t frames,
+                 uint8_t *dst, size_t *len)
+{
+  int32_t s[WAVE_CODEC_BLOCK_FRAMES];
+
+  V_ASSERT(frames && frames <= WAVE_CODEC_BLOCK_FRAMES);
+  *len = WAVE_ADPCM_BLOCK_BOUND(frames, channels);
+  memset(dst, 0, *len);
+
+  for (int c = 0; c < channels; c++)
+    {
+      unpack<2>(src + c * 2, frames, channels, s);
+
+      /*
+       * Start with the step closest to the first move.
+       */
+      int32_t pred = s[0];
+      int index = 0;
+      if (frames > 1)
+        {
+          int32_t d = abs(s[1] - s[0]);
+          while (index < 88 && g_adpcmSteps[index + 1] <= d)
+            index++;
+        }
+
+      dst[0] = (uint8_t)pred;
+      dst[1] = (uint8_t)(pred >> 8);
+      dst[2] = (uint8_t)index;
+      dst += 4;
+
+      for (size_t i = 1; i < frames; i++)
+        {
+          int step = g_adpcmSteps[index];
+          int32_t diff = s[i] - pred;
+          int code = 0;
+          if (diff < 0)
+            {
+              code = 8;
+              diff = -diff;
+            }
+          if (diff >= step) { code |= 4; diff -= step; }
+          if (diff >= step >> 1) { code |= 2; diff -= step >> 1; }
+          if (diff >= step >> 2) code |= 1;
+
+          adpcmStep(code, &pred, &index);
+          dst[(i - 1) >> 1] |= (uint8_t)(code << (((i - 1) & 1) * 4));
+        }
+      dst += frames / 2;
+    }
+  return VINF_SUCCEEDED;
+}
+
+} // namespace wavetable
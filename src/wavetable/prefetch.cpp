@@ -0,0 +1,184 @@
+/** @file
+ * Qin - Predictive prefetch of the samples.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+
+#include "util/misc.h"
+#include "util/types.h"
+#include "util/assert.h"
+
+#include "wavetable/wavetable.h"
+#include "wavetable/prefetch.h"
+
+#if OS(LINUX)
+# include <fcntl.h>
+#endif
+
+/*
+ * The bytes of the head of a sample to read ahead. The rest of the
+ * sample is left to the read-ahead of the system, which follows the
+ * stream once it has started.
+ */
+#define PREFETCH_HEAD_BYTES (64 * 1024)
+
+/*
+ * The largest distance between two notes which makes a run.
+ */
+#define PREFETCH_RUN_STEP (2)
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace wavetable {
+
+SamplePrefetcher::SamplePrefetcher()
+  : m_samples(0),
+    m_lastNote(midi::NOTE_INVALID),
+    m_ringCount(0),
+    m_ringNext(0)
+{
+  std::memset(&m_stats, 0, sizeof(m_stats));
+}
+
+/**
+ * Set the samples to guess from.
+ * @param samples       The lists of the samples, indexed by the note,
+ *                      0 to stop guessing.
+ */
+void
+SamplePrefetcher::init(const V_LIST<WaveSample> *samples)
+{
+  m_samples = samples;
+  m_lastNote = midi::NOTE_INVALID;
+  m_ringCount = 0;
+  m_ringNext = 0;
+}
+
+/**
+ * Tell the prefetcher a note has started, the note is counted as a hit
+ * if its sample was advised lately, then the samples of the likely next
+ * notes are advised.
+ * @param note          The note started.
+ * @param ws            The sample chosen for the note.
+ */
+void
+SamplePrefetcher::noteOn(midi::Note note, const WaveSample *ws)
+{
+  if (!m_samples)
+    return;
+
+  if (ws->m_cache)
+    m_stats.resident++;
+  else if (advised(note, ws->m_dynamics))
+    m_stats.hits++;
+  else
+    m_stats.misses++;
+
+  int step = m_lastNote != midi::NOTE_INVALID ? note - m_lastNote : 0;
+  m_lastNote = note;
+
+  if (step && std::abs(step) <= PREFETCH_RUN_STEP)
+    {
+      /*
+       * A run, the next two strings in its direction.
+       */
+      issue(layer(note + step, ws->m_dynamics));
+      issue(layer(note + step * 2, ws->m_dynamics));
+    }
+  else
+    {
+      issue(layer(note - 1, ws->m_dynamics));
+      issue(layer(note + 1, ws->m_dynamics));
+    }
+}
+
+/**
+ * Get the counters of the prefetcher.
+ * @param stats         Where to store the counters.
+ */
+void
+SamplePrefetcher::getStats(PrefetchStats *stats) const
+{
+  *stats = m_stats;
+}
+
+/*
+ * Whether the sample was advised lately.
+ */
+bool
+SamplePrefetcher::advised(midi::Note note, midi::Velocity dynamics) const
+{
+  for (int i = 0; i < m_ringCount; i++)
+    {
+      if (m_ring[i].note == note && m_ring[i].dynamics == dynamics)
+        return true;
+    }
+  return false;
+}
+
+/*
+ * The sample of the note nearest to the dynamics, 0 if there is none.
+ */
+const WaveSample *
+SamplePrefetcher::layer(int note, midi::Velocity dynamics) const
+{
+  if (note <= midi::NOTE_INVALID || note >= midi::_MAX_NOTE_NUM)
+    return 0;
+
+  const WaveSample *m = 0;
+  int Vm = 256;
+  for (const WaveSample *w = m_samples[note].root; w; w = w->next)
+    {
+      int dV = std::abs((int)dynamics - (int)w->m_dynamics);
+      if (dV < Vm)
+        {
+          m = w;
+          Vm = dV;
+        }
+    }
+  return m;
+}
+
+/*
+ * Ask the system to read the head of a sample ahead, unless it is in
+ * the memory or advised lately.
+ */
+void
+SamplePrefetcher::issue(const WaveSample *ws)
+{
+  if (!ws || ws->m_cache || !ws->m_file)
+    return;
+  if (advised(ws->m_note, ws->m_dynamics))
+    return;
+
+#if OS(LINUX)
+  off_t len = ws->m_stored < PREFETCH_HEAD_BYTES ? ws->m_stored : PREFETCH_HEAD_BYTES;
+  posix_fadvise(fileno(ws->m_file), ws->m_offset, len, POSIX_FADV_WILLNEED);
+#endif
+
+  m_ring[m_ringNext].note = ws->m_note;
+  m_ring[m_ringNext].dynamics = ws->m_dynamics;
+  m_ringNext = (m_ringNext + 1) % PREFETCH_RING_SIZE;
+  if (m_ringCount < PREFETCH_RING_SIZE)
+    m_ringCount++;
+
+  m_stats.issued++;
+}
+
+} // namespace wavetable
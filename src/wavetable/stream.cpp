@@ -0,0 +1,682 @@
+/** @file
+ * Qin - Asynchronous streaming of the samples.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+#include <cstring>
+#include <cerrno>
+#include <new>
+
+#include "util/misc.h"
+#include "util/types.h"
+#include "util/error.h"
+#include "util/assert.h"
+
+#include "memory/mmu.h"
+
+#include "wavetable/stream.h"
+
+/*
+ * The plain reads and the probe of io_uring came with Linux 5.6, the
+ * engine is built in only when it is configured, so the older headers
+ * still build the rest.
+ */
+#if OS(LINUX) && defined(CONF_STREAM_ASYNC) && CONF_STREAM_ASYNC
+# define STREAM_ASYNC 1
+#else
+# define STREAM_ASYNC 0
+#endif
+
+#if STREAM_ASYNC
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <sys/uio.h>
+# include <linux/io_uring.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace wavetable {
+
+StreamEngine::StreamEngine()
+  : m_streams(0),
+    m_state(0),
+    m_segments(0),
+    m_store(0),
+    m_storeBlock(0),
+    m_fixed(false),
+    m_ring(-1),
+    m_sqMap(0),
+    m_sqMapSize(0),
+    m_cqMap(0),
+    m_cqMapSize(0),
+    m_sqes(0),
+    m_sqesSize(0),
+    m_sqHead(0),
+    m_sqTail(0),
+    m_sqMask(0),
+    m_sqArray(0),
+    m_cqHead(0),
+    m_cqTail(0),
+    m_cqMask(0),
+    m_cqes(0),
+    m_queued(0),
+    m_inflight(0)
+{
+  std::memset(&m_stats, 0, sizeof(m_stats));
+}
+
+StreamEngine::~StreamEngine()
+{
+  uninit();
+}
+
+/**
+ * Set up the io_uring and the rings of the streams.
+ * @param streams       The number of streams, one for each unit.
+ * @return VERR_NOT_SUPPORTED if the system has no io_uring or its reads,
+ *         or the engine is not configured, see CONF_STREAM_ASYNC.
+ * @return status code.
+ */
+int
+StreamEngine::init(int streams)
+{
+  uninit();
+
+#if STREAM_ASYNC
+  V_ASSERT(streams > 0);
+
+  size_t total = (size_t)streams * STREAM_RING_SEGMENTS * STREAM_SEGMENT_SIZE;
+
+  m_state = new (std::nothrow) streamState[streams];
+  m_segments = new (std::nothrow) segment[streams * STREAM_RING_SEGMENTS];
+  m_storeBlock = (uint8_t *)AllocLargeMem(total + STREAM_ALIGN, MEM_TAG_SAMPLE_CACHE, MEM_LARGE_THP);
+  if (!m_state || !m_segments || !m_storeBlock)
+    {
+      uninit();
+      return VERR_ALLOC_MEMORY;
+    }
+  m_store = ALIGN_PTR_CAST(m_storeBlock, STREAM_ALIGN, uint8_t *);
+
+  /*
+   * Each segment is in flight once at most, so the rings never
+   * overflow with an entry for each of them.
+   */
+  unsigned entries = 1;
+  while (entries < (unsigned)streams * STREAM_RING_SEGMENTS)
+    entries <<= 1;
+
+  bool readFixed;
+  if (!setupRing(entries) || !probeReads(&readFixed))
+    {
+      uninit();
+      return VERR_NOT_SUPPORTED;
+    }
+
+  /*
+   * Register the buffers, the kernel then maps them once instead of on
+   * each read. It may be refused for the limit of the locked memory,
+   * the plain reads work all the same.
+   */
+  struct iovec iov;
+  iov.iov_base = m_store;
+  iov.iov_len = total;
+  m_fixed = readFixed &&
+      syscall(__NR_io_uring_register, m_ring, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+
+  for (int n = 0; n < streams; n++)
+    {
+      std::memset(&m_state[n], 0, sizeof(m_state[n]));
+      m_state[n].fd = -1;
+    }
+  for (int n = 0; n < streams * STREAM_RING_SEGMENTS; n++)
+    {
+      std::memset(&m_segments[n], 0, sizeof(m_segments[n]));
+      m_segments[n].state = SEGMENT_FREE;
+    }
+
+  m_streams = streams;
+  m_queued = 0;
+  m_inflight = 0;
+  std::memset(&m_stats, 0, sizeof(m_stats));
+  return VINF_SUCCEEDED;
+#else
+  return VERR_NOT_SUPPORTED;
+#endif
+}
+
+/**
+ * Wait for the reads in flight and tear down the engine.
+ */
+void
+StreamEngine::uninit()
+{
+#if STREAM_ASYNC
+  if (m_ring >= 0)
+    {
+      /*
+       * The reads in flight are writing into the buffers.
+       */
+      while (m_inflight)
+        {
+          if (V_FAILURE(reap(true)))
+            break;
+        }
+
+      if (m_sqes)
+        munmap(m_sqes, m_sqesSize);
+      if (m_cqMap && m_cqMap != m_sqMap)
+        munmap(m_cqMap, m_cqMapSize);
+      if (m_sqMap)
+        munmap(m_sqMap, m_sqMapSize);
+      ::close(m_ring);
+    }
+#endif
+
+  delete [] m_state;
+  delete [] m_segments;
+  FreeLargeMem(m_storeBlock);
+
+  m_state = 0;
+  m_segments = 0;
+  m_storeBlock = 0;
+  m_store = 0;
+  m_streams = 0;
+  m_fixed = false;
+  m_ring = -1;
+  m_sqMap = 0;
+  m_cqMap = 0;
+  m_sqes = 0;
+  m_queued = 0;
+  m_inflight = 0;
+}
+
+/**
+ * Start streaming a sample. The reads of the first segments are queued,
+ * and the first of them is waited for here, so the voice does not stall
+ * on its first read() in the middle of a block; the rest are submitted
+ * by poll().
+ * @param stream        Index of the stream.
+ * @param fd            The file descriptor of the sample file.
+ * @param start         The offset of the sample in the file.
+ * @param size          The bytes of the sample.
+ * @return status code.
+ */
+int
+StreamEngine::open(int stream, int fd, uint64_t start, uint64_t size)
+{
+  V_ASSERT(enabled());
+  V_ASSERT(stream >= 0 && stream < m_streams);
+
+  close(stream);
+
+  streamState *st = &m_state[stream];
+  st->fd = fd;
+  st->open = true;
+  st->epoch++;
+  st->end = start + size;
+  st->cur = start;
+  st->next = start & ~(uint64_t)(STREAM_ALIGN - 1);
+  st->head = 0;
+  st->count = 0;
+  st->drained = false;
+
+  refill(stream);
+
+  if (st->count)
+    {
+      segment *s = seg(stream, st->order[st->head]);
+      while (s->state == SEGMENT_INFLIGHT)
+        {
+          int rc = reap(true);
+          if (V_FAILURE(rc))
+            return rc;
+        }
+    }
+  return VINF_SUCCEEDED;
+}
+
+/**
+ * Consume the data of a stream.
+ * @param stream        Index of the stream.
+ * @param len           The bytes to consume.
+ * @param dst           Where to copy the data if it spans the segments.
+ * @param data          Where to store the pointer to the data. It points
+ *                      into the segment if the data lies in one, and is
+ *                      valid until the next read of the stream.
+ * @return status code.
+ */
+int
+StreamEngine::read(int stream, size_t len, void *dst, const uint8_t **data)
+{
+  V_ASSERT(stream >= 0 && stream < m_streams);
+  streamState *st = &m_state[stream];
+  V_ASSERT(st->open);
+
+  if (len > st->end - st->cur)
+    {
+      return VERR_READING_FILE; // out of the sample
+    }
+
+  recycle(stream);
+
+  uint8_t *out = reinterpret_cast<uint8_t *>(dst);
+  *data = out;
+
+  while (len)
+    {
+      if (!st->count)
+        {
+          return VERR_READING_FILE;
+        }
+
+      int index = st->order[st->head];
+      segment *s = seg(stream, index);
+
+      if (s->state == SEGMENT_INFLIGHT)
+        {
+          /*
+           * The voice got ahead of its reads.
+           */
+          m_stats.stalls++;
+          while (s->state == SEGMENT_INFLIGHT)
+            {
+              int rc = reap(true);
+              if (V_FAILURE(rc))
+                return rc;
+            }
+        }
+      if (s->state != SEGMENT_READY)
+        {
+          return VERR_READING_FILE;
+        }
+
+      size_t offset = (size_t)(st->cur - s->pos);
+      if (offset >= s->filled)
+        {
+          return VERR_READING_FILE; // the file is short
+        }
+      size_t n = s->filled - offset;
+      if (n > len)
+        n = len;
+
+      const uint8_t *src = buffer(stream, index) + offset;
+      st->cur += n;
+      if (st->cur - s->pos == s->filled)
+        st->drained = true;
+
+      if (n == len && out == dst)
+        {
+          *data = src; // all in the segment, it is recycled next time
+          return VINF_SUCCEEDED;
+        }
+
+      std::memcpy(out, src, n);
+      out += n;
+      len -= n;
+      recycle(stream);
+    }
+  return VINF_SUCCEEDED;
+}
+
+/**
+ * Stop streaming, the reads in flight are dropped when they complete.
+ * @param stream        Index of the stream.
+ */
+void
+StreamEngine::close(int stream)
+{
+  V_ASSERT(stream >= 0 && stream < m_streams);
+  streamState *st = &m_state[stream];
+  if (!st->open)
+    return;
+
+  for (int n = 0; n < st->count; n++)
+    {
+      segment *s = seg(stream, st->order[(st->head + n) % STREAM_RING_SEGMENTS]);
+      if (s->state != SEGMENT_INFLIGHT)
+        s->state = SEGMENT_FREE;
+    }
+  st->open = false;
+  st->epoch++;
+  st->head = 0;
+  st->count = 0;
+  st->drained = false;
+}
+
+/**
+ * Submit the reads queued since the last time in one call, and take
+ * the completed ones. Call this once for each block rendered.
+ * @return status code.
+ */
+int
+StreamEngine::poll()
+{
+  if (!enabled())
+    return VINF_SUCCEEDED;
+  return reap(false);
+}
+
+/**
+ * Get the counters of the streams.
+ * @param stats         Where to store the counters.
+ */
+void
+StreamEngine::getStats(StreamStats *stats) const
+{
+  *stats = m_stats;
+}
+
+inline uint8_t *
+StreamEngine::buffer(int stream, int index)
+{
+  return m_store + ((size_t)stream * STREAM_RING_SEGMENTS + index) * STREAM_SEGMENT_SIZE;
+}
+
+/*
+ * Give the free segments of an open stream the next parts of the sample.
+ */
+void
+StreamEngine::refill(int stream)
+{
+  streamState *st = &m_state[stream];
+
+  for (int index = 0; index < STREAM_RING_SEGMENTS; index++)
+    {
+      if (!st->open || st->next >= st->end || st->count == STREAM_RING_SEGMENTS)
+        break;
+      segment *s = seg(stream, index);
+      if (s->state != SEGMENT_FREE)
+        continue;
+
+      s->state = SEGMENT_INFLIGHT;
+      s->epoch = st->epoch;
+      s->pos = st->next;
+      s->filled = 0;
+      s->want = STREAM_SEGMENT_SIZE;
+      st->next += STREAM_SEGMENT_SIZE;
+
+      st->order[(st->head + st->count) % STREAM_RING_SEGMENTS] = index;
+      st->count++;
+
+      submit(stream, index);
+    }
+}
+
+/*
+ * Queue the read of the rest of a segment.
+ */
+void
+StreamEngine::submit(int stream, int index)
+{
+#if STREAM_ASYNC
+  segment *s = seg(stream, index);
+
+  unsigned tail = *m_sqTail;
+  unsigned slot = tail & m_sqMask;
+  struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(m_sqes) + slot;
+
+  std::memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = m_fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = m_state[stream].fd;
+  sqe->off = s->pos + s->filled;
+  sqe->addr = (uint64_t)(uintptr_t)(buffer(stream, index) + s->filled);
+  sqe->len = (uint32_t)(s->want - s->filled);
+  sqe->buf_index = 0;
+  sqe->user_data = (uint64_t)stream * STREAM_RING_SEGMENTS + index;
+
+  m_sqArray[slot] = slot;
+  __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+
+  m_queued++;
+  m_inflight++;
+  m_stats.submitted++;
+  if (m_inflight > m_stats.peak)
+    m_stats.peak = m_inflight;
+#endif
+}
+
+/*
+ * Recycle the head segment of a stream once it is consumed.
+ */
+void
+StreamEngine::recycle(int stream)
+{
+  streamState *st = &m_state[stream];
+  if (!st->drained)
+    return;
+
+  segment *s = seg(stream, st->order[st->head]);
+  s->state = SEGMENT_FREE;
+  st->head = (st->head + 1) % STREAM_RING_SEGMENTS;
+  st->count--;
+  st->drained = false;
+
+  refill(stream);
+}
+
+/*
+ * Submit the queued reads and take the completed ones.
+ * @param wait          Whether to wait for a completion.
+ */
+int
+StreamEngine::reap(bool wait)
+{
+#if STREAM_ASYNC
+  if (m_queued || wait)
+    {
+      int rc = enter(m_queued, wait ? 1 : 0);
+      if (V_FAILURE(rc))
+        return rc;
+    }
+
+  unsigned head = *m_cqHead;
+  unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+  while (head != tail)
+    {
+      struct io_uring_cqe *cqe = static_cast<struct io_uring_cqe *>(m_cqes) + (head & m_cqMask);
+      uint64_t data = cqe->user_data;
+      int32_t res = cqe->res;
+
+      head++;
+      __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+
+      complete(data, res);
+      tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+    }
+  return VINF_SUCCEEDED;
+#else
+  return VERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+ * A read has completed.
+ */
+void
+StreamEngine::complete(uint64_t data, int32_t res)
+{
+  int stream = (int)(data / STREAM_RING_SEGMENTS);
+  int index = (int)(data % STREAM_RING_SEGMENTS);
+  V_ASSERT(stream < m_streams);
+
+  streamState *st = &m_state[stream];
+  segment *s = seg(stream, index);
+
+  m_inflight--;
+  m_stats.completed++;
+
+  if (!st->open || s->epoch != st->epoch)
+    {
+      /*
+       * The stream was closed or has started another sample.
+       */
+      s->state = SEGMENT_FREE;
+      refill(stream);
+      return;
+    }
+
+  if (res < 0)
+    {
+      s->state = SEGMENT_ERROR;
+      return;
+    }
+
+  s->filled += res;
+  if (res > 0 && s->filled < s->want && s->pos + s->filled < st->end)
+    {
+      submit(stream, index); // a short read, ask for the rest
+      return;
+    }
+  s->state = SEGMENT_READY;
+}
+
+/*
+ * Call into the system.
+ */
+int
+StreamEngine::enter(unsigned submit, unsigned wait)
+{
+#if STREAM_ASYNC
+  for (;;)
+    {
+      unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+      long ret = syscall(__NR_io_uring_enter, m_ring, submit, wait, flags, (void *)0, 0);
+      m_stats.syscalls++;
+
+      if (ret >= 0)
+        {
+          m_queued -= (unsigned)ret < m_queued ? (unsigned)ret : m_queued;
+          return VINF_SUCCEEDED;
+        }
+      if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        return VERR_READING_FILE;
+    }
+#else
+  return VERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+ * Create the io_uring and map its rings.
+ */
+bool
+StreamEngine::setupRing(unsigned entries)
+{
+#if STREAM_ASYNC
+  struct io_uring_params p;
+  std::memset(&p, 0, sizeof(p));
+
+  int fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if (fd < 0)
+    {
+      return false;
+    }
+  m_ring = fd;
+
+  m_sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  m_cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (m_cqMapSize > m_sqMapSize)
+        m_sqMapSize = m_cqMapSize;
+      m_cqMapSize = m_sqMapSize;
+    }
+
+  void *sq = mmap(0, m_sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED)
+    {
+      return false;
+    }
+  m_sqMap = sq;
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      m_cqMap = m_sqMap;
+    }
+  else
+    {
+      void *cq = mmap(0, m_cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+      if (cq == MAP_FAILED)
+        {
+          return false;
+        }
+      m_cqMap = cq;
+    }
+
+  m_sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+  void *sqes = mmap(0, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+    {
+      return false;
+    }
+  m_sqes = sqes;
+
+  uint8_t *sqp = static_cast<uint8_t *>(m_sqMap);
+  uint8_t *cqp = static_cast<uint8_t *>(m_cqMap);
+  m_sqHead = reinterpret_cast<unsigned *>(sqp + p.sq_off.head);
+  m_sqTail = reinterpret_cast<unsigned *>(sqp + p.sq_off.tail);
+  m_sqMask = *reinterpret_cast<unsigned *>(sqp + p.sq_off.ring_mask);
+  m_sqArray = reinterpret_cast<unsigned *>(sqp + p.sq_off.array);
+  m_cqHead = reinterpret_cast<unsigned *>(cqp + p.cq_off.head);
+  m_cqTail = reinterpret_cast<unsigned *>(cqp + p.cq_off.tail);
+  m_cqMask = *reinterpret_cast<unsigned *>(cqp + p.cq_off.ring_mask);
+  m_cqes = cqp + p.cq_off.cqes;
+  return true;
+#else
+  return false;
+#endif
+}
+
+/*
+ * Ask the kernel for the reads the engine submits. A kernel older than
+ * the probe has no IORING_OP_READ either.
+ * @param fixed         Where to store whether IORING_OP_READ_FIXED is there.
+ * @return whether IORING_OP_READ is there.
+ */
+bool
+StreamEngine::probeReads(bool *fixed)
+{
+  *fixed = false;
+#if STREAM_ASYNC
+  const unsigned ops = 256;
+  size_t size = sizeof(struct io_uring_probe) + ops * sizeof(struct io_uring_probe_op);
+  uint8_t *buf = new (std::nothrow) uint8_t[size];
+  if (!buf)
+    {
+      return false;
+    }
+  std::memset(buf, 0, size);
+  struct io_uring_probe *probe = reinterpret_cast<struct io_uring_probe *>(buf);
+
+  bool read = false;
+  if (syscall(__NR_io_uring_register, m_ring, IORING_REGISTER_PROBE, probe, ops) == 0)
+    {
+#define PROBE_HAS(op) ((op) <= probe->last_op && (op) < probe->ops_len && \
+                       (probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+      read = PROBE_HAS(IORING_OP_READ);
+      *fixed = PROBE_HAS(IORING_OP_READ_FIXED);
+#undef PROBE_HAS
+    }
+  delete [] buf;
+  return read;
+#else
+  return false;
+#endif
+}
+
+} // namespace wavetable
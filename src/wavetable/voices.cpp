@@ -0,0 +1,293 @@
+/** @file
+ * Qin - Allocator of the polyphony units.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+#include <cstring>
+#include <new>
+
+#include "util/types.h"
+#include "util/error.h"
+#include "util/assert.h"
+
+#include "wavetable/voices.h"
+
+/*
+ * The position of a unit which is not in the heap.
+ */
+#define VOICE_FREE (-1)
+#define VOICE_TAKEN (-2)
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace wavetable {
+
+VoiceAllocator::VoiceAllocator()
+  : m_voices(0),
+    m_free(0),
+    m_freeCount(0),
+    m_heap(0),
+    m_heapCount(0),
+    m_pos(0),
+    m_loudness(0),
+    m_started(0),
+    m_clock(0)
+{
+  std::memset(&m_stats, 0, sizeof(m_stats));
+}
+
+VoiceAllocator::~VoiceAllocator()
+{
+  freeUnits();
+}
+
+/**
+ * Allocate the units and make all of them free.
+ * @param voices        The number of units.
+ * @return status code.
+ */
+int
+VoiceAllocator::init(int voices)
+{
+  V_ASSERT(voices > 0 && voices <= _MAX_POLYPHONY_NUM);
+
+  freeUnits();
+  m_free = new (std::nothrow) int[voices];
+  m_heap = new (std::nothrow) int[voices];
+  m_pos = new (std::nothrow) int[voices];
+  m_loudness = new (std::nothrow) float[voices];
+  m_started = new (std::nothrow) uint32_t[voices];
+  if (!m_free || !m_heap || !m_pos || !m_loudness || !m_started)
+    {
+      freeUnits();
+      return VERR_ALLOC_MEMORY;
+    }
+
+  m_voices = voices;
+  m_heapCount = 0;
+  m_freeCount = 0;
+
+  /*
+   * The stack pops the unit 0 first.
+   */
+  for (int v = voices - 1; v >= 0; v--)
+    {
+      m_free[m_freeCount++] = v;
+      m_pos[v] = VOICE_FREE;
+      m_loudness[v] = 0;
+      m_started[v] = 0;
+    }
+  return VINF_SUCCEEDED;
+}
+
+/*
+ * Free the arrays of the units.
+ */
+void
+VoiceAllocator::freeUnits()
+{
+  delete [] m_free;
+  delete [] m_heap;
+  delete [] m_pos;
+  delete [] m_loudness;
+  delete [] m_started;
+
+  m_free = 0;
+  m_heap = 0;
+  m_pos = 0;
+  m_loudness = 0;
+  m_started = 0;
+  m_voices = 0;
+  m_freeCount = 0;
+  m_heapCount = 0;
+}
+
+/**
+ * Take a unit for a new note. A free one is taken if there is any,
+ * otherwise the quietest one in use is stolen. The unit is out of both
+ * the free ones and the ones in use until start().
+ * @param stolen        Where to store whether the unit was in use.
+ * @return the index of the unit.
+ */
+int
+VoiceAllocator::acquire(bool *stolen)
+{
+  V_ASSERT(m_voices);
+
+  int voice;
+  if (m_freeCount)
+    {
+      voice = m_free[--m_freeCount];
+      *stolen = false;
+    }
+  else
+    {
+      voice = m_heap[0];
+      remove(voice);
+      m_stats.stolen++;
+      *stolen = true;
+    }
+  m_pos[voice] = VOICE_TAKEN;
+  return voice;
+}
+
+/**
+ * Put a unit taken by acquire() in use.
+ * @param voice         Index of the unit.
+ * @param loudness      The loudness the note is heading for.
+ */
+void
+VoiceAllocator::start(int voice, float loudness)
+{
+  V_ASSERT(voice >= 0 && voice < m_voices);
+  V_ASSERT(m_pos[voice] == VOICE_TAKEN);
+
+  m_loudness[voice] = loudness;
+  m_started[voice] = m_clock++;
+
+  place(m_heapCount++, voice);
+  siftUp(m_pos[voice]);
+
+  m_stats.notes++;
+  if ((uint32_t)m_heapCount > m_stats.peak)
+    m_stats.peak = m_heapCount;
+}
+
+/**
+ * Update the loudness of a unit in use.
+ * @param voice         Index of the unit.
+ * @param loudness      The current loudness.
+ */
+void
+VoiceAllocator::update(int voice, float loudness)
+{
+  V_ASSERT(voice >= 0 && voice < m_voices);
+
+  int pos = m_pos[voice];
+  if (pos < 0)
+    return;
+
+  float old = m_loudness[voice];
+  m_loudness[voice] = loudness;
+
+  if (loudness < old)
+    siftUp(pos);
+  else if (loudness > old)
+    siftDown(pos);
+}
+
+/**
+ * Give a unit back to the free ones.
+ * @param voice         Index of the unit.
+ */
+void
+VoiceAllocator::release(int voice)
+{
+  V_ASSERT(voice >= 0 && voice < m_voices);
+
+  if (m_pos[voice] == VOICE_FREE)
+    return;
+  if (m_pos[voice] >= 0)
+    remove(voice);
+
+  m_pos[voice] = VOICE_FREE;
+  m_free[m_freeCount++] = voice;
+}
+
+/**
+ * Get the counters of the allocator.
+ * @param stats         Where to store the counters.
+ */
+void
+VoiceAllocator::getStats(VoiceStats *stats) const
+{
+  *stats = m_stats;
+}
+
+/*
+ * The order of the heap, whether a is to be stolen before b.
+ */
+inline bool
+VoiceAllocator::quieter(int a, int b) const
+{
+  if (m_loudness[a] != m_loudness[b])
+    return m_loudness[a] < m_loudness[b];
+  return (int32_t)(m_started[a] - m_started[b]) < 0;
+}
+
+inline void
+VoiceAllocator::place(int pos, int voice)
+{
+  m_heap[pos] = voice;
+  m_pos[voice] = pos;
+}
+
+void
+VoiceAllocator::siftUp(int pos)
+{
+  int voice = m_heap[pos];
+
+  while (pos > 0)
+    {
+      int parent = (pos - 1) / 2;
+      if (!quieter(voice, m_heap[parent]))
+        break;
+      place(pos, m_heap[parent]);
+      pos = parent;
+    }
+  place(pos, voice);
+}
+
+void
+VoiceAllocator::siftDown(int pos)
+{
+  int voice = m_heap[pos];
+
+  for (;;)
+    {
+      int child = pos * 2 + 1;
+      if (child >= m_heapCount)
+        break;
+      if (child + 1 < m_heapCount && quieter(m_heap[child + 1], m_heap[child]))
+        child++;
+      if (!quieter(m_heap[child], voice))
+        break;
+      place(pos, m_heap[child]);
+      pos = child;
+    }
+  place(pos, voice);
+}
+
+/*
+ * Take a unit out of the heap, the last one fills its place.
+ */
+void
+VoiceAllocator::remove(int voice)
+{
+  int pos = m_pos[voice];
+  V_ASSERT(pos >= 0 && pos < m_heapCount);
+
+  m_pos[voice] = VOICE_TAKEN;
+  int last = m_heap[--m_heapCount];
+  if (last == voice)
+    return;
+
+  place(pos, last);
+  siftUp(pos);
+  siftDown(m_pos[last]);
+}
+
+} // namespace wavetable
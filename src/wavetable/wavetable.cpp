@@ -28,12 +28,19 @@
 #include "util/bswap.h"
 
 #include "audiosys/audioformat.h"
+#include "memory/mmu.h"
 
 #include "midi/note.h" // request: stringToNote()
 #include "midi/mapping.h" // request: mapNote()
 
 #include "wavetable/wavebank.h"
 #include "wavetable/wavetable.h"
+#include "wavetable/codec.h"
+
+#if OS(LINUX)
+# include <fcntl.h>
+# include <unistd.h>
+#endif
 
 #define SAMPLE_TABLE_HEADER "QIN SAMPLE TABLE 1\n"
 
@@ -49,23 +56,104 @@
 namespace wavetable {
 
 WaveTable::WaveTable()
-  : m_sampleSize(0)
+  : m_polyphony(0),
+    m_waveSamples(0),
+    m_units(0),
+    m_active(0),
+    m_activeCount(0),
+    m_activePos(0),
+    m_sampleSize(0),
+    m_cache(0),
+    m_cacheSize(0),
+    m_cacheOriginal(0),
+    m_codedFrameBytes(0),
+    m_codedScratch(0),
+    m_codedScratchSize(0)
 {
 }
 
 /**
- * Do the logical initialization.
+ * Do the logical initialization, the units are allocated here.
+ * @param polyphony     The number of polyphonic units,
+ *                      1 ~ _MAX_POLYPHONY_NUM.
  * @return status code.
  */
 int
-WaveTable::init()
+WaveTable::init(int polyphony)
 {
-  return VINF_SUCCEEDED;
+  if (polyphony <= 0 || polyphony > _MAX_POLYPHONY_NUM)
+    {
+      return VERR_OUT_OF_RANGE;
+    }
+  V_ASSERT(!m_units);
+
+  m_waveSamples = new (std::nothrow) V_LIST<WaveSample>[midi::_MAX_NOTE_NUM];
+  m_units = new (std::nothrow) PolyUnit[polyphony];
+  m_active = new (std::nothrow) int[polyphony];
+  m_activePos = new (std::nothrow) int[polyphony];
+  if (!m_waveSamples || !m_units || !m_active || !m_activePos)
+    {
+      uninit();
+      return VERR_ALLOC_MEMORY;
+    }
+  m_polyphony = polyphony;
+
+  for (int n = 0; n < polyphony; n++)
+    {
+      m_activePos[n] = -1;
+    }
+  m_activeCount = 0;
+
+  int rc = m_voices.init(polyphony);
+  if (V_FAILURE(rc))
+    {
+      uninit();
+    }
+  return rc;
 }
 
 int
 WaveTable::uninit()
 {
+  ReleaseSampleCache();
+  m_streams.uninit();
+  m_blocks.uninit();
+  closeDirect();
+
+  for (int note = 0; m_waveSamples && note < midi::_MAX_NOTE_NUM; note++)
+    {
+      for (WaveSample *ws = m_waveSamples[note].root; ws; ws = ws->next)
+        {
+          delete [] ws->m_blockIndex;
+        }
+      m_waveSamples[note].earseRefs();
+    }
+  for (SampleFile *sf = m_sampleFiles.root; sf; sf = sf->next)
+    {
+      fclose(sf->fp);
+    }
+  m_sampleFiles.earseRefs();
+  m_prefetch.init(0);
+
+  for (int nPoly = 0; m_units && nPoly < m_polyphony; nPoly++)
+    {
+      delete [] m_units[nPoly].pcm;
+    }
+  delete [] m_codedScratch;
+  m_codedScratch = 0;
+  m_codedScratchSize = 0;
+  m_codedFrameBytes = 0;
+
+  delete [] m_waveSamples;
+  delete [] m_units;
+  delete [] m_active;
+  delete [] m_activePos;
+  m_waveSamples = 0;
+  m_units = 0;
+  m_active = 0;
+  m_activePos = 0;
+  m_activeCount = 0;
+  m_polyphony = 0;
   return VINF_SUCCEEDED;
 }
 
@@ -91,12 +179,622 @@ WaveTable::LoadTimbres(const char *path)
   rc = parseSynTable(fp);
 
   fclose(fp);
+  if (V_FAILURE(rc))
+    {
+      return rc;
+    }
 
   m_sampleSize = queryCommonSample()->m_bps / 8;
 
+  m_prefetch.init(m_waveSamples);
+
+  if (V_SUCCESS(rc) && m_codedFrameBytes)
+    {
+      rc = allocDecoders(m_codedFrameBytes);
+    }
+
   return rc;
 }
 
+/*
+ * Allocate the buffers where the units decode the coded samples a block
+ * at a time, for the frames up to frameBytes. The units must be idle.
+ */
+int
+WaveTable::allocDecoders(size_t frameBytes)
+{
+  if (m_codedScratch && frameBytes <= m_codedFrameBytes)
+    {
+      return VINF_SUCCEEDED;
+    }
+  if (frameBytes < m_codedFrameBytes)
+    frameBytes = m_codedFrameBytes;
+
+  delete [] m_codedScratch;
+  for (int nPoly = 0; nPoly < m_polyphony; nPoly++)
+    {
+      delete [] m_units[nPoly].pcm;
+      m_units[nPoly].pcm = 0;
+    }
+  m_codedFrameBytes = frameBytes;
+
+  m_codedScratchSize = WAVE_CODEC_BLOCK_BOUND(WAVE_CODEC_BLOCK_FRAMES, m_codedFrameBytes);
+  m_codedScratch = new (MEM_TAG_AUDIO_BUFFER, MEM_ALIGN_CACHELINE, std::nothrow) uint8_t[m_codedScratchSize];
+  if (!m_codedScratch)
+    {
+      return VERR_ALLOC_MEMORY;
+    }
+  for (int nPoly = 0; nPoly < m_polyphony; nPoly++)
+    {
+      m_units[nPoly].pcm = new (MEM_TAG_AUDIO_BUFFER, MEM_ALIGN_CACHELINE, std::nothrow)
+          uint8_t[WAVE_CODEC_BLOCK_FRAMES * m_codedFrameBytes];
+      if (!m_units[nPoly].pcm)
+        {
+          return VERR_ALLOC_MEMORY;
+        }
+    }
+  return VINF_SUCCEEDED;
+}
+
+/**
+ * Load the samples into memory, so that the units will no longer
+ * read them from the disk. The store is a single large block which can
+ * be backed by huge pages, as the voices are reading from scattered
+ * offsets of it and the TLB will thrash with the normal pages.
+ * Samples that don't fit in the budget are still streamed from the file.
+ *
+ * @param budget    The maximum number of bytes to cache, 0 = all samples.
+ * @param flags     MEM_LARGE_* flags passed to AllocLargeMem().
+ * @return status code.
+ */
+int
+WaveTable::CacheSamples(size_t budget, int flags)
+{
+  ReleaseSampleCache();
+
+  size_t total = 0;
+  for (int note = 0; note < midi::_MAX_NOTE_NUM; note++)
+    {
+      for (WaveSample *ws = m_waveSamples[note].root; ws; ws = ws->next)
+        {
+          if (budget && total + ws->m_stored > budget)
+            continue;
+          total += ws->m_stored;
+        }
+    }
+  if (!total)
+    {
+      return VINF_SUCCEEDED;
+    }
+
+  m_cache = (uint8_t *)AllocLargeMem(total, MEM_TAG_SAMPLE_CACHE, flags);
+  if (!m_cache)
+    {
+      return VERR_ALLOC_MEMORY;
+    }
+  m_cacheSize = total;
+
+  size_t pos = 0;
+  for (int note = 0; note < midi::_MAX_NOTE_NUM; note++)
+    {
+      for (WaveSample *ws = m_waveSamples[note].root; ws; ws = ws->next)
+        {
+          if (pos + ws->m_stored > total)
+            continue;
+
+          if (readFileAt(ws->m_file, ws->m_offset, m_cache + pos, ws->m_stored) != ws->m_stored)
+            {
+              ReleaseSampleCache();
+              return VERR_READING_FILE;
+            }
+
+          ws->m_cache = m_cache + pos;
+          ws->m_cacheIndex = 0;
+          ws->m_cacheCodec = WAVE_CODEC_RICE;
+          m_cacheOriginal += ws->m_size;
+
+          pos += ws->m_stored;
+        }
+    }
+
+  MemoryStats stats;
+  GetMemoryStats(MEM_TAG_SAMPLE_CACHE, &stats);
+  LOG(INFO) << "sample cache: " << m_cacheSize / 1024 << " KBytes, huge pages: " <<
+      stats.huge / 1024 << " KBytes, advised: " << stats.advised / 1024 << " KBytes.\n";
+
+  return VINF_SUCCEEDED;
+}
+
+/**
+ * Load the samples into memory compressed, for the machines which can
+ * not hold the bank as PCM. The units decode the samples a block at a
+ * time as they read them, trading a little CPU for the memory. The
+ * samples coded in the bank already are held as they are stored.
+ *
+ * @param budget    The maximum number of bytes to cache, 0 = all samples.
+ * @param codec     WAVE_CODEC_RICE, lossless, or WAVE_CODEC_ADPCM, 4 bits
+ *                  per sample but lossy. ADPCM only codes the 16 bits
+ *                  samples, the others are coded by WAVE_CODEC_RICE.
+ * @param flags     MEM_LARGE_* flags passed to AllocLargeMem().
+ * @return status code.
+ */
+int
+WaveTable::CompressSamples(size_t budget, int codec, int flags)
+{
+  if (codec != WAVE_CODEC_RICE && codec != WAVE_CODEC_ADPCM)
+    {
+      return VERR_INVALID_PARAMETER;
+    }
+
+  ReleaseSampleCache();
+
+  int count = 0;
+  size_t frameBytes = 0;
+  for (int note = 0; note < midi::_MAX_NOTE_NUM; note++)
+    {
+      for (WaveSample *ws = m_waveSamples[note].root; ws; ws = ws->next)
+        {
+          size_t fb = ws->m_channels * ws->m_bps / 8;
+          if (fb > frameBytes)
+            frameBytes = fb;
+          count++;
+        }
+    }
+  if (!count)
+    {
+      return VINF_SUCCEEDED;
+    }
+
+  for (int nPoly = 0; nPoly < m_polyphony; nPoly++)
+    {
+      if (m_units[nPoly].busy)
+        endUnit(nPoly);
+    }
+  int rc = allocDecoders(frameBytes);
+  if (V_FAILURE(rc))
+    {
+      return rc;
+    }
+
+  /*
+   * The samples are sized first and then coded straight into the store,
+   * so the store is the only copy of them. Sizing a Rice coded sample
+   * codes it a block at a time into work, and stops once the sample is
+   * past the budget left; the samples after the budget is used up are
+   * not coded at all.
+   */
+  struct packedSample
+  {
+    /** bytes of the coded sample, 0 = not held */
+    size_t      len;
+    int         codec;
+  };
+
+  packedSample *packed = new (std::nothrow) packedSample[count]();
+  uint8_t *work = new (std::nothrow) uint8_t[WAVE_CODEC_BLOCK_BOUND(WAVE_CODEC_BLOCK_FRAMES, frameBytes)];
+  uint8_t *pcm = new (std::nothrow) uint8_t[WAVE_CODEC_BLOCK_FRAMES * frameBytes];
+  if (!packed || !work || !pcm)
+    {
+      delete [] packed;
+      delete [] work;
+      delete [] pcm;
+      return VERR_ALLOC_MEMORY;
+    }
+
+  size_t total = 0;
+  int n = 0;
+  for (int note = 0; V_SUCCESS(rc) && note < midi::_MAX_NOTE_NUM; note++)
+    {
+      for (WaveSample *ws = m_waveSamples[note].root; ws; ws = ws->next, n++)
+        {
+          packedSample *p = &packed[n];
+          p->codec = codec == WAVE_CODEC_ADPCM && ws->m_bps == 16 ? WAVE_CODEC_ADPCM : WAVE_CODEC_RICE;
+
+          if (budget && total + sizeof(WaveCodedSample_t) > budget)
+            continue;
+
+          size_t len;
+          rc = encodeSample(ws, p->codec, pcm, work, 0, budget ? budget - total : 0, &len);
+          if (V_FAILURE(rc))
+            break;
+
+          size_t stored = ALIGN_TYPE(len, sizeof(uint32_t), size_t);
+          if (budget && total + stored > budget)
+            continue;
+
+          p->len = len;
+          total += stored;
+        }
+    }
+
+  if (V_SUCCESS(rc) && total)
+    {
+      m_cache = (uint8_t *)AllocLargeMem(total, MEM_TAG_SAMPLE_CACHE, flags);
+      if (!m_cache)
+        {
+          rc = VERR_ALLOC_MEMORY;
+        }
+    }
+
+  if (V_SUCCESS(rc) && m_cache)
+    {
+      m_cacheSize = total;
+
+      size_t pos = 0;
+      n = 0;
+      for (int note = 0; V_SUCCESS(rc) && note < midi::_MAX_NOTE_NUM; note++)
+        {
+          for (WaveSample *ws = m_waveSamples[note].root; ws; ws = ws->next, n++)
+            {
+              packedSample *p = &packed[n];
+              if (!p->len)
+                continue;
+
+              size_t len;
+              rc = encodeSample(ws, p->codec, pcm, work, m_cache + pos, 0, &len);
+              if (V_FAILURE(rc))
+                break;
+              V_ASSERT(len == p->len);
+
+              /*
+               * The sample coded in the bank is held as it is stored,
+               * its own index applies.
+               */
+              const uint32_t *index = 0;
+              if (p->codec != WAVE_CODEC_RICE || !ws->m_blockIndex)
+                index = reinterpret_cast<const uint32_t *>(m_cache + pos + sizeof(WaveCodedSample_t));
+
+              ws->m_cache = m_cache + pos;
+              ws->m_cacheIndex = index;
+              ws->m_cacheCodec = p->codec;
+              m_cacheOriginal += ws->m_size;
+
+              pos += ALIGN_TYPE(p->len, sizeof(uint32_t), size_t);
+            }
+        }
+    }
+
+  if (V_FAILURE(rc))
+    {
+      ReleaseSampleCache();
+    }
+  else if (m_cache)
+    {
+      MemoryStats stats;
+      GetMemoryStats(MEM_TAG_SAMPLE_CACHE, &stats);
+      LOG(INFO) << "compressed sample cache: " << m_cacheSize / 1024 << " KBytes of " <<
+          m_cacheOriginal / 1024 << " KBytes PCM, ratio = " <<
+          (float)m_cacheOriginal / m_cacheSize << ", huge pages: " <<
+          stats.huge / 1024 << " KBytes, advised: " << stats.advised / 1024 << " KBytes.\n";
+    }
+
+  delete [] packed;
+  delete [] work;
+  delete [] pcm;
+  return rc;
+}
+
+/*
+ * Code a sample for CompressSamples(), in the format of a coded sample
+ * of the bank. A sample coded in the bank already is copied as it is.
+ * Without dst the sample is only sized: the Rice coded blocks go to
+ * work, the size of the ADPCM ones is fixed.
+ * @param ws            The sample.
+ * @param codec         WAVE_CODEC_RICE or WAVE_CODEC_ADPCM.
+ * @param pcm           Where to read a block to.
+ * @param work          Where to code a block when sizing, WAVE_CODEC_BLOCK_BOUND bytes.
+ * @param dst           Where to store the coded sample, 0 = size it only.
+ * @param limit         Stop once the sample is past the bytes, 0 = no limit.
+ * @param len           Where to store the bytes of the coded sample, past
+ *                      limit if it stopped there.
+ * @return status code.
+ */
+int
+WaveTable::encodeSample(WaveSample *ws, int codec, uint8_t *pcm, uint8_t *work,
+                        uint8_t *dst, size_t limit, size_t *len)
+{
+  if (codec == WAVE_CODEC_RICE && ws->m_blockIndex)
+    {
+      if (dst && readFileAt(ws->m_file, ws->m_offset, dst, ws->m_stored) != ws->m_stored)
+        {
+          return VERR_READING_FILE;
+        }
+      *len = ws->m_stored;
+      return VINF_SUCCEEDED;
+    }
+
+  const size_t frameBytes = ws->m_channels * ws->m_bps / 8;
+  const size_t frames = ws->m_size / frameBytes;
+  const uint32_t blocks = (uint32_t)((frames + WAVE_CODEC_BLOCK_FRAMES - 1) / WAVE_CODEC_BLOCK_FRAMES);
+
+  WaveCodedSample_t *hdr = reinterpret_cast<WaveCodedSample_t *>(dst);
+  uint32_t *index = reinterpret_cast<uint32_t *>(dst + sizeof(WaveCodedSample_t));
+  uint32_t pos = sizeof(WaveCodedSample_t) + (blocks + 1) * sizeof(uint32_t);
+
+  for (uint32_t b = 0; b < blocks && !(limit && pos > limit); b++)
+    {
+      size_t n = frames - (size_t)b * WAVE_CODEC_BLOCK_FRAMES;
+      if (n > WAVE_CODEC_BLOCK_FRAMES)
+        n = WAVE_CODEC_BLOCK_FRAMES;
+
+      size_t clen;
+      if (!dst && codec == WAVE_CODEC_ADPCM)
+        {
+          clen = WAVE_ADPCM_BLOCK_BOUND(n, ws->m_channels);
+        }
+      else
+        {
+          uint8_t *out = dst ? dst + pos : work;
+          int rc = readBlock(ws, b, pcm);
+          if (V_SUCCESS(rc))
+            {
+              if (codec == WAVE_CODEC_ADPCM)
+                rc = encodeAdpcmBlock(pcm, ws->m_channels, n, out, &clen);
+              else
+                rc = encodeRiceBlock(pcm, ws->m_channels, ws->m_bps / 8, n, out, &clen);
+            }
+          if (V_FAILURE(rc))
+            {
+              return rc;
+            }
+        }
+      if (dst)
+        index[b] = pos;
+      pos += (uint32_t)clen;
+    }
+
+  if (dst)
+    {
+      index[blocks] = pos;
+      hdr->stored = pos;
+      hdr->blocks = blocks;
+    }
+  *len = pos;
+  return VINF_SUCCEEDED;
+}
+
+/*
+ * Read a block of the PCM data of a sample from the bank, decoding it
+ * if the sample is coded, see CompressSamples().
+ * @param ws            The sample.
+ * @param block         The index of the block.
+ * @param dst           Where to store the data.
+ * @return status code.
+ */
+int
+WaveTable::readBlock(WaveSample *ws, uint32_t block, uint8_t *dst)
+{
+  const size_t frameBytes = ws->m_channels * ws->m_bps / 8;
+  size_t frames = ws->m_size / frameBytes - (size_t)block * WAVE_CODEC_BLOCK_FRAMES;
+  if (frames > WAVE_CODEC_BLOCK_FRAMES)
+    frames = WAVE_CODEC_BLOCK_FRAMES;
+
+  if (ws->m_blockIndex)
+    {
+      const uint32_t *idx = ws->m_blockIndex;
+      size_t clen = idx[block + 1] - idx[block];
+      if (readFileAt(ws->m_file, ws->m_offset + idx[block], m_codedScratch, clen) != clen)
+        {
+          return VERR_READING_FILE;
+        }
+      return decodeRiceBlock(m_codedScratch, clen, ws->m_channels, ws->m_bps / 8, frames, dst);
+    }
+
+  uint64_t pos = ws->m_offset + (uint64_t)block * WAVE_CODEC_BLOCK_FRAMES * frameBytes;
+  if (readFileAt(ws->m_file, pos, dst, frames * frameBytes) != frames * frameBytes)
+    {
+      return VERR_READING_FILE;
+    }
+  return VINF_SUCCEEDED;
+}
+
+/**
+ * Release the in-memory sample store, the units will
+ * read the samples from the disk again.
+ */
+void
+WaveTable::ReleaseSampleCache()
+{
+  if (!m_cache)
+    return;
+
+  for (int note = 0; note < midi::_MAX_NOTE_NUM; note++)
+    {
+      for (WaveSample *ws = m_waveSamples[note].root; ws; ws = ws->next)
+        {
+          ws->m_cache = 0;
+          ws->m_cacheIndex = 0;
+          ws->m_cacheCodec = 0;
+        }
+    }
+  for (int nPoly = 0; nPoly < m_polyphony; nPoly++)
+    {
+      if (m_units[nPoly].busy)
+        endUnit(nPoly);
+      m_units[nPoly].cache = 0;
+    }
+
+  FreeLargeMem(m_cache);
+  m_cache = 0;
+  m_cacheSize = 0;
+  m_cacheOriginal = 0;
+}
+
+/**
+ * Keep the blocks of the samples streamed from the disk in the memory,
+ * so a note played again does not read the disk. Unlike CacheSamples(),
+ * the memory is fixed whatever the size of the bank, the blocks read
+ * least lately are dropped for the new ones.
+ *
+ * @param budget    The bytes of the blocks, 0 = no block cache.
+ * @return status code.
+ */
+int
+WaveTable::CacheBlocks(size_t budget)
+{
+  int rc = m_blocks.init(budget);
+  if (V_SUCCESS(rc) && budget)
+    {
+      LOG(INFO) << "block cache: " << budget / 1024 << " KBytes.\n";
+    }
+  return rc;
+}
+
+/**
+ * Stream the samples from the disk asynchronously, each unit reads
+ * ahead of its voice through io_uring instead of blocking in fread().
+ * The reads are submitted by PollStreams().
+ *
+ * With direct, the files are read with O_DIRECT into the rings of the
+ * units, bypassing the page cache, so a large bank does not push the
+ * rest of the system out of the memory. The reads are aligned either
+ * way, a bank compiled aligned (see WAVE_BANK_ALIGN) just wastes no
+ * bytes of the neighbouring samples. The prefetch advice, which would
+ * fill the page cache, is turned off then.
+ *
+ * @param direct    Whether to read the files with O_DIRECT.
+ * @return VERR_NOT_SUPPORTED if the system can not, the samples are
+ *         read synchronously then.
+ * @return status code.
+ */
+int
+WaveTable::InitStreams(bool direct)
+{
+  int rc = m_streams.init(m_polyphony);
+  if (V_SUCCESS(rc))
+    {
+      if (direct)
+        {
+          openDirect();
+          m_prefetch.init(0);
+        }
+      LOG(INFO) << "asynchronous streams: " << m_polyphony << " x " <<
+          STREAM_RING_SEGMENTS * STREAM_SEGMENT_SIZE / 1024 << " KBytes" <<
+          (direct ? ", O_DIRECT" : "") << ".\n";
+    }
+  return rc;
+}
+
+/*
+ * Open the sample files with O_DIRECT. A file which refuses it, on a
+ * file system without the support, is read through the page cache.
+ */
+void
+WaveTable::openDirect()
+{
+#if OS(LINUX)
+  for (SampleFile *sf = m_sampleFiles.root; sf; sf = sf->next)
+    {
+      if (sf->directFd < 0)
+        sf->directFd = ::open(sf->path.c_str(), O_RDONLY | O_DIRECT);
+      if (sf->directFd < 0)
+        {
+          LOG(WARNING) << "O_DIRECT is refused by " << sf->name << ", reading through the page cache.\n";
+        }
+    }
+
+  for (int note = 0; note < midi::_MAX_NOTE_NUM; note++)
+    {
+      for (WaveSample *ws = m_waveSamples[note].root; ws; ws = ws->next)
+        {
+          SampleFile *sf = m_sampleFiles.root;
+          for (int i = 0; sf && i < ws->m_fileId; i++)
+            sf = sf->next;
+          ws->m_directFd = sf ? sf->directFd : -1;
+        }
+    }
+#endif
+}
+
+/*
+ * Close the files opened with O_DIRECT.
+ */
+void
+WaveTable::closeDirect()
+{
+#if OS(LINUX)
+  for (SampleFile *sf = m_sampleFiles.root; sf; sf = sf->next)
+    {
+      if (sf->directFd >= 0)
+        ::close(sf->directFd);
+      sf->directFd = -1;
+    }
+#endif
+}
+
+/**
+ * Submit the reads the units have asked for while rendering, and take
+ * the completed ones. Call this once for each block.
+ * @return status code.
+ */
+int
+WaveTable::PollStreams()
+{
+  return m_streams.poll();
+}
+
+/*
+ * Load the block index of a coded sample.
+ * @param fp            The bank.
+ * @param offset        The start of the sample in the bank.
+ * @param size          Bytes of the decoded sample.
+ * @param frameBytes    Bytes of a frame.
+ * @param index         Where to store the offsets of the blocks, delete [] it.
+ * @param blocks        Where to store the number of the blocks.
+ * @param stored        Where to store the bytes of the sample in the bank.
+ * @return status code.
+ */
+int
+WaveTable::loadBlockIndex(FILE *fp, uint32_t offset, uint32_t size, uint32_t frameBytes,
+                          uint32_t **index, uint32_t *blocks, uint32_t *stored)
+{
+  WaveCodedSample_t hdr;
+
+  if (readFileAt(fp, offset, &hdr, sizeof(hdr)) != sizeof(hdr))
+    {
+      return VERR_READING_FILE;
+    }
+
+  uint32_t frames = size / frameBytes;
+  if (hdr.blocks != (frames + WAVE_CODEC_BLOCK_FRAMES - 1) / WAVE_CODEC_BLOCK_FRAMES)
+    {
+      return VERR_INVALID_DATA;
+    }
+
+  uint32_t *idx = new (std::nothrow) uint32_t[hdr.blocks + 1];
+  if (!idx)
+    {
+      return VERR_ALLOC_MEMORY;
+    }
+  size_t idxBytes = (hdr.blocks + 1) * sizeof(uint32_t);
+  if (readFileAt(fp, (uint64_t)offset + sizeof(hdr), idx, idxBytes) != idxBytes)
+    {
+      delete [] idx;
+      return VERR_READING_FILE;
+    }
+
+  /*
+   * The blocks follow the index one by one, up to the end of the sample.
+   */
+  bool valid = idx[0] == sizeof(hdr) + (hdr.blocks + 1) * sizeof(uint32_t) &&
+      idx[hdr.blocks] == hdr.stored;
+  for (uint32_t b = 0; valid && b < hdr.blocks; b++)
+    {
+      valid = idx[b] <= idx[b + 1] &&
+          idx[b + 1] - idx[b] <= WAVE_CODEC_BLOCK_BOUND(WAVE_CODEC_BLOCK_FRAMES, frameBytes);
+    }
+  if (!valid)
+    {
+      delete [] idx;
+      return VERR_INVALID_DATA;
+    }
+
+  *index = idx;
+  *blocks = hdr.blocks;
+  *stored = hdr.stored;
+  return VINF_SUCCEEDED;
+}
+
 /**
  * Inner, parse the syn table.
  * @param fp        Pointer to the file stream.
@@ -156,6 +854,9 @@ WaveTable::parseSynTable(FILE *fp)
   int _align = 0;
 
   uint32_t _offset = sizeof(WaveBank_t);
+  uint32_t _stored = 0;
+  uint32_t *_blockIndex = 0;
+  uint32_t _blocks = 0;
 
   /*
    * Read the each line
@@ -255,73 +956,123 @@ WaveTable::parseSynTable(FILE *fp)
                 (_align > 0))
               {
                 /*
-                 * Store the mapping information for each polyphonic unit.
+                 * Open the sample file. We made use of lazy loading
+                 * as we are in single-thread design. All the units
+                 * share the samples and the handle of the file, they
+                 * read at their own positions by readFileAt().
                  */
-                for (int nPoly = 0; nPoly < _MAX_POLYPHONY_NUM; nPoly++)
+                FILE *fp = 0;
+                int fileId = 0;
+                uint32_t bankAlign = 0;
+                int bankCodec = WAVE_CODEC_PCM;
+                for (SampleFile *sf = m_sampleFiles.root; sf; sf = sf->next, fileId++)
                   {
-                    /*
-                     * Open the sample file. We made use of lazy loading
-                     * as we are in single-thread design. Each note element
-                     * in the same polyphonic unit shared with the same sample
-                     * file buffer.
-                     */
-                    FILE *fp = 0;
-                    for (SampleFile *sf = m_units[nPoly].sampleFiles.root; sf; sf = sf->next)
+                    if (sf->name.compare(rawfile /*(1)*/) == 0)
                       {
-                        if (sf->name.compare(rawfile /*(1)*/) == 0)
-                          {
-                            fp = sf->fp; // so the requested has been opened before.
-                            break;
-                          }
+                        fp = sf->fp; // so the requested has been opened before.
+                        bankAlign = sf->align;
+                        bankCodec = sf->codec;
+                        break;
                       }
+                  }
 
+                if (!fp)
+                  {
+                    fp = fopen(_rawfile.c_str(), "rb");
                     if (!fp)
                       {
-                        fp = fopen(_rawfile.c_str(), "rb");
-                        if (!fp)
-                          {
-                            LOG(ERR) << "failed on loading sample: " << rawfile << "\n";
-                            return VERR_OPEN_FILE;
-                          }
-                        /*
-                         * once opened the file, we will cache the fp so that
-                         * the other note units will be able to reused it.
-                         */
-                        SampleFile *nsf = new (std::nothrow) SampleFile;
-                        if (!nsf)
-                          {
-                            return VERR_ALLOC_MEMORY;
-                          }
-                        nsf->name = rawfile; /*(1)*/
-                        nsf->fp = fp;
-                        rc = m_units[nPoly].sampleFiles.push(nsf);
-                        UPDATE_RC(rc);
+                        LOG(ERR) << "failed on loading sample: " << rawfile << "\n";
+                        return VERR_OPEN_FILE;
                       }
-
-                    WaveSample *ws = new (std::nothrow) WaveSample;
-                    if (!ws)
+                    /*
+                     * The header tells whether the samples are aligned,
+                     * and how they are coded.
+                     */
+                    WaveBank_t bank;
+                    if (readFileAt(fp, 0, &bank, sizeof(bank)) != sizeof(bank))
+                      {
+                        LOG(ERR) << "failed on reading the wave bank: " << rawfile << "\n";
+                        fclose(fp);
+                        return VERR_READING_FILE;
+                      }
+                    if (bank.align < 0 || (bank.align & (bank.align - 1)) ||
+                        (bank.codec != WAVE_CODEC_PCM && bank.codec != WAVE_CODEC_RICE))
+                      {
+                        fclose(fp);
+                        return VERR_INVALID_FORMAT;
+                      }
+                    bankAlign = bank.align;
+                    bankCodec = bank.codec;
+                    /*
+                     * once opened the file, we will cache the fp so that
+                     * the other notes will be able to reused it.
+                     */
+                    SampleFile *nsf = new (std::nothrow) SampleFile;
+                    if (!nsf)
                       {
+                        fclose(fp);
                         return VERR_ALLOC_MEMORY;
                       }
-                    ws->m_note      = _note;
-                    ws->m_name      = name;
-                    ws->m_rawfile   = rawfile;
-                    ws->m_bank      = _bank;
-                    ws->m_dynamics  = _dynamics;
-                    ws->m_size      = _size;
-                    ws->m_offset    = _offset;
-                    ws->m_channels  = _channels;
-                    ws->m_bps       = _bps;
-                    ws->m_rate      = _rate;
-                    ws->m_align     = _align;
-                    ws->m_file      = fp;
-
-                    rc = m_waveSamples[nPoly][_note].push(ws);
+                    nsf->name = rawfile; /*(1)*/
+                    nsf->path = _rawfile;
+                    nsf->fp = fp;
+                    nsf->directFd = -1;
+                    nsf->align = bankAlign;
+                    nsf->codec = bankCodec;
+                    rc = m_sampleFiles.push(nsf);
                     UPDATE_RC(rc);
                   }
 
+                if (bankAlign)
+                  {
+                    _offset = ALIGN_32(_offset, bankAlign);
+                  }
+
+                _stored = _size;
+                _blockIndex = 0;
+                _blocks = 0;
+                if (bankCodec == WAVE_CODEC_RICE)
+                  {
+                    if (_bps != 8 && _bps != 16 && _bps != 24)
+                      {
+                        return VERR_INVALID_FORMAT;
+                      }
+                    uint32_t frameBytes = _channels * _bps / 8;
+                    rc = loadBlockIndex(fp, _offset, _size, frameBytes,
+                                        &_blockIndex, &_blocks, &_stored);
+                    UPDATE_RC(rc);
+                    if (frameBytes > m_codedFrameBytes)
+                      m_codedFrameBytes = frameBytes;
+                  }
+
+                WaveSample *ws = new (std::nothrow) WaveSample;
+                if (!ws)
+                  {
+                    delete [] _blockIndex;
+                    return VERR_ALLOC_MEMORY;
+                  }
+                ws->m_note      = _note;
+                ws->m_name      = name;
+                ws->m_rawfile   = rawfile;
+                ws->m_bank      = _bank;
+                ws->m_dynamics  = _dynamics;
+                ws->m_size      = _size;
+                ws->m_stored    = _stored;
+                ws->m_blockIndex = _blockIndex;
+                ws->m_blocks    = _blocks;
+                ws->m_offset    = _offset;
+                ws->m_channels  = _channels;
+                ws->m_bps       = _bps;
+                ws->m_rate      = _rate;
+                ws->m_align     = _align;
+                ws->m_file      = fp;
+                ws->m_fileId    = fileId;
+
+                rc = m_waveSamples[_note].push(ws);
+                UPDATE_RC(rc);
+
                 // pointer to the next wave
-                _offset += _size;
+                _offset += _stored;
 
                 LOG(INFO) << "sample loaded: " << name << "\n";
               }
@@ -355,58 +1106,51 @@ WaveTable::parseSynTable(FILE *fp)
 }
 
 /*
- * Send a MIDI event to the polyphonic unit.
+ * Send a MIDI event to the polyphonic unit. A NoteOn posts the note to a
+ * unit, a NoteOff (or NoteOn of velocity 0) releases the unit playing
+ * the key, the unit streams on until ClosePipeChannel().
  * @param event         Reference of the source event.
- * @param poly          Optionally, Where to store the index of polyphony unit.
+ * @param poly          Optionally, Where to store the index of polyphony
+ *                      unit, -1 if the event does not involve any unit.
+ * @return VINF_REPLACED if the note took the unit of a sounding one.
  * @return status code.
  */
 int
 WaveTable::SendMIDIEvent(const midi::Event &event, int *poly)
 {
+  if (poly)
+    *poly = -1;
+
   /*
    * Filter the MIDI events
    */
   switch (event.type())
   {
+    case midi::NoteOn:
+      if (event.velocity())
+        break;
+      /* fall through */
     case midi::NoteOff:
+      for (int n = 0; n < m_polyphony; n++)
+        {
+          PolyUnit *unit = &m_units[n];
+          if (unit->busy && !unit->released &&
+              unit->event.channel() == event.channel() &&
+              unit->event.key() == event.key())
+            {
+              unit->released = true;
+              if (poly)
+                *poly = n;
+              break;
+            }
+        }
       return VINF_SUCCEEDED;
-    case midi::NoteOn:
-      break;
     case midi::PitchBend:
       return VINF_SUCCEEDED;
     default:
       return VINF_SUCCEEDED;
   }
 
-  /*
-   * First of all, Dispatching the units
-   */
-  int nPoly;
-  for (nPoly = 0; nPoly < _MAX_POLYPHONY_NUM; nPoly++)
-    {
-      if (!m_units[nPoly].busy) break;
-    }
-  /*
-   * There is no free unit available, so we have to
-   * force the most suitable unit to stall.
-   */
-  if (nPoly == _MAX_POLYPHONY_NUM)
-    {
-      nPoly = 0;
-      /*
-       * Find the minimum remain
-       */
-      size_t min = m_units[0].remain;
-      for (int n = 1; n < _MAX_POLYPHONY_NUM; n++)
-        {
-          if (m_units[n].remain < min)
-            {
-              min = m_units[n].remain;
-              nPoly = n;
-            }
-        }
-    }
-
   midi::Note note = midi::mapNote(event.key());
 
   if (note == midi::NOTE_INVALID)
@@ -416,12 +1160,24 @@ WaveTable::SendMIDIEvent(const midi::Event &event, int *poly)
 
   V_ASSERT(note > midi::NOTE_INVALID && note < midi::_MAX_NOTE_NUM);
 
+  if (!m_waveSamples[note].root)
+    {
+      return VINF_SUCCEEDED;
+    }
+
+  /*
+   * First of all, Dispatching the units. When there is no free unit
+   * available, the least audible one is stolen.
+   */
+  bool stolen;
+  int nPoly = m_voices.acquire(&stolen);
+
   /*
    * Match the bank and map the velocity to dynamics.
    */
   int dV, Vm = 128;
   WaveSample *ws = 0, *m = 0;
-  for (WaveSample *w = m_waveSamples[nPoly][note].root; w; w = w->next)
+  for (WaveSample *w = m_waveSamples[note].root; w; w = w->next)
     {
       ws = w;
       dV = abs(event.velocity() - w->m_dynamics);
@@ -441,44 +1197,78 @@ WaveTable::SendMIDIEvent(const midi::Event &event, int *poly)
   int level = MAX_LEVEL + dV;
 
   /*
-   * Prepare the file stream, this is a slow procedure as it
-   * will cause heavily disk accessing.
+   * Prepare the stream of the sample. When it fails, the unit taken is
+   * given back, ending the note stolen from it.
+   */
+  uint32_t start = ws->m_blockIndex ? ws->m_blockIndex[0] : 0; // skip the block index
+  if (!ws->m_cache && m_streams.enabled())
+    {
+      int fd = ws->m_directFd >= 0 ? ws->m_directFd : fileno(ws->m_file);
+      int rc = m_streams.open(nPoly, fd, ws->m_offset + start, ws->m_stored - start);
+      if (V_FAILURE(rc))
+        {
+          if (stolen)
+            endUnit(nPoly);
+          else
+            m_voices.release(nPoly);
+          return rc;
+        }
+    }
+
+  /*
+   * Read the samples of the likely next notes ahead.
    */
-  fseek(ws->m_file, ws->m_offset, SEEK_SET);
+  m_prefetch.noteOn(note, ws);
 
   /*
    * Post the event
    */
   m_units[nPoly].busy = true;
+  m_units[nPoly].released = false;
   m_units[nPoly].event = event;
   m_units[nPoly].dynamics = ws->m_dynamics;
   m_units[nPoly].level = level;
   m_units[nPoly].fp = ws->m_file;
+  m_units[nPoly].fileId = ws->m_fileId;
+  m_units[nPoly].offset = ws->m_offset;
+  m_units[nPoly].channels = ws->m_channels;
+  if (ws->m_cache && ws->m_cacheIndex)
+    {
+      m_units[nPoly].blockIndex = ws->m_cacheIndex;
+      m_units[nPoly].codec = ws->m_cacheCodec;
+    }
+  else
+    {
+      m_units[nPoly].blockIndex = ws->m_blockIndex;
+      m_units[nPoly].codec = WAVE_CODEC_RICE;
+    }
+  m_units[nPoly].decoded = -1;
+  m_units[nPoly].cache = ws->m_cache;
   m_units[nPoly].len = 0;
   m_units[nPoly].remain = ws->m_size;
   m_units[nPoly].size = ws->m_size;
 
+  m_voices.start(nPoly, (float)level / MAX_LEVEL);
+  activateUnit(nPoly);
+
 #if DEBUG_LEVEL > 1
   LOG(INFO) << "sample:" << ws->m_name << " velocity = " << (uint32_t)ws->m_dynamics << " level = " << level << "\n";
 #endif
 
   if (poly)
     *poly = nPoly;
-  return VINF_SUCCEEDED;
+  return stolen ? VINF_REPLACED : VINF_SUCCEEDED;
 }
 
 
 WaveSample *
 WaveTable::queryCommonSample()
 {
-  for (int i = 0; i < _MAX_POLYPHONY_NUM; i++)
+  for (int j = 0; j < midi::_MAX_NOTE_NUM; j++)
     {
-      for (int j = 0; j < midi::_MAX_NOTE_NUM; j++)
+      if (m_waveSamples[j].root)
         {
-          if (m_waveSamples[i][j].root)
-            {
-              return m_waveSamples[i][j].root;
-            }
+          return m_waveSamples[j].root;
         }
     }
   return 0;
@@ -540,7 +1330,22 @@ WaveTable::GetChannels()
 int
 WaveTable::GetPipeChannelNum()
 {
-  return _MAX_POLYPHONY_NUM;
+  return m_polyphony;
+}
+
+/**
+ * Get the pipes which are busy, packed in no particular order. A pipe
+ * which ends is swapped with the last one, so walking the list from
+ * the end to the start visits each pipe once even if it ends during
+ * the walk.
+ * @param pipes         Where to store the pointer to the indexes.
+ * @return the number of busy pipes.
+ */
+int
+WaveTable::GetActivePipes(const int **pipes)
+{
+  *pipes = m_active;
+  return m_activeCount;
 }
 
 /**
@@ -550,174 +1355,452 @@ WaveTable::GetPipeChannelNum()
 bool
 WaveTable::PipeBusy(int index)
 {
-  V_ASSERT(index >= 0 && index < _MAX_POLYPHONY_NUM);
+  V_ASSERT(index >= 0 && index < m_polyphony);
   return m_units[index].busy;
 }
 
 /**
- * Read the data from a audio pipe.
+ * Query whether the note of the pipe is released.
+ * @return true if it is.
+ */
+bool
+WaveTable::PipeReleased(int index)
+{
+  V_ASSERT(index >= 0 && index < m_polyphony);
+  return m_units[index].released;
+}
+
+/**
+ * Stop streaming a pipe before the end of its sample, the unit is free
+ * to take the next note. This is for a voice which has decayed away.
  * @param index         The index of target pipe.
- * @param ori           Where to store the original sample data.
- *                      The bits of each of the sample is specified
- *                      by GetBps().
- * @param buff          Where to store the unified sample data, the
- *                      buffer should have enough space to be filled in.
- * @param nsamples      The count of samples you want to read. It should
- *                      be the multiple of sizeof(Sample_t), otherwise
- *                      it will cause something unforeseen.
+ */
+void
+WaveTable::ClosePipeChannel(int index)
+{
+  V_ASSERT(index >= 0 && index < m_polyphony);
+  PolyUnit *unit = &m_units[index];
+
+  unit->remain = 0;
+  endUnit(index);
+}
+
+/*
+ * Put a unit posted a note in the list of the busy ones.
+ */
+void
+WaveTable::activateUnit(int index)
+{
+  if (m_activePos[index] >= 0)
+    return; // the unit was stolen, it is in the list already
+
+  m_activePos[index] = m_activeCount;
+  m_active[m_activeCount++] = index;
+}
+
+/*
+ * The unit has finished its note, it is free for the next one.
+ */
+void
+WaveTable::endUnit(int index)
+{
+  PolyUnit *unit = &m_units[index];
+
+  unit->busy = false;
+  unit->released = false;
+  m_voices.release(index);
+  if (m_streams.enabled())
+    m_streams.close(index);
+
+  int pos = m_activePos[index];
+  if (pos >= 0)
+    {
+      int last = m_active[--m_activeCount];
+      m_active[pos] = last;
+      m_activePos[last] = pos;
+      m_activePos[index] = -1;
+    }
+}
+
+/**
+ * Tell how loud a pipe is now, the quietest pipe is the one stolen
+ * when there is no free unit for a new note.
+ * @param index         The index of target pipe.
+ * @param gain          The gain of the effectors on the pipe, 0 ~ 1.
+ */
+void
+WaveTable::SetPipeLoudness(int index, float gain)
+{
+  V_ASSERT(index >= 0 && index < m_polyphony);
+  m_voices.update(index, gain * m_units[index].level / MAX_LEVEL);
+}
+
+/**
+ * Get the counters of the voice allocation.
+ * @param stats         Where to store the counters.
+ */
+void
+WaveTable::GetVoiceStats(VoiceStats *stats)
+{
+  m_voices.getStats(stats);
+}
+
+/**
+ * Get the counters of the sample prefetch.
+ * @param stats         Where to store the counters.
+ */
+void
+WaveTable::GetPrefetchStats(PrefetchStats *stats)
+{
+  m_prefetch.getStats(stats);
+}
+
+/**
+ * Get the counters of the block cache.
+ * @param stats         Where to store the counters.
+ */
+void
+WaveTable::GetBlockCacheStats(BlockCacheStats *stats)
+{
+  m_blocks.getStats(stats);
+}
+
+/**
+ * Get the counters of the asynchronous streams.
+ * @param stats         Where to store the counters.
+ */
+void
+WaveTable::GetStreamStats(StreamStats *stats)
+{
+  m_streams.getStats(stats);
+}
+
+/**
+ * Get the sizes of the in-memory sample store, the ratio of them is
+ * what CompressSamples() saves.
+ * @param stats         Where to store the sizes.
+ */
+void
+WaveTable::GetSampleCacheStats(SampleCacheStats *stats)
+{
+  stats->resident = m_cacheSize;
+  stats->original = m_cacheOriginal;
+}
+
+/**
+ * Fetch the original data of a audio pipe, without decoding it. The
+ * data is only copied when it has to, a cached sample is given in
+ * place, so is data which lies in one block of the block cache or in one
+ * segment of a stream. The latter is valid until the next fetch.
+ * @param index         The index of target pipe.
+ * @param ori           Where to store the original sample data if it
+ *                      has to be read or padded.
+ * @param nsamples      The count of samples you want to read.
+ * @param chunk         Where to store the description of the data.
  * @return status code.
  */
 int
-WaveTable::ReadPipeChannel(int index, void *ori, Sample_t *buff, size_t nsamples)
+WaveTable::FetchPipeChannel(int index, void *ori, size_t nsamples, PipeChunk *chunk)
 {
   int64_t remain = 0;
 
-  V_ASSERT(index >= 0 && index < _MAX_POLYPHONY_NUM);
+  V_ASSERT(index >= 0 && index < m_polyphony);
   PolyUnit *unit = &m_units[index];
 
-  if (unit->busy)
+  chunk->sampleSize = m_sampleSize;
+  chunk->level = unit->level;
+  chunk->pcm = 0;
+
+  if (!unit->busy)
     {
-      V_ASSERT(unit->fp && unit->size);
+      return VINF_SUCCEEDED;
+    }
 
-      /*
-       * Work out the length of original data
-       */
-      size_t len = nsamples * m_sampleSize;
+  V_ASSERT(unit->fp && unit->size);
+
+  /*
+   * Work out the length of original data
+   */
+  size_t len = nsamples * m_sampleSize;
+
+  remain = (int64_t)len - (int64_t)unit->remain;
+  if (remain > 0)
+    {
+      len = unit->remain;
+    }
 
-      remain = (int64_t)len - (int64_t)unit->remain;
+  /*
+   * Read the sample from the cache if it is resident, otherwise
+   * from the file. The latter is a slow procedure. A coded sample
+   * is decoded a block at a time.
+   */
+  if (unit->blockIndex)
+    {
+      int rc = readCoded(index, ori, len, &chunk->pcm);
+      if (V_FAILURE(rc))
+        {
+          return rc;
+        }
       if (remain > 0)
         {
-          len = unit->remain;
+          if (chunk->pcm != ori)
+            memcpy(ori, chunk->pcm, len);
+          memset((char*)ori + len, 0, remain);
+          chunk->pcm = reinterpret_cast<const uint8_t *>(ori);
         }
-
-      /*
-       * Read the sample from the file. The following
-       * procedure is a slow one. Should we consider a
-       * extra special cache there ?
-       */
-      size_t rd = fread(ori, 1,len, unit->fp);
-      if (rd != len || ferror(unit->fp))
+    }
+  else if (unit->cache && remain <= 0)
+    {
+      chunk->pcm = unit->cache + unit->len;
+    }
+  else if (!unit->cache && (m_streams.enabled() || m_blocks.enabled()))
+    {
+      int rc = m_streams.enabled()
+          ? m_streams.read(index, len, ori, &chunk->pcm)
+          : m_blocks.read(unit->fileId, unit->fp, unit->offset + unit->len, len, ori, &chunk->pcm);
+      if (V_FAILURE(rc))
         {
-          return VERR_READING_FILE;
+          return rc;
+        }
+      if (remain > 0)
+        {
+          if (chunk->pcm != ori)
+            memcpy(ori, chunk->pcm, len);
+          memset((char*)ori + len, 0, remain);
+          chunk->pcm = reinterpret_cast<const uint8_t *>(ori);
+        }
+    }
+  else
+    {
+      if (unit->cache)
+        {
+          memcpy(ori, unit->cache + unit->len, len);
+        }
+      else
+        {
+          size_t rd = readFileAt(unit->fp, unit->offset + unit->len, ori, len);
+          if (rd != len)
+            {
+              return VERR_READING_FILE;
+            }
         }
       if (remain > 0)
         {
-          memset((char*)ori + rd, 0, remain);
+          memset((char*)ori + len, 0, remain);
         }
+      chunk->pcm = reinterpret_cast<const uint8_t *>(ori);
+    }
 
-      int level = unit->level;
+  /*
+   * Refresh the status of this unit.
+   */
+  unit->len += len;
+  unit->remain -= len;
+  if ((int64_t)(unit->remain) <= 0)
+    {
+      endUnit(index);
+    }
 
-      size_t n = nsamples;
-      uint8_t *src = reinterpret_cast<uint8_t *>(ori);
-      uint8_t *dst = reinterpret_cast<uint8_t *>(buff);
+  return VINF_SUCCEEDED;
+}
 
-      register int64_t sample;
+/*
+ * Read the data of a coded sample, decoding the blocks it goes through.
+ * The data which lies in one block is given in place.
+ */
+int
+WaveTable::readCoded(int index, void *ori, size_t len, const uint8_t **data)
+{
+  PolyUnit *unit = &m_units[index];
+  const size_t blockBytes = WAVE_CODEC_BLOCK_FRAMES * unit->channels * m_sampleSize;
 
-      /*
-       * Convert the original data into unified samples.
-       * This could be optimized by vector asm.
-       */
-      switch (m_sampleSize)
-      {
-        case 1: // 8bit
-          {
-            while ( n-- )
-              {
-#if HAVE(BIGENDIAN)
-                *dst++ = *src++;
-                *dst++ = 0;
-                *dst++ = 0;
-                *dst++ = 0;
-#else
-                *dst++ = 0;
-                *dst++ = 0;
-                *dst++ = 0;
-                *dst++ = *src++;
-#endif
-                sample = *buff;
-                COMP_LEVEL(sample, level);
-                *buff++ = sample;
-              }
-          }
-          break;
-        case 2: // 16bit
-          {
-            while ( n-- )
-              {
-#if HAVE(BIGENDIAN)
-                *dst++ = src[1];
-                *dst++ = src[0];
-                *dst++ = 0;
-                *dst++ = 0;
-                src += 2;
-#else
-                *dst++ = 0;
-                *dst++ = 0;
-                *dst++ = *src++;
-                *dst++ = *src++;
-#endif
-                sample = *buff;
-                COMP_LEVEL(sample, level);
-                *buff++ = sample;
-              }
-          }
-          break;
-        case 3: // 24bit
-          {
-            while ( n-- )
-              {
-#if HAVE(BIGENDIAN)
-                *dst++ = src[2];
-                *dst++ = src[1];
-                *dst++ = src[0];
-                *dst++ = 0;
-                src += 3;
-#else
-                *dst++ = 0;
-                *dst++ = *src++;
-                *dst++ = *src++;
-                *dst++ = *src++;
-#endif
-                sample = *buff;
-                COMP_LEVEL(sample, level);
-                *buff++ = sample;
-              }
-          }
-          break;
+  uint8_t *out = reinterpret_cast<uint8_t *>(ori);
+  size_t pos = unit->len;
+  *data = out;
 
-        case 4: // 32bit
+  while (len)
+    {
+      int block = (int)(pos / blockBytes);
+      if (block != unit->decoded)
         {
-          memcpy(buff, ori, rd);
+          int rc = decodeBlock(index, block);
+          if (V_FAILURE(rc))
+            {
+              return rc;
+            }
         }
-        break;
 
-        default: /* if this happens, FIXME! */
-          V_ASSERT(0);
-          return VERR_FAILED;
-      }
+      size_t offset = pos % blockBytes;
+      size_t end = unit->size - (size_t)block * blockBytes;
+      if (end > blockBytes)
+        end = blockBytes;
 
-      /*
-       * Refresh the status of this unit.
-       */
-      unit->len += rd;
-      unit->remain -= rd;
-      if ((int64_t)(unit->remain) <= 0)
+      size_t n = end - offset;
+      if (n > len)
+        n = len;
+
+      if (n == len && out == ori)
+        {
+          *data = unit->pcm + offset;
+          return VINF_SUCCEEDED;
+        }
+
+      memcpy(out, unit->pcm + offset, n);
+      out += n;
+      pos += n;
+      len -= n;
+    }
+  return VINF_SUCCEEDED;
+}
+
+/*
+ * Decode a block of the coded sample of a unit. The blocks are decoded
+ * in order, so the streams are read on one by one.
+ */
+int
+WaveTable::decodeBlock(int index, int block)
+{
+  PolyUnit *unit = &m_units[index];
+  const uint32_t *idx = unit->blockIndex;
+  const size_t frameBytes = unit->channels * m_sampleSize;
+
+  size_t clen = idx[block + 1] - idx[block];
+  if (clen > m_codedScratchSize)
+    {
+      return VERR_INVALID_DATA;
+    }
+
+  const uint8_t *src;
+  if (unit->cache)
+    {
+      src = unit->cache + idx[block];
+    }
+  else if (m_streams.enabled())
+    {
+      int rc = m_streams.read(index, clen, m_codedScratch, &src);
+      if (V_FAILURE(rc))
+        {
+          return rc;
+        }
+    }
+  else if (m_blocks.enabled())
+    {
+      int rc = m_blocks.read(unit->fileId, unit->fp, unit->offset + idx[block], clen, m_codedScratch, &src);
+      if (V_FAILURE(rc))
+        {
+          return rc;
+        }
+    }
+  else
+    {
+      if (readFileAt(unit->fp, unit->offset + idx[block], m_codedScratch, clen) != clen)
         {
-          unit->busy = false;
+          return VERR_READING_FILE;
         }
+      src = m_codedScratch;
     }
+
+  size_t frames = unit->size / frameBytes - (size_t)block * WAVE_CODEC_BLOCK_FRAMES;
+  if (frames > WAVE_CODEC_BLOCK_FRAMES)
+    frames = WAVE_CODEC_BLOCK_FRAMES;
+
+  int rc;
+  if (unit->codec == WAVE_CODEC_ADPCM)
+    rc = decodeAdpcmBlock(src, clen, unit->channels, frames, unit->pcm);
   else
+    rc = decodeRiceBlock(src, clen, unit->channels, m_sampleSize, frames, unit->pcm);
+  if (V_SUCCESS(rc))
+    {
+      unit->decoded = block;
+    }
+  return rc;
+}
+
+/*
+ * Convert the original data into unified samples.
+ */
+template <int BYTES>
+  static void
+  decodeChunk(const uint8_t *src, int level, Sample_t *buff, size_t n)
+{
+  register int64_t sample;
+
+  while ( n-- )
+    {
+      sample = decodePcm<BYTES>(src);
+      COMP_LEVEL(sample, level);
+      *buff++ = sample;
+      src += BYTES;
+    }
+}
+
+/**
+ * Decode the fetched data into unified samples.
+ * @param chunk         The data given by FetchPipeChannel().
+ * @param buff          Where to store the unified sample data.
+ * @param nsamples      The count of samples.
+ * @return VINF_SILENCE if the pipe is idle, the buffer is all zero.
+ * @return status code.
+ */
+int
+WaveTable::DecodePipeChunk(const PipeChunk &chunk, Sample_t *buff, size_t nsamples)
+{
+  if (!chunk.pcm)
     {
       /*
        * Fill the buffer with silence zeros.
        */
       memset(buff, 0, nsamples * sizeof(Sample_t));
+      return VINF_SILENCE;
     }
 
-  /* succeeded! */
+  switch (chunk.sampleSize)
+  {
+    case 1: // 8bit
+      decodeChunk<1>(chunk.pcm, chunk.level, buff, nsamples);
+      break;
+    case 2: // 16bit
+      decodeChunk<2>(chunk.pcm, chunk.level, buff, nsamples);
+      break;
+    case 3: // 24bit
+      decodeChunk<3>(chunk.pcm, chunk.level, buff, nsamples);
+      break;
+    case 4: // 32bit
+      memcpy(buff, chunk.pcm, nsamples * sizeof(Sample_t));
+      break;
+
+    default: /* if this happens, FIXME! */
+      V_ASSERT(0);
+      return VERR_FAILED;
+  }
   return VINF_SUCCEEDED;
 }
 
+/**
+ * Read the data from a audio pipe.
+ * @param index         The index of target pipe.
+ * @param ori           Where to store the original sample data.
+ *                      The bits of each of the sample is specified
+ *                      by GetBps().
+ * @param buff          Where to store the unified sample data, the
+ *                      buffer should have enough space to be filled in.
+ * @param nsamples      The count of samples you want to read. It should
+ *                      be the multiple of sizeof(Sample_t), otherwise
+ *                      it will cause something unforeseen.
+ * @return VINF_SILENCE if the pipe is idle, the buffer is all zero.
+ * @return status code.
+ */
+int
+WaveTable::ReadPipeChannel(int index, void *ori, Sample_t *buff, size_t nsamples)
+{
+  PipeChunk chunk;
+
+  int rc = FetchPipeChannel(index, ori, nsamples, &chunk);
+  if (V_SUCCESS(rc))
+    rc = DecodePipeChunk(chunk, buff, nsamples);
+  return rc;
+}
+
 /******************************************************************************/
 /* END - KEY AUDIO PIPE */
 /******************************************************************************/
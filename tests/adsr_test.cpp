@@ -0,0 +1,249 @@
+/** @file
+ * Qin - Tests of the ADSR envelope.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <cstdlib>
+#include <string>
+
+#include "util/error.h"
+#include "dsp/effect.h"
+
+#include "test.h"
+
+/* a rate of 1000 Hz makes the milliseconds frames */
+#define TEST_RATE       (1000)
+#define TEST_INPUT      (1 << 24)
+#define TEST_FRAMES     (120)
+
+/*
+ * The envelope worked out one frame at a time, the way the state
+ * machine ran before it was rendered per block.
+ */
+static void
+referenceEnv(float attack, float decay, float sustain, float release,
+             int gateOff, float *env, int nframes)
+{
+  enum { idle, att, dec, sus, rel } state = att;
+  float level = 0;
+
+  for (int i = 0; i < nframes; i++)
+    {
+      if (i == gateOff)
+        state = rel;
+
+      switch (state)
+      {
+        case att:
+          level += 1 / (attack * TEST_RATE / 1000);
+          if (level >= 1)
+            {
+              level = 1;
+              state = dec;
+            }
+          break;
+        case dec:
+          level -= 1 / (decay * TEST_RATE / 1000);
+          if (level <= sustain)
+            {
+              level = sustain;
+              state = sus;
+            }
+          break;
+        case rel:
+          level -= 1 / (release * TEST_RATE / 1000);
+          if (level <= 0)
+            {
+              level = 0;
+              state = idle;
+            }
+          break;
+        default:
+          break;
+      }
+      env[i] = level;
+    }
+}
+
+/*
+ * Render the envelope through process() in blocks of 'block' frames,
+ * releasing the gate at 'gateOff', and compare it to the reference.
+ */
+static void
+checkAgainstReference(int channels, int block, int gateOff)
+{
+  const float attack = 12.5f, decay = 25, sustain = 50, release = 11;
+  float ref[TEST_FRAMES];
+  Sample_t buff[TEST_FRAMES * 2];
+
+  referenceEnv(attack, decay, sustain / 100, release, gateOff, ref, TEST_FRAMES);
+
+  dsp::ADSRImpl adsr(TEST_RATE, channels);
+  adsr.setParameter(0, attack);
+  adsr.setParameter(1, decay);
+  adsr.setParameter(2, sustain);
+  adsr.setParameter(3, release);
+  TEST_CHECK(V_SUCCESS(adsr.init(0)));
+  adsr.gate(true);
+
+  for (int i = 0; i < TEST_FRAMES * channels; i++)
+    buff[i] = TEST_INPUT;
+
+  int done = 0;
+  while (done < TEST_FRAMES)
+    {
+      int n = TEST_FRAMES - done < block ? TEST_FRAMES - done : block;
+      if (done < gateOff && done + n > gateOff)
+        n = gateOff - done;
+      if (done == gateOff)
+        adsr.gate(false);
+
+      TEST_CHECK(V_SUCCESS(adsr.process(buff + done * channels, n)));
+      done += n;
+    }
+
+  for (int i = 0; i < TEST_FRAMES; i++)
+    {
+      Sample_t expect = (Sample_t)(TEST_INPUT * ref[i]);
+      for (int c = 0; c < channels; c++)
+        {
+          TEST_CHECK(std::abs(buff[i * channels + c] - expect) <= TEST_INPUT / 100000);
+        }
+    }
+}
+
+/*
+ * The block envelope follows the per frame one whatever the size of
+ * the blocks, and wherever the gate is released.
+ */
+static void
+testBlockEnvelope()
+{
+  checkAgainstReference(1, TEST_FRAMES, 60);
+  checkAgainstReference(2, 7, 60);
+  checkAgainstReference(2, 1, 60);
+  checkAgainstReference(1, 5, 16);
+  checkAgainstReference(2, 3, 4);
+}
+
+/*
+ * Render an envelope of the given shape for all the stages into env,
+ * the gate is released at 'gateOff'.
+ */
+static void
+renderCurve(int curve, int gateOff, float *env, int nframes)
+{
+  static const float square[] = { 0, 0.0625f, 0.25f, 0.5625f, 1 };
+  Sample_t buff[_EFFECT_BLOCK_FRAMES];
+
+  dsp::ADSRImpl adsr(TEST_RATE, 1);
+  adsr.setParameter(0, 40);
+  adsr.setParameter(1, 40);
+  adsr.setParameter(2, 50);
+  adsr.setParameter(3, 40);
+  adsr.setParameter(4, curve);
+  adsr.setParameter(5, curve);
+  adsr.setParameter(6, curve);
+  TEST_CHECK(V_SUCCESS(adsr.setCurveTable(square, 5)));
+  TEST_CHECK(V_SUCCESS(adsr.init(0)));
+  adsr.gate(true);
+
+  for (int i = 0; i < nframes; i++)
+    buff[i] = TEST_INPUT;
+  TEST_CHECK(V_SUCCESS(adsr.process(buff, gateOff)));
+  adsr.gate(false);
+  TEST_CHECK(V_SUCCESS(adsr.process(buff + gateOff, nframes - gateOff)));
+
+  for (int i = 0; i < nframes; i++)
+    env[i] = (float)buff[i] / TEST_INPUT;
+}
+
+/*
+ * Every shape starts each stage where the last one stopped, moves one
+ * way only, and lands exactly on its target: the top, the sustain level
+ * and zero. The middle of the attack tells the shapes apart.
+ */
+static void
+testCurveEndpoints()
+{
+  const int gateOff = 100, nframes = 200;
+  float env[nframes];
+
+  for (int curve = 0; curve < 3; curve++)
+    {
+      renderCurve(curve, gateOff, env, nframes);
+
+      int top = 0;
+      while (top < gateOff && env[top] < 1)
+        top++;
+      TEST_CHECK(top == 39 || top == 40);
+      TEST_CHECK(env[0] > 0);
+      for (int i = 1; i <= top; i++)
+        TEST_CHECK(env[i] >= env[i - 1]);
+
+      int sustain = top;
+      while (sustain < gateOff && env[sustain] > 0.5f)
+        sustain++;
+      TEST_CHECK(sustain < gateOff);
+      for (int i = top + 1; i < gateOff; i++)
+        TEST_CHECK(env[i] <= env[i - 1]);
+      for (int i = sustain; i < gateOff; i++)
+        TEST_CHECK(env[i] == 0.5f);
+
+      int idle = gateOff;
+      while (idle < nframes && env[idle] > 0)
+        idle++;
+      TEST_CHECK(idle <= gateOff + 40);
+      for (int i = gateOff; i < nframes; i++)
+        TEST_CHECK(env[i] <= env[i - 1]);
+      for (int i = idle; i < nframes; i++)
+        TEST_CHECK(env[i] == 0);
+
+      switch (curve)
+      {
+        case 0: TEST_CHECK(env[19] > 0.49f && env[19] < 0.51f); break;
+        case 1: TEST_CHECK(env[19] > 0.6f); break;
+        case 2: TEST_CHECK(env[19] > 0.24f && env[19] < 0.26f); break;
+      }
+    }
+}
+
+/*
+ * An idle envelope writes silence, and says so.
+ */
+static void
+testIdle()
+{
+  Sample_t buff[16];
+  dsp::ADSRImpl adsr(TEST_RATE, 2);
+  TEST_CHECK(V_SUCCESS(adsr.init(0)));
+
+  for (int i = 0; i < 16; i++)
+    buff[i] = TEST_INPUT;
+  TEST_CHECK(adsr.process(buff, 8) == VINF_SILENCE);
+  for (int i = 0; i < 16; i++)
+    TEST_CHECK(buff[i] == 0);
+}
+
+int
+main()
+{
+  testBlockEnvelope();
+  testCurveEndpoints();
+  testIdle();
+  return testResult("adsr_test");
+}
@@ -0,0 +1,272 @@
+/** @file
+ * Qin - Tests of the batches of the group effectors.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <cmath>
+#include <cstring>
+#include <new>
+#include <stdint.h>
+
+#include "util/error.h"
+#include "dsp/effect.h"
+
+#include "test.h"
+
+using namespace dsp;
+
+#define TEST_RATE   (48000)
+#define TEST_FRAMES (4800)
+
+static const double testPi = 4. * atan(1.);
+
+/*
+ * Run a buffer of each voice through a batch.
+ */
+static void
+runBatch(IEffectorBatch *batch, Sample_t *const *buffs, int count)
+{
+  int voices[_MAX_POLYPHONY_NUM];
+  bool silent[_MAX_POLYPHONY_NUM];
+
+  for (int i = 0; i < count; i++)
+    {
+      voices[i] = i;
+      silent[i] = false;
+    }
+  TEST_CHECK(V_SUCCESS(batch->process(voices, buffs, silent, count, TEST_FRAMES)));
+}
+
+/*
+ * Fill a mono buffer with a sine, and tell the peak left after a
+ * batch in the second half.
+ */
+static void
+fillSine(Sample_t *buff, double freq)
+{
+  for (int i = 0; i < TEST_FRAMES; i++)
+    buff[i] = (Sample_t)(1.0e8 * sin(2 * testPi * freq * i / TEST_RATE));
+}
+
+static double
+peak(const Sample_t *buff)
+{
+  double m = 0;
+  for (int i = TEST_FRAMES / 2; i < TEST_FRAMES; i++)
+    if (fabs((double)buff[i]) > m)
+      m = fabs((double)buff[i]);
+  return m / 1.0e8;
+}
+
+/*
+ * The sustain set after the batch was made holds the voices.
+ */
+static void
+testADSRParameter()
+{
+  ADSRImpl adsr(TEST_RATE, 1);
+  adsr.setParameter(0 /* Attack */, 1);
+  adsr.setParameter(1 /* Decay */, 1);
+
+  IEffectorBatch *batch = adsr.createBatch(1);
+  TEST_CHECK(batch != 0);
+  if (!batch) return;
+
+  batch->setParameter(2 /* Sustain */, 50);
+  batch->gate(0, true);
+
+  Sample_t *buff = new (std::nothrow) Sample_t[TEST_FRAMES];
+  for (int i = 0; i < TEST_FRAMES; i++)
+    buff[i] = 1000000;
+  runBatch(batch, &buff, 1);
+
+  TEST_CHECK(fabs(batch->level(0) - 0.5f) < 1e-3f);
+  TEST_CHECK(abs(buff[TEST_FRAMES - 1] - 500000) < 1000);
+
+  delete [] buff;
+  delete batch;
+}
+
+/*
+ * The class and the cutoff set after the batch was made reach every
+ * voice: a low pass at 100 Hz takes out a 5 kHz sine which the band
+ * notch at 300 Hz let through.
+ */
+static void
+testFilterParameter()
+{
+  const int voices = 3;
+  FilterImpl filter(TEST_RATE, 1);
+  IEffectorBatch *batch = filter.createBatch(voices);
+  TEST_CHECK(batch != 0);
+  if (!batch) return;
+
+  Sample_t *buffs[voices];
+  for (int v = 0; v < voices; v++)
+    {
+      buffs[v] = new (std::nothrow) Sample_t[TEST_FRAMES];
+      fillSine(buffs[v], 5000);
+    }
+  runBatch(batch, buffs, voices);
+  for (int v = 0; v < voices; v++)
+    TEST_CHECK(peak(buffs[v]) > 0.9);
+
+  batch->setParameter(3 /* Class */, BIQUAD_LOWPASS);
+  batch->setParameter(0 /* Freq */, 100);
+  for (int v = 0; v < voices; v++)
+    fillSine(buffs[v], 5000);
+  runBatch(batch, buffs, voices);
+  for (int v = 0; v < voices; v++)
+    TEST_CHECK(peak(buffs[v]) < 0.01);
+
+  for (int v = 0; v < voices; v++)
+    delete [] buffs[v];
+  delete batch;
+}
+
+/*
+ * A filter voice given the silence keeps running until its tail has
+ * rung out, then it sleeps and passes the silence on. The voice next
+ * to it which still sounds is not held back.
+ */
+static void
+testFilterSleep()
+{
+  const int voices = 2, block = 256;
+  FilterImpl filter(TEST_RATE, 1);
+  filter.setParameter(3 /* Class */, BIQUAD_LOWPASS);
+  filter.setParameter(0 /* Freq */, 1000);
+  TEST_CHECK(V_SUCCESS(filter.init(0)));
+  size_t tail = filter.tail();
+  TEST_CHECK(tail > 0 && tail < 20 * block);
+
+  IEffectorBatch *batch = filter.createBatch(voices);
+  TEST_CHECK(batch != 0);
+  if (!batch) return;
+
+  Sample_t *buffs[voices];
+  for (int v = 0; v < voices; v++)
+    buffs[v] = new (std::nothrow) Sample_t[TEST_FRAMES];
+
+  int ids[voices] = { 0, 1 };
+  size_t asleepAt = 0;
+  for (size_t pos = 0; pos < 40 * block; pos += block)
+    {
+      bool silent[voices];
+      fillSine(buffs[0], 500);
+      fillSine(buffs[1], 500);
+      silent[1] = false;
+      if (pos < block)
+        silent[0] = false;
+      else
+        {
+          silent[0] = true;
+          if (!asleepAt)
+            memset(buffs[0], 0, block * sizeof(Sample_t));
+        }
+
+      TEST_CHECK(V_SUCCESS(batch->process(ids, buffs, silent, voices, block)));
+      TEST_CHECK(!silent[1]);
+      if (silent[0] && !asleepAt)
+        asleepAt = pos;
+      TEST_CHECK(silent[0] == (asleepAt != 0));
+    }
+  TEST_CHECK(asleepAt >= block + tail && asleepAt <= 2 * block + tail);
+
+  for (int v = 0; v < voices; v++)
+    delete [] buffs[v];
+  delete batch;
+}
+
+/*
+ * An envelope which is idle hands back the silence, whatever was given.
+ */
+static void
+testADSRIdle()
+{
+  ADSRImpl adsr(TEST_RATE, 1);
+  IEffectorBatch *batch = adsr.createBatch(2);
+  TEST_CHECK(batch != 0);
+  if (!batch) return;
+
+  Sample_t *buffs[2];
+  int ids[2] = { 0, 1 };
+  bool silent[2] = { false, false };
+  for (int v = 0; v < 2; v++)
+    {
+      buffs[v] = new (std::nothrow) Sample_t[TEST_FRAMES];
+      for (int i = 0; i < TEST_FRAMES; i++)
+        buffs[v][i] = 1000000;
+    }
+
+  batch->gate(1, true);
+  TEST_CHECK(V_SUCCESS(batch->process(ids, buffs, silent, 2, TEST_FRAMES)));
+  TEST_CHECK(silent[0] && !silent[1]);
+  TEST_CHECK(buffs[0][0] == 0 && buffs[0][TEST_FRAMES - 1] == 0);
+
+  for (int v = 0; v < 2; v++)
+    delete [] buffs[v];
+  delete batch;
+}
+
+/*
+ * A voice reset stops ringing at once, the other voices in the same
+ * register go on.
+ */
+static void
+testFilterReset()
+{
+  const int voices = 2;
+  FilterImpl filter(TEST_RATE, 1);
+  filter.setParameter(3 /* Class */, BIQUAD_LOWPASS);
+  filter.setParameter(0 /* Freq */, 100);
+  IEffectorBatch *batch = filter.createBatch(voices);
+  TEST_CHECK(batch != 0);
+  if (!batch) return;
+
+  Sample_t *buffs[voices];
+  for (int v = 0; v < voices; v++)
+    {
+      buffs[v] = new (std::nothrow) Sample_t[TEST_FRAMES];
+      fillSine(buffs[v], 50);
+    }
+  runBatch(batch, buffs, voices);
+
+  batch->reset(0);
+  for (int v = 0; v < voices; v++)
+    for (int i = 0; i < TEST_FRAMES; i++)
+      buffs[v][i] = 0;
+  runBatch(batch, buffs, voices);
+
+  TEST_CHECK(peak(buffs[0]) == 0 && buffs[0][0] == 0);
+  TEST_CHECK(buffs[1][0] != 0);
+
+  for (int v = 0; v < voices; v++)
+    delete [] buffs[v];
+  delete batch;
+}
+
+int
+main()
+{
+  testADSRParameter();
+  testFilterParameter();
+  testFilterSleep();
+  testADSRIdle();
+  testFilterReset();
+  return testResult("batch_test");
+}
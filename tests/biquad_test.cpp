@@ -0,0 +1,263 @@
+/** @file
+ * Qin - Tests of the biquad filters.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <cmath>
+#include <new>
+#include <stdint.h>
+
+#include "util/error.h"
+#include "dsp/biquad.h"
+
+#include "test.h"
+
+using namespace dsp;
+
+#define TEST_RATE       (48000.0)
+#define TEST_CUTOFF     (1000.0)
+#define TEST_FRAMES     (48000)
+#define TEST_AMPLITUDE  (1.0e8)
+
+static const double testPi = 4. * atan(1.);
+
+/*
+ * The RBJ cookbook response of the low pass (or high pass) with
+ * Q = 1/sqrt(2), which is what the second order butterworth is.
+ */
+static double
+rbjMagnitude(int cls, double freq)
+{
+  double w0 = 2 * testPi * TEST_CUTOFF / TEST_RATE;
+  double alpha = sin(w0) / (2 / sqrt(2.0));
+  double cw = cos(w0);
+  double b0, b1, b2;
+
+  if (cls == BIQUAD_LOWPASS)
+    {
+      b0 = (1 - cw) / 2; b1 = 1 - cw; b2 = (1 - cw) / 2;
+    }
+  else
+    {
+      b0 = (1 + cw) / 2; b1 = -(1 + cw); b2 = (1 + cw) / 2;
+    }
+  double a0 = 1 + alpha, a1 = -2 * cw, a2 = 1 - alpha;
+
+  /*
+   * |H(e^jw)| evaluated straight from the polynomials.
+   */
+  double w = 2 * testPi * freq / TEST_RATE;
+  double nr = b0 + b1 * cos(w) + b2 * cos(2 * w);
+  double ni = -b1 * sin(w) - b2 * sin(2 * w);
+  double dr = a0 + a1 * cos(w) + a2 * cos(2 * w);
+  double di = -a1 * sin(w) - a2 * sin(2 * w);
+  return sqrt((nr * nr + ni * ni) / (dr * dr + di * di));
+}
+
+/*
+ * The response of the butterworth low pass of the given order, after
+ * the bilinear transform with the cutoff prewarped.
+ */
+static double
+butterworthMagnitude(int order, double freq)
+{
+  double r = tan(testPi * freq / TEST_RATE) / tan(testPi * TEST_CUTOFF / TEST_RATE);
+  return 1 / sqrt(1 + pow(r, 2 * order));
+}
+
+/*
+ * Work out the amplitude of a filtered sine over the second half of the
+ * buffer, where the transient is gone, by projecting it on the sine and
+ * the cosine of the frequency.
+ */
+static double
+settledMagnitude(const Sample_t *buff, int stride, double freq)
+{
+  double s = 0, co = 0;
+  for (int i = TEST_FRAMES / 2; i < TEST_FRAMES; i++)
+    {
+      double w = 2 * testPi * freq * i / TEST_RATE;
+      s += buff[i * stride] * sin(w);
+      co += buff[i * stride] * cos(w);
+    }
+  return 2 * sqrt(s * s + co * co) / (TEST_FRAMES / 2) / TEST_AMPLITUDE;
+}
+
+/*
+ * Feed a sine of each frequency to a lane and compare the amplitude
+ * the lane settles at with the analytic response.
+ */
+static void
+testMagnitude(int cls)
+{
+  static const double freqs[BIQUAD_LANES] = { 100, 1000, 3000, 12000 };
+  Sample_t *buff = new (std::nothrow) Sample_t[TEST_FRAMES * BIQUAD_LANES];
+  BiquadCoeffs c;
+  BiquadLanes lanes;
+
+  TEST_CHECK(designBiquad(cls, TEST_RATE, TEST_CUTOFF, 1, &c) == VINF_SUCCEEDED);
+  for (int n = 0; n < BIQUAD_LANES; n++)
+    lanes.setCoeffs(n, c);
+
+  for (int i = 0; i < TEST_FRAMES; i++)
+    for (int n = 0; n < BIQUAD_LANES; n++)
+      buff[i * BIQUAD_LANES + n] = (Sample_t)(TEST_AMPLITUDE * sin(2 * testPi * freqs[n] * i / TEST_RATE));
+
+  lanes.process(buff, TEST_FRAMES, BIQUAD_LANES, BIQUAD_LANES);
+
+  for (int n = 0; n < BIQUAD_LANES; n++)
+    {
+      double mag = settledMagnitude(buff + n, BIQUAD_LANES, freqs[n]);
+      double expect = rbjMagnitude(cls, freqs[n]);
+
+      if (fabs(mag - expect) > 1e-3)
+        std::fprintf(stderr, "class %d at %g Hz: %g, expected %g\n", cls, freqs[n], mag, expect);
+      TEST_CHECK(fabs(mag - expect) <= 1e-3);
+    }
+
+  delete [] buff;
+}
+
+/*
+ * Run a bank of more filters than a register holds, each filter on its
+ * own buffer, with the cascades of every order, and compare each one
+ * with the butterworth response.
+ */
+static void
+testButterworth()
+{
+  static const double freqs[] = { 250, 500, 1000, 2000, 4000, 8000 };
+  const int filters = sizeof(freqs) / sizeof(freqs[0]);
+  Sample_t *buffs[filters];
+  BiquadCoeffs sections[BIQUAD_MAX_SECTIONS];
+  int nsections;
+
+  for (int n = 0; n < filters; n++)
+    buffs[n] = new (std::nothrow) Sample_t[TEST_FRAMES];
+
+  for (int order = 2; order <= BIQUAD_MAX_ORDER; order += 2)
+    {
+      BiquadBank bank;
+      TEST_CHECK(bank.init(filters) == VINF_SUCCEEDED);
+      TEST_CHECK(designButterworth(BIQUAD_LOWPASS, TEST_RATE, TEST_CUTOFF, 1, order, sections, &nsections) == VINF_SUCCEEDED);
+      TEST_CHECK(nsections == order / 2);
+
+      for (int n = 0; n < filters; n++)
+        {
+          TEST_CHECK(bank.setFilter(n, sections, nsections) == VINF_SUCCEEDED);
+          for (int i = 0; i < TEST_FRAMES; i++)
+            buffs[n][i] = (Sample_t)(TEST_AMPLITUDE * sin(2 * testPi * freqs[n] * i / TEST_RATE));
+        }
+
+      bank.process(buffs, TEST_FRAMES, 1);
+
+      for (int n = 0; n < filters; n++)
+        {
+          double mag = settledMagnitude(buffs[n], 1, freqs[n]);
+          double expect = butterworthMagnitude(order, freqs[n]);
+
+          if (fabs(mag - expect) > 1e-3)
+            std::fprintf(stderr, "order %d at %g Hz: %g, expected %g\n", order, freqs[n], mag, expect);
+          TEST_CHECK(fabs(mag - expect) <= 1e-3);
+        }
+    }
+
+  for (int n = 0; n < filters; n++)
+    delete [] buffs[n];
+}
+
+/*
+ * A glide lands exactly on the target coefficients at the end of the
+ * block: afterwards the lanes filter like lanes set to the target at
+ * once.
+ */
+static void
+testGlide()
+{
+  const int frames = 512;
+  Sample_t a[frames * BIQUAD_LANES], b[frames * BIQUAD_LANES];
+  BiquadCoeffs from, to;
+  BiquadLanes glided, direct;
+
+  TEST_CHECK(designBiquad(BIQUAD_LOWPASS, TEST_RATE, 200, 1, &from) == VINF_SUCCEEDED);
+  TEST_CHECK(designBiquad(BIQUAD_LOWPASS, TEST_RATE, 5000, 1, &to) == VINF_SUCCEEDED);
+
+  for (int n = 0; n < BIQUAD_LANES; n++)
+    {
+      glided.setCoeffs(n, &from, 1);
+      glided.setCoeffs(n, &to, 1, true);
+      direct.setCoeffs(n, &to, 1);
+    }
+
+  for (int i = 0; i < frames * BIQUAD_LANES; i++)
+    a[i] = (Sample_t)(TEST_AMPLITUDE * sin(0.37 * i));
+  glided.process(a, frames, BIQUAD_LANES, BIQUAD_LANES);
+
+  glided.reset();
+  for (int i = 0; i < frames * BIQUAD_LANES; i++)
+    a[i] = b[i] = (Sample_t)(TEST_AMPLITUDE * sin(0.11 * i));
+  glided.process(a, frames, BIQUAD_LANES, BIQUAD_LANES);
+  direct.process(b, frames, BIQUAD_LANES, BIQUAD_LANES);
+
+  for (int i = 0; i < frames * BIQUAD_LANES; i++)
+    TEST_CHECK(a[i] == b[i]);
+}
+
+/*
+ * The designs read from the table are close to the exact ones, the
+ * cutoff is only off by the step of the table.
+ */
+static void
+testLookup()
+{
+  static const double freqs[BIQUAD_LANES] = { 500, 1000, 2000, 4000 };
+  Sample_t *buff = new (std::nothrow) Sample_t[TEST_FRAMES * BIQUAD_LANES];
+  BiquadCoeffs sections[BIQUAD_MAX_SECTIONS];
+  BiquadLanes lanes;
+  int nsections;
+
+  TEST_CHECK(initBiquadTable() == VINF_SUCCEEDED);
+  TEST_CHECK(lookupButterworth(BIQUAD_LOWPASS, TEST_RATE, TEST_CUTOFF, 1, 4, sections, &nsections) == VINF_SUCCEEDED);
+  TEST_CHECK(nsections == 2);
+  for (int n = 0; n < BIQUAD_LANES; n++)
+    lanes.setCoeffs(n, sections, nsections);
+
+  for (int i = 0; i < TEST_FRAMES; i++)
+    for (int n = 0; n < BIQUAD_LANES; n++)
+      buff[i * BIQUAD_LANES + n] = (Sample_t)(TEST_AMPLITUDE * sin(2 * testPi * freqs[n] * i / TEST_RATE));
+
+  lanes.process(buff, TEST_FRAMES, BIQUAD_LANES, BIQUAD_LANES);
+
+  for (int n = 0; n < BIQUAD_LANES; n++)
+    {
+      double mag = settledMagnitude(buff + n, BIQUAD_LANES, freqs[n]);
+      TEST_CHECK(fabs(mag - butterworthMagnitude(4, freqs[n])) <= 2e-2);
+    }
+
+  delete [] buff;
+}
+
+int
+main()
+{
+  testMagnitude(BIQUAD_LOWPASS);
+  testMagnitude(BIQUAD_HIGHPASS);
+  testButterworth();
+  testGlide();
+  testLookup();
+  return testResult("biquad_test");
+}
@@ -0,0 +1,214 @@
+/** @file
+ * Qin - Tests of the block cache of the samples.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <stdint.h>
+
+#include "util/error.h"
+#include "wavetable/blockcache.h"
+
+#include "test.h"
+
+using namespace wavetable;
+
+#define TEST_FILE       "blocks.raw"
+#define TEST_BIG_FILE   "blocks-big.raw"
+/* not a multiple of the blocks, so the last one is short */
+#define TEST_FILE_SIZE  (BLOCK_CACHE_BLOCK_SIZE * 20 + 1000)
+#define TEST_BLOCKS     (8)
+
+/*
+ * The byte at a position of the file, so the data tells where it was
+ * read from.
+ */
+static uint8_t
+fileByte(uint64_t pos)
+{
+  return (uint8_t)(pos * 7 + (pos >> 8) + (pos >> 32));
+}
+
+static bool
+checkData(const uint8_t *data, uint64_t pos, size_t len)
+{
+  for (size_t i = 0; i < len; i++)
+    if (data[i] != fileByte(pos + i))
+      return false;
+  return true;
+}
+
+/*
+ * Read at random through a cache much smaller than the file, the data
+ * is the one of the file wherever it lies, a read within one block is
+ * handed out in place, and the counters add up.
+ */
+static void
+testRandom()
+{
+  FILE *fp = fopen(TEST_FILE, "w+b");
+  TEST_CHECK(fp != 0);
+  if (!fp) return;
+  for (uint64_t pos = 0; pos < TEST_FILE_SIZE; pos++)
+    fputc(fileByte(pos), fp);
+  fflush(fp);
+
+  BlockCache cache;
+  TEST_CHECK(!cache.enabled());
+  TEST_CHECK(V_SUCCESS(cache.init(TEST_BLOCKS * BLOCK_CACHE_BLOCK_SIZE)));
+  TEST_CHECK(cache.enabled());
+
+  const size_t maxLen = 3 * BLOCK_CACHE_BLOCK_SIZE;
+  uint8_t *buff = new (std::nothrow) uint8_t[maxLen];
+  uint32_t seed = 1, reads = 0, inPlace = 0, wrong = 0;
+
+  for (int n = 0; n < 20000; n++)
+    {
+      seed = seed * 1103515245 + 12345;
+      size_t len = 1 + (seed >> 8) % (n % 10 ? 4096 : maxLen);
+      seed = seed * 1103515245 + 12345;
+      uint64_t pos = (seed >> 4) % (TEST_FILE_SIZE - len + 1);
+
+      const uint8_t *data;
+      int rc = cache.read(0, fp, pos, len, buff, &data);
+      TEST_CHECK(V_SUCCESS(rc));
+      if (V_FAILURE(rc))
+        break;
+      if (!checkData(data, pos, len))
+        wrong++;
+
+      bool inBlock = pos / BLOCK_CACHE_BLOCK_SIZE == (pos + len - 1) / BLOCK_CACHE_BLOCK_SIZE;
+      TEST_CHECK((data != buff) == inBlock);
+      inPlace += data != buff;
+      reads += 1 + (uint32_t)((pos + len - 1) / BLOCK_CACHE_BLOCK_SIZE - pos / BLOCK_CACHE_BLOCK_SIZE);
+    }
+  TEST_CHECK(wrong == 0);
+  TEST_CHECK(inPlace > 0);
+
+  BlockCacheStats stats;
+  cache.getStats(&stats);
+  TEST_CHECK(stats.hits + stats.misses == reads);
+  TEST_CHECK(stats.hits > 0 && stats.misses > TEST_BLOCKS);
+  TEST_CHECK(stats.evictions == stats.misses - TEST_BLOCKS);
+  /* the last block of the file is short */
+  TEST_CHECK(stats.resident > (TEST_BLOCKS - 1) * BLOCK_CACHE_BLOCK_SIZE &&
+             stats.resident <= TEST_BLOCKS * BLOCK_CACHE_BLOCK_SIZE);
+
+  /*
+   * Past the end of the file.
+   */
+  const uint8_t *data;
+  TEST_CHECK(V_FAILURE(cache.read(0, fp, TEST_FILE_SIZE - 10, 20, buff, &data)));
+
+  delete [] buff;
+  cache.uninit();
+  fclose(fp);
+  remove(TEST_FILE);
+}
+
+/*
+ * The blocks of another file are told apart from the ones at the same
+ * positions of the first.
+ */
+static void
+testFiles()
+{
+  FILE *fp[2];
+  for (int f = 0; f < 2; f++)
+    {
+      fp[f] = fopen(f ? TEST_BIG_FILE : TEST_FILE, "w+b");
+      TEST_CHECK(fp[f] != 0);
+      if (!fp[f]) return;
+      for (uint64_t pos = 0; pos < BLOCK_CACHE_BLOCK_SIZE; pos++)
+        fputc(fileByte(pos + f), fp[f]);
+      fflush(fp[f]);
+    }
+
+  BlockCache cache;
+  TEST_CHECK(V_SUCCESS(cache.init(TEST_BLOCKS * BLOCK_CACHE_BLOCK_SIZE)));
+  for (int n = 0; n < 4; n++)
+    {
+      const uint8_t *data;
+      uint8_t buff[100];
+      TEST_CHECK(V_SUCCESS(cache.read(n % 2, fp[n % 2], 100, sizeof(buff), buff, &data)));
+      TEST_CHECK(checkData(data, 100 + n % 2, sizeof(buff)));
+    }
+
+  BlockCacheStats stats;
+  cache.getStats(&stats);
+  TEST_CHECK(stats.misses == 2 && stats.hits == 2);
+
+  for (int f = 0; f < 2; f++)
+    fclose(fp[f]);
+  remove(TEST_FILE);
+  remove(TEST_BIG_FILE);
+}
+
+/*
+ * The blocks past 2 GB and 4 GB of a file are loaded from their full
+ * positions. The file is sparse, only the data read is written.
+ */
+static void
+testLarge()
+{
+  static const uint64_t positions[] = {
+    (1ULL << 31) - 100,                 /* across 2 GB */
+    (1ULL << 32) + 12345,               /* past 4 GB */
+    5000000000ULL
+  };
+  const size_t len = 200;
+  const int count = (int)(sizeof(positions) / sizeof(positions[0]));
+
+  FILE *fp = fopen(TEST_BIG_FILE, "w+b");
+  TEST_CHECK(fp != 0);
+  if (!fp) return;
+
+  for (int i = 0; i < count; i++)
+    {
+      uint8_t data[len];
+      for (size_t b = 0; b < len; b++)
+        data[b] = fileByte(positions[i] + b);
+      TEST_CHECK(fseeko(fp, (off_t)positions[i], SEEK_SET) == 0);
+      TEST_CHECK(fwrite(data, 1, len, fp) == len);
+    }
+  fflush(fp);
+
+  BlockCache cache;
+  TEST_CHECK(V_SUCCESS(cache.init(TEST_BLOCKS * BLOCK_CACHE_BLOCK_SIZE)));
+  for (int i = count - 1; i >= 0; i--)
+    {
+      const uint8_t *data;
+      uint8_t buff[len];
+      TEST_CHECK(V_SUCCESS(cache.read(0, fp, positions[i], len, buff, &data)));
+      TEST_CHECK(checkData(data, positions[i], len));
+    }
+
+  cache.uninit();
+  fclose(fp);
+  remove(TEST_BIG_FILE);
+}
+
+int
+main()
+{
+  testRandom();
+  testFiles();
+  testLarge();
+  return testResult("blockcache_test");
+}
@@ -0,0 +1,326 @@
+/** @file
+ * Qin - Tests of the effector chains.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <stdint.h>
+
+#include "util/error.h"
+#include "dsp/effect.h"
+#include "dsp/chain.h"
+#include "dsp/voice.h"
+#include "wavetable/wavetable.h"
+
+#include "test.h"
+
+using namespace dsp;
+
+#define TEST_RATE       (48000)
+#define TEST_FRAMES     (1500)
+#define TEST_BLOCK      (300)
+
+/*
+ * A chain with a run of point operations, a delay which is not one,
+ * and a lone point operation after it.
+ */
+struct testChain
+{
+  testChain(int channels)
+    : adsr(TEST_RATE, channels),
+      amp(TEST_RATE, channels),
+      inverter(TEST_RATE, channels),
+      delay(TEST_RATE, channels),
+      amp2(TEST_RATE, channels)
+  {
+    adsr.setParameter(0 /* Attack */, 5);
+    amp.setParameter(0 /* Gain */, -6);
+    amp.setParameter(1 /* Line */, 80);
+    inverter.setParameter(0 /* Invert */, 1);
+    delay.setParameter(0 /* Samples */, 200.5f);
+    amp2.setParameter(0 /* Gain */, 3);
+
+    TEST_CHECK(V_SUCCESS(adsr.init(0)));
+    TEST_CHECK(V_SUCCESS(amp.init(0)));
+    TEST_CHECK(V_SUCCESS(inverter.init(0)));
+    TEST_CHECK(V_SUCCESS(delay.init(0)));
+    TEST_CHECK(V_SUCCESS(amp2.init(0)));
+
+    slots.push(&adsr);
+    slots.push(&amp);
+    slots.push(&inverter);
+    slots.push(&delay);
+    slots.push(&amp2);
+    adsr.gate(true);
+  }
+
+  ~testChain()
+  {
+    delay.uninit(0);
+  }
+
+  /*
+   * Run the effectors one by one, the way the chains did before.
+   */
+  void process(Sample_t *buff, size_t nframes)
+  {
+    for (IEffector *e = slots.root; e; e = e->next)
+      TEST_CHECK(V_SUCCESS(e->process(buff, nframes)));
+  }
+
+  ADSRImpl          adsr;
+  AmplifierImpl     amp;
+  InverterImpl      inverter;
+  DelayImpl         delay;
+  AmplifierImpl     amp2;
+  V_LIST<IEffector> slots;
+};
+
+/*
+ * Fill a buffer with a noise, the same for the same seed.
+ */
+static void
+fillNoise(Sample_t *buff, size_t count, uint32_t seed)
+{
+  for (size_t i = 0; i < count; i++)
+    {
+      seed = seed * 1103515245 + 12345;
+      buff[i] = (Sample_t)(seed >> 4) - (1 << 27);
+    }
+}
+
+/*
+ * The compiled chain gives the very same samples as the effectors
+ * called in turn, while the gate, the bypass and a parameter change
+ * between the blocks.
+ */
+static void
+checkFused(int channels)
+{
+  Sample_t *a = new (std::nothrow) Sample_t[TEST_FRAMES * channels];
+  Sample_t *b = new (std::nothrow) Sample_t[TEST_FRAMES * channels];
+  testChain fused(channels), plain(channels);
+  EffectChain chain;
+
+  TEST_CHECK(V_SUCCESS(chain.compile(fused.slots, channels)));
+  TEST_CHECK(chain.stages() == 3);
+
+  fillNoise(a, TEST_FRAMES * channels, channels);
+  fillNoise(b, TEST_FRAMES * channels, channels);
+
+  for (size_t pos = 0; pos < TEST_FRAMES; pos += TEST_BLOCK)
+    {
+      if (pos == 2 * TEST_BLOCK)
+        {
+          fused.amp.bypass(true);
+          plain.amp.bypass(true);
+          fused.amp2.setParameter(0 /* Gain */, -3);
+          plain.amp2.setParameter(0 /* Gain */, -3);
+        }
+      if (pos == 3 * TEST_BLOCK)
+        {
+          fused.adsr.gate(false);
+          plain.adsr.gate(false);
+        }
+
+      TEST_CHECK(V_SUCCESS(chain.process(a + pos * channels, TEST_BLOCK)));
+      plain.process(b + pos * channels, TEST_BLOCK);
+    }
+
+  size_t diff = 0;
+  for (size_t i = 0; i < TEST_FRAMES * (size_t)channels; i++)
+    if (a[i] != b[i])
+      diff++;
+  TEST_CHECK(diff == 0);
+
+  delete [] a;
+  delete [] b;
+}
+
+/*
+ * The mono and stereo kernels are specialized, the others take the
+ * generic loop.
+ */
+static void
+testFused()
+{
+  checkFused(1);
+  checkFused(2);
+  checkFused(3);
+}
+
+/*
+ * Render a voice of random data through a VoiceKernel, and compare it
+ * with the data decoded and run through the process() of the envelope
+ * and the amplifier.
+ */
+template <class AMP, int CHANNELS>
+  static void
+  checkVoice(int bytes)
+{
+  uint8_t *pcm = new (std::nothrow) uint8_t[TEST_FRAMES * CHANNELS * bytes];
+  Sample_t *a = new (std::nothrow) Sample_t[TEST_FRAMES * CHANNELS];
+  Sample_t *b = new (std::nothrow) Sample_t[TEST_FRAMES * CHANNELS];
+  const bool withAmp = sizeof(AMP) != sizeof(NullEffector);
+  ADSRImpl env1(TEST_RATE, CHANNELS), env2(TEST_RATE, CHANNELS);
+  AmplifierImpl amp1(TEST_RATE, CHANNELS), amp2(TEST_RATE, CHANNELS);
+
+  env1.setParameter(0 /* Attack */, 5);
+  env2.setParameter(0 /* Attack */, 5);
+  amp1.setParameter(0 /* Gain */, -6);
+  amp2.setParameter(0 /* Gain */, -6);
+  TEST_CHECK(V_SUCCESS(env1.init(0)) && V_SUCCESS(env2.init(0)));
+  TEST_CHECK(V_SUCCESS(amp1.init(0)) && V_SUCCESS(amp2.init(0)));
+  env1.gate(true);
+  env2.gate(true);
+
+  uint32_t seed = bytes;
+  for (size_t i = 0; i < (size_t)TEST_FRAMES * CHANNELS * bytes; i++)
+    {
+      seed = seed * 1103515245 + 12345;
+      pcm[i] = (uint8_t)(seed >> 16);
+    }
+
+  for (size_t pos = 0; pos < TEST_FRAMES; pos += TEST_BLOCK)
+    {
+      if (pos == 3 * TEST_BLOCK)
+        {
+          env1.gate(false);
+          env2.gate(false);
+        }
+
+      wavetable::PipeChunk chunk;
+      chunk.pcm = pcm + pos * CHANNELS * bytes;
+      chunk.sampleSize = bytes;
+      chunk.level = 100;
+
+      TEST_CHECK(V_SUCCESS((VoiceKernel<ADSRImpl, AMP, CHANNELS>::render(&env1, withAmp ? &amp1 : 0, chunk,
+                                                                        a + pos * CHANNELS, TEST_BLOCK))));
+
+      Sample_t *y = b + pos * CHANNELS;
+      TEST_CHECK(V_SUCCESS(wavetable::WaveTable::DecodePipeChunk(chunk, y, TEST_BLOCK * CHANNELS)));
+      TEST_CHECK(V_SUCCESS(env2.process(y, TEST_BLOCK)));
+      if (withAmp)
+        TEST_CHECK(V_SUCCESS(amp2.process(y, TEST_BLOCK)));
+    }
+
+  size_t diff = 0;
+  for (size_t i = 0; i < (size_t)TEST_FRAMES * CHANNELS; i++)
+    if (a[i] != b[i])
+      diff++;
+  TEST_CHECK(diff == 0);
+
+  delete [] pcm;
+  delete [] a;
+  delete [] b;
+}
+
+/*
+ * Every width of the data, mono and stereo, with and without the
+ * amplifier.
+ */
+static void
+testVoiceKernel()
+{
+  for (int bytes = 1; bytes <= 4; bytes++)
+    {
+      checkVoice<NullEffector, 1>(bytes);
+      checkVoice<AmplifierImpl, 1>(bytes);
+      checkVoice<NullEffector, 2>(bytes);
+      checkVoice<AmplifierImpl, 2>(bytes);
+    }
+}
+
+/*
+ * Once the input goes silent the chain keeps running while the echoes
+ * of the delay ring out, giving the same samples as the effectors
+ * called in turn. After the tail it sleeps and reports the silence.
+ */
+static void
+testSilence()
+{
+  const int channels = 2;
+  const size_t blocks = 100;
+  Sample_t a[TEST_BLOCK * channels], b[TEST_BLOCK * channels];
+  DelayImpl delay1(TEST_RATE, channels), delay2(TEST_RATE, channels);
+  InverterImpl inv1(TEST_RATE, channels), inv2(TEST_RATE, channels);
+  V_LIST<IEffector> slots;
+  EffectChain chain;
+
+  delay1.setParameter(0 /* Samples */, 200.5f);
+  delay2.setParameter(0 /* Samples */, 200.5f);
+  inv1.setParameter(0 /* Invert */, 1);
+  inv2.setParameter(0 /* Invert */, 1);
+  TEST_CHECK(V_SUCCESS(delay1.init(0)) && V_SUCCESS(delay2.init(0)));
+  TEST_CHECK(V_SUCCESS(inv1.init(0)) && V_SUCCESS(inv2.init(0)));
+  slots.push(&delay1);
+  slots.push(&inv1);
+  TEST_CHECK(V_SUCCESS(chain.compile(slots, channels)));
+
+  size_t tail = delay1.tail();
+  TEST_CHECK(tail > 0 && tail < (blocks - 4) * TEST_BLOCK);
+
+  size_t silentAt = 0;
+  for (size_t n = 0; n < blocks; n++)
+    {
+      bool silent = n >= 2;
+      if (silent)
+        {
+          memset(a, 0, sizeof(a));
+          memset(b, 0, sizeof(b));
+        }
+      else
+        {
+          fillNoise(a, TEST_BLOCK * channels, n + 1);
+          fillNoise(b, TEST_BLOCK * channels, n + 1);
+        }
+
+      int rc = chain.process(a, TEST_BLOCK, silent);
+      TEST_CHECK(V_SUCCESS(rc));
+      TEST_CHECK(V_SUCCESS(delay2.process(b, TEST_BLOCK)));
+      TEST_CHECK(V_SUCCESS(inv2.process(b, TEST_BLOCK)));
+
+      if (rc == VINF_SILENCE && !silentAt)
+        silentAt = n;
+      if (silentAt)
+        {
+          TEST_CHECK(rc == VINF_SILENCE);
+          for (size_t i = 0; i < TEST_BLOCK * channels; i++)
+            TEST_CHECK(a[i] == 0 && abs(b[i]) < 1 << 8);
+        }
+      else
+        TEST_CHECK(memcmp(a, b, sizeof(a)) == 0);
+    }
+
+  TEST_CHECK(silentAt * TEST_BLOCK >= 2 * TEST_BLOCK + tail);
+  TEST_CHECK(silentAt * TEST_BLOCK <= 4 * TEST_BLOCK + tail);
+
+  delay1.uninit(0);
+  delay2.uninit(0);
+}
+
+int
+main()
+{
+  testFused();
+  testVoiceKernel();
+  testSilence();
+  return testResult("chain_test");
+}
@@ -0,0 +1,177 @@
+/** @file
+ * Qin - Tests of the codecs of the sample banks.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+
+#include "util/error.h"
+#include "wavetable/codec.h"
+
+#include "test.h"
+
+using namespace wavetable;
+
+#define TEST_PI (4. * atan(1.))
+
+/*
+ * Fill a block in the format of the bank, a sine with some noise, or
+ * the noise of the full range which takes the escape codes.
+ */
+static void
+fillBlock(uint8_t *dst, size_t frames, int channels, int bytes, bool full)
+{
+  const int bits = bytes * 8;
+  const int32_t top = (1 << (bits - 1)) - 1;
+  uint32_t seed = 12345u * (uint32_t)(bits + channels);
+
+  for (size_t i = 0; i < frames; i++)
+    {
+      for (int c = 0; c < channels; c++)
+        {
+          seed = seed * 1103515245u + 12345u;
+          int32_t v;
+          if (full)
+            v = (int32_t)(seed >> (32 - bits)) - (top + 1);
+          else
+            v = (int32_t)(top * 0.7 * sin(2 * TEST_PI * (c + 1) * 440. * i / 44100.)) +
+                (int32_t)(seed >> 28) - 8;
+          if (v > top)
+            v = top;
+          if (v < -top - 1)
+            v = -top - 1;
+          for (int b = 0; b < bytes; b++)
+            dst[(i * channels + c) * bytes + b] = (uint8_t)((uint32_t)v >> (8 * b));
+        }
+    }
+}
+
+/*
+ * WAVE_CODEC_RICE gives back the very bytes, at each width, channels
+ * and length of the block.
+ */
+static void
+testRiceRoundTrip()
+{
+  static uint8_t pcm[WAVE_CODEC_BLOCK_FRAMES * 2 * 3];
+  static uint8_t out[WAVE_CODEC_BLOCK_FRAMES * 2 * 3];
+  static uint8_t coded[WAVE_CODEC_BLOCK_BOUND(WAVE_CODEC_BLOCK_FRAMES, 2 * 3)];
+  const size_t lengths[] = { WAVE_CODEC_BLOCK_FRAMES, 1000, 5, 1 };
+
+  for (int bytes = 1; bytes <= 3; bytes++)
+    for (int channels = 1; channels <= 2; channels++)
+      for (int full = 0; full < 2; full++)
+        for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+          {
+            size_t frames = lengths[l];
+            size_t size = frames * channels * bytes;
+            fillBlock(pcm, frames, channels, bytes, full);
+
+            size_t clen = 0;
+            TEST_CHECK(V_SUCCESS(encodeRiceBlock(pcm, channels, bytes, frames, coded, &clen)));
+            TEST_CHECK(clen <= (size_t)WAVE_CODEC_BLOCK_BOUND(frames, channels * bytes));
+            if (!full && frames == WAVE_CODEC_BLOCK_FRAMES)
+              TEST_CHECK(clen < size);
+
+            std::memset(out, 0xa5, size);
+            TEST_CHECK(V_SUCCESS(decodeRiceBlock(coded, clen, channels, bytes, frames, out)));
+            TEST_CHECK(std::memcmp(out, pcm, size) == 0);
+          }
+}
+
+/*
+ * A damaged block is refused instead of decoded into noise.
+ */
+static void
+testRiceDamaged()
+{
+  static uint8_t pcm[WAVE_CODEC_BLOCK_FRAMES * 2 * 2];
+  static uint8_t out[WAVE_CODEC_BLOCK_FRAMES * 2 * 2];
+  static uint8_t coded[WAVE_CODEC_BLOCK_BOUND(WAVE_CODEC_BLOCK_FRAMES, 2 * 2)];
+
+  fillBlock(pcm, WAVE_CODEC_BLOCK_FRAMES, 2, 2, false);
+  size_t clen = 0;
+  TEST_CHECK(V_SUCCESS(encodeRiceBlock(pcm, 2, 2, WAVE_CODEC_BLOCK_FRAMES, coded, &clen)));
+
+  TEST_CHECK(decodeRiceBlock(coded, clen / 2, 2, 2, WAVE_CODEC_BLOCK_FRAMES, out) == VERR_INVALID_DATA);
+
+  uint8_t hdr = coded[0];
+  coded[0] = (uint8_t)(7 << 5); // no such order
+  TEST_CHECK(decodeRiceBlock(coded, clen, 2, 2, WAVE_CODEC_BLOCK_FRAMES, out) == VERR_INVALID_DATA);
+  coded[0] = hdr;
+
+  TEST_CHECK(decodeRiceBlock(coded, clen, 2, 4, WAVE_CODEC_BLOCK_FRAMES, out) == VERR_INVALID_FORMAT);
+}
+
+/*
+ * WAVE_CODEC_ADPCM is lossy, but a sine comes back well above the
+ * noise, and the first frame of each channel is exact.
+ */
+static void
+testAdpcmSnr()
+{
+  static uint8_t pcm[WAVE_CODEC_BLOCK_FRAMES * 2 * 2];
+  static uint8_t out[WAVE_CODEC_BLOCK_FRAMES * 2 * 2];
+  static uint8_t coded[WAVE_ADPCM_BLOCK_BOUND(WAVE_CODEC_BLOCK_FRAMES, 2)];
+  const size_t lengths[] = { WAVE_CODEC_BLOCK_FRAMES, 777 };
+
+  for (int channels = 1; channels <= 2; channels++)
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+      {
+        size_t frames = lengths[l];
+        fillBlock(pcm, frames, channels, 2, false);
+
+        size_t clen = 0;
+        TEST_CHECK(V_SUCCESS(encodeAdpcmBlock(pcm, channels, frames, coded, &clen)));
+        TEST_CHECK(clen == (size_t)WAVE_ADPCM_BLOCK_BOUND(frames, channels));
+        TEST_CHECK(V_SUCCESS(decodeAdpcmBlock(coded, clen, channels, frames, out)));
+
+        const int16_t *a = reinterpret_cast<const int16_t *>(pcm);
+        const int16_t *b = reinterpret_cast<const int16_t *>(out);
+        double sig = 0, err = 0;
+        for (size_t i = 0; i < frames * channels; i++)
+          {
+            sig += (double)a[i] * a[i];
+            err += (double)(a[i] - b[i]) * (a[i] - b[i]);
+          }
+        double snr = 10 * log10(sig / (err + 1));
+        TEST_CHECK(snr > 35);
+        for (int c = 0; c < channels; c++)
+          TEST_CHECK(a[c] == b[c]);
+      }
+
+  /*
+   * A short block or a step out of the table is damaged.
+   */
+  fillBlock(pcm, WAVE_CODEC_BLOCK_FRAMES, 1, 2, false);
+  size_t clen = 0;
+  TEST_CHECK(V_SUCCESS(encodeAdpcmBlock(pcm, 1, WAVE_CODEC_BLOCK_FRAMES, coded, &clen)));
+  TEST_CHECK(decodeAdpcmBlock(coded, clen - 1, 1, WAVE_CODEC_BLOCK_FRAMES, out) == VERR_INVALID_DATA);
+  coded[2] = 89;
+  TEST_CHECK(decodeAdpcmBlock(coded, clen, 1, WAVE_CODEC_BLOCK_FRAMES, out) == VERR_INVALID_DATA);
+}
+
+int
+main()
+{
+  testRiceRoundTrip();
+  testRiceDamaged();
+  testAdpcmSnr();
+  return testResult("codec_test");
+}
@@ -0,0 +1,222 @@
+/** @file
+ * Qin - Tests of the delay effector.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <cmath>
+#include <cstdlib>
+#include <new>
+#include <stdint.h>
+
+#include "util/error.h"
+#include "dsp/effect.h"
+
+#include "test.h"
+
+using namespace dsp;
+
+#define TEST_RATE (48000)
+
+/*
+ * Run an impulse through a mono delay and tell where the first echo
+ * comes out, -1 if it does not within frames.
+ */
+static int
+echoAt(DelayImpl *delay, int frames)
+{
+  const int block = 1000;
+  Sample_t buff[block];
+  int echo = -1;
+
+  for (int pos = 0; pos < frames && echo < 0; pos += block)
+    {
+      for (int i = 0; i < block; i++)
+        buff[i] = pos + i == 0 ? 1000000 : 0;
+      TEST_CHECK(V_SUCCESS(delay->process(buff, block)));
+      for (int i = 0; i < block && echo < 0; i++)
+        if (pos + i > 0 && buff[i] != 0)
+          echo = pos + i;
+    }
+  return echo;
+}
+
+/*
+ * The default delay is longer than a second and is not cut to the
+ * sample rate, and a change takes effect on the next process().
+ */
+static void
+testLength()
+{
+  DelayImpl proto(TEST_RATE, 1);
+  IEffector *e = proto.create();
+  TEST_CHECK(e != 0);
+  if (!e) return;
+
+  DelayImpl *delay = static_cast<DelayImpl *>(e);
+  TEST_CHECK(echoAt(delay, 60000) == 50000);
+
+  delay->setParameter(0 /* Samples */, 100000);
+  delay->reset();
+  TEST_CHECK(echoAt(delay, 120000) == 100000);
+
+  delete e;
+}
+
+/* more than the ring holds, so the positions wrap */
+#define TEST_WRAP_FRAMES (300000)
+
+/*
+ * Run a stereo signal through the delay in odd sized blocks, long
+ * enough for the ring to wrap, and compare it frame by frame with a
+ * delay line that never wraps.
+ */
+static void
+checkRingWrap(float samples, size_t block)
+{
+  const int channels = 2;
+  const size_t count = TEST_WRAP_FRAMES * channels;
+  const float level = 0.5f, feedback = 0.5f;
+  Sample_t *buff = new (std::nothrow) Sample_t[count];
+  Sample_t *src = new (std::nothrow) Sample_t[count];
+  float *line = new (std::nothrow) float[count];
+  TEST_CHECK(buff && src && line);
+  if (!buff || !src || !line) return;
+
+  DelayImpl delay(TEST_RATE, channels);
+  delay.setParameter(0 /* Samples */, samples);
+  delay.setParameter(1 /* Level */, level);
+  delay.setParameter(2 /* Feedback */, feedback);
+  TEST_CHECK(V_SUCCESS(delay.init(0)));
+
+  uint32_t seed = 1;
+  for (size_t i = 0; i < count; i++)
+    {
+      seed = seed * 1103515245 + 12345;
+      src[i] = buff[i] = (Sample_t)(seed >> 8) - (1 << 23);
+    }
+
+  for (size_t pos = 0; pos < TEST_WRAP_FRAMES; pos += block)
+    {
+      size_t n = TEST_WRAP_FRAMES - pos < block ? TEST_WRAP_FRAMES - pos : block;
+      TEST_CHECK(V_SUCCESS(delay.process(buff + pos * channels, n)));
+    }
+
+  const size_t di = (size_t)samples;
+  const float fr = samples - di;
+  size_t wrong = 0;
+
+  for (size_t i = 0; i < TEST_WRAP_FRAMES; i++)
+    for (int c = 0; c < channels; c++)
+      {
+        float x = (float)src[i * channels + c];
+        float t0 = i >= di ? line[(i - di) * channels + c] : 0;
+        float t1 = i >= di + 1 ? line[(i - di - 1) * channels + c] : 0;
+        float d = (1 - fr) * t0 + fr * t1;
+        line[i * channels + c] = x + feedback * d;
+
+        if (std::abs(buff[i * channels + c] - (Sample_t)(x + level * d)) > 4)
+          wrong++;
+      }
+  TEST_CHECK(wrong == 0);
+
+  delay.uninit(0);
+  delete [] buff;
+  delete [] src;
+  delete [] line;
+}
+
+/*
+ * A delay set wet only leaves the dry signal out and keeps the echo,
+ * the "Dry" level applies again once it is cleared.
+ */
+static void
+testWetOnly()
+{
+  Sample_t buff[200];
+  DelayImpl delay(TEST_RATE, 1);
+  delay.setParameter(0 /* Samples */, 100);
+  TEST_CHECK(V_SUCCESS(delay.init(0)));
+
+  delay.setWetOnly(true);
+  for (int i = 0; i < 200; i++)
+    buff[i] = i == 0 ? 1000000 : 0;
+  TEST_CHECK(V_SUCCESS(delay.process(buff, 200)));
+  TEST_CHECK(buff[0] == 0);
+  TEST_CHECK(buff[100] == 500000);
+
+  delay.setWetOnly(false);
+  delay.reset();
+  for (int i = 0; i < 200; i++)
+    buff[i] = i == 0 ? 1000000 : 0;
+  TEST_CHECK(V_SUCCESS(delay.process(buff, 200)));
+  TEST_CHECK(buff[0] == 1000000);
+  TEST_CHECK(buff[100] == 500000);
+
+  delay.uninit(0);
+}
+
+/*
+ * The rings come out of a fixed pool, the halves merge back once
+ * they are released so the largest rings can be taken again.
+ */
+static void
+testPool()
+{
+  const int count = 32;
+  DelayImpl proto(TEST_RATE, 2);
+  IEffector *delays[count];
+  Sample_t buff[2 * 64] = { 0 };
+  int taken = 0;
+
+  for (int i = 0; i < count; i++)
+    {
+      delays[i] = proto.create();
+      TEST_CHECK(delays[i] != 0);
+      delays[i]->setParameter(3 /* Max samples */, 192000);
+      if (V_SUCCESS(delays[i]->process(buff, 64)))
+        taken++;
+    }
+  TEST_CHECK(taken > 0 && taken < count);
+
+  /*
+   * Split the freed rings into small ones and give them back.
+   */
+  delete delays[0];
+  IEffector *small = proto.create();
+  small->setParameter(0 /* Samples */, 100);
+  small->setParameter(3 /* Max samples */, 100);
+  TEST_CHECK(V_SUCCESS(small->process(buff, 64)));
+  delete small;
+
+  delays[0] = proto.create();
+  delays[0]->setParameter(3 /* Max samples */, 192000);
+  TEST_CHECK(V_SUCCESS(delays[0]->process(buff, 64)));
+
+  for (int i = 0; i < count; i++)
+    delete delays[i];
+}
+
+int
+main()
+{
+  testLength();
+  checkRingWrap(1000.25f, 777);
+  checkRingWrap(150000, 256);
+  testWetOnly();
+  testPool();
+  return testResult("delay_test");
+}
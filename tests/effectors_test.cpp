@@ -0,0 +1,130 @@
+/** @file
+ * Qin - Tests of the effectors of the voices.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <new>
+#include <string>
+#include <stdint.h>
+
+#include "util/error.h"
+#include "memory/mmu.h"
+#include "dsp/effect.h"
+#include "wavetable/wavetable.h"
+
+#include "test.h"
+
+using namespace dsp;
+
+#define TEST_RATE       (48000)
+#define TEST_CHANNELS   (2)
+#define TEST_BLOCK      (256)
+#define TEST_VOICES     (3)
+
+/*
+ * Render a block of every voice and mix them, the voices are a noise
+ * of 16 bits.
+ */
+static void
+renderBlock(Effectors *fx, Sample_t *master, const uint8_t *pcm)
+{
+  wavetable::PipeChunk chunk;
+  chunk.pcm = pcm;
+  chunk.sampleSize = 2;
+  chunk.level = 100;
+
+  for (int n = 0; n < TEST_VOICES; n++)
+    TEST_CHECK(V_SUCCESS(fx->renderVoice(n, chunk, TEST_BLOCK * TEST_CHANNELS, TEST_CHANNELS)));
+  TEST_CHECK(V_SUCCESS(fx->mixVoices(master, TEST_BLOCK * TEST_CHANNELS, TEST_CHANNELS)));
+}
+
+/*
+ * A voice held by its envelope does not decay, once released it does
+ * so after the release and the tail of the filter behind it, while
+ * the voices still held go on.
+ */
+static void
+checkDecay(VoiceLayout layout)
+{
+  const float release = 20; /* ms */
+  uint8_t *pcm = new (std::nothrow) uint8_t[TEST_BLOCK * TEST_CHANNELS * 2];
+  Sample_t *master = new (MEM_TAG_AUDIO_BUFFER, MEM_ALIGN_CACHELINE, std::nothrow) Sample_t[TEST_BLOCK * TEST_CHANNELS];
+  Effectors fx;
+
+  uint32_t seed = 1;
+  for (size_t i = 0; i < TEST_BLOCK * TEST_CHANNELS * 2; i++)
+    {
+      seed = seed * 1103515245 + 12345;
+      pcm[i] = (uint8_t)(seed >> 16);
+    }
+
+  ADSRImpl adsr(TEST_RATE, TEST_CHANNELS);
+  adsr.setParameter(0 /* Attack */, 1);
+  adsr.setParameter(3 /* Release */, release);
+  FilterImpl filter(TEST_RATE, TEST_CHANNELS);
+  filter.setParameter(3 /* Class */, BIQUAD_LOWPASS);
+  filter.setParameter(0 /* Freq */, 2000);
+  TEST_CHECK(V_SUCCESS(filter.init(0)));
+
+  TEST_CHECK(V_SUCCESS(fx.initVoices(TEST_VOICES, TEST_BLOCK * TEST_CHANNELS, layout)));
+  TEST_CHECK(V_SUCCESS(fx.add(EFFECT_SCOPE_GROUP, adsr)));
+  TEST_CHECK(V_SUCCESS(fx.add(EFFECT_SCOPE_GROUP, filter)));
+
+  for (int n = 0; n < TEST_VOICES; n++)
+    fx.groupGate(n, true);
+  for (int b = 0; b < 20; b++)
+    {
+      renderBlock(&fx, master, pcm);
+      for (int n = 0; n < TEST_VOICES; n++)
+        TEST_CHECK(!fx.voiceDecayed(n));
+    }
+
+  fx.groupGate(1, false);
+  size_t ring = release * TEST_RATE / 1000 + filter.tail();
+  size_t decayedAt = 0;
+  for (size_t pos = TEST_BLOCK; pos <= ring + 4 * TEST_BLOCK; pos += TEST_BLOCK)
+    {
+      renderBlock(&fx, master, pcm);
+      TEST_CHECK(!fx.voiceDecayed(0) && !fx.voiceDecayed(2));
+      if (fx.voiceDecayed(1) && !decayedAt)
+        decayedAt = pos;
+      TEST_CHECK(fx.voiceDecayed(1) == (decayedAt != 0));
+    }
+  TEST_CHECK(decayedAt > release * TEST_RATE / 1000);
+  TEST_CHECK(decayedAt && decayedAt <= ring + 3 * TEST_BLOCK);
+
+  delete [] pcm;
+  delete [] master;
+}
+
+/*
+ * The voices decay the same whether the group effectors run a chain
+ * per voice or a batch for all of them.
+ */
+static void
+testDecay()
+{
+  checkDecay(VOICE_LAYOUT_CHAIN);
+  checkDecay(VOICE_LAYOUT_BATCH);
+}
+
+int
+main()
+{
+  testDecay();
+  return testResult("effectors_test");
+}
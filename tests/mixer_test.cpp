@@ -0,0 +1,71 @@
+/** @file
+ * Qin - Tests of the mixer.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <new>
+#include <stdint.h>
+
+#include "util/error.h"
+#include "memory/mmu.h"
+#include "mixer/mixer.h"
+
+#include "test.h"
+
+/*
+ * The aligned mix at the full volume gives the same samples as the
+ * plain one, the clipped ones included. The count leaves a tail.
+ */
+static void
+testMixAligned()
+{
+  const uint32_t count = 1027;
+  Sample_t *a = new (MEM_TAG_AUDIO_BUFFER, std::nothrow) Sample_t[count];
+  Sample_t *b = new (MEM_TAG_AUDIO_BUFFER, std::nothrow) Sample_t[count];
+  Sample_t *c = new (std::nothrow) Sample_t[count];
+  uint32_t seed = 1;
+
+  for (uint32_t i = 0; i < count; i++)
+    {
+      seed = seed * 1103515245 + 12345;
+      a[i] = c[i] = (Sample_t)seed;
+      seed = seed * 1103515245 + 12345;
+      b[i] = i % 7 ? (Sample_t)seed : a[i];
+    }
+
+  TEST_CHECK(mixer::Mixer::MixAligned(a, b, count) == VINF_SUCCEEDED);
+  mixer::Mixer::MixAudio(c, b, count, MIXER_MAXVOLUME);
+
+  int diff = 0;
+  for (uint32_t i = 0; i < count; i++)
+    {
+      if (a[i] != c[i])
+        diff++;
+    }
+  TEST_CHECK(diff == 0);
+
+  delete [] a;
+  delete [] b;
+  delete [] c;
+}
+
+int
+main()
+{
+  testMixAligned();
+  return testResult("mixer_test");
+}
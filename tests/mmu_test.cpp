@@ -0,0 +1,106 @@
+/** @file
+ * Qin - Tests of the memory management unit.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <new>
+#include <stdint.h>
+
+#include "memory/mmu.h"
+
+#include "test.h"
+
+/*
+ * The counters balance and the peak follows the largest usage, also
+ * when the shard grows by less than MEM_PEAK_STEP at a time.
+ */
+static void
+testStats()
+{
+  MemoryStats before, s;
+  GetMemoryStats(MEM_TAG_EFFECTOR_BUFFER, &before);
+
+  const int count = 64;
+  char *blocks[count];
+  for (int i = 0; i < count; i++)
+    {
+      blocks[i] = new (MEM_TAG_EFFECTOR_BUFFER, std::nothrow) char[4096];
+      TEST_CHECK(blocks[i] != 0);
+    }
+
+  GetMemoryStats(MEM_TAG_EFFECTOR_BUFFER, &s);
+  TEST_CHECK(s.allocs == before.allocs + count);
+  TEST_CHECK(s.current >= before.current + count * 4096);
+  std::size_t high = s.current;
+
+  for (int i = 0; i < count; i++)
+    {
+      delete [] blocks[i];
+    }
+
+  GetMemoryStats(MEM_TAG_EFFECTOR_BUFFER, &s);
+  TEST_CHECK(s.current == before.current);
+  TEST_CHECK(s.peak >= high);
+}
+
+/*
+ * The blocks keep the alignment asked for, or the one of the tag.
+ */
+static void
+testAlignment()
+{
+  char *a = new (MEM_TAG_AUDIO_BUFFER, std::nothrow) char[100];
+  char *b = new (MEM_TAG_DEFAULT, MEM_ALIGN_32, std::nothrow) char[7];
+  TEST_CHECK((uintptr_t)a % GetMemTagAlignment(MEM_TAG_AUDIO_BUFFER) == 0);
+  TEST_CHECK((uintptr_t)b % 32 == 0);
+  delete [] a;
+  delete [] b;
+}
+
+/*
+ * A large block is counted as advised or huge only while it lives,
+ * without the huge pages it still comes from somewhere.
+ */
+static void
+testLargeMem()
+{
+  MemoryStats before, s;
+  GetMemoryStats(MEM_TAG_SAMPLE_CACHE, &before);
+
+  char *p = (char *)AllocLargeMem(3 * 1024 * 1024, MEM_TAG_SAMPLE_CACHE, MEM_LARGE_THP);
+  TEST_CHECK(p != 0);
+  TEST_CHECK((uintptr_t)p % MEM_CACHELINE_SIZE == 0);
+  p[3 * 1024 * 1024 - 1] = 1;
+
+  GetMemoryStats(MEM_TAG_SAMPLE_CACHE, &s);
+  TEST_CHECK(s.current >= before.current + 3 * 1024 * 1024);
+  TEST_CHECK(s.huge == before.huge);
+
+  FreeLargeMem(p);
+  GetMemoryStats(MEM_TAG_SAMPLE_CACHE, &s);
+  TEST_CHECK(s.current == before.current);
+  TEST_CHECK(s.advised == before.advised);
+}
+
+int
+main()
+{
+  testStats();
+  testAlignment();
+  testLargeMem();
+  return testResult("mmu_test");
+}
@@ -0,0 +1,177 @@
+/** @file
+ * Qin - Tests of the asynchronous streams of the samples.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <cstdio>
+#include <new>
+#include <stdint.h>
+
+#include "util/error.h"
+#include "wavetable/stream.h"
+
+#include "test.h"
+
+using namespace wavetable;
+
+#define TEST_FILE       "stream.raw"
+#define TEST_FILE_SIZE  (300 * 1024)
+#define TEST_STREAMS    (3)
+
+/*
+ * The byte at a position of the file, so the data tells where it was
+ * read from.
+ */
+static uint8_t
+fileByte(uint64_t pos)
+{
+  return (uint8_t)(pos * 7 + (pos >> 8));
+}
+
+/*
+ * The samples streamed, none of them aligned.
+ */
+static const struct
+{
+  uint64_t start;
+  uint64_t size;
+} testSamples[TEST_STREAMS] = {
+  { 1000, 100000 },
+  { 50003, 70001 },
+  { 123457, 150000 }
+};
+
+/*
+ * Read the streams in turn in chunks of changing sizes, polling once a
+ * round as the render loop does, and tell how many bytes were wrong.
+ */
+static size_t
+readStreams(StreamEngine *engine, uint8_t *buff)
+{
+  uint64_t done[TEST_STREAMS] = { 0 };
+  size_t wrong = 0;
+
+  for (int round = 0; ; round++)
+    {
+      TEST_CHECK(V_SUCCESS(engine->poll()));
+
+      bool busy = false;
+      for (int n = 0; n < TEST_STREAMS; n++)
+        {
+          uint64_t left = testSamples[n].size - done[n];
+          if (!left)
+            continue;
+          busy = true;
+
+          size_t len = 700 * (1 + (round + n) % 5) * 2;
+          if (len > left)
+            len = (size_t)left;
+
+          const uint8_t *data;
+          int rc = engine->read(n, len, buff, &data);
+          TEST_CHECK(V_SUCCESS(rc));
+          if (V_FAILURE(rc))
+            return wrong + 1;
+
+          for (size_t b = 0; b < len; b++)
+            if (data[b] != fileByte(testSamples[n].start + done[n] + b))
+              wrong++;
+          done[n] += len;
+        }
+      if (!busy)
+        break;
+    }
+  return wrong;
+}
+
+/*
+ * The streams give the data of the samples, through the segments and
+ * across them, and fail past the end of a sample.
+ */
+static void
+testRead(StreamEngine *engine, FILE *fp, uint8_t *buff)
+{
+  for (int n = 0; n < TEST_STREAMS; n++)
+    TEST_CHECK(V_SUCCESS(engine->open(n, fileno(fp), testSamples[n].start, testSamples[n].size)));
+  TEST_CHECK(readStreams(engine, buff) == 0);
+
+  const uint8_t *data;
+  TEST_CHECK(V_FAILURE(engine->read(0, 1, buff, &data)));
+
+  StreamStats stats;
+  engine->getStats(&stats);
+  TEST_CHECK(stats.submitted > 0 && stats.completed <= stats.submitted);
+  TEST_CHECK(stats.peak > 0 && stats.peak <= TEST_STREAMS * STREAM_RING_SEGMENTS);
+
+  for (int n = 0; n < TEST_STREAMS; n++)
+    engine->close(n);
+}
+
+/*
+ * A stream opened again while its reads are in flight drops them, and
+ * gives the data of the new sample only.
+ */
+static void
+testReopen(StreamEngine *engine, FILE *fp, uint8_t *buff)
+{
+  for (int n = 0; n < TEST_STREAMS; n++)
+    {
+      const uint8_t *data;
+      TEST_CHECK(V_SUCCESS(engine->open(n, fileno(fp), 200000 + n, 90000)));
+      TEST_CHECK(V_SUCCESS(engine->read(n, 10, buff, &data)));
+    }
+
+  for (int n = 0; n < TEST_STREAMS; n++)
+    TEST_CHECK(V_SUCCESS(engine->open(n, fileno(fp), testSamples[n].start, testSamples[n].size)));
+  TEST_CHECK(readStreams(engine, buff) == 0);
+
+  for (int n = 0; n < TEST_STREAMS; n++)
+    engine->close(n);
+}
+
+int
+main()
+{
+  FILE *fp = fopen(TEST_FILE, "w+b");
+  TEST_CHECK(fp != 0);
+  if (!fp)
+    return testResult("stream_test");
+  for (uint64_t pos = 0; pos < TEST_FILE_SIZE; pos++)
+    fputc(fileByte(pos), fp);
+  fflush(fp);
+
+  uint8_t *buff = new (std::nothrow) uint8_t[STREAM_SEGMENT_SIZE * 2];
+  StreamEngine engine;
+  int rc = engine.init(TEST_STREAMS);
+  if (rc == VERR_NOT_SUPPORTED)
+    {
+      /* the system has no io_uring, wavetable_test covers the fallback */
+      std::printf("stream_test: io_uring is unavailable, skipped\n");
+    }
+  else
+    {
+      TEST_CHECK(V_SUCCESS(rc) && engine.enabled());
+      testRead(&engine, fp, buff);
+      testReopen(&engine, fp, buff);
+    }
+
+  engine.uninit();
+  delete [] buff;
+  fclose(fp);
+  remove(TEST_FILE);
+  return testResult("stream_test");
+}
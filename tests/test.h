@@ -0,0 +1,49 @@
+/** @file
+ * Qin - Helpers of the tests.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef TESTS_TEST_H_
+#define TESTS_TEST_H_
+
+#include <cstdio>
+
+static int testFailures = 0;
+
+/** @def TEST_CHECK
+ * Report a failed condition and keep going.
+ */
+#define TEST_CHECK(cond) \
+  do { \
+    if (!(cond)) \
+      { \
+        std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        testFailures++; \
+      } \
+  } while (0)
+
+/*
+ * Print the result of a test program and give its exit code.
+ */
+static inline int
+testResult(const char *name)
+{
+  std::printf("%s: %s\n", name, testFailures ? "FAILED" : "passed");
+  return testFailures ? 1 : 0;
+}
+
+#endif //!defined(TESTS_TEST_H_)
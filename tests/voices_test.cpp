@@ -0,0 +1,100 @@
+/** @file
+ * Qin - Tests of the voice allocator.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include "util/error.h"
+#include "wavetable/voices.h"
+
+#include "test.h"
+
+using namespace wavetable;
+
+#define TEST_VOICES (8)
+
+/*
+ * The free units are taken before any is stolen, then the quietest
+ * one goes, the older one when two are as loud.
+ */
+static void
+testSteal()
+{
+  VoiceAllocator voices;
+  bool stolen, taken[TEST_VOICES] = { false };
+  int older = -1;
+  voices.init(TEST_VOICES);
+
+  for (int n = 0; n < TEST_VOICES; n++)
+    {
+      int v = voices.acquire(&stolen);
+      TEST_CHECK(!stolen && v >= 0 && v < TEST_VOICES && !taken[v]);
+      taken[v] = true;
+      if (older < 0 && (v == 5 || v == 6))
+        older = v;
+      /* unit 3 is the quietest, 5 and 6 come next as loud */
+      voices.start(v, v == 3 ? 0.1f : v == 5 || v == 6 ? 0.2f : 0.9f);
+    }
+
+  TEST_CHECK(voices.acquire(&stolen) == 3 && stolen);
+  voices.start(3, 1);
+
+  TEST_CHECK(voices.acquire(&stolen) == older && stolen);
+  voices.start(older, 1);
+
+  /* the other one gets louder than 0 which fades */
+  voices.update(11 - older, 0.95f);
+  voices.update(0, 0.05f);
+  TEST_CHECK(voices.acquire(&stolen) == 0 && stolen);
+  voices.start(0, 1);
+
+  VoiceStats stats;
+  voices.getStats(&stats);
+  TEST_CHECK(stats.notes == TEST_VOICES + 3);
+  TEST_CHECK(stats.stolen == 3);
+  TEST_CHECK(stats.peak == TEST_VOICES);
+}
+
+/*
+ * A unit given back is free again, the ones taken but not started yet
+ * included.
+ */
+static void
+testRelease()
+{
+  VoiceAllocator voices;
+  bool stolen;
+  voices.init(TEST_VOICES);
+
+  for (int n = 0; n < TEST_VOICES; n++)
+    voices.start(voices.acquire(&stolen), 0.5f);
+
+  voices.release(4);
+  TEST_CHECK(voices.acquire(&stolen) == 4 && !stolen);
+  voices.release(4);
+  voices.release(4);
+  TEST_CHECK(voices.acquire(&stolen) == 4 && !stolen);
+  voices.start(4, 0.5f);
+  TEST_CHECK(voices.acquire(&stolen) != 4 && stolen);
+}
+
+int
+main()
+{
+  testSteal();
+  testRelease();
+  return testResult("voices_test");
+}
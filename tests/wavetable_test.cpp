@@ -0,0 +1,491 @@
+/** @file
+ * Qin - Tests of the wave table.
+ */
+
+/*
+ *  Qin is Copyright (C) 2016, The 1st Middle School in
+ *  Yongsheng Lijiang, Yunnan Province, ZIP 674200 China
+ *
+ *  This project is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License(GPL)
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This project is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <string>
+#include <stdint.h>
+
+#include "util/error.h"
+#include "midi/event.h"
+#include "wavetable/wavebank.h"
+#include "wavetable/wavetable.h"
+
+#include "test.h"
+
+using namespace wavetable;
+
+/* built once more with the asynchronous streams */
+#if defined(CONF_STREAM_ASYNC) && CONF_STREAM_ASYNC
+# define TEST_NAME      "wavetable_async_test"
+#else
+# define TEST_NAME      "wavetable_test"
+#endif
+
+#define TEST_TABLE      "wt.syntab"
+#define TEST_BANK       "wt.raw"
+#define TEST_POLYPHONY  (4)
+/* frames of each fetch, not a divisor of the sizes of the samples */
+#define TEST_FETCH      (700)
+
+/* the samples in the bank, 16 bits stereo */
+static const struct
+{
+  const char *note;
+  int16_t     key;
+  uint32_t    size;
+} testSamples[] = {
+  { "d1", 36, 40000 },
+  { "e1", 38, 60000 },
+  { "f#1", 40, 50000 }
+};
+#define TEST_SAMPLES ((int)(sizeof(testSamples) / sizeof(testSamples[0])))
+
+/*
+ * The byte at a position of the bank, so the data tells where it was
+ * read from.
+ */
+static uint8_t
+bankByte(uint64_t pos)
+{
+  return (uint8_t)(pos * 7 + (pos >> 8));
+}
+
+/*
+ * Where a sample starts in the bank, each one at a multiple of align
+ * if it is not 0.
+ */
+static uint64_t
+sampleStart(int i, uint32_t align)
+{
+  uint64_t pos = sizeof(WaveBank_t);
+  for (int k = 0; ; k++)
+    {
+      if (align)
+        pos = (pos + align - 1) / align * align;
+      if (k == i)
+        return pos;
+      pos += testSamples[k].size;
+    }
+}
+
+/*
+ * Put the low n bits of v, from the MSB of each byte.
+ */
+static void
+putBits(uint8_t *out, size_t *nbit, uint32_t v, int n)
+{
+  for (int i = n - 1; i >= 0; i--, (*nbit)++)
+    if ((v >> i) & 1)
+      out[*nbit / 8] |= (uint8_t)(0x80 >> (*nbit % 8));
+}
+
+/*
+ * Code a sample of 16 bits stereo by WAVE_CODEC_RICE, with no predictor
+ * and k of 16, into out which is zeroed. Returns the bytes stored.
+ */
+static uint32_t
+encodeSample(const uint8_t *pcm, uint32_t size, uint8_t *out)
+{
+  const uint32_t frames = size / 4;
+  WaveCodedSample_t hdr;
+  hdr.blocks = (frames + WAVE_CODEC_BLOCK_FRAMES - 1) / WAVE_CODEC_BLOCK_FRAMES;
+
+  uint32_t *idx = reinterpret_cast<uint32_t *>(out + sizeof(hdr));
+  uint32_t pos = sizeof(hdr) + (hdr.blocks + 1) * sizeof(uint32_t);
+  for (uint32_t b = 0; b < hdr.blocks; b++)
+    {
+      idx[b] = pos;
+      uint32_t first = b * WAVE_CODEC_BLOCK_FRAMES;
+      uint32_t last = first + WAVE_CODEC_BLOCK_FRAMES < frames ? first + WAVE_CODEC_BLOCK_FRAMES : frames;
+
+      size_t nbit = 0;
+      for (int c = 0; c < 2; c++)
+        {
+          nbit = (nbit + 7) / 8 * 8;
+          putBits(out + pos, &nbit, 16, 8);
+          for (uint32_t f = first; f < last; f++)
+            {
+              int32_t v = (int16_t)(pcm[f * 4 + c * 2] | pcm[f * 4 + c * 2 + 1] << 8);
+              uint32_t u = ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+              putBits(out + pos, &nbit, 1, (int)(u >> 16) + 1);
+              putBits(out + pos, &nbit, u, 16);
+            }
+        }
+      pos += (uint32_t)((nbit + 7) / 8);
+    }
+  idx[hdr.blocks] = pos;
+  hdr.stored = pos;
+  memcpy(out, &hdr, sizeof(hdr));
+  return pos;
+}
+
+/*
+ * Write the bank and the table which describes it. The data of the
+ * samples is the one of a packed plain bank, however they are stored.
+ */
+static bool
+writeBank(uint32_t align = 0, int codec = WAVE_CODEC_PCM)
+{
+  FILE *fp = fopen(TEST_BANK, "wb");
+  if (!fp)
+    return false;
+
+  WaveBank_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "QWSF", 4);
+  header.align = align;
+  header.codec = codec;
+  fwrite(&header, sizeof(header), 1, fp);
+
+  if (codec != WAVE_CODEC_RICE)
+    {
+      uint64_t end = sampleStart(TEST_SAMPLES - 1, align) + testSamples[TEST_SAMPLES - 1].size;
+      for (uint64_t pos = sizeof(header); pos < end; pos++)
+        fputc(bankByte(pos), fp);
+    }
+  else
+    {
+      for (int i = 0; i < TEST_SAMPLES; i++)
+        {
+          uint32_t size = testSamples[i].size;
+          uint8_t *pcm = new (std::nothrow) uint8_t[size];
+          uint8_t *coded = new (std::nothrow) uint8_t[size * 2 + 4096];
+          if (!pcm || !coded)
+            return false;
+          for (uint32_t b = 0; b < size; b++)
+            pcm[b] = bankByte(sampleStart(i, 0) + b);
+          memset(coded, 0, size * 2 + 4096);
+
+          uint32_t stored = encodeSample(pcm, size, coded);
+          fwrite(coded, 1, stored, fp);
+          delete [] pcm;
+          delete [] coded;
+        }
+    }
+  fclose(fp);
+
+  fp = fopen(TEST_TABLE, "wb");
+  if (!fp)
+    return false;
+  fprintf(fp, "QIN SAMPLE TABLE 1\n");
+  for (int i = 0; i < TEST_SAMPLES; i++)
+    fprintf(fp, "%s s%d %s sn 100 %u 2 16 44100 1 4 \n",
+            testSamples[i].note, i, TEST_BANK, testSamples[i].size);
+  fclose(fp);
+  return true;
+}
+
+/*
+ * Start a note of each sample, the same sample in two units, and fetch
+ * them in turn. Every unit reads its own data at its own position,
+ * though they share the handle of the bank.
+ */
+static void
+checkUnits(WaveTable *wt, uint32_t align = 0)
+{
+  const int sampleSize = 2;
+  int units[TEST_SAMPLES + 1], sample[TEST_SAMPLES + 1];
+  uint64_t start[TEST_SAMPLES + 1], done[TEST_SAMPLES + 1];
+  uint8_t *ori = new (std::nothrow) uint8_t[TEST_FETCH * sampleSize];
+
+  for (int n = 0; n <= TEST_SAMPLES; n++)
+    {
+      int i = n % TEST_SAMPLES;
+      midi::Event event(midi::NoteOn, 0, testSamples[i].key, 100);
+      TEST_CHECK(V_SUCCESS(wt->SendMIDIEvent(event, &units[n])));
+      TEST_CHECK(units[n] >= 0 && units[n] < TEST_POLYPHONY);
+
+      sample[n] = i;
+      start[n] = sampleStart(i, align);
+      done[n] = 0;
+    }
+
+  size_t wrong = 0;
+  for (bool busy = true; busy; )
+    {
+      TEST_CHECK(V_SUCCESS(wt->PollStreams()));
+      busy = false;
+      for (int n = 0; n <= TEST_SAMPLES; n++)
+        {
+          if (!wt->PipeBusy(units[n]))
+            continue;
+          busy = true;
+
+          PipeChunk chunk;
+          chunk.pcm = 0;
+          int rc = wt->FetchPipeChannel(units[n], ori, TEST_FETCH, &chunk);
+          TEST_CHECK(V_SUCCESS(rc));
+          TEST_CHECK(chunk.pcm != 0 && chunk.sampleSize == sampleSize);
+          if (V_FAILURE(rc) || !chunk.pcm)
+            {
+              delete [] ori;
+              return;
+            }
+
+          uint64_t size = testSamples[sample[n]].size;
+          for (uint64_t b = 0; b < TEST_FETCH * sampleSize; b++)
+            {
+              uint8_t expect = done[n] + b < size ? bankByte(start[n] + done[n] + b) : 0;
+              if (chunk.pcm[b] != expect)
+                wrong++;
+            }
+          done[n] += TEST_FETCH * sampleSize;
+        }
+    }
+  TEST_CHECK(wrong == 0);
+
+  for (int n = 0; n <= TEST_SAMPLES; n++)
+    TEST_CHECK(done[n] >= testSamples[sample[n]].size &&
+               done[n] < testSamples[sample[n]].size + TEST_FETCH * sampleSize);
+
+  delete [] ori;
+}
+
+/*
+ * The units play the right data from the files, through the blocks, the
+ * asynchronous streams where there are, and from the sample cache,
+ * compressed or not, the samples stored plain or coded.
+ */
+static void
+checkShared(int codec)
+{
+  TEST_CHECK(writeBank(0, codec));
+
+  WaveTable wt;
+  TEST_CHECK(V_SUCCESS(wt.init(TEST_POLYPHONY)));
+  TEST_CHECK(V_SUCCESS(wt.LoadTimbres(TEST_TABLE)));
+  TEST_CHECK(wt.GetPipeChannelNum() == TEST_POLYPHONY);
+
+  checkUnits(&wt);
+
+  /* fewer blocks than the samples span */
+  TEST_CHECK(V_SUCCESS(wt.CacheBlocks(BLOCK_CACHE_BLOCK_SIZE * 2)));
+  checkUnits(&wt);
+  BlockCacheStats stats;
+  wt.GetBlockCacheStats(&stats);
+  TEST_CHECK(stats.hits > 0 && stats.evictions > 0);
+
+  /*
+   * Without io_uring the units read the blocks as before.
+   */
+  int rc = wt.InitStreams(false);
+#if defined(CONF_STREAM_ASYNC) && CONF_STREAM_ASYNC
+  TEST_CHECK(V_SUCCESS(rc) || rc == VERR_NOT_SUPPORTED);
+#else
+  TEST_CHECK(rc == VERR_NOT_SUPPORTED);
+#endif
+  checkUnits(&wt);
+  StreamStats sstats;
+  wt.GetStreamStats(&sstats);
+  TEST_CHECK(V_SUCCESS(rc) ? sstats.completed > 0 : sstats.submitted == 0);
+
+  TEST_CHECK(V_SUCCESS(wt.CacheSamples(0, 0)));
+  checkUnits(&wt);
+
+  /*
+   * Compressed in the memory, all of them and then the ones in half of
+   * the memory, the others read from the file.
+   */
+  SampleCacheStats full, half;
+  TEST_CHECK(V_SUCCESS(wt.CompressSamples(0, WAVE_CODEC_RICE, 0)));
+  checkUnits(&wt);
+  wt.GetSampleCacheStats(&full);
+  TEST_CHECK(full.original == sampleStart(TEST_SAMPLES, 0) - sizeof(WaveBank_t));
+  TEST_CHECK(full.resident > 0);
+
+  TEST_CHECK(V_SUCCESS(wt.CompressSamples(full.resident / 2, WAVE_CODEC_RICE, 0)));
+  checkUnits(&wt);
+  wt.GetSampleCacheStats(&half);
+  TEST_CHECK(half.original > 0 && half.original < full.original);
+  TEST_CHECK(half.resident <= full.resident / 2);
+
+  wt.uninit();
+  remove(TEST_TABLE);
+  remove(TEST_BANK);
+}
+
+/*
+ * The samples after the first one of a coded bank take the coding of
+ * the file opened for it, and a bank of an unknown coding is refused.
+ */
+static void
+testShared()
+{
+  checkShared(WAVE_CODEC_PCM);
+  checkShared(WAVE_CODEC_RICE);
+
+  TEST_CHECK(writeBank(0, WAVE_CODEC_RICE + 1));
+  WaveTable wt;
+  TEST_CHECK(V_SUCCESS(wt.init(TEST_POLYPHONY)));
+  TEST_CHECK(wt.LoadTimbres(TEST_TABLE) == VERR_INVALID_FORMAT);
+  wt.uninit();
+  remove(TEST_TABLE);
+  remove(TEST_BANK);
+}
+
+/*
+ * The list of the active pipes holds each busy unit once, and nothing
+ * else.
+ */
+static void
+checkActive(WaveTable *wt, int expect)
+{
+  const int *pipes;
+  int count = wt->GetActivePipes(&pipes);
+  bool seen[TEST_POLYPHONY] = { false };
+
+  TEST_CHECK(count == expect);
+  for (int i = 0; i < count; i++)
+    {
+      TEST_CHECK(pipes[i] >= 0 && pipes[i] < TEST_POLYPHONY);
+      TEST_CHECK(!seen[pipes[i]] && wt->PipeBusy(pipes[i]));
+      seen[pipes[i]] = true;
+    }
+  for (int n = 0; n < TEST_POLYPHONY; n++)
+    TEST_CHECK(seen[n] == wt->PipeBusy(n));
+}
+
+/*
+ * The units join the list when a note starts, a stolen one is not
+ * added twice, and they leave it when closed, also while the list is
+ * walked from the end.
+ */
+static void
+testActive()
+{
+  TEST_CHECK(writeBank());
+
+  WaveTable wt;
+  TEST_CHECK(V_SUCCESS(wt.init(TEST_POLYPHONY)));
+  TEST_CHECK(V_SUCCESS(wt.LoadTimbres(TEST_TABLE)));
+  checkActive(&wt, 0);
+
+  int poly;
+  for (int n = 0; n < TEST_POLYPHONY + 2; n++)
+    {
+      midi::Event event(midi::NoteOn, 0, testSamples[n % TEST_SAMPLES].key, 100);
+      int rc = wt.SendMIDIEvent(event, &poly);
+      TEST_CHECK(rc == (n < TEST_POLYPHONY ? VINF_SUCCEEDED : VINF_REPLACED));
+      checkActive(&wt, n < TEST_POLYPHONY ? n + 1 : TEST_POLYPHONY);
+    }
+
+  const int *pipes;
+  int left = TEST_POLYPHONY;
+  for (int i = wt.GetActivePipes(&pipes) - 1; i >= 0; i--)
+    {
+      if (i % 2)
+        continue;
+      wt.ClosePipeChannel(pipes[i]);
+      checkActive(&wt, --left);
+    }
+
+  wt.uninit();
+  remove(TEST_TABLE);
+  remove(TEST_BANK);
+}
+
+/*
+ * Play a note and close it at once.
+ */
+static void
+playNote(WaveTable *wt, int n)
+{
+  int poly;
+  midi::Event event(midi::NoteOn, 0, testSamples[n].key, 100);
+  TEST_CHECK(V_SUCCESS(wt->SendMIDIEvent(event, &poly)));
+  wt->ClosePipeChannel(poly);
+}
+
+/*
+ * A run of notes is followed ahead, up and back down, so it misses
+ * only its first note. The samples in the memory are not advised.
+ */
+static void
+testPrefetch()
+{
+  TEST_CHECK(writeBank());
+
+  WaveTable wt;
+  TEST_CHECK(V_SUCCESS(wt.init(TEST_POLYPHONY)));
+  TEST_CHECK(V_SUCCESS(wt.LoadTimbres(TEST_TABLE)));
+
+  for (int n = 0; n < TEST_SAMPLES; n++)
+    playNote(&wt, n);
+  for (int n = TEST_SAMPLES - 2; n >= 0; n--)
+    playNote(&wt, n);
+
+  PrefetchStats stats;
+  wt.GetPrefetchStats(&stats);
+  TEST_CHECK(stats.issued == TEST_SAMPLES);
+  TEST_CHECK(stats.misses == 1);
+  TEST_CHECK(stats.hits == 2 * TEST_SAMPLES - 2);
+  TEST_CHECK(stats.resident == 0);
+
+  TEST_CHECK(V_SUCCESS(wt.CacheSamples(0, 0)));
+  for (int n = 0; n < TEST_SAMPLES; n++)
+    playNote(&wt, n);
+
+  wt.GetPrefetchStats(&stats);
+  TEST_CHECK(stats.issued == TEST_SAMPLES);
+  TEST_CHECK(stats.resident == TEST_SAMPLES);
+
+  wt.uninit();
+  remove(TEST_TABLE);
+  remove(TEST_BANK);
+}
+
+/*
+ * The samples of an aligned bank are found at the multiples of the
+ * alignment, also those of the file opened for an earlier sample, and
+ * are streamed with O_DIRECT where the system can.
+ */
+static void
+testAligned()
+{
+  TEST_CHECK(writeBank(WAVE_BANK_ALIGN));
+
+  WaveTable wt;
+  TEST_CHECK(V_SUCCESS(wt.init(TEST_POLYPHONY)));
+  TEST_CHECK(V_SUCCESS(wt.LoadTimbres(TEST_TABLE)));
+  checkUnits(&wt, WAVE_BANK_ALIGN);
+
+  int rc = wt.InitStreams(true);
+#if defined(CONF_STREAM_ASYNC) && CONF_STREAM_ASYNC
+  TEST_CHECK(V_SUCCESS(rc) || rc == VERR_NOT_SUPPORTED);
+#else
+  TEST_CHECK(rc == VERR_NOT_SUPPORTED);
+#endif
+  checkUnits(&wt, WAVE_BANK_ALIGN);
+
+  wt.uninit();
+  remove(TEST_TABLE);
+  remove(TEST_BANK);
+}
+
+int
+main()
+{
+  testShared();
+  testActive();
+  testPrefetch();
+  testAligned();
+  return testResult(TEST_NAME);
+}